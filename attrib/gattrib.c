@@ -63,6 +63,7 @@ struct command {
 	guint16 len;
 	guint8 expected;
 	gboolean sent;
+	gboolean borrowed;
 	GAttribResultFunc func;
 	gpointer user_data;
 	GDestroyNotify notify;
@@ -158,10 +159,28 @@ static void command_destroy(struct command *cmd)
 	if (cmd->notify)
 		cmd->notify(cmd->user_data);
 
-	g_free(cmd->pdu);
+	if (!cmd->borrowed)
+		g_free(cmd->pdu);
 	g_free(cmd);
 }
 
+/* A command already sent stays queued until its response arrives, but
+ * must no longer call back or point into a buffer of its canceller */
+static void command_detach(struct command *cmd)
+{
+	cmd->func = NULL;
+
+	if (!cmd->borrowed)
+		return;
+
+	cmd->notify(cmd->user_data);
+	cmd->notify = NULL;
+	cmd->user_data = NULL;
+	cmd->pdu = NULL;
+	cmd->len = 0;
+	cmd->borrowed = FALSE;
+}
+
 static void event_destroy(struct event *evt)
 {
 	if (evt->notify)
@@ -528,9 +547,10 @@ GAttrib *g_attrib_new(GIOChannel *io)
 	return g_attrib_ref(attrib);
 }
 
-guint g_attrib_send(GAttrib *attrib, guint id, guint8 opcode,
-			const guint8 *pdu, guint16 len, GAttribResultFunc func,
-			gpointer user_data, GDestroyNotify notify)
+static guint attrib_send(GAttrib *attrib, guint id, guint8 opcode,
+			const guint8 *pdu, guint16 len, gboolean borrowed,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify)
 {
 	struct command *c;
 
@@ -543,8 +563,13 @@ guint g_attrib_send(GAttrib *attrib, guint id, guint8 opcode,
 
 	c->opcode = opcode;
 	c->expected = opcode2expected(opcode);
-	c->pdu = g_malloc(len);
-	memcpy(c->pdu, pdu, len);
+	if (borrowed)
+		c->pdu = (guint8 *) pdu;
+	else {
+		c->pdu = g_malloc(len);
+		memcpy(c->pdu, pdu, len);
+	}
+	c->borrowed = borrowed;
 	c->len = len;
 	c->func = func;
 	c->user_data = user_data;
@@ -566,6 +591,25 @@ guint g_attrib_send(GAttrib *attrib, guint id, guint8 opcode,
 	return c->id;
 }
 
+guint g_attrib_send(GAttrib *attrib, guint id, guint8 opcode,
+			const guint8 *pdu, guint16 len, GAttribResultFunc func,
+			gpointer user_data, GDestroyNotify notify)
+{
+	return attrib_send(attrib, id, opcode, pdu, len, FALSE, func,
+							user_data, notify);
+}
+
+guint g_attrib_send_buffer(GAttrib *attrib, guint8 opcode,
+			const guint8 *pdu, guint16 len, GAttribResultFunc func,
+			gpointer user_data, GDestroyNotify notify)
+{
+	if (notify == NULL)
+		return 0;
+
+	return attrib_send(attrib, 0, opcode, pdu, len, TRUE, func,
+							user_data, notify);
+}
+
 static gint command_cmp_by_id(gconstpointer a, gconstpointer b)
 {
 	const struct command *cmd = a;
@@ -590,7 +634,7 @@ gboolean g_attrib_cancel(GAttrib *attrib, guint id)
 	cmd = l->data;
 
 	if (cmd == g_queue_peek_head(attrib->queue) && cmd->sent)
-		cmd->func = NULL;
+		command_detach(cmd);
 	else {
 		g_queue_remove(attrib->queue, cmd);
 		command_destroy(cmd);
@@ -610,7 +654,7 @@ gboolean g_attrib_cancel_all(GAttrib *attrib)
 	while ((c = g_queue_pop_head(attrib->queue))) {
 		if (first && c->sent) {
 			/* If the command was sent ignore its callback ... */
-			c->func = NULL;
+			command_detach(c);
 			head = c;
 			continue;
 		}
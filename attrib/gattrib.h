@@ -63,6 +63,13 @@ guint g_attrib_send(GAttrib *attrib, guint id, guint8 opcode,
 			const guint8 *pdu, guint16 len, GAttribResultFunc func,
 			gpointer user_data, GDestroyNotify notify);
 
+/* Queues pdu without copying it: the caller keeps it unchanged until
+ * notify is called, once the command completes or is dropped. Once
+ * g_attrib_cancel() returns, notify has been called. */
+guint g_attrib_send_buffer(GAttrib *attrib, guint8 opcode,
+			const guint8 *pdu, guint16 len, GAttribResultFunc func,
+			gpointer user_data, GDestroyNotify notify);
+
 gboolean g_attrib_cancel(GAttrib *attrib, guint id);
 gboolean g_attrib_cancel_all(GAttrib *attrib);
 
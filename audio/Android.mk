@@ -63,12 +63,16 @@ LOCAL_SRC_FILES:= \
 	android_audio_hw.c \
 	liba2dp.c \
 	ipc.c \
+	pcm_convert.c \
+	media_packetizer.c \
 	../sbc/sbc_primitives.c \
 	../sbc/sbc_primitives_neon.c
 
 ifeq ($(TARGET_ARCH),x86)
 LOCAL_SRC_FILES+= \
 	../sbc/sbc_primitives_mmx.c \
+	../sbc/sbc_primitives_sse2.c \
+	../sbc/sbc_primitives_avx2.c \
 	../sbc/sbc.c
 else
 LOCAL_SRC_FILES+= \
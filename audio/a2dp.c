@@ -132,6 +132,7 @@ struct a2dp_server {
 	gboolean sink_enabled;
 	gboolean source_enabled;
 	gboolean sbc_quality_high;
+	gboolean sbc_fast_encoder;
 };
 
 static GSList *servers = NULL;
@@ -1482,6 +1483,7 @@ int a2dp_register(DBusConnection *conn, const bdaddr_t *src, GKeyFile *config)
 	int mpeg12_srcs = 0, mpeg12_sinks = 0;
 	gboolean source = TRUE, sink = FALSE, socket = TRUE;
 	gboolean delay_reporting = FALSE, sbc_quality = TRUE;
+	gboolean sbc_fast = FALSE;
 	char *str;
 	GError *err = NULL;
 	int i;
@@ -1598,9 +1600,12 @@ proceed:
 		servers = g_slist_append(servers, server);
 	}
 
-	if (config)
+	if (config) {
 		delay_reporting = g_key_file_get_boolean(config, "A2DP",
 						"DelayReporting", NULL);
+		sbc_fast = g_key_file_get_boolean(config, "A2DP",
+						"SBCFastEncoder", NULL);
+	}
 
 	if (delay_reporting)
 		server->version = 0x0103;
@@ -1631,6 +1636,7 @@ proceed:
 	}
 
 	server->sbc_quality_high = sbc_quality;
+	server->sbc_fast_encoder = sbc_fast;
 
 	return 0;
 }
@@ -2574,6 +2580,20 @@ gboolean a2dp_is_reconfig(struct avdtp *session)
 	return is_reconfig ;
 }
 
+gboolean a2dp_read_sbc_fast_encoder(bdaddr_t *src)
+{
+	struct a2dp_server *server;
+
+	if (!src)
+		return FALSE;
+
+	server = find_server(servers, src);
+	if (!server)
+		return FALSE;
+
+	return server->sbc_fast_encoder;
+}
+
 gboolean a2dp_read_edrcapability(bdaddr_t *src, bdaddr_t *dst)
 {
 	uint16_t version;
@@ -165,3 +165,4 @@ struct a2dp_sep *a2dp_get_sep(struct avdtp *session,
 				struct avdtp_stream *stream);
 gboolean a2dp_is_reconfig(struct avdtp *session);
 gboolean a2dp_read_edrcapability( bdaddr_t *src, bdaddr_t *dst);
+gboolean a2dp_read_sbc_fast_encoder(bdaddr_t *src);
@@ -22,10 +22,16 @@
 #define LOG_NDEBUG 0
 
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <linux/futex.h>
 
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 #include <cutils/str_parms.h>
 
@@ -45,6 +51,9 @@
 #define A2DP_WAKE_LOCK_NAME            "A2dpOutputStream"
 #define MAX_WRITE_RETRIES              5
 
+/* SCHED_FIFO priority of the thread writing to the a2dp sink */
+#define A2DP_WRITER_RT_PRIORITY        2
+
 #define A2DP_SUSPENDED_PARM            "A2dpSuspended"
 #define BLUETOOOTH_ENABLED_PARM        "bluetooth_enabled"
 
@@ -56,21 +65,25 @@
 #define BUF_WRITE_COMPLETION_TIMEOUT_MS 5000
 /* maximum time allowed by out_write() for frames to be available in in write thread buffer */
 #define BUF_WRITE_AVAILABILITY_TIMEOUT_MS 5000
+/* sink latency assumed for headsets that do not send AVDTP delay reports */
+#define DEFAULT_SINK_LATENCY_US 200000
+
 /* maximum number of attempts to wait for a write completion in out_standby_stream_locked() */
 #define MAX_WRITE_COMPLETION_ATTEMPTS 5
 
-/* NOTE: there are 2 mutexes used by the a2dp output stream.
+/* NOTE: the a2dp output stream uses a single mutex.
  *  - lock: protects all calls to a2dp lib functions (a2dp_stop(), a2dp_cleanup()...).
  *    One exception is a2dp_write() which is also protected by the flag write_busy. This is because
  *    out_write() cannot block waiting for a2dp_write() to complete because this function
  *    can sleep to throttle the A2DP bit rate.
  *    This flag is always set/reset and tested with "lock" mutex held.
- *  - buf_lock: protects access to pcm buffer read and write indexes.
  *
- *  The locking order is always as follows:
- *      buf_lock -> lock
+ * The pcm buffer between out_write() and the write thread is a single producer, single
+ * consumer ring without a lock: only out_write() moves buf_wr_idx and only the write thread
+ * moves buf_rd_idx. A thread only sleeps (on a futex) when the ring is empty or full, and
+ * the other side only makes a wake up call when it sees the waiting flag set.
  *
- * If you need to hold the adev_a2dp->lock AND the astream_out->lock or astream_out->buf_lock,
+ * If you need to hold the adev_a2dp->lock AND the astream_out->lock,
  * you MUST take adev_a2dp lock first!!
  */
 
@@ -111,19 +124,30 @@ struct astream_out {
     bool                    suspended;
     char                    a2dp_addr[20];
 
-    uint32_t *buf;              /* pcm buffer between audioflinger thread and write thread*/
-    size_t buf_size;            /* size of pcm buffer in frames */
-    size_t buf_rd_idx;          /* read index in pcm buffer, in frames*/
-    size_t buf_wr_idx;          /* write index in pcm buffer, in frames */
-    size_t buf_frames_ready;    /* number of frames ready for writing to a2dp sink */
-    pthread_mutex_t buf_lock;   /* mutex protecting read and write indexes */
-                                /* see NOTE on mutex locking order above */
-    pthread_cond_t buf_cond;    /* condition signaling data write/read to/from pcm buffer */
+    uint32_t *buf;              /* pcm ring between audioflinger thread and write thread*/
+    size_t buf_size;            /* size of pcm ring in frames, one frame always stays free */
+    volatile int32_t buf_rd_idx;    /* read index in pcm ring, in frames, see NOTE above */
+    volatile int32_t buf_wr_idx;    /* write index in pcm ring, in frames */
+    volatile int32_t buf_data_seq;  /* futex, bumped to wake the write thread */
+    volatile int32_t buf_space_seq; /* futex, bumped to wake out_write() */
+    volatile int32_t buf_rd_waiting;    /* write thread sleeps on buf_data_seq */
+    volatile int32_t buf_wr_waiting;    /* out_write() sleeps on buf_space_seq */
     pthread_t buf_thread;       /* thread reading data from buffer and writing to a2dp sink*/
-    bool buf_thread_exit;       /* flag requesting write thread exit */
+    volatile int32_t buf_thread_exit;   /* flag requesting write thread exit */
     bool write_busy;            /* indicates that a write to a2dp sink is in progress and that
                                    standby must wait for this flag to be cleared by write thread */
     pthread_cond_t write_cond;  /* condition associated with write_busy flag */
+
+    /* pcm ring statistics for out_dump(), each only updated by one thread */
+    uint64_t buf_frames_in;     /* frames queued by out_write() */
+    uint64_t buf_frames_out;    /* frames accepted by a2dp_write() */
+    uint64_t buf_fill_sum;      /* ring fill level seen before each a2dp_write() */
+    uint32_t buf_fill_samples;
+    uint32_t buf_fill_max;
+    uint32_t buf_underruns;     /* write thread found the ring empty while streaming */
+    uint32_t buf_overruns;      /* out_write() had to wait for room in the ring */
+    uint64_t render_base;       /* buf_frames_out when leaving standby */
+    uint32_t render_position;   /* last out_get_render_position() result */
 };
 
 static uint64_t system_time(void)
@@ -176,16 +200,95 @@ static audio_format_t out_set_format(struct audio_stream *stream, audio_format_t
     return 0;
 }
 
+static size_t _out_frames_ready(struct astream_out *out);
+
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct astream_out *out = (struct astream_out *)stream;
+    char buffer[512];
+    uint32_t samples = out->buf_fill_samples;
+
+    /* statistics are read without synchronization, they may be slightly off */
+    snprintf(buffer, sizeof(buffer),
+             "A2DP output stream %p:\n"
+             "  pcm ring: %u frames, %u queued\n"
+             "  fill level: avg %u max %u frames\n"
+             "  frames in %llu out %llu\n"
+             "  underruns %u overruns %u\n",
+             out, out->buf_size ? (uint32_t)out->buf_size - 1 : 0,
+             out->buf_size ? (uint32_t)_out_frames_ready(out) : 0,
+             samples ? (uint32_t)(out->buf_fill_sum / samples) : 0,
+             out->buf_fill_max,
+             (unsigned long long)out->buf_frames_in,
+             (unsigned long long)out->buf_frames_out,
+             out->buf_underruns, out->buf_overruns);
+    write(fd, buffer, strlen(buffer));
+
+    /* out->data goes away with the stream, but don't hold up dumpsys */
+    if (pthread_mutex_trylock(&out->lock) != 0)
+        return 0;
+
+    if (out->data) {
+        struct a2dp_stats stats;
+        int len, i;
+
+        a2dp_get_stats(out->data, &stats);
+        len = snprintf(buffer, sizeof(buffer),
+                 "  packets %llu bytes %llu\n"
+                 "  frames per packet:",
+                 (unsigned long long)stats.packets,
+                 (unsigned long long)stats.bytes);
+        for (i = 1; i <= A2DP_STATS_MAX_FRAMES && len < (int)sizeof(buffer); i++)
+            if (stats.frames[i])
+                len += snprintf(buffer + len, sizeof(buffer) - len,
+                                " %d:%u", i, stats.frames[i]);
+        if (len < (int)sizeof(buffer))
+            snprintf(buffer + len, sizeof(buffer) - len,
+                     "\n"
+                     "  poll timeouts %u eagain %u epipe %u\n"
+                     "  deadline misses %u\n"
+                     "  bitpool %u, %u changes\n"
+                     "  encode %llu ns per frame\n",
+                     stats.poll_timeouts, stats.eagain, stats.epipe,
+                     stats.deadline_misses,
+                     stats.bitpool, stats.bitpool_changes,
+                     stats.encode_frames ? (unsigned long long)
+                         (stats.encode_ns / stats.encode_frames) : 0ULL);
+        write(fd, buffer, strlen(buffer));
+    }
+
+    pthread_mutex_unlock(&out->lock);
+
     return 0;
 }
 
+/* microseconds between a frame leaving the pcm ring and being played,
+ * must be called with out->lock held */
+static uint32_t _out_a2dp_latency_us_locked(struct astream_out *out)
+{
+    if (!out->data)
+        return DEFAULT_SINK_LATENCY_US;
+
+    return a2dp_get_latency(out->data, DEFAULT_SINK_LATENCY_US);
+}
+
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
-    const struct astream_out *out = (const struct astream_out *)stream;
+    struct astream_out *out = (struct astream_out *)stream;
+    uint32_t latency_us;
 
-    return ((out->buffer_duration_us * BUF_NUM_PERIODS) / 1000) + 200;
+    /* a full pcm ring, as that is where it settles while streaming */
+    latency_us = out->buffer_duration_us * BUF_NUM_PERIODS;
+
+    /* never wait for a standby in progress, which can take seconds */
+    if (pthread_mutex_trylock(&out->lock) == 0) {
+        latency_us += _out_a2dp_latency_us_locked(out);
+        pthread_mutex_unlock(&out->lock);
+    } else {
+        latency_us += DEFAULT_SINK_LATENCY_US;
+    }
+
+    return latency_us / 1000;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
@@ -197,7 +300,31 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
-    return -ENOSYS;
+    struct astream_out *out = (struct astream_out *)stream;
+    uint64_t frames, pending;
+
+    /* never wait for a standby in progress, which can take seconds, as
+     * audioflinger calls this with its playback thread lock held */
+    if (pthread_mutex_trylock(&out->lock) != 0) {
+        *dsp_frames = out->render_position;
+        return 0;
+    }
+
+    if (out->standby) {
+        out->render_position = 0;
+    } else {
+        /* frames handed to liba2dp, minus those it has not played yet */
+        frames = out->buf_frames_out - out->render_base;
+        pending = (uint64_t)_out_a2dp_latency_us_locked(out) *
+                  out->sample_rate / 1000000;
+        out->render_position = frames > pending ?
+                               (uint32_t)(frames - pending) : 0;
+    }
+
+    *dsp_frames = out->render_position;
+    pthread_mutex_unlock(&out->lock);
+
+    return 0;
 }
 
 static int _out_init_locked(struct astream_out *out, const char *addr)
@@ -219,6 +346,7 @@ static int _out_init_locked(struct astream_out *out, const char *addr)
     if (addr)
         strlcpy(out->a2dp_addr, addr, sizeof(out->a2dp_addr));
     a2dp_set_sink(out->data, out->a2dp_addr);
+    a2dp_set_realtime(out->data, A2DP_WRITER_RT_PRIORITY);
 
     return 0;
 }
@@ -360,44 +488,120 @@ static char * out_get_parameters(const struct audio_stream *stream,
     return str;
 }
 
-size_t _out_frames_available_locked(struct astream_out *out)
+static int _futex_wait(volatile int32_t *addr, int32_t val, int timeout_ms)
 {
+    struct timespec ts;
+    struct timespec *timeout = NULL;
 
-    size_t frames = out->buf_size - out->buf_frames_ready;
-    if (frames > out->buf_size - out->buf_wr_idx) {
-        frames = out->buf_size - out->buf_wr_idx;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        timeout = &ts;
     }
-    return frames;
+
+    if (syscall(__NR_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0) < 0)
+        return -errno;
+    return 0;
+}
+
+static void _futex_wake(volatile int32_t *addr)
+{
+    syscall(__NR_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* wakes a thread sleeping in _out_wait_data() or _out_wait_consumed() */
+static void _out_signal(volatile int32_t *seq, volatile int32_t *waiting)
+{
+    /* orders the index update before the waiting flag test, pairs with the
+     * barrier between setting the flag and testing the index on the
+     * waiting side */
+    android_memory_barrier();
+    if (android_atomic_acquire_load(waiting)) {
+        android_atomic_inc(seq);
+        _futex_wake(seq);
+    }
+}
+
+/* number of frames queued in the pcm ring, callable from both threads */
+static size_t _out_frames_ready(struct astream_out *out)
+{
+    int32_t rd = android_atomic_acquire_load(&out->buf_rd_idx);
+    int32_t wr = android_atomic_acquire_load(&out->buf_wr_idx);
+
+    return (wr - rd + out->buf_size) % out->buf_size;
 }
 
-size_t _out_frames_ready_locked(struct astream_out *out)
+/* contiguous frames out_write() can copy into the ring */
+static size_t _out_frames_available(struct astream_out *out)
 {
-    size_t frames = out->buf_frames_ready;
+    int32_t wr = out->buf_wr_idx;
+    size_t frames = out->buf_size - 1 - _out_frames_ready(out);
 
-    if (frames > out->buf_size - out->buf_rd_idx) {
-        frames = out->buf_size - out->buf_rd_idx;
+    if (frames > out->buf_size - wr) {
+        frames = out->buf_size - wr;
     }
     return frames;
 }
 
-void _out_inc_wr_idx_locked(struct astream_out *out, size_t frames)
+/* only called by out_write(), publishes frames copied at buf_wr_idx */
+static void _out_inc_wr_idx(struct astream_out *out, size_t frames)
 {
-    out->buf_wr_idx += frames;
-    out->buf_frames_ready += frames;
-    if (out->buf_wr_idx == out->buf_size) {
-        out->buf_wr_idx = 0;
+    int32_t wr = out->buf_wr_idx + frames;
+
+    if (wr == (int32_t)out->buf_size) {
+        wr = 0;
     }
-    pthread_cond_signal(&out->buf_cond);
+    out->buf_frames_in += frames;
+    android_atomic_release_store(wr, &out->buf_wr_idx);
+    _out_signal(&out->buf_data_seq, &out->buf_rd_waiting);
+}
+
+/* only called by the write thread, releases frames at buf_rd_idx */
+static void _out_inc_rd_idx(struct astream_out *out, size_t frames)
+{
+    int32_t rd = (out->buf_rd_idx + frames) % out->buf_size;
+
+    android_atomic_release_store(rd, &out->buf_rd_idx);
+    _out_signal(&out->buf_space_seq, &out->buf_wr_waiting);
 }
 
-void _out_inc_rd_idx_locked(struct astream_out *out, size_t frames)
+/* Sleeps until the write thread moves buf_rd_idx away from rd. Returns
+ * -ETIMEDOUT if that did not happen within timeout_ms. */
+static int _out_wait_consumed(struct astream_out *out, int32_t rd, int timeout_ms)
 {
-    out->buf_rd_idx += frames;
-    out->buf_frames_ready -= frames;
-    if (out->buf_rd_idx == out->buf_size) {
-        out->buf_rd_idx = 0;
+    uint64_t deadline = system_time() + timeout_ms * 1000000LL;
+    int ret = 0;
+
+    while (android_atomic_acquire_load(&out->buf_rd_idx) == rd) {
+        int32_t seq = android_atomic_acquire_load(&out->buf_space_seq);
+        uint64_t now = system_time();
+
+        if (now >= deadline) {
+            ret = -ETIMEDOUT;
+            break;
+        }
+
+        android_atomic_release_store(1, &out->buf_wr_waiting);
+        android_memory_barrier();
+        if (android_atomic_acquire_load(&out->buf_rd_idx) == rd)
+            _futex_wait(&out->buf_space_seq, seq,
+                        (deadline - now + 999999) / 1000000);
+        android_atomic_release_store(0, &out->buf_wr_waiting);
     }
-    pthread_cond_signal(&out->buf_cond);
+
+    return ret;
+}
+
+/* Sleeps until out_write() queues frames or the write thread must exit. seq
+ * is the value of buf_data_seq read before the ring was found empty. */
+static void _out_wait_data(struct astream_out *out, int32_t seq)
+{
+    android_atomic_release_store(1, &out->buf_rd_waiting);
+    android_memory_barrier();
+    if (!_out_frames_ready(out) &&
+        !android_atomic_acquire_load(&out->buf_thread_exit))
+        _futex_wait(&out->buf_data_seq, seq, -1);
+    android_atomic_release_store(0, &out->buf_rd_waiting);
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -408,8 +612,9 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     size_t frames_total = bytes / sizeof(uint32_t); // always stereo 16 bit
     uint32_t *buf = (uint32_t *)buffer;
     size_t frames_written = 0;
+    bool was_standby;
+    int32_t rd;
 
-    pthread_mutex_lock(&out->buf_lock);
     pthread_mutex_lock(&out->lock);
     if (!out->bt_enabled || out->suspended) {
         ALOGV("a2dp: bluetooth disabled bt_en %d, suspended %d",
@@ -418,12 +623,12 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         goto err_bt_disabled;
     }
 
+    was_standby = out->standby;
     if (out->standby) {
         acquire_wake_lock(PARTIAL_WAKE_LOCK, A2DP_WAKE_LOCK_NAME);
         out->last_write_time = system_time();
-        out->buf_rd_idx = 0;
-        out->buf_wr_idx = 0;
-        out->buf_frames_ready = 0;
+        /* the write thread does not pass on frames during standby */
+        out->render_base = out->buf_frames_out;
     }
 
     ret = _out_init_locked(out, NULL);
@@ -431,47 +636,47 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         goto err_init;
     }
 
+    /* leave standby before queueing anything, the write thread drops all
+     * frames it finds in the ring while in standby */
+    out->standby = false;
     pthread_mutex_unlock(&out->lock);
 
     while (frames_written < frames_total) {
-        size_t frames = _out_frames_available_locked(out);
+        size_t frames = _out_frames_available(out);
         if (frames == 0) {
-            int ret = pthread_cond_timeout_np(&out->buf_cond,
-                                              &out->buf_lock,
-                                              BUF_WRITE_AVAILABILITY_TIMEOUT_MS);
-            if (ret != 0) {
+            out->buf_overruns++;
+            rd = android_atomic_acquire_load(&out->buf_rd_idx);
+            if (_out_frames_available(out) == 0 &&
+                _out_wait_consumed(out, rd,
+                                   BUF_WRITE_AVAILABILITY_TIMEOUT_MS) < 0) {
                 pthread_mutex_lock(&out->lock);
                 goto err_write;
             }
-            frames  = _out_frames_available_locked(out);
+            continue;
         }
         if (frames > frames_total - frames_written) {
             frames = frames_total - frames_written;
         }
         memcpy(out->buf + out->buf_wr_idx, buf + frames_written, frames * sizeof(uint32_t));
         frames_written += frames;
-        _out_inc_wr_idx_locked(out, frames);
-        pthread_mutex_lock(&out->lock);
-        if (out->standby && out->bt_enabled) {
-            out->standby = false;
-            pthread_mutex_unlock(&out->lock);
-            ALOGV("*********Audio thread wait");
-            pthread_cond_timeout_np(&out->buf_cond,
-                                              &out->buf_lock,
-                                              BUF_WRITE_AVAILABILITY_TIMEOUT_MS);
-            ALOGV("*********Audio thread wait end ");
-        } else
-           pthread_mutex_unlock(&out->lock);
+        _out_inc_wr_idx(out, frames);
+    }
+
+    if (was_standby) {
+        /* give the write thread a chance to start the stream before
+         * audioflinger fills up the whole ring */
+        ALOGV("*********Audio thread wait");
+        rd = android_atomic_acquire_load(&out->buf_rd_idx);
+        _out_wait_consumed(out, rd, BUF_WRITE_AVAILABILITY_TIMEOUT_MS);
+        ALOGV("*********Audio thread wait end ");
     }
-    pthread_mutex_unlock(&out->buf_lock);
 
     return bytes;
 
-/* out->lock must be locked and out->buf_lock unlocked when jumping here */
+/* out->lock must be locked when jumping here */
 err_write:
 err_init:
 err_bt_disabled:
-    pthread_mutex_unlock(&out->buf_lock);
     ALOGV("!!!! write error");
     out_standby_stream_locked(out);
     pthread_mutex_unlock(&out->lock);
@@ -485,96 +690,106 @@ err_bt_disabled:
 static void *_out_buf_thread_func(void *context)
 {
     struct astream_out *out = (struct astream_out *)context;
+    int retries = MAX_WRITE_RETRIES;
 
-    pthread_mutex_lock(&out->buf_lock);
+    while (!android_atomic_acquire_load(&out->buf_thread_exit)) {
+        int32_t seq = android_atomic_acquire_load(&out->buf_data_seq);
+        size_t frames = _out_frames_ready(out);
+        int ret;
+        uint64_t now;
+        uint32_t elapsed_us;
+        uint32_t buffer_duration_us;
+        struct iovec iov[2];
 
-    while(!out->buf_thread_exit) {
-        size_t frames;
+        if (frames == 0) {
+            if (!out->standby)
+                out->buf_underruns++;
+            retries = MAX_WRITE_RETRIES;
+            _out_wait_data(out, seq);
+            continue;
+        }
 
-        frames = _out_frames_ready_locked(out);
-        while (frames && !out->buf_thread_exit) {
-            int retries = MAX_WRITE_RETRIES;
-            uint64_t now;
-            uint32_t elapsed_us;
+        pthread_mutex_lock(&out->lock);
+        if (out->standby || !out->bt_enabled) {
+            /* abort and clear all pending frames if standby requested.
+             * out_write() clears standby before queueing new frames, so
+             * everything queued at this point predates the standby */
+            frames = _out_frames_ready(out);
+            pthread_mutex_unlock(&out->lock);
+            _out_inc_rd_idx(out, frames);
+            continue;
+        }
+        /* indicate to out_standby_stream_locked() that a2dp_write() is active */
+        out->write_busy = true;
+        pthread_mutex_unlock(&out->lock);
+
+        if (frames > out->buf_fill_max)
+            out->buf_fill_max = frames;
+        out->buf_fill_sum += frames;
+        out->buf_fill_samples++;
+
+        /* PCM format is always 16bit stereo */
+        if (frames > out->buffer_size / sizeof(uint32_t)) {
+            frames = out->buffer_size / sizeof(uint32_t);
+        }
 
-            while (frames > 0 && !out->buf_thread_exit) {
-                int ret;
-                uint32_t buffer_duration_us;
-                /* PCM format is always 16bit stereo */
-                size_t bytes = frames * sizeof(uint32_t);
-                if (bytes > out->buffer_size) {
-                    bytes = out->buffer_size;
-                }
+        /* hand both parts of a wrapped ring to liba2dp, it encodes them
+         * in place so that no partial SBC block is left at the ring end */
+        iov[0].iov_base = out->buf + out->buf_rd_idx;
+        iov[0].iov_len = frames;
+        if (iov[0].iov_len > out->buf_size - out->buf_rd_idx) {
+            iov[0].iov_len = out->buf_size - out->buf_rd_idx;
+        }
+        iov[1].iov_base = out->buf;
+        iov[1].iov_len = (frames - iov[0].iov_len) * sizeof(uint32_t);
+        iov[0].iov_len *= sizeof(uint32_t);
 
-                pthread_mutex_lock(&out->lock);
-                if (out->standby || !out->bt_enabled) {
-                    /* abort and clear all pending frames if standby requested */
-                    pthread_mutex_unlock(&out->lock);
-                    frames = _out_frames_ready_locked(out);
-                    _out_inc_rd_idx_locked(out, frames);
-                    goto wait;
-                }
-                /* indicate to out_standby_stream_locked() that a2dp_write() is active */
-                out->write_busy = true;
-                pthread_mutex_unlock(&out->lock);
-                pthread_mutex_unlock(&out->buf_lock);
-
-                ret = a2dp_write(out->data, out->buf + out->buf_rd_idx, bytes);
-
-                /* clear write_busy condition */
-                pthread_mutex_lock(&out->buf_lock);
-                pthread_mutex_lock(&out->lock);
-                out->write_busy = false;
-                pthread_cond_signal(&out->write_cond);
-                pthread_mutex_unlock(&out->lock);
-
-                if (ret < 0) {
-                        ALOGE("%s: a2dp_write failed (%d)\n", __func__, ret);
-                    /* skip pending frames in case of write error */
-                    _out_inc_rd_idx_locked(out, frames);
-                    break;
-                } else if (ret == 0) {
-                    if (retries-- == 0) {
-                        /* skip pending frames in case of multiple time out */
-                        _out_inc_rd_idx_locked(out, frames);
-                        break;
-                    }
-                    continue;
-                }
-                ret /= sizeof(uint32_t);
-                _out_inc_rd_idx_locked(out, ret);
-                frames -= ret;
-
-                /* XXX: PLEASE FIX ME!!!! */
-
-                /* if A2DP sink runs abnormally fast, sleep a little so that
-                 * audioflinger mixer thread does no spin and starve other threads. */
-                /* NOTE: It is likely that the A2DP headset is being disconnected */
-                now = system_time();
-                elapsed_us = (now - out->last_write_time) / 1000UL;
-                buffer_duration_us = ((ret * 1000) / out->sample_rate) * 1000;
-
-                if (elapsed_us < (buffer_duration_us / 4)) {
-                    ALOGV("A2DP sink runs too fast");
-                    usleep(buffer_duration_us - elapsed_us);
-                }
-                out->last_write_time = now;
+        ret = a2dp_writev(out->data, iov, iov[1].iov_len ? 2 : 1);
 
+        /* clear write_busy condition */
+        pthread_mutex_lock(&out->lock);
+        out->write_busy = false;
+        pthread_cond_signal(&out->write_cond);
+        pthread_mutex_unlock(&out->lock);
+
+        if (ret < 0) {
+                ALOGE("%s: a2dp_writev failed (%d)\n", __func__, ret);
+            /* skip pending frames in case of write error */
+            _out_inc_rd_idx(out, frames);
+            continue;
+        } else if (ret == 0) {
+            if (retries-- == 0) {
+                /* skip pending frames in case of multiple time out */
+                _out_inc_rd_idx(out, frames);
+                retries = MAX_WRITE_RETRIES;
             }
-            frames = _out_frames_ready_locked(out);
+            continue;
         }
-wait:
-        if (!out->buf_thread_exit) {
-            pthread_cond_wait(&out->buf_cond, &out->buf_lock);
-            ALOGV("Got Signal");
+        ret /= sizeof(uint32_t);
+        _out_inc_rd_idx(out, ret);
+        out->buf_frames_out += ret;
+        retries = MAX_WRITE_RETRIES;
+
+        /* XXX: PLEASE FIX ME!!!! */
+
+        /* if A2DP sink runs abnormally fast, sleep a little so that
+         * audioflinger mixer thread does no spin and starve other threads. */
+        /* NOTE: It is likely that the A2DP headset is being disconnected */
+        now = system_time();
+        elapsed_us = (now - out->last_write_time) / 1000UL;
+        buffer_duration_us = ((ret * 1000) / out->sample_rate) * 1000;
+
+        if (elapsed_us < (buffer_duration_us / 4)) {
+            ALOGV("A2DP sink runs too fast");
+            usleep(buffer_duration_us - elapsed_us);
         }
+        out->last_write_time = now;
     }
-    pthread_mutex_unlock(&out->buf_lock);
+
     return NULL;
 }
 
 
-
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
     return 0;
@@ -694,11 +909,6 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         goto err_validate_parms;
     }
 
-    int err = pthread_create(&out->buf_thread, (const pthread_attr_t *) NULL, _out_buf_thread_func, out);
-    if (err != 0) {
-        goto err_validate_parms;
-    }
-
     /* PCM format is always 16bit, stereo */
     out->buf_size = (out->buffer_size * BUF_NUM_PERIODS) / sizeof(int32_t);
     out->buf = (uint32_t *)malloc(out->buf_size * sizeof(int32_t));
@@ -706,6 +916,13 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         goto err_validate_parms;
     }
 
+    /* the write thread must not run before the ring exists */
+    int err = pthread_create(&out->buf_thread, (const pthread_attr_t *) NULL, _out_buf_thread_func, out);
+    if (err != 0) {
+        free(out->buf);
+        goto err_validate_parms;
+    }
+
     /* XXX: check return code? */
     if (adev->bt_enabled)
         _out_init_locked(out, "00:00:00:00:00:00");
@@ -758,13 +975,11 @@ static void adev_close_output_stream_locked(struct adev_a2dp *dev,
     out_close_stream_locked(out);
     pthread_mutex_unlock(&out->lock);
     if (out->buf_thread) {
-        pthread_mutex_lock(&out->buf_lock);
-        out->buf_thread_exit = true;
-        pthread_cond_broadcast(&out->buf_cond);
-        pthread_mutex_unlock(&out->buf_lock);
+        android_atomic_release_store(1, &out->buf_thread_exit);
+        android_memory_barrier();
+        android_atomic_inc(&out->buf_data_seq);
+        _futex_wake(&out->buf_data_seq);
         pthread_join(out->buf_thread, (void **) NULL);
-        pthread_cond_destroy(&out->buf_cond);
-        pthread_mutex_destroy(&out->buf_lock);
     }
     if (out->buf) {
         free(out->buf);
@@ -27,36 +27,12 @@
 
 #include "gstpragma.h"
 #include "gstrtpsbcpay.h"
+#include "media_packetizer.h"
 #include <math.h>
 #include <string.h>
 
 #define RTP_SBC_PAYLOAD_HEADER_SIZE 1
 #define DEFAULT_MIN_FRAMES 0
-#define RTP_SBC_HEADER_TOTAL (12 + RTP_SBC_PAYLOAD_HEADER_SIZE)
-
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-
-struct rtp_payload {
-	guint8 frame_count:4;
-	guint8 rfa0:1;
-	guint8 is_last_fragment:1;
-	guint8 is_first_fragment:1;
-	guint8 is_fragmented:1;
-} __attribute__ ((packed));
-
-#elif __BYTE_ORDER == __BIG_ENDIAN
-
-struct rtp_payload {
-	guint8 is_fragmented:1;
-	guint8 is_first_fragment:1;
-	guint8 is_last_fragment:1;
-	guint8 rfa0:1;
-	guint8 frame_count:4;
-} __attribute__ ((packed));
-
-#else
-#error "Unknown byte order"
-#endif
 
 enum {
 	PROP_0,
@@ -103,6 +79,8 @@ static void gst_rtp_sbc_pay_set_property(GObject *object, guint prop_id,
 static void gst_rtp_sbc_pay_get_property(GObject *object, guint prop_id,
 				GValue *value, GParamSpec *pspec);
 
+static GstFlowReturn gst_rtp_sbc_pay_flush_buffers(GstRtpSBCPay *sbcpay);
+
 static gint gst_rtp_sbc_pay_get_frame_len(gint subbands, gint channels,
 		gint blocks, gint bitpool, const gchar *channel_mode)
 {
@@ -152,7 +130,19 @@ static gboolean gst_rtp_sbc_pay_set_caps(GstBaseRTPPayload *payload,
 	frame_len = gst_rtp_sbc_pay_get_frame_len(subbands, channels, blocks,
 				bitpool, channel_mode);
 
+	/* the pending packet holds frames of the old configuration */
+	if (sbcpay->packet != NULL && frame_len != sbcpay->frame_length) {
+		gst_rtp_sbc_pay_flush_buffers(sbcpay);
+		if (sbcpay->packet != NULL) {
+			gst_buffer_unref(sbcpay->packet);
+			sbcpay->packet = NULL;
+			sbcpay->packet_len = 0;
+		}
+	}
+
 	sbcpay->frame_length = frame_len;
+	sbcpay->frame_duration = gst_util_uint64_scale(blocks * subbands,
+							GST_SECOND, rate);
 
 	gst_basertppayload_set_options(payload, "audio", TRUE, "SBC", rate);
 
@@ -161,49 +151,75 @@ static gboolean gst_rtp_sbc_pay_set_caps(GstBaseRTPPayload *payload,
 	return gst_basertppayload_set_outcaps(payload, NULL);
 }
 
-static GstFlowReturn gst_rtp_sbc_pay_flush_buffers(GstRtpSBCPay *sbcpay)
+static void gst_rtp_sbc_pay_new_packet(GstRtpSBCPay *sbcpay,
+						GstClockTime timestamp)
 {
-	guint available;
 	guint max_payload;
-	GstBuffer *outbuf;
+
+	max_payload = gst_rtp_buffer_calc_payload_len(
+		GST_BASE_RTP_PAYLOAD_MTU(sbcpay), 0, 0);
+
+	/* whole frames only, and no more than the header can count */
+	sbcpay->packet_size = sbcpay->frame_length *
+				media_packetizer_max_frames(max_payload,
+						sbcpay->frame_length);
+	if (sbcpay->packet_size == 0)
+		sbcpay->packet_size = sbcpay->frame_length;
+
+	sbcpay->packet = gst_rtp_buffer_new_allocate(sbcpay->packet_size +
+					RTP_SBC_PAYLOAD_HEADER_SIZE, 0, 0);
+	sbcpay->packet_len = 0;
+	sbcpay->packet_timestamp = timestamp;
+}
+
+static GstFlowReturn gst_rtp_sbc_pay_flush_buffers(GstRtpSBCPay *sbcpay)
+{
+	GstBuffer *outbuf = sbcpay->packet;
 	guint8 *payload_data;
 	guint frame_count;
 	guint payload_length;
-	struct rtp_payload *payload;
-
-	if (sbcpay->frame_length == 0) {
-		GST_ERROR_OBJECT(sbcpay, "Frame length is 0");
-		return GST_FLOW_ERROR;
-	}
-
-	available = gst_adapter_available(sbcpay->adapter);
+	guint left;
+	GstClockTime timestamp;
 
-	max_payload = gst_rtp_buffer_calc_payload_len(
-		GST_BASE_RTP_PAYLOAD_MTU(sbcpay) - RTP_SBC_PAYLOAD_HEADER_SIZE,
-		0, 0);
+	if (outbuf == NULL)
+		return GST_FLOW_OK;
 
-	max_payload = MIN(max_payload, available);
-	frame_count = max_payload / sbcpay->frame_length;
+	frame_count = sbcpay->packet_len / sbcpay->frame_length;
 	payload_length = frame_count * sbcpay->frame_length;
 	if (payload_length == 0) /* Nothing to send */
 		return GST_FLOW_OK;
 
-	outbuf = gst_rtp_buffer_new_allocate(payload_length +
-			RTP_SBC_PAYLOAD_HEADER_SIZE, 0, 0);
+	payload_data = gst_rtp_buffer_get_payload(outbuf);
+	timestamp = sbcpay->packet_timestamp;
+	left = sbcpay->packet_len - payload_length;
+
+	sbcpay->packet = NULL;
+	sbcpay->packet_len = 0;
+
+	/* an incomplete frame starts the next packet */
+	if (left > 0) {
+		gst_rtp_sbc_pay_new_packet(sbcpay,
+				GST_CLOCK_TIME_IS_VALID(timestamp) ?
+				timestamp + frame_count *
+					sbcpay->frame_duration :
+				GST_CLOCK_TIME_NONE);
+
+		memcpy(gst_rtp_buffer_get_payload(sbcpay->packet) +
+				RTP_SBC_PAYLOAD_HEADER_SIZE,
+				payload_data + RTP_SBC_PAYLOAD_HEADER_SIZE +
+				payload_length, left);
+		sbcpay->packet_len = left;
+	}
 
 	gst_rtp_buffer_set_payload_type(outbuf,
 			GST_BASE_RTP_PAYLOAD_PT(sbcpay));
+	gst_rtp_buffer_set_packet_len(outbuf,
+			gst_rtp_buffer_calc_packet_len(payload_length +
+				RTP_SBC_PAYLOAD_HEADER_SIZE, 0, 0));
 
-	payload_data = gst_rtp_buffer_get_payload(outbuf);
-	payload = (struct rtp_payload *) payload_data;
-	memset(payload, 0, sizeof(struct rtp_payload));
-	payload->frame_count = frame_count;
-
-	gst_adapter_copy(sbcpay->adapter, payload_data +
-			RTP_SBC_PAYLOAD_HEADER_SIZE, 0, payload_length);
-	gst_adapter_flush(sbcpay->adapter, payload_length);
+	media_packetizer_payload_header(payload_data, frame_count);
 
-	GST_BUFFER_TIMESTAMP(outbuf) = sbcpay->timestamp;
+	GST_BUFFER_TIMESTAMP(outbuf) = timestamp;
 	GST_DEBUG_OBJECT(sbcpay, "Pushing %d bytes", payload_length);
 
 	return gst_basertppayload_push(GST_BASE_RTP_PAYLOAD(sbcpay), outbuf);
@@ -213,23 +229,54 @@ static GstFlowReturn gst_rtp_sbc_pay_handle_buffer(GstBaseRTPPayload *payload,
 			GstBuffer *buffer)
 {
 	GstRtpSBCPay *sbcpay;
-	guint available;
+	GstFlowReturn ret = GST_FLOW_OK;
+	GstClockTime timestamp;
+	const guint8 *data;
+	guint8 *payload_data;
+	guint size, offset = 0, len;
 
 	/* FIXME check for negotiation */
 
 	sbcpay = GST_RTP_SBC_PAY(payload);
-	sbcpay->timestamp = GST_BUFFER_TIMESTAMP(buffer);
 
-	gst_adapter_push(sbcpay->adapter, buffer);
+	if (sbcpay->frame_length == 0) {
+		GST_ERROR_OBJECT(sbcpay, "Frame length is 0");
+		gst_buffer_unref(buffer);
+		return GST_FLOW_ERROR;
+	}
+
+	data = GST_BUFFER_DATA(buffer);
+	size = GST_BUFFER_SIZE(buffer);
+	timestamp = GST_BUFFER_TIMESTAMP(buffer);
+
+	/* frames are copied once, from the input into the packet; large
+	 * input buffers can fill several packets */
+	while (ret == GST_FLOW_OK && offset < size) {
+		if (sbcpay->packet == NULL)
+			gst_rtp_sbc_pay_new_packet(sbcpay,
+				GST_CLOCK_TIME_IS_VALID(timestamp) ?
+				timestamp + offset / sbcpay->frame_length *
+					sbcpay->frame_duration :
+				GST_CLOCK_TIME_NONE);
+
+		len = MIN(size - offset,
+				sbcpay->packet_size - sbcpay->packet_len);
+
+		payload_data = gst_rtp_buffer_get_payload(sbcpay->packet);
+		memcpy(payload_data + RTP_SBC_PAYLOAD_HEADER_SIZE +
+				sbcpay->packet_len, data + offset, len);
+		sbcpay->packet_len += len;
+		offset += len;
+
+		if (sbcpay->packet_len == sbcpay->packet_size ||
+				sbcpay->packet_len >
+				sbcpay->min_frames * sbcpay->frame_length)
+			ret = gst_rtp_sbc_pay_flush_buffers(sbcpay);
+	}
 
-	available = gst_adapter_available(sbcpay->adapter);
-	if (available + RTP_SBC_HEADER_TOTAL >=
-				GST_BASE_RTP_PAYLOAD_MTU(sbcpay) ||
-			(available >
-				(sbcpay->min_frames * sbcpay->frame_length)))
-		return gst_rtp_sbc_pay_flush_buffers(sbcpay);
+	gst_buffer_unref(buffer);
 
-	return GST_FLOW_OK;
+	return ret;
 }
 
 static gboolean gst_rtp_sbc_pay_handle_event(GstPad *pad,
@@ -263,7 +310,9 @@ static void gst_rtp_sbc_pay_base_init(gpointer g_class)
 static void gst_rtp_sbc_pay_finalize(GObject *object)
 {
 	GstRtpSBCPay *sbcpay = GST_RTP_SBC_PAY(object);
-	g_object_unref(sbcpay->adapter);
+
+	if (sbcpay->packet != NULL)
+		gst_buffer_unref(sbcpay->packet);
 
 	GST_CALL_PARENT(G_OBJECT_CLASS, finalize, (object));
 }
@@ -337,9 +386,10 @@ static void gst_rtp_sbc_pay_get_property(GObject *object, guint prop_id,
 
 static void gst_rtp_sbc_pay_init(GstRtpSBCPay *self, GstRtpSBCPayClass *klass)
 {
-	self->adapter = gst_adapter_new();
+	self->packet = NULL;
+	self->packet_len = 0;
 	self->frame_length = 0;
-	self->timestamp = 0;
+	self->frame_duration = 0;
 
 	self->min_frames = DEFAULT_MIN_FRAMES;
 }
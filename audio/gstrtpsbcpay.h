@@ -23,7 +23,6 @@
 
 #include <gst/gst.h>
 #include <gst/rtp/gstbasertppayload.h>
-#include <gst/base/gstadapter.h>
 #include <gst/rtp/gstrtpbuffer.h>
 
 G_BEGIN_DECLS
@@ -47,10 +46,15 @@ typedef struct _GstRtpSBCPayClass GstRtpSBCPayClass;
 struct _GstRtpSBCPay {
 	GstBaseRTPPayload base;
 
-	GstAdapter *adapter;
-	GstClockTime timestamp;
+	/* packet being filled straight from the input buffers, its last
+	 * frame may still be incomplete */
+	GstBuffer *packet;
+	guint packet_len;
+	guint packet_size;
+	GstClockTime packet_timestamp;
 
 	guint frame_length;
+	GstClockTime frame_duration;
 
 	guint min_frames;
 };
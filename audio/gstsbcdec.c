@@ -34,6 +34,11 @@
 GST_DEBUG_CATEGORY_STATIC(sbc_dec_debug);
 #define GST_CAT_DEFAULT sbc_dec_debug
 
+/* Frames decoded into one output buffer at most */
+#define SBC_DEC_MAX_FRAMES 16
+/* Output buffers kept for reuse */
+#define SBC_DEC_POOL_SIZE 8
+
 GST_BOILERPLATE(GstSbcDec, gst_sbc_dec, GstElement, GST_TYPE_ELEMENT);
 
 static const GstElementDetails sbc_dec_details =
@@ -56,15 +61,57 @@ static GstStaticPadTemplate sbc_dec_src_factory =
 				"width = (int) 16, "
 				"depth = (int) 16"));
 
+static GstCaps *sbc_dec_get_outcaps(GstSbcDec *dec)
+{
+	GstPadTemplate *template;
+	GstCaps *caps;
+
+	/* we will reuse the same caps object */
+	if (dec->outcaps != NULL)
+		return dec->outcaps;
+
+	caps = gst_caps_new_simple("audio/x-raw-int",
+			"rate", G_TYPE_INT,
+			gst_sbc_parse_rate_from_sbc(dec->sbc.frequency),
+			"channels", G_TYPE_INT,
+			gst_sbc_get_channel_number(dec->sbc.mode),
+			NULL);
+
+	template = gst_static_pad_template_get(&sbc_dec_src_factory);
+
+	dec->outcaps = gst_caps_intersect(caps,
+				gst_pad_template_get_caps(template));
+
+	gst_caps_unref(caps);
+
+	return dec->outcaps;
+}
+
+static GstFlowReturn sbc_dec_push(GstSbcDec *dec, GstBuffer *output,
+							guint size)
+{
+	if (size == 0) {
+		gst_buffer_unref(output);
+		return GST_FLOW_OK;
+	}
+
+	GST_BUFFER_SIZE(output) = size;
+	gst_buffer_set_caps(output, sbc_dec_get_outcaps(dec));
+
+	/* FIXME get a real timestamp */
+	GST_BUFFER_TIMESTAMP(output) = GST_CLOCK_TIME_NONE;
+
+	return gst_pad_push(dec->srcpad, output);
+}
+
 static GstFlowReturn sbc_dec_chain(GstPad *pad, GstBuffer *buffer)
 {
 	GstSbcDec *dec = GST_SBC_DEC(gst_pad_get_parent(pad));
 	GstFlowReturn res = GST_FLOW_OK;
-	guint size, codesize, offset = 0;
+	GstBuffer *output = NULL;
+	guint size, codesize, offset = 0, filled = 0;
 	guint8 *data;
 
-	codesize = sbc_get_codesize(&dec->sbc);
-
 	if (dec->buffer) {
 		GstBuffer *temp = buffer;
 		buffer = gst_buffer_span(dec->buffer, 0, buffer,
@@ -77,57 +124,43 @@ static GstFlowReturn sbc_dec_chain(GstPad *pad, GstBuffer *buffer)
 	data = GST_BUFFER_DATA(buffer);
 	size = GST_BUFFER_SIZE(buffer);
 
+	/* all frames of the input are decoded into one pooled buffer */
 	while (offset < size) {
-		GstBuffer *output;
-		GstPadTemplate *template;
-		GstCaps *caps;
 		int consumed;
+		size_t written;
 
-		res = gst_pad_alloc_buffer_and_set_caps(dec->srcpad,
-						GST_BUFFER_OFFSET_NONE,
-						codesize, NULL, &output);
+		/* the PCM of the last frame decoded, or of the defaults */
+		codesize = sbc_get_codesize(&dec->sbc);
 
-		if (res != GST_FLOW_OK)
-			goto done;
+		if (output != NULL && GST_BUFFER_SIZE(output) - filled <
+								codesize) {
+			res = sbc_dec_push(dec, output, filled);
+			output = NULL;
+			if (res != GST_FLOW_OK)
+				goto done;
+		}
+
+		if (output == NULL) {
+			output = gst_sbc_buffer_pool_get(&dec->pool,
+					SBC_DEC_MAX_FRAMES * codesize, NULL);
+			filled = 0;
+		}
 
 		consumed = sbc_decode(&dec->sbc, data + offset, size - offset,
-					GST_BUFFER_DATA(output), codesize,
-					NULL);
+					GST_BUFFER_DATA(output) + filled,
+					GST_BUFFER_SIZE(output) - filled,
+					&written);
 		if (consumed <= 0)
 			break;
 
-		/* we will reuse the same caps object */
-		if (dec->outcaps == NULL) {
-			caps = gst_caps_new_simple("audio/x-raw-int",
-					"rate", G_TYPE_INT,
-					gst_sbc_parse_rate_from_sbc(
-						dec->sbc.frequency),
-					"channels", G_TYPE_INT,
-					gst_sbc_get_channel_number(
-						dec->sbc.mode),
-					NULL);
-
-			template = gst_static_pad_template_get(&sbc_dec_src_factory);
-
-			dec->outcaps = gst_caps_intersect(caps,
-						gst_pad_template_get_caps(template));
-
-			gst_caps_unref(caps);
-		}
-
-		gst_buffer_set_caps(output, dec->outcaps);
-
-		/* FIXME get a real timestamp */
-		GST_BUFFER_TIMESTAMP(output) = GST_CLOCK_TIME_NONE;
-
-		res = gst_pad_push(dec->srcpad, output);
-		if (res != GST_FLOW_OK)
-			goto done;
-
+		filled += written;
 		offset += consumed;
 	}
 
-	if (offset < size)
+	if (output != NULL)
+		res = sbc_dec_push(dec, output, filled);
+
+	if (res == GST_FLOW_OK && offset < size)
 		dec->buffer = gst_buffer_create_sub(buffer,
 							offset, size - offset);
 
@@ -165,6 +198,7 @@ static GstStateChangeReturn sbc_dec_change_state(GstElement *element,
 			gst_caps_unref(dec->outcaps);
 			dec->outcaps = NULL;
 		}
+		gst_sbc_buffer_pool_clear(&dec->pool);
 		break;
 
 	default:
@@ -187,12 +221,24 @@ static void gst_sbc_dec_base_init(gpointer g_class)
 	gst_element_class_set_details(element_class, &sbc_dec_details);
 }
 
+static void gst_sbc_dec_finalize(GObject *object)
+{
+	GstSbcDec *dec = GST_SBC_DEC(object);
+
+	gst_sbc_buffer_pool_free(&dec->pool);
+
+	GST_CALL_PARENT(G_OBJECT_CLASS, finalize, (object));
+}
+
 static void gst_sbc_dec_class_init(GstSbcDecClass *klass)
 {
+	GObjectClass *object_class = G_OBJECT_CLASS(klass);
 	GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
 
 	parent_class = g_type_class_peek_parent(klass);
 
+	object_class->finalize = GST_DEBUG_FUNCPTR(gst_sbc_dec_finalize);
+
 	element_class->change_state = GST_DEBUG_FUNCPTR(sbc_dec_change_state);
 
 	GST_DEBUG_CATEGORY_INIT(sbc_dec_debug, "sbcdec", 0,
@@ -212,6 +258,7 @@ static void gst_sbc_dec_init(GstSbcDec *self, GstSbcDecClass *klass)
 	gst_element_add_pad(GST_ELEMENT(self), self->srcpad);
 
 	self->outcaps = NULL;
+	gst_sbc_buffer_pool_init(&self->pool, SBC_DEC_POOL_SIZE);
 }
 
 gboolean gst_sbc_dec_plugin_init(GstPlugin *plugin)
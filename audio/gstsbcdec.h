@@ -24,6 +24,7 @@
 #include <gst/gst.h>
 
 #include "sbc.h"
+#include "gstsbcutil.h"
 
 G_BEGIN_DECLS
 
@@ -51,6 +52,7 @@ struct _GstSbcDec {
 
 	/* caps for outgoing buffers */
 	GstCaps *outcaps;
+	GstSbcBufferPool pool;
 
 	sbc_t sbc;
 };
@@ -38,6 +38,11 @@
 #define SBC_ENC_DEFAULT_RATE 0
 #define SBC_ENC_DEFAULT_CHANNELS 0
 
+/* Frames encoded into one output buffer at most */
+#define SBC_ENC_MAX_FRAMES 16
+/* Output buffers kept for reuse */
+#define SBC_ENC_POOL_SIZE 8
+
 #define SBC_ENC_BITPOOL_AUTO 1
 #define SBC_ENC_BITPOOL_MIN 2
 #define SBC_ENC_BITPOOL_MIN_STR "2"
@@ -132,7 +137,8 @@ enum {
 	PROP_ALLOCATION,
 	PROP_BLOCKS,
 	PROP_SUBBANDS,
-	PROP_BITPOOL
+	PROP_BITPOOL,
+	PROP_FAST
 };
 
 GST_BOILERPLATE(GstSbcEnc, gst_sbc_enc, GstElement, GST_TYPE_ELEMENT);
@@ -371,45 +377,66 @@ static GstFlowReturn sbc_enc_chain(GstPad *pad, GstBuffer *buffer)
 
 	gst_adapter_push(adapter, buffer);
 
+	/* every frame available goes into one pooled buffer, rather than a
+	 * buffer allocated downstream for each frame */
 	while (gst_adapter_available(adapter) >= enc->codesize &&
 							res == GST_FLOW_OK) {
 		GstBuffer *output;
-		GstCaps *caps;
+		GstClockTime timestamp;
+		guint64 distance;
 		const guint8 *data;
+		guint frames, i, size = 0;
 		gint consumed;
+		ssize_t written;
 
-		caps = GST_PAD_CAPS(enc->srcpad);
-		res = gst_pad_alloc_buffer_and_set_caps(enc->srcpad,
-						GST_BUFFER_OFFSET_NONE,
-						enc->frame_length, caps,
-						&output);
-		if (res != GST_FLOW_OK)
-			goto done;
+		frames = MIN(gst_adapter_available(adapter) / enc->codesize,
+							SBC_ENC_MAX_FRAMES);
 
-		data = gst_adapter_peek(adapter, enc->codesize);
+		output = gst_sbc_buffer_pool_get(&enc->pool,
+					SBC_ENC_MAX_FRAMES * enc->frame_length,
+					GST_PAD_CAPS(enc->srcpad));
 
-		consumed = sbc_encode(&enc->sbc, (gpointer) data,
-					enc->codesize,
-					GST_BUFFER_DATA(output),
-					GST_BUFFER_SIZE(output), NULL);
-		if (consumed <= 0) {
-			GST_DEBUG_OBJECT(enc, "comsumed < 0, codesize: %d",
+		/* the batch may start in the middle of an input buffer */
+		timestamp = gst_adapter_prev_timestamp(adapter, &distance);
+		if (GST_CLOCK_TIME_IS_VALID(timestamp))
+			timestamp += gst_util_uint64_scale(distance,
+					enc->frame_duration * GST_USECOND,
 					enc->codesize);
+
+		/* only copies when the frames span input buffers */
+		data = gst_adapter_peek(adapter, frames * enc->codesize);
+
+		for (i = 0; i < frames; i++) {
+			consumed = sbc_encode(&enc->sbc,
+					(gpointer) (data + i * enc->codesize),
+					enc->codesize,
+					GST_BUFFER_DATA(output) + size,
+					GST_BUFFER_SIZE(output) - size,
+					&written);
+			if (consumed <= 0) {
+				GST_DEBUG_OBJECT(enc, "comsumed < 0, "
+					"codesize: %d", enc->codesize);
+				break;
+			}
+
+			size += written;
+		}
+
+		gst_adapter_flush(adapter, i * enc->codesize);
+
+		if (i == 0) {
+			gst_buffer_unref(output);
 			break;
 		}
-		gst_adapter_flush(adapter, consumed);
 
-		GST_BUFFER_TIMESTAMP(output) = GST_BUFFER_TIMESTAMP(buffer);
-		/* we have only 1 frame */
-		GST_BUFFER_DURATION(output) = enc->frame_duration;
+		GST_BUFFER_SIZE(output) = size;
+		GST_BUFFER_TIMESTAMP(output) = timestamp;
+		GST_BUFFER_DURATION(output) = i * enc->frame_duration *
+								GST_USECOND;
 
 		res = gst_pad_push(enc->srcpad, output);
-
-		if (res != GST_FLOW_OK)
-			goto done;
 	}
 
-done:
 	gst_object_unref(enc);
 
 	return res;
@@ -423,12 +450,14 @@ static GstStateChangeReturn sbc_enc_change_state(GstElement *element,
 	switch (transition) {
 	case GST_STATE_CHANGE_READY_TO_PAUSED:
 		GST_DEBUG("Setup subband codec");
-		sbc_init(&enc->sbc, 0);
+		sbc_init(&enc->sbc, enc->fast ? SBC_FLAG_FAST : 0);
 		break;
 
 	case GST_STATE_CHANGE_PAUSED_TO_READY:
 		GST_DEBUG("Finish subband codec");
 		sbc_finish(&enc->sbc);
+		gst_adapter_clear(enc->adapter);
+		gst_sbc_buffer_pool_clear(&enc->pool);
 		break;
 
 	default:
@@ -446,6 +475,8 @@ static void gst_sbc_enc_dispose(GObject *object)
 		g_object_unref(G_OBJECT(enc->adapter));
 
 	enc->adapter = NULL;
+
+	gst_sbc_buffer_pool_free(&enc->pool);
 }
 
 static void gst_sbc_enc_base_init(gpointer g_class)
@@ -485,6 +516,9 @@ static void gst_sbc_enc_set_property(GObject *object, guint prop_id,
 	case PROP_BITPOOL:
 		enc->bitpool = g_value_get_int(value);
 		break;
+	case PROP_FAST:
+		enc->fast = g_value_get_boolean(value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
 		break;
@@ -512,6 +546,9 @@ static void gst_sbc_enc_get_property(GObject *object, guint prop_id,
 	case PROP_BITPOOL:
 		g_value_set_int(value, enc->bitpool);
 		break;
+	case PROP_FAST:
+		g_value_set_boolean(value, enc->fast);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
 		break;
@@ -557,6 +594,11 @@ static void gst_sbc_enc_class_init(GstSbcEncClass *klass)
 				SBC_ENC_BITPOOL_AUTO, SBC_ENC_BITPOOL_MAX,
 				SBC_ENC_BITPOOL_AUTO, G_PARAM_READWRITE));
 
+	g_object_class_install_property(object_class, PROP_FAST,
+			g_param_spec_boolean("fast", "Fast",
+				"Faster encoding at reduced quality",
+				FALSE, G_PARAM_READWRITE));
+
 	GST_DEBUG_CATEGORY_INIT(sbc_enc_debug, "sbcenc", 0,
 						"SBC encoding element");
 }
@@ -587,11 +629,13 @@ static void gst_sbc_enc_init(GstSbcEnc *self, GstSbcEncClass *klass)
 	self->rate = SBC_ENC_DEFAULT_RATE;
 	self->channels = SBC_ENC_DEFAULT_CHANNELS;
 	self->bitpool = SBC_ENC_BITPOOL_AUTO;
+	self->fast = FALSE;
 
 	self->frame_length = 0;
 	self->frame_duration = 0;
 
 	self->adapter = gst_adapter_new();
+	gst_sbc_buffer_pool_init(&self->pool, SBC_ENC_POOL_SIZE);
 }
 
 gboolean gst_sbc_enc_plugin_init(GstPlugin *plugin)
@@ -25,6 +25,7 @@
 #include <gst/base/gstadapter.h>
 
 #include "sbc.h"
+#include "gstsbcutil.h"
 
 G_BEGIN_DECLS
 
@@ -48,6 +49,7 @@ struct _GstSbcEnc {
 	GstPad *sinkpad;
 	GstPad *srcpad;
 	GstAdapter *adapter;
+	GstSbcBufferPool pool;
 
 	gint rate;
 	gint channels;
@@ -56,6 +58,7 @@ struct _GstSbcEnc {
 	gint allocation;
 	gint subbands;
 	gint bitpool;
+	gboolean fast;
 
 	guint codesize;
 	gint frame_length;
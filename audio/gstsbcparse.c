@@ -59,14 +59,29 @@ static GstStaticPadTemplate sbc_parse_src_factory =
 				"bitpool = (int) [ 2, 64 ],"
 				"parsed = (boolean) true"));
 
+/* Pushes a run of frames sharing the current caps, without copying them */
+static GstFlowReturn sbc_parse_push(GstSbcParse *parse, GstBuffer *buffer,
+						guint offset, guint size)
+{
+	GstBuffer *output;
+
+	if (size == 0)
+		return GST_FLOW_OK;
+
+	output = gst_buffer_create_sub(buffer, offset, size);
+	gst_buffer_set_caps(output, parse->outcaps);
+
+	return gst_pad_push(parse->srcpad, output);
+}
+
 static GstFlowReturn sbc_parse_chain(GstPad *pad, GstBuffer *buffer)
 {
 	GstSbcParse *parse = GST_SBC_PARSE(gst_pad_get_parent(pad));
 	GstFlowReturn res = GST_FLOW_OK;
-	guint size, offset = 0;
+	guint size, offset = 0, start = 0;
 	guint8 *data;
 
-	/* FIXME use a gstadpter */
+	/* only an incomplete frame is kept between buffers */
 	if (parse->buffer) {
 		GstBuffer *temp;
 		temp = buffer;
@@ -82,7 +97,6 @@ static GstFlowReturn sbc_parse_chain(GstPad *pad, GstBuffer *buffer)
 	size = GST_BUFFER_SIZE(buffer);
 
 	while (offset < size) {
-		GstBuffer *output;
 		int consumed;
 
 		consumed = sbc_parse(&parse->new_sbc, data + offset,
@@ -93,6 +107,13 @@ static GstFlowReturn sbc_parse_chain(GstPad *pad, GstBuffer *buffer)
 		if (parse->first_parsing || (memcmp(&parse->sbc,
 				&parse->new_sbc, sizeof(sbc_t)) != 0)) {
 
+			/* frames before this one have the old caps */
+			res = sbc_parse_push(parse, buffer, start,
+							offset - start);
+			if (res != GST_FLOW_OK)
+				goto done;
+			start = offset;
+
 			memcpy(&parse->sbc, &parse->new_sbc, sizeof(sbc_t));
 			if (parse->outcaps != NULL)
 				gst_caps_unref(parse->outcaps);
@@ -103,23 +124,12 @@ static GstFlowReturn sbc_parse_chain(GstPad *pad, GstBuffer *buffer)
 			parse->first_parsing = FALSE;
 		}
 
-		res = gst_pad_alloc_buffer_and_set_caps(parse->srcpad,
-						GST_BUFFER_OFFSET_NONE,
-						consumed, parse->outcaps, &output);
-
-		if (res != GST_FLOW_OK)
-			goto done;
-
-		memcpy(GST_BUFFER_DATA(output), data + offset, consumed);
-
-		res = gst_pad_push(parse->srcpad, output);
-		if (res != GST_FLOW_OK)
-			goto done;
-
 		offset += consumed;
 	}
 
-	if (offset < size)
+	res = sbc_parse_push(parse, buffer, start, offset - start);
+
+	if (res == GST_FLOW_OK && offset < size)
 		parse->buffer = gst_buffer_create_sub(buffer,
 							offset, size - offset);
 
@@ -519,3 +519,77 @@ gboolean gst_sbc_util_fill_sbc_params(sbc_t *sbc, GstCaps *caps)
 	return TRUE;
 }
 
+void gst_sbc_buffer_pool_init(GstSbcBufferPool *pool, guint max)
+{
+	pool->buffers = g_queue_new();
+	pool->size = 0;
+	pool->max = max;
+}
+
+void gst_sbc_buffer_pool_clear(GstSbcBufferPool *pool)
+{
+	GstBuffer *buffer;
+
+	if (pool->buffers == NULL)
+		return;
+
+	while ((buffer = g_queue_pop_head(pool->buffers)) != NULL)
+		gst_buffer_unref(buffer);
+
+	pool->size = 0;
+}
+
+void gst_sbc_buffer_pool_free(GstSbcBufferPool *pool)
+{
+	gst_sbc_buffer_pool_clear(pool);
+
+	if (pool->buffers != NULL)
+		g_queue_free(pool->buffers);
+
+	pool->buffers = NULL;
+}
+
+/**
+ * Returns a buffer of size bytes with caps set. A pooled buffer is free
+ * again when the pool holds the only reference to it; buffers are tried
+ * oldest first as they are the most likely to have been released.
+ */
+GstBuffer *gst_sbc_buffer_pool_get(GstSbcBufferPool *pool, guint size,
+							GstCaps *caps)
+{
+	GstBuffer *buffer;
+	GList *l;
+
+	if (size != pool->size) {
+		gst_sbc_buffer_pool_clear(pool);
+		pool->size = size;
+	}
+
+	for (l = pool->buffers->head; l != NULL; l = l->next) {
+		buffer = l->data;
+
+		if (GST_MINI_OBJECT_REFCOUNT_VALUE(buffer) != 1)
+			continue;
+
+		g_queue_unlink(pool->buffers, l);
+		g_queue_push_tail_link(pool->buffers, l);
+
+		GST_MINI_OBJECT_FLAGS(buffer) = 0;
+		GST_BUFFER_SIZE(buffer) = size;
+		GST_BUFFER_TIMESTAMP(buffer) = GST_CLOCK_TIME_NONE;
+		GST_BUFFER_DURATION(buffer) = GST_CLOCK_TIME_NONE;
+		GST_BUFFER_OFFSET(buffer) = GST_BUFFER_OFFSET_NONE;
+		GST_BUFFER_OFFSET_END(buffer) = GST_BUFFER_OFFSET_NONE;
+		gst_buffer_set_caps(buffer, caps);
+
+		return gst_buffer_ref(buffer);
+	}
+
+	buffer = gst_buffer_new_and_alloc(size);
+	gst_buffer_set_caps(buffer, caps);
+
+	if (g_queue_get_length(pool->buffers) < pool->max)
+		g_queue_push_tail(pool->buffers, gst_buffer_ref(buffer));
+
+	return buffer;
+}
@@ -73,3 +73,18 @@ void gst_sbc_util_set_structure_string_param(GstStructure *structure,
 
 gboolean gst_sbc_util_fill_sbc_params(sbc_t *sbc, GstCaps *caps);
 
+/* Output buffers kept by an element and handed out again once downstream
+ * has released them, so steady streaming allocates nothing */
+typedef struct {
+	GQueue *buffers;
+	guint size;
+	guint max;
+} GstSbcBufferPool;
+
+void gst_sbc_buffer_pool_init(GstSbcBufferPool *pool, guint max);
+void gst_sbc_buffer_pool_clear(GstSbcBufferPool *pool);
+void gst_sbc_buffer_pool_free(GstSbcBufferPool *pool);
+
+GstBuffer *gst_sbc_buffer_pool_get(GstSbcBufferPool *pool, guint size,
+							GstCaps *caps);
+
@@ -63,6 +63,8 @@
 
 #define RING_INTERVAL 3
 
+#define CODEC_TIMEOUT 3
+
 #define BUF_SIZE 1024
 
 #define HEADSET_GAIN_SPEAKER 'S'
@@ -92,6 +94,7 @@ static struct {
 
 static gboolean sco_hci = TRUE;
 static gboolean fast_connectable = FALSE;
+static gboolean wideband_speech = FALSE;
 
 static GSList *active_devices = NULL;
 
@@ -148,6 +151,8 @@ struct headset_slc {
 	int mic_gain;
 
 	unsigned int hf_features;
+	gboolean hf_msbc;		/* mSBC listed by AT+BAC */
+	uint8_t codec;			/* Confirmed by AT+BCS, 0 if none */
 };
 
 struct headset {
@@ -160,6 +165,7 @@ struct headset {
 	GIOChannel *tmp_rfcomm;
 	GIOChannel *sco;
 	guint sco_id;
+	guint codec_timer;		/* Waiting for AT+BCS */
 
 	gboolean auto_dc;
 
@@ -167,6 +173,7 @@ struct headset {
 
 	gboolean hfp_active;
 	gboolean search_hfp;
+	gboolean wideband;
 
 	headset_state_t state;
 	struct pending_connect *pending;
@@ -226,6 +233,8 @@ static void print_ag_features(uint32_t features)
 		g_string_append(gstr, "\"Enhanced call control\" ");
 	if (features & AG_FEATURE_EXTENDED_ERROR_RESULT_CODES)
 		g_string_append(gstr, "\"Extended Error Result Codes\" ");
+	if (features & AG_FEATURE_CODEC_NEGOTIATION)
+		g_string_append(gstr, "\"Codec negotiation\" ");
 
 	str = g_string_free(gstr, FALSE);
 
@@ -260,6 +269,8 @@ static void print_hf_features(uint32_t features)
 		g_string_append(gstr, "\"Enhanced call status\" ");
 	if (features & HF_FEATURE_ENHANCED_CALL_CONTROL)
 		g_string_append(gstr, "\"Enhanced call control\" ");
+	if (features & HF_FEATURE_CODEC_NEGOTIATION)
+		g_string_append(gstr, "\"Codec negotiation\" ");
 
 	str = g_string_free(gstr, FALSE);
 
@@ -351,6 +362,31 @@ static int supported_features(struct audio_device *device, const char *buf)
 	return headset_send(hs, "\r\nOK\r\n");
 }
 
+static int available_codecs(struct audio_device *device, const char *buf)
+{
+	struct headset *hs = device->headset;
+	struct headset_slc *slc = hs->slc;
+	char **codecs;
+	int i;
+
+	if (strlen(buf) < 8)
+		return -EINVAL;
+
+	slc->hf_msbc = FALSE;
+
+	codecs = g_strsplit(&buf[7], ",", 0);
+	for (i = 0; codecs[i] != NULL; i++) {
+		if (strtoul(codecs[i], NULL, 10) == HFP_CODEC_MSBC)
+			slc->hf_msbc = TRUE;
+	}
+	g_strfreev(codecs);
+
+	/* The codec agreed before may no longer be available */
+	slc->codec = 0;
+
+	return headset_send(hs, "\r\nOK\r\n");
+}
+
 static char *indicator_ranges(const struct indicator *indicators)
 {
 	int i;
@@ -611,19 +647,21 @@ static void sco_connect_cb(GIOChannel *chan, GError *err, gpointer user_data)
 	}
 }
 
-static int sco_connect(struct audio_device *dev, headset_stream_cb_t cb,
-			void *user_data, unsigned int *cb_id)
+static int sco_open(struct audio_device *dev)
 {
 	struct headset *hs = dev->headset;
+	uint16_t voice = 0;
 	GError *err = NULL;
 	GIOChannel *io;
 
-	if (hs->state != HEADSET_STATE_CONNECTED)
-		return -EINVAL;
+	/* mSBC frames go over the air untouched by the controller */
+	if (headset_get_codec(dev) == HFP_CODEC_MSBC)
+		voice = BT_VOICE_TRANSPARENT;
 
 	io = bt_io_connect(BT_IO_SCO, sco_connect_cb, dev, NULL, &err,
 				BT_IO_OPT_SOURCE_BDADDR, &dev->src,
 				BT_IO_OPT_DEST_BDADDR, &dev->dst,
+				BT_IO_OPT_VOICE, voice,
 				BT_IO_OPT_INVALID);
 	if (!io) {
 		error("%s", err->message);
@@ -633,6 +671,82 @@ static int sco_connect(struct audio_device *dev, headset_stream_cb_t cb,
 
 	hs->sco = io;
 
+	return 0;
+}
+
+/* Opens the SCO link once the codec is settled, or fails the connect */
+static void sco_open_pending(struct audio_device *dev)
+{
+	struct headset *hs = dev->headset;
+	struct pending_connect *p = hs->pending;
+	int err;
+
+	err = sco_open(dev);
+	if (err == 0)
+		return;
+
+	if (p != NULL) {
+		p->err = err;
+		if (p->msg)
+			error_connect_failed(dev->conn, p->msg, p->err);
+		pending_connect_finalize(dev);
+	}
+
+	headset_set_state(dev, HEADSET_STATE_CONNECTED);
+}
+
+static gboolean codec_timeout(gpointer user_data)
+{
+	struct audio_device *dev = user_data;
+	struct headset *hs = dev->headset;
+
+	DBG("No AT+BCS from %s, using CVSD", dev->path);
+
+	/* Do not offer mSBC to clients of this HF anymore */
+	hs->codec_timer = 0;
+	hs->slc->hf_msbc = FALSE;
+	hs->slc->codec = HFP_CODEC_CVSD;
+
+	sco_open_pending(dev);
+
+	return FALSE;
+}
+
+static gboolean codec_negotiation(struct headset *hs)
+{
+	struct headset_slc *slc = hs->slc;
+
+	if (!hs->wideband || slc == NULL || !slc->hf_msbc)
+		return FALSE;
+
+	return (ag.features & AG_FEATURE_CODEC_NEGOTIATION) &&
+			(slc->hf_features & HF_FEATURE_CODEC_NEGOTIATION);
+}
+
+static int sco_connect(struct audio_device *dev, headset_stream_cb_t cb,
+			void *user_data, unsigned int *cb_id)
+{
+	struct headset *hs = dev->headset;
+	int err;
+
+	if (hs->state != HEADSET_STATE_CONNECTED)
+		return -EINVAL;
+
+	/* Propose mSBC first unless the HF already confirmed a codec, the
+	 * link is opened when it answers with AT+BCS */
+	if (codec_negotiation(hs) && hs->slc->codec == 0) {
+		err = headset_send(hs, "\r\n+BCS: %u\r\n", HFP_CODEC_MSBC);
+		if (err < 0)
+			return err;
+
+		hs->codec_timer = g_timeout_add_seconds(CODEC_TIMEOUT,
+							codec_timeout, dev);
+	} else {
+		err = sco_open(dev);
+		if (err < 0)
+			return err;
+	}
+
 	headset_set_state(dev, HEADSET_STATE_PLAY_IN_PROGRESS);
 
 	pending_connect_init(hs, HEADSET_STATE_PLAYING);
@@ -647,6 +761,35 @@ static int sco_connect(struct audio_device *dev, headset_stream_cb_t cb,
 	return 0;
 }
 
+static int codec_selected(struct audio_device *device, const char *buf)
+{
+	struct headset *hs = device->headset;
+	struct headset_slc *slc = hs->slc;
+	unsigned long codec;
+	int err;
+
+	if (strlen(buf) < 8 || !hs->codec_timer)
+		return -EINVAL;
+
+	codec = strtoul(&buf[7], NULL, 10);
+	if (codec != HFP_CODEC_MSBC && codec != HFP_CODEC_CVSD)
+		return -EINVAL;
+
+	g_source_remove(hs->codec_timer);
+	hs->codec_timer = 0;
+	slc->codec = codec;
+
+	DBG("Codec %lu selected for %s", codec, device->path);
+
+	err = headset_send(hs, "\r\nOK\r\n");
+	if (err < 0)
+		return err;
+
+	sco_open_pending(device);
+
+	return 0;
+}
+
 static int hfp_cmp(struct headset *hs)
 {
 	if (hs->hfp_active)
@@ -1212,6 +1355,8 @@ static struct event event_callbacks[] = {
 	{ "ATD", dial_number },
 	{ "AT+VG", signal_gain_setting },
 	{ "AT+BRSF", supported_features },
+	{ "AT+BAC", available_codecs },
+	{ "AT+BCS", codec_selected },
 	{ "AT+CIND", report_indicators },
 	{ "AT+CMER", event_reporting },
 	{ "AT+CHLD", call_hold },
@@ -1263,6 +1408,11 @@ static void close_sco(struct audio_device *device)
 		g_source_remove(hs->sco_id);
 		hs->sco_id = 0;
 	}
+
+	if (hs->codec_timer) {
+		g_source_remove(hs->codec_timer);
+		hs->codec_timer = 0;
+	}
 }
 
 static gboolean rfcomm_io_cb(GIOChannel *chan, GIOCondition cond,
@@ -1994,6 +2144,10 @@ static DBusMessage *hs_get_properties(DBusConnection *conn,
 	value = (device->headset->state >= HEADSET_STATE_CONNECTED);
 	dict_append_entry(&dict, "Connected", DBUS_TYPE_BOOLEAN, &value);
 
+	/* WidebandSpeech */
+	dict_append_entry(&dict, "WidebandSpeech", DBUS_TYPE_BOOLEAN,
+					&device->headset->wideband);
+
 	if (!value)
 		goto done;
 
@@ -2016,9 +2170,11 @@ done:
 static DBusMessage *hs_set_property(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
+	struct audio_device *device = data;
 	const char *property;
 	DBusMessageIter iter;
 	DBusMessageIter sub;
+	dbus_bool_t wideband;
 	uint16_t gain;
 
 	if (!dbus_message_iter_init(msg, &iter))
@@ -2048,6 +2204,26 @@ static DBusMessage *hs_set_property(DBusConnection *conn,
 		dbus_message_iter_get_basic(&sub, &gain);
 		return hs_set_gain(conn, msg, data, gain,
 					HEADSET_GAIN_MICROPHONE);
+	} else if (g_str_equal("WidebandSpeech", property)) {
+		if (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_BOOLEAN)
+			return btd_error_invalid_args(msg);
+
+		dbus_message_iter_get_basic(&sub, &wideband);
+		if (device->headset->wideband == wideband)
+			return dbus_message_new_method_return(msg);
+
+		device->headset->wideband = wideband;
+
+		/* Negotiate again before the next audio connection */
+		if (device->headset->slc)
+			device->headset->slc->codec = 0;
+
+		emit_property_changed(conn, device->path,
+					AUDIO_HEADSET_INTERFACE,
+					"WidebandSpeech", DBUS_TYPE_BOOLEAN,
+					&device->headset->wideband);
+
+		return dbus_message_new_method_return(msg);
 	}
 
 	return btd_error_invalid_args(msg);
@@ -2201,6 +2377,7 @@ struct headset *headset_init(struct audio_device *dev, uint16_t svc,
 	hs = g_new0(struct headset, 1);
 	hs->rfcomm_ch = -1;
 	hs->search_hfp = server_is_enabled(&dev->src, HANDSFREE_SVCLASS_ID);
+	hs->wideband = wideband_speech;
 
 	record = btd_device_get_record(dev->btd_dev, uuidstr);
 	if (!record)
@@ -2273,6 +2450,13 @@ uint32_t headset_config_init(GKeyFile *config)
 		g_free(str);
 	}
 
+	wideband_speech = g_key_file_get_boolean(config, "Headset",
+						"WidebandSpeech", &err);
+	if (err) {
+		DBG("audio.conf: %s", err->message);
+		g_clear_error(&err);
+	}
+
 	return ag.features;
 }
 
@@ -2744,6 +2928,20 @@ gboolean headset_get_sco_hci(struct audio_device *dev)
 	return sco_hci;
 }
 
+uint8_t headset_get_codec(struct audio_device *dev)
+{
+	struct headset *hs = dev->headset;
+
+	if (hs->slc && hs->slc->codec)
+		return hs->slc->codec;
+
+	/* Not confirmed yet, mSBC will be proposed if possible */
+	if (codec_negotiation(hs))
+		return HFP_CODEC_MSBC;
+
+	return HFP_CODEC_CVSD;
+}
+
 void headset_shutdown(struct audio_device *dev)
 {
 	struct pending_connect *p = dev->headset->pending;
@@ -2865,6 +3063,8 @@ int telephony_ready_ind(uint32_t features,
 {
 	ag.telephony_ready = TRUE;
 	ag.features = features;
+	if (wideband_speech)
+		ag.features |= AG_FEATURE_CODEC_NEGOTIATION;
 	ag.indicators = indicators;
 	ag.rh = rh;
 	ag.chld = chld;
@@ -27,6 +27,10 @@
 #define DEFAULT_HS_AG_CHANNEL 12
 #define DEFAULT_HF_AG_CHANNEL 13
 
+/* HFP 1.6 codec IDs */
+#define HFP_CODEC_CVSD 0x01
+#define HFP_CODEC_MSBC 0x02
+
 typedef enum {
 	HEADSET_STATE_DISCONNECTED,
 	HEADSET_STATE_CONNECTING,
@@ -98,6 +102,7 @@ unsigned int headset_add_nrec_cb(struct audio_device *dev,
 gboolean headset_remove_nrec_cb(struct audio_device *dev, unsigned int id);
 gboolean headset_get_inband(struct audio_device *dev);
 gboolean headset_get_sco_hci(struct audio_device *dev);
+uint8_t headset_get_codec(struct audio_device *dev);
 
 gboolean headset_is_active(struct audio_device *dev);
 
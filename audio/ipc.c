@@ -41,9 +41,9 @@ static const char *strnames[] = {
 	"BT_START_STREAM",
 	"BT_STOP_STREAM",
 	"BT_CLOSE",
-	"BT_SUSPEND_STREAM",
-	"BT_RESUME_STREAM",
 	"BT_CONTROL",
+	"BT_DELAY_REPORT",
+	"BT_STREAM_STATS",
 };
 
 int bt_audio_service_open(void)
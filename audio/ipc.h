@@ -103,6 +103,7 @@ typedef struct {
 #define BT_CLOSE			6
 #define BT_CONTROL			7
 #define BT_DELAY_REPORT			8
+#define BT_STREAM_STATS			9
 
 #define BT_CAPABILITIES_TRANSPORT_A2DP	0
 #define BT_CAPABILITIES_TRANSPORT_SCO	1
@@ -175,6 +176,7 @@ struct bt_get_capabilities_req {
 #define BT_MPEG_LAYER_3				1
 
 #define BT_HFP_CODEC_PCM			0x00
+#define BT_HFP_CODEC_MSBC			0x01
 
 #define BT_PCM_FLAG_NREC			0x01
 #define BT_PCM_FLAG_PCM_ROUTING			0x02
@@ -225,6 +227,7 @@ struct bt_get_capabilities_rsp {
 	char			destination[18];/* Address of the remote Device */
 	char			object[128];	/* DBus object path */
 	uint8_t			isEdrCapable;	/* EDR capable */
+	uint8_t			sbcFastEncoder;	/* Use the fast SBC encoder */
 	uint8_t			data[0];	/* First codec_capabilities_t */
 } __attribute__ ((packed));
 
@@ -338,6 +341,25 @@ struct bt_delay_report_ind {
 	uint16_t		delay;
 } __attribute__ ((packed));
 
+/* Sent by the client while streaming, there is no response. Counters are
+ * cumulative since the client was created. */
+#define BT_STREAM_STATS_MAX_FRAMES		15
+
+struct bt_stream_stats_ind {
+	bt_audio_msg_header_t	h;
+	uint64_t		packets;	/* Media packets sent */
+	uint64_t		bytes;		/* Bytes sent */
+	uint32_t		frames[BT_STREAM_STATS_MAX_FRAMES + 1];
+						/* Packets by SBC frame count */
+	uint32_t		poll_timeouts;
+	uint32_t		eagain;
+	uint32_t		epipe;
+	uint32_t		deadline_misses;
+	uint32_t		bitpool_changes;
+	uint8_t			bitpool;	/* Current bitpool */
+	uint32_t		encode_ns;	/* Encoding time per SBC frame */
+} __attribute__ ((packed));
+
 /* Function declaration */
 
 /* Opens a connection to the audio service: return a socket descriptor */
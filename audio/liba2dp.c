@@ -28,25 +28,33 @@
 #endif
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <signal.h>
 #include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <errno.h>
 
 #include <netinet/in.h>
+#include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <linux/sockios.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 
 #include "ipc.h"
 #include "sbc.h"
-#include "rtp.h"
+#include "pcm_convert.h"
+#include "media_packetizer.h"
 #include "liba2dp.h"
 
 #define BUFFER_SIZE 2048
@@ -89,13 +97,37 @@
 /* Number of packets to buffer in the stream socket */
 #define PACKET_BUFFER_COUNT		10
 
-/* timeout in milliseconds to prevent poll() from hanging indefinitely */
-#define POLL_TIMEOUT			1000
-
 /* milliseconds of unsucessfull a2dp packets before we stop trying to catch up
  * on write()'s and fall-back to metered writes */
 #define CATCH_UP_TIMEOUT		200
 
+/* packets between two reports of the pacing jitter statistics */
+#define JITTER_REPORT_PACKETS		1000
+
+/* packets between two reports of the transmit statistics to bluetoothd */
+#define STATS_REPORT_PACKETS		500
+
+/* packets between two attempts to bring a broadcast follower up */
+#define BROADCAST_KICK_PACKETS		16
+
+/* samples of converted PCM waiting for the SBC encoder */
+#define CONVERT_BUFFER_SIZE		4096
+
+/* packets between two checks for indications from bluetoothd while
+ * streaming, such as the sink's delay report */
+#define INDICATION_POLL_PACKETS		64
+
+/* Adaptive bitpool: fill level of the stream socket send buffer, in eighths,
+ * at which the link counts as congested and as clear */
+#define BITPOOL_QUEUE_HIGH		4
+#define BITPOOL_QUEUE_LOW		1
+
+/* packets to leave the queue alone for after lowering the bitpool */
+#define BITPOOL_HOLDOFF			PACKET_BUFFER_COUNT
+
+/* packets in a row with a clear link before raising the bitpool by one */
+#define BITPOOL_RAISE_PACKETS		50
+
 /* timeout in milliseconds for a2dp_write */
 #define WRITE_TIMEOUT			1000
 
@@ -143,19 +175,64 @@ struct bluetooth_data {
 	size_t sizeof_scms_t;                   /* Indicates protection hdr */
 	uint8_t scms_t_cp_header;		/* Protection header to use */
 	uint8_t buffer[BUFFER_SIZE];		/* Codec transfer buffer */
-	int count;				/* Codec transfer buffer counter */
-
-	int nsamples;				/* Cumulative number of codec samples */
-	uint16_t seq_num;			/* Cumulative packet sequence */
-	int frame_count;			/* Current frames in buffer*/
+	struct media_packetizer packetizer;	/* Packet being filled */
+	struct media_backlog backlog;		/* Packets the socket had no
+						 * room for yet */
+	int epoll_fd;				/* Stream socket writability */
+	struct pcm_convert *convert;		/* Rate/channel conversion */
+	int16_t convert_buf[CONVERT_BUFFER_SIZE];	/* Converted PCM */
+	int convert_len;			/* Converted bytes not encoded */
 
 	char	address[20];
 	int	rate;
 	int	channels;
+	int	sink_rate;			/* Format sent to the sink, when */
+	int	sink_channels;			/* different input is converted */
 
 	/* used for pacing our writes to the output socket */
-	uint64_t	next_write;
+	uint64_t	next_write;		/* Absolute deadline of next packet */
+	int	rt_priority;			/* SCHED_FIFO priority of writer */
+	int	rt_applied;
+	pthread_t	rt_thread;		/* Writer thread rt_priority is set on */
+
+	/* pacing jitter, reset after each report */
+	unsigned int	jitter_packets;
+	unsigned int	jitter_late;		/* Packets late by a frame or more */
+	unsigned int	jitter_resyncs;		/* Deadline resets after falling behind */
+	uint64_t	jitter_sum;
+	uint64_t	jitter_max;
+
+	/* latency model, see a2dp_get_latency() */
+	uint16_t	sink_delay;		/* Sink delay report in 1/10 ms */
+	int	sink_delay_valid;
+	unsigned int	packet_len;		/* Size of the last packet sent */
+	long	packet_duration;		/* Its playback time in microseconds */
+
+	/* adaptive bitpool within the negotiated range */
+	uint8_t	min_bitpool;
+	uint8_t	max_bitpool;
+	int	sndbuf;				/* Stream socket send buffer size */
+	int	bitpool_holdoff;		/* Packets until the next step down */
+	int	bitpool_clear;			/* Packets in a row with a clear link */
+
+	/* transmit statistics, stats_work is private to the writer which
+	 * publishes it to stats once per packet, see a2dp_get_stats() */
+	struct a2dp_stats stats_work;
+	struct a2dp_stats stats;
+	volatile unsigned int stats_seq;	/* Odd while stats is updated */
+
+	/* broadcast, see a2dp_broadcast_add() */
+	pthread_mutex_t broadcast_lock;		/* Protects followers */
+	struct bluetooth_data *followers[A2DP_BROADCAST_MAX];
+	int	nfollowers;
+	unsigned int	broadcast_mtu;		/* Smallest follower MTU */
+	uint8_t	broadcast_min_bitpool;		/* Bitpool range all followers */
+	uint8_t	broadcast_max_bitpool;		/* accept, 0 if unrestricted */
+	struct bluetooth_data *leader;		/* Set on followers */
+	int	broadcast_policy;
+
 	uint8_t	isEdrCapable;
+	uint8_t	sbcFastEncoder;
 };
 
 #define CP_TYPE_SCMS_T 		0x0002
@@ -166,7 +243,28 @@ static uint64_t get_microseconds()
 {
 	struct timespec now;
 	clock_gettime(CLOCK_MONOTONIC, &now);
-	return (now.tv_sec * 1000000UL + now.tv_nsec / 1000UL);
+	return ((uint64_t) now.tv_sec * 1000000UL + now.tv_nsec / 1000UL);
+}
+
+static uint64_t get_nanoseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+/* Sleeps until an absolute CLOCK_MONOTONIC deadline, so wakeup errors
+ * never accumulate from one packet to the next */
+static void sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000UL;
+	ts.tv_nsec = (deadline % 1000000UL) * 1000UL;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+							NULL) == EINTR)
+		;
 }
 
 #ifdef ENABLE_TIMING
@@ -180,7 +278,10 @@ static int audioservice_send(struct bluetooth_data *data, const bt_audio_msg_hea
 static int audioservice_expect(struct bluetooth_data *data, bt_audio_msg_header_t *outmsg,
 				int expected_type);
 static int bluetooth_a2dp_hw_params(struct bluetooth_data *data);
+static void audioservice_poll(struct bluetooth_data *data);
 static void set_state(struct bluetooth_data *data, a2dp_state_t state);
+static void __set_command(struct bluetooth_data *data,
+						a2dp_command_t command);
 
 
 static void bluetooth_close(struct bluetooth_data *data)
@@ -252,7 +353,8 @@ static int bluetooth_start(struct bluetooth_data *data)
 	struct bt_start_stream_req *start_req = (void*) buf;
 	struct bt_start_stream_rsp *start_rsp = (void*) buf;
 	struct bt_new_stream_ind *streamfd_ind = (void*) buf;
-	int opt_name, err, bytes;
+	int opt_name, err, bytes, flags;
+	socklen_t optlen;
 
 	DBG("bluetooth_start");
 	data->state = A2DP_STATE_STARTING;
@@ -286,18 +388,49 @@ static int bluetooth_start(struct bluetooth_data *data)
 	l2cap_set_flushable(data->stream.fd, 1);
 	data->stream.events = POLLOUT;
 
+	/* packets are paced by deadlines, a full socket must not block */
+	flags = fcntl(data->stream.fd, F_GETFL);
+	if (flags >= 0)
+		fcntl(data->stream.fd, F_SETFL, flags | O_NONBLOCK);
+	media_backlog_init(&data->backlog);
+
+	if (data->epoll_fd >= 0) {
+		struct epoll_event event;
+
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLOUT | EPOLLET;
+		if (epoll_ctl(data->epoll_fd, EPOLL_CTL_ADD, data->stream.fd,
+							&event) < 0)
+			ERR("Can't watch stream socket: %s", strerror(errno));
+	}
+
 	/* set our socket buffer to the size of PACKET_BUFFER_COUNT packets */
 	bytes = data->link_mtu * PACKET_BUFFER_COUNT;
 	setsockopt(data->stream.fd, SOL_SOCKET, SO_SNDBUF, &bytes,
 			sizeof(bytes));
 
-	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload) + data->sizeof_scms_t;
-	data->frame_count = 0;
+	/* the kernel may have adjusted it, the bitpool controller needs
+	 * the real size */
+	optlen = sizeof(data->sndbuf);
+	if (getsockopt(data->stream.fd, SOL_SOCKET, SO_SNDBUF, &data->sndbuf,
+							&optlen) < 0)
+		data->sndbuf = 0;
+
+	/* every stream starts out at the best negotiated quality */
+	data->sbc.bitpool = data->max_bitpool;
+	data->bitpool_holdoff = 0;
+	data->bitpool_clear = 0;
+
+	media_packetizer_init(&data->packetizer, data->buffer,
+				sizeof(data->buffer), data->link_mtu,
+				data->sizeof_scms_t ? data->scms_t_cp_header : -1);
 	data->samples = 0;
-	data->nsamples = 0;
-	data->seq_num = 0;
-	data->frame_count = 0;
 	data->next_write = 0;
+	data->jitter_packets = 0;
+	data->jitter_late = 0;
+	data->jitter_resyncs = 0;
+	data->jitter_sum = 0;
+	data->jitter_max = 0;
 
 	set_state(data, A2DP_STATE_STARTED);
 	return 0;
@@ -421,13 +554,67 @@ static uint8_t medium_quality_default_bitpool(uint8_t freq, uint8_t mode)
 	}
 }
 
+/* Picks the sink rate closest to rate that rate can be converted to, the
+ * higher one on a tie. Returns 0 if there is none. */
+static int a2dp_select_rate(uint8_t frequencies, int rate)
+{
+	static const struct {
+		int rate;
+		uint8_t flag;
+	} rates[] = {
+		{ 48000, BT_SBC_SAMPLING_FREQ_48000 },
+		{ 44100, BT_SBC_SAMPLING_FREQ_44100 },
+		{ 32000, BT_SBC_SAMPLING_FREQ_32000 },
+		{ 16000, BT_SBC_SAMPLING_FREQ_16000 },
+	};
+	int i, best = 0;
+
+	/* nothing known about the sink, let the daemon decide */
+	if (!frequencies)
+		return rate;
+
+	for (i = 0; i < (int) (sizeof(rates) / sizeof(rates[0])); i++) {
+		if (!(frequencies & rates[i].flag))
+			continue;
+		if (rates[i].rate != rate &&
+				!pcm_convert_supported(rate, rates[i].rate))
+			continue;
+		if (!best || abs(rates[i].rate - rate) < abs(best - rate))
+			best = rates[i].rate;
+	}
+
+	return best;
+}
+
 static int bluetooth_a2dp_init(struct bluetooth_data *data)
 {
 	sbc_capabilities_t *cap = &data->sbc_capabilities;
 	unsigned int max_bitpool, min_bitpool;
 	int dir, def_bitpool;
+	uint8_t stereo_modes = BT_A2DP_CHANNEL_MODE_JOINT_STEREO |
+				BT_A2DP_CHANNEL_MODE_STEREO |
+				BT_A2DP_CHANNEL_MODE_DUAL_CHANNEL;
+
+	/* convert to what the sink supports rather than failing */
+	data->sink_rate = a2dp_select_rate(cap->frequency, data->rate);
+
+	data->sink_channels = data->channels;
+	if (data->channels == 2 && !(cap->channel_mode & stereo_modes) &&
+			(cap->channel_mode & BT_A2DP_CHANNEL_MODE_MONO))
+		data->sink_channels = 1;
+	else if (data->channels == 1 &&
+			!(cap->channel_mode & BT_A2DP_CHANNEL_MODE_MONO) &&
+			(cap->channel_mode & stereo_modes))
+		data->sink_channels = 2;
+
+	if (data->sink_rate != data->rate ||
+				data->sink_channels != data->channels) {
+		DBG("converting %d Hz %d channels to %d Hz %d channels",
+				data->rate, data->channels,
+				data->sink_rate, data->sink_channels);
+	}
 
-	switch (data->rate) {
+	switch (data->sink_rate) {
 	case 48000:
 		cap->frequency = BT_SBC_SAMPLING_FREQ_48000;
 		break;
@@ -445,7 +632,7 @@ static int bluetooth_a2dp_init(struct bluetooth_data *data)
 		return -1;
 	}
 
-	if (data->channels == 2) {
+	if (data->sink_channels == 2) {
 		if (cap->channel_mode & BT_A2DP_CHANNEL_MODE_JOINT_STEREO)
 			cap->channel_mode = BT_A2DP_CHANNEL_MODE_JOINT_STEREO;
 		else if (cap->channel_mode & BT_A2DP_CHANNEL_MODE_STEREO)
@@ -504,11 +691,11 @@ static int bluetooth_a2dp_init(struct bluetooth_data *data)
 	return 0;
 }
 
-static void bluetooth_a2dp_setup(struct bluetooth_data *data)
+static int bluetooth_a2dp_setup(struct bluetooth_data *data)
 {
 	sbc_capabilities_t active_capabilities = data->sbc_capabilities;
 
-	sbc_reinit(&data->sbc, 0);
+	sbc_reinit(&data->sbc, data->sbcFastEncoder ? SBC_FLAG_FAST : 0);
 
 	if (active_capabilities.frequency & BT_SBC_SAMPLING_FREQ_16000)
 		data->sbc.frequency = SBC_FREQ_16000;
@@ -563,9 +750,28 @@ static void bluetooth_a2dp_setup(struct bluetooth_data *data)
 	}
 
 	data->sbc.bitpool = active_capabilities.max_bitpool;
+	data->min_bitpool = active_capabilities.min_bitpool;
+	data->max_bitpool = active_capabilities.max_bitpool;
 	data->codesize = sbc_get_codesize(&data->sbc);
 	data->frame_duration = sbc_get_frame_duration(&data->sbc);
 	DBG("frame_duration: %d us", data->frame_duration);
+
+	pcm_convert_free(data->convert);
+	data->convert = NULL;
+	data->convert_len = 0;
+	if (data->sink_rate != data->rate ||
+			data->sink_channels != data->channels) {
+		data->convert = pcm_convert_new(data->rate, data->channels,
+					data->sink_rate, data->sink_channels);
+		if (!data->convert) {
+			ERR("Can't convert %d Hz %d channels to %d Hz %d channels",
+					data->rate, data->channels,
+					data->sink_rate, data->sink_channels);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
 }
 
 static int bluetooth_a2dp_hw_params(struct bluetooth_data *data)
@@ -706,7 +912,9 @@ static int bluetooth_a2dp_hw_params(struct bluetooth_data *data)
 	DBG("MTU: %d -- SCMS-T Enabled: %d", data->link_mtu, setconf_rsp->content_protection);
 
 	/* Setup SBC encoder now we agree on parameters */
-	bluetooth_a2dp_setup(data);
+	err = bluetooth_a2dp_setup(data);
+	if (err < 0)
+		return err;
 
 	DBG("\tallocation=%u\n\tsubbands=%u\n\tblocks=%u\n\tbitpool=%u\n",
 		data->sbc.allocation, data->sbc.subbands, data->sbc.blocks,
@@ -715,93 +923,433 @@ static int bluetooth_a2dp_hw_params(struct bluetooth_data *data)
 	return 0;
 }
 
-static int avdtp_write(struct bluetooth_data *data)
+/*
+ * Lower the bitpool quickly when the stream socket backs up or a packet
+ * misses its deadline, and raise it again slowly once the link has been
+ * clear for a while. The bitpool is part of every SBC frame header, so the
+ * sink follows without any AVDTP reconfiguration. Called between packets,
+ * all frames of one packet always share the same bitpool.
+ */
+static void bitpool_update(struct bluetooth_data *data, int late)
 {
-	int ret = 0;
-	struct rtp_header *header;
-	struct rtp_payload *payload;
+	int space, level = 0;
+	uint8_t bitpool = data->sbc.bitpool;
+	uint8_t min_bitpool = data->min_bitpool;
+	uint8_t max_bitpool = data->max_bitpool;
+
+	/* broadcast followers must be able to decode every frame too */
+	if (data->broadcast_max_bitpool) {
+		min_bitpool = MAX(min_bitpool, data->broadcast_min_bitpool);
+		max_bitpool = MIN(max_bitpool, data->broadcast_max_bitpool);
+		if (min_bitpool > max_bitpool)
+			return;
+	}
+
+	if (bitpool > max_bitpool || bitpool < min_bitpool) {
+		data->sbc.bitpool = bitpool > max_bitpool ?
+						max_bitpool : min_bitpool;
+		data->stats_work.bitpool_changes++;
+		return;
+	}
+
+	if (min_bitpool >= max_bitpool)
+		return;
+
+	/* For L2CAP sockets SIOCOUTQ reports the free send buffer space */
+	if (data->sndbuf > 0 &&
+			ioctl(data->stream.fd, SIOCOUTQ, &space) == 0 &&
+			space < data->sndbuf)
+		level = (data->sndbuf - space) * 8 / data->sndbuf;
+
+	if (data->bitpool_holdoff > 0)
+		data->bitpool_holdoff--;
+
+	if (late || level >= BITPOOL_QUEUE_HIGH) {
+		data->bitpool_clear = 0;
+
+		/* give the queue a chance to drain at the lower rate first */
+		if (data->bitpool_holdoff > 0)
+			return;
+
+		bitpool -= MAX(bitpool / 8, 1);
+		if (bitpool < min_bitpool)
+			bitpool = min_bitpool;
+
+		data->bitpool_holdoff = BITPOOL_HOLDOFF;
+	} else if (level <= BITPOOL_QUEUE_LOW) {
+		if (++data->bitpool_clear < BITPOOL_RAISE_PACKETS)
+			return;
+
+		data->bitpool_clear = 0;
+		if (bitpool < max_bitpool)
+			bitpool++;
+	} else
+		data->bitpool_clear = 0;
+
+	if (bitpool != data->sbc.bitpool) {
+		DBG("bitpool %d -> %d (queue %d/8%s)", data->sbc.bitpool,
+				bitpool, level, late ? ", late" : "");
+		data->sbc.bitpool = bitpool;
+		data->stats_work.bitpool_changes++;
+	}
+}
 
+static void jitter_update(struct bluetooth_data *data, uint64_t lateness)
+{
+	data->jitter_packets++;
+	data->jitter_sum += lateness;
+	if (lateness > data->jitter_max)
+		data->jitter_max = lateness;
+	if (lateness >= (uint64_t) data->frame_duration) {
+		data->jitter_late++;
+		data->stats_work.deadline_misses++;
+	}
+
+	if (data->jitter_packets < JITTER_REPORT_PACKETS)
+		return;
+
+	DBG("pacing: %u packets, jitter avg %llu us max %llu us, "
+			"%u late, %u resyncs", data->jitter_packets,
+			(unsigned long long) (data->jitter_sum /
+							data->jitter_packets),
+			(unsigned long long) data->jitter_max,
+			data->jitter_late, data->jitter_resyncs);
+
+	data->jitter_packets = 0;
+	data->jitter_late = 0;
+	data->jitter_resyncs = 0;
+	data->jitter_sum = 0;
+	data->jitter_max = 0;
+}
+
+/*
+ * Sleeps until the deadline like sleep_until(), but sends queued packets
+ * as soon as the stream socket has room again instead of leaving them for
+ * the next packet. The socket is registered edge triggered, so each wakeup
+ * means room has been freed since the last send ran into a full socket.
+ */
+static void backlog_wait(struct bluetooth_data *data, uint64_t deadline)
+{
+	struct epoll_event event;
 	uint64_t now;
-	long duration = data->frame_duration * data->frame_count;
-#ifdef ENABLE_TIMING
-	uint64_t begin, end, begin2, end2;
-	begin = get_microseconds();
-#endif
 
-	header = (struct rtp_header *)data->buffer;
-	payload = (struct rtp_payload *)(data->buffer + sizeof(*header) + data->sizeof_scms_t);
+	while (data->backlog.count > 0 && data->epoll_fd >= 0) {
+		now = get_microseconds();
+		if (now + 1000 > deadline)
+			break;
 
-	memset(data->buffer, 0, sizeof(*header) + sizeof(*payload) + data->sizeof_scms_t);
+		/* whole milliseconds, sleep_until() does the rest */
+		if (epoll_wait(data->epoll_fd, &event, 1,
+					(deadline - now) / 1000) <= 0)
+			break;
 
-	if (data->sizeof_scms_t) {
-		data->buffer[sizeof(*header)] = data->scms_t_cp_header;
+		if (media_backlog_flush(&data->backlog, data->stream.fd) < 0)
+			break;
 	}
-	payload->frame_count = data->frame_count;
-	header->v = 2;
-	header->pt = 1;
-	header->sequence_number = htons(data->seq_num);
-	header->timestamp = htonl(data->nsamples);
-	header->ssrc = htonl(1);
 
-	data->stream.revents = 0;
-#ifdef ENABLE_TIMING
-	begin2 = get_microseconds();
-#endif
-	ret = poll(&data->stream, 1, POLL_TIMEOUT);
-#ifdef ENABLE_TIMING
-	end2 = get_microseconds();
-	print_time("poll", begin2, end2);
-#endif
-	long ahead = 0;
-	now = get_microseconds();
+	sleep_until(deadline);
+}
 
-	if (data->next_write) {
-		ahead = data->next_write - now;
-#ifdef ENABLE_TIMING
-		DBG("duration: %ld, ahead: %ld", duration, ahead);
-#endif
-		if (ahead > 0) {
-			/* too fast, need to throttle */
-			usleep(ahead);
-		}
-	} else {
+/*
+ * Waits for the deadline of the current packet. Deadlines are absolute and
+ * advance by exactly one packet duration, so oversleeping one packet
+ * shortens the wait for the next one instead of delaying the whole stream.
+ */
+static void avdtp_wait(struct bluetooth_data *data, long duration)
+{
+	uint64_t now = get_microseconds();
+	uint64_t lateness = 0;
+
+	if (!data->next_write) {
 		data->next_write = now;
+	} else if (now < data->next_write) {
+		/* too fast, need to throttle */
+		backlog_wait(data, data->next_write);
+		now = get_microseconds();
 	}
-	if (ahead <= -CATCH_UP_TIMEOUT * 1000) {
+
+	if (now > data->next_write)
+		lateness = now - data->next_write;
+	jitter_update(data, lateness);
+
+	if (lateness >= CATCH_UP_TIMEOUT * 1000) {
 		/* fallen too far behind, don't try to catch up */
-		VDBG("ahead < %d, reseting next_write timestamp", -CATCH_UP_TIMEOUT * 1000);
-		data->next_write = 0;
-	} else {
-		data->next_write += duration;
+		VDBG("%llu us late, resetting next_write deadline",
+						(unsigned long long) lateness);
+		data->next_write = now;
+		data->jitter_resyncs++;
+	}
+
+	data->next_write += duration;
+}
+
+/* Seqlock style publishing, readers retry while the sequence is odd or
+ * changed under them, the writer never waits */
+static void stats_publish(struct bluetooth_data *data)
+{
+	data->stats_work.bitpool = data->sbc.bitpool;
+
+	data->stats_seq++;
+	__sync_synchronize();
+	memcpy(&data->stats, &data->stats_work, sizeof(data->stats));
+	__sync_synchronize();
+	data->stats_seq++;
+}
+
+/* Hands the counters to bluetoothd, which exports them over D-Bus, must be
+ * called with data->mutex held since the IPC socket belongs to its owner */
+static void __stats_report(struct bluetooth_data *data)
+{
+	struct bt_stream_stats_ind ind;
+	struct a2dp_stats *stats = &data->stats_work;
+	int i;
+
+	if (data->server.fd < 0)
+		return;
+
+	memset(&ind, 0, sizeof(ind));
+	ind.h.type = BT_INDICATION;
+	ind.h.name = BT_STREAM_STATS;
+	ind.h.length = sizeof(ind);
+	ind.packets = stats->packets;
+	ind.bytes = stats->bytes;
+	for (i = 0; i <= BT_STREAM_STATS_MAX_FRAMES; i++)
+		ind.frames[i] = stats->frames[i];
+	ind.poll_timeouts = stats->poll_timeouts;
+	ind.eagain = stats->eagain;
+	ind.epipe = stats->epipe;
+	ind.deadline_misses = stats->deadline_misses;
+	ind.bitpool_changes = stats->bitpool_changes;
+	ind.bitpool = stats->bitpool;
+	if (stats->encode_frames)
+		ind.encode_ns = stats->encode_ns / stats->encode_frames;
+
+	audioservice_send(data, &ind.h);
+}
+
+static void stats_report(struct bluetooth_data *data)
+{
+	if (pthread_mutex_trylock(&data->mutex) != 0)
+		return;
+
+	__stats_report(data);
+
+	pthread_mutex_unlock(&data->mutex);
+}
+
+/* Same codec parameters as the leader apart from the bitpool */
+static int broadcast_compatible(struct bluetooth_data *data,
+						struct bluetooth_data *f)
+{
+	return f->sbc.frequency == data->sbc.frequency &&
+			f->sbc.mode == data->sbc.mode &&
+			f->sbc.subbands == data->sbc.subbands &&
+			f->sbc.blocks == data->sbc.blocks &&
+			f->sbc.allocation == data->sbc.allocation &&
+			f->sizeof_scms_t == data->sizeof_scms_t;
+}
+
+/* Sends a packet to a follower without blocking the group, unless its
+ * policy allows waiting up to the packet's duration for room */
+static void broadcast_send_one(struct bluetooth_data *f,
+				const struct iovec *iov, size_t len,
+				long duration, unsigned int frame_count)
+{
+	struct msghdr msg;
+	struct pollfd pfd;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = 2;
+
+	ret = sendmsg(f->stream.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (ret < 0 && errno == EAGAIN &&
+			f->broadcast_policy == A2DP_BROADCAST_WAIT) {
+		pfd.fd = f->stream.fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, duration / 1000) == 1)
+			ret = sendmsg(f->stream.fd, &msg,
+					MSG_NOSIGNAL | MSG_DONTWAIT);
+		else
+			f->stats_work.poll_timeouts++;
+	}
+
+	if (ret >= 0) {
+		f->packet_len = ret;
+		f->packet_duration = duration;
+		f->stats_work.packets++;
+		f->stats_work.bytes += ret;
+		f->stats_work.frames[frame_count]++;
+		return;
+	}
+
+	f->stats_work.dropped++;
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		f->stats_work.eagain++;
+	} else if (errno == EPIPE || errno == ECONNRESET ||
+						errno == ENOTCONN) {
+		/* let the follower's thread tear the stream down, it gets
+		 * restarted by broadcast_kick() */
+		if (errno == EPIPE)
+			f->stats_work.epipe++;
+		__set_command(f, A2DP_CMD_STOP);
 	}
 
-	if (ret == 1 && data->stream.revents == POLLOUT) {
+	VDBG("broadcast send failed: %zu bytes (errno %s)", len,
+							strerror(errno));
+}
+
+/* Moves a follower one step towards streaming, like wait_for_start()
+ * without waiting, must be called with f->mutex held */
+static void broadcast_kick(struct bluetooth_data *f)
+{
+	if (f->state == A2DP_STATE_NONE)
+		__set_command(f, A2DP_CMD_INIT);
+	else if (f->state == A2DP_STATE_INITIALIZED)
+		__set_command(f, A2DP_CMD_CONFIGURE);
+	else if (f->state == A2DP_STATE_CONFIGURED)
+		__set_command(f, A2DP_CMD_START);
+}
+
+/*
+ * Sends the packet just sent to the sink to every follower too. Followers
+ * whose thread is busy, for instance with signalling, miss the packet
+ * rather than stall the group. Also works out the MTU and bitpool range
+ * every follower accepts, for the packets to come.
+ */
+static void broadcast_send(struct bluetooth_data *data,
+				const struct iovec *iov, long duration,
+				unsigned int frame_count)
+{
+	size_t len = iov[0].iov_len + iov[1].iov_len;
+	unsigned int mtu = 0;
+	uint8_t min_bitpool = 0, max_bitpool = 0;
+	int i;
+
+	pthread_mutex_lock(&data->broadcast_lock);
+
+	for (i = 0; i < data->nfollowers; i++) {
+		struct bluetooth_data *f = data->followers[i];
+
+		if (pthread_mutex_trylock(&f->mutex) != 0) {
+			f->stats_work.dropped++;
+			continue;
+		}
+
+		if (f->state != A2DP_STATE_STARTED) {
+			if (data->packetizer.seq_num %
+						BROADCAST_KICK_PACKETS == 0)
+				broadcast_kick(f);
+			goto next;
+		}
+
+		if (!broadcast_compatible(data, f)) {
+			f->stats_work.dropped++;
+			goto next;
+		}
+
+		if (!mtu || f->link_mtu < mtu)
+			mtu = f->link_mtu;
+		if (f->min_bitpool > min_bitpool)
+			min_bitpool = f->min_bitpool;
+		if (!max_bitpool || f->max_bitpool < max_bitpool)
+			max_bitpool = f->max_bitpool;
+
+		if (len > f->link_mtu || data->sbc.bitpool < f->min_bitpool ||
+					data->sbc.bitpool > f->max_bitpool) {
+			/* the next packets will be made to fit */
+			f->stats_work.dropped++;
+			goto next;
+		}
+
+		broadcast_send_one(f, iov, len, duration, frame_count);
+
+next:
+		f->sbc.bitpool = data->sbc.bitpool;
+		stats_publish(f);
+		if (data->packetizer.seq_num % STATS_REPORT_PACKETS == 0)
+			__stats_report(f);
+		pthread_mutex_unlock(&f->mutex);
+	}
+
+	pthread_mutex_unlock(&data->broadcast_lock);
+
+	data->broadcast_mtu = mtu;
+	data->broadcast_min_bitpool = min_bitpool;
+	data->broadcast_max_bitpool = max_bitpool;
+}
+
+static int avdtp_write(struct bluetooth_data *data)
+{
+	int ret = 0;
+	struct media_packetizer *mp = &data->packetizer;
+	unsigned int frame_count = mp->frame_count;
+	const struct iovec *iov;
+	uint32_t dropped = data->backlog.dropped;
+	long duration = data->frame_duration * frame_count;
+	int late;
 #ifdef ENABLE_TIMING
-		begin2 = get_microseconds();
+	uint64_t begin, end, begin2, end2;
+	begin = get_microseconds();
 #endif
-		ret = send(data->stream.fd, data->buffer, data->count, MSG_NOSIGNAL);
+
+	media_packetizer_set_cp_header(mp, data->scms_t_cp_header);
+	iov = media_packetizer_packet(mp, NULL);
+
+	avdtp_wait(data, duration);
+
 #ifdef ENABLE_TIMING
-		end2 = get_microseconds();
-		print_time("send", begin2, end2);
+	begin2 = get_microseconds();
 #endif
-		if (ret < 0) {
-			/* can happen during normal remote disconnect */
-			VDBG("send() failed: %d (errno %s)", ret, strerror(errno));
-		}
-		if (ret == -EPIPE) {
-			bluetooth_close(data);
-		}
-	} else {
+	/* never blocks, a full socket queues the packet instead */
+	ret = media_backlog_send(&data->backlog, data->stream.fd, iov, 2);
+#ifdef ENABLE_TIMING
+	end2 = get_microseconds();
+	print_time("send", begin2, end2);
+#endif
+
+	/* the link can't keep up when packets have to wait */
+	late = ret == 0;
+
+	if (ret < 0) {
 		/* can happen during normal remote disconnect */
-		VDBG("poll() failed: %d (revents = %d, errno %s)",
-				ret, data->stream.revents, strerror(errno));
+		VDBG("send() failed: %d (%s)", ret, strerror(-ret));
+		if (ret == -EPIPE)
+			data->stats_work.epipe++;
+	} else {
+		if (ret > 0)
+			data->packet_len = ret;
+		else
+			data->stats_work.eagain++;
+		data->packet_duration = duration;
+		data->stats_work.packets++;
+		data->stats_work.bytes += iov[0].iov_len + iov[1].iov_len;
+		data->stats_work.frames[frame_count]++;
 	}
+	data->stats_work.dropped += data->backlog.dropped - dropped;
+
+	broadcast_send(data, iov, duration, frame_count);
 
 	/* Reset buffer of data to send */
-	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload) + data->sizeof_scms_t;
-	data->frame_count = 0;
+	media_packetizer_next(mp);
 	data->samples = 0;
-	data->seq_num++;
+
+	/* packets must fit the smallest MTU of the group */
+	mp->mtu = data->link_mtu;
+	if (data->broadcast_mtu && data->broadcast_mtu < mp->mtu)
+		mp->mtu = data->broadcast_mtu;
+
+	if (data->stream.fd >= 0)
+		bitpool_update(data, late);
+
+	stats_publish(data);
+	if (mp->seq_num % STATS_REPORT_PACKETS == 0)
+		stats_report(data);
+
+	if (mp->seq_num % INDICATION_POLL_PACKETS == 0)
+		audioservice_poll(data);
 
 #ifdef ENABLE_TIMING
 	end = get_microseconds();
@@ -890,13 +1438,77 @@ static int audioservice_recv(struct bluetooth_data *data,
 	return err;
 }
 
+/* Handles an unsolicited message from bluetoothd, returns 1 if it was one */
+static int audioservice_indication(struct bluetooth_data *data,
+		const bt_audio_msg_header_t *msg)
+{
+	const struct bt_delay_report_ind *ind = (const void *) msg;
+
+	if (msg->type != BT_INDICATION)
+		return 0;
+
+	if (msg->name == BT_DELAY_REPORT && msg->length >= sizeof(*ind)) {
+		DBG("sink delay report %u.%u ms", ind->delay / 10,
+							ind->delay % 10);
+		data->sink_delay = ind->delay;
+		data->sink_delay_valid = 1;
+	}
+
+	return 1;
+}
+
+/*
+ * Reads indications queued by bluetoothd while streaming. Only done while
+ * a2dp_thread is idle, so that no response to one of its requests is taken
+ * away from it.
+ */
+static void audioservice_poll(struct bluetooth_data *data)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	bt_audio_msg_header_t *msg = (void *) buf;
+	struct pollfd pfd;
+	int ret;
+
+	if (pthread_mutex_trylock(&data->mutex) != 0)
+		return;
+
+	pfd.fd = data->server.fd;
+	pfd.events = POLLIN;
+
+	while (pfd.fd >= 0 && poll(&pfd, 1, 0) == 1 &&
+						(pfd.revents & POLLIN)) {
+		/* the socket is a stream, read one message at a time */
+		ret = recv(pfd.fd, msg, sizeof(*msg), MSG_PEEK);
+		if (ret < (int) sizeof(*msg) || msg->length < sizeof(*msg) ||
+				msg->length > BT_SUGGESTED_BUFFER_SIZE)
+			break;
+
+		ret = recv(pfd.fd, buf, msg->length, 0);
+		if (ret < (int) sizeof(*msg))
+			break;
+
+		if (!audioservice_indication(data, msg))
+			ERR("Unexpected %s while streaming",
+					bt_audio_strname(msg->name));
+	}
+
+	pthread_mutex_unlock(&data->mutex);
+}
+
 static int audioservice_expect(struct bluetooth_data *data,
 		bt_audio_msg_header_t *rsp_hdr, int expected_name)
 {
-	int err = audioservice_recv(data, rsp_hdr);
+	uint16_t length = rsp_hdr->length;
+	int err;
 
-	if (err != 0)
-		return err;
+	/* indications can arrive ahead of the response */
+	do {
+		rsp_hdr->length = length;
+		err = audioservice_recv(data, rsp_hdr);
+		if (err != 0)
+			return err;
+	} while (expected_name != BT_DELAY_REPORT &&
+				audioservice_indication(data, rsp_hdr));
 
 	if (rsp_hdr->name != expected_name) {
 		err = -EINVAL;
@@ -963,6 +1575,7 @@ static int bluetooth_parse_capabilities(struct bluetooth_data *data,
 	memcpy(&data->sbc_capabilities, codec, codec->length);
 
 	data->isEdrCapable = rsp->isEdrCapable;
+	data->sbcFastEncoder = rsp->sbcFastEncoder;
 	return 0;
 }
 
@@ -977,6 +1590,7 @@ static int bluetooth_configure(struct bluetooth_data *data)
 	DBG("bluetooth_configure");
 
 	data->state = A2DP_STATE_CONFIGURING;
+	data->sink_delay_valid = 0;
 	memset(getcaps_req, 0, BT_SUGGESTED_BUFFER_SIZE);
 	getcaps_req->h.type = BT_REQUEST;
 	getcaps_req->h.name = BT_GET_CAPABILITIES;
@@ -1111,6 +1725,10 @@ again:
 
 static void a2dp_free(struct bluetooth_data *data)
 {
+	pcm_convert_free(data->convert);
+	if (data->epoll_fd >= 0)
+		close(data->epoll_fd);
+	pthread_mutex_destroy(&data->broadcast_lock);
 	pthread_cond_destroy(&data->client_wait);
 	pthread_cond_destroy(&data->thread_wait);
 	pthread_cond_destroy(&data->thread_start);
@@ -1209,16 +1827,20 @@ int a2dp_init(int rate, int channels, a2dpData* dataPtr)
 	memset(data, 0, sizeof(struct bluetooth_data));
 	data->server.fd = -1;
 	data->stream.fd = -1;
+	data->epoll_fd = epoll_create(1);
 	data->state = A2DP_STATE_NONE;
 	data->command = A2DP_CMD_NONE;
 
 	strncpy(data->address, "00:00:00:00:00:00", 18);
 	data->rate = rate;
 	data->channels = channels;
+	data->sink_rate = rate;
+	data->sink_channels = channels;
 
 	sbc_init(&data->sbc, 0);
 
 	pthread_mutex_init(&data->mutex, NULL);
+	pthread_mutex_init(&data->broadcast_lock, NULL);
 	pthread_cond_init(&data->thread_start, NULL);
 	pthread_cond_init(&data->thread_wait, NULL);
 	pthread_cond_init(&data->client_wait, NULL);
@@ -1268,6 +1890,17 @@ void a2dp_set_sink(a2dpData d, const char* address)
 	}
 }
 
+void a2dp_set_realtime(a2dpData d, int priority)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+
+	if (data) {
+		DBG("a2dp_set_realtime priority %d", priority);
+		data->rt_priority = priority;
+		data->rt_applied = 0;
+	}
+}
+
 void a2dp_set_cp_header(a2dpData d, uint8_t cpHeader)
 {
 	struct bluetooth_data* data = (struct bluetooth_data*)d;
@@ -1280,58 +1913,84 @@ void a2dp_set_cp_header(a2dpData d, uint8_t cpHeader)
 	}
 }
 
-int a2dp_write(a2dpData d, const void* buffer, int count)
+/* Raises the thread calling a2dp_write(), which paces the stream, to
+ * SCHED_FIFO once. Needs CAP_SYS_NICE, keeps running as is otherwise. */
+static void set_realtime(struct bluetooth_data *data)
 {
-	struct bluetooth_data* data = (struct bluetooth_data*)d;
-	uint8_t* src = (uint8_t *)buffer;
-	int codesize;
-	int err, ret = 0;
-	long frames_left = count;
-	int encoded;
-	unsigned int written;
-	const char *buff;
-	int did_configure = 0;
-#ifdef ENABLE_TIMING
-	uint64_t begin, end;
-	DBG("********** a2dp_write **********");
-	begin = get_microseconds();
-#endif
+	struct sched_param param;
+	pthread_t self = pthread_self();
+	int err;
 
-	err = wait_for_start(data, WRITE_TIMEOUT);
-	if (err < 0)
-		return err;
+	if (data->rt_applied && pthread_equal(data->rt_thread, self))
+		return;
 
-	codesize = data->codesize;
+	data->rt_applied = 1;
+	data->rt_thread = self;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = data->rt_priority;
+	err = pthread_setschedparam(self, SCHED_FIFO, &param);
+	if (err) {
+		ERR("Can't set SCHED_FIFO priority %d: %s (%d)",
+				data->rt_priority, strerror(err), err);
+	} else {
+		DBG("writer running at SCHED_FIFO priority %d",
+				data->rt_priority);
+	}
+}
+
+/* Encodes and sends whole codesize blocks from src, returns the number of
+ * bytes consumed. Packets are only sent once full, so a partial packet stays
+ * pending for the next call. */
+static int a2dp_encode(struct bluetooth_data *data, const uint8_t *src,
+								int count)
+{
+	int codesize = data->codesize;
+	long frames_left = count;
+	int encoded;
+	int err, ret = 0;
 
 	while (frames_left >= codesize) {
+		unsigned int frame_length;
+		uint64_t encode_start;
+		int frames;
+
 		/* Enough data to encode (sbc wants 512 byte blocks) */
 		if (data->sbc.priv == NULL) {
 			ERR("bad state");
-			ret = -EINVAL;
-			goto done;
+			return -EINVAL;
 		}
-		encoded = sbc_encode(&(data->sbc), src, codesize,
-					data->buffer + data->count,
-					sizeof(data->buffer) - data->count,
-					&written);
+
+		/* Encode as many frames as still fit into the current packet */
+		frame_length = sbc_get_frame_length(&data->sbc);
+		frames = media_packetizer_room(&data->packetizer, frame_length);
+		if (frames > frames_left / codesize)
+			frames = frames_left / codesize;
+
+		encode_start = get_nanoseconds();
+		encoded = sbc_encode_iov(&(data->sbc), src, frames * codesize,
+				media_packetizer_payload(&data->packetizer),
+				sizeof(data->buffer));
+		data->stats_work.encode_ns += get_nanoseconds() - encode_start;
 		if (encoded <= 0) {
 			ERR("Encoding error %d", encoded);
-			goto done;
+			break;
 		}
-		VDBG("sbc_encode returned %d, codesize: %d, written: %d\n",
-			encoded, codesize, written);
+		VDBG("sbc_encode_iov returned %d, codesize: %d, payload: %zu\n",
+			encoded, codesize,
+			media_packetizer_payload(&data->packetizer)->iov_len);
 
 		src += encoded;
-		data->count += written;
-		data->frame_count++;
+		media_packetizer_commit(&data->packetizer, encoded / codesize,
+					encoded / (data->sink_channels * 2));
+		data->stats_work.encode_frames += encoded / codesize;
 		data->samples += encoded;
-		data->nsamples += encoded/4;
 
-		/* No space left for another frame then send or frame count limit reached */
-		if ((data->frame_count == 15) || (data->count + written >= data->link_mtu) ||
-				(data->count + written >= BUFFER_SIZE)) {
-			VDBG("sending packet %d, count %d, link_mtu %u",
-					data->seq_num, data->count,
+		/* No space left for another frame then send */
+		if (media_packetizer_room(&data->packetizer,
+							frame_length) == 0) {
+			VDBG("sending packet %d, link_mtu %u",
+					data->packetizer.seq_num,
 					data->link_mtu);
 			err = avdtp_write(data);
 			if (err < 0)
@@ -1342,10 +2001,78 @@ int a2dp_write(a2dpData d, const void* buffer, int count)
 		frames_left -= encoded;
 	}
 
-	if (frames_left > 0)
-		ERR("%ld bytes left at end of a2dp_write\n", frames_left);
+	return ret;
+}
+
+/* Converts src to the sink format and encodes it, returns the number of
+ * input bytes consumed. Converted data short of a codesize block is kept
+ * for the next call. */
+static int a2dp_convert(struct bluetooth_data *data, const uint8_t *src,
+								int count)
+{
+	int frame_size = data->channels * 2;
+	int sink_frame_size = data->sink_channels * 2;
+	int frames = count / frame_size;
+	int used = 0;
+
+	while (used < frames) {
+		int consumed, produced, len, n;
+
+		produced = pcm_convert_process(data->convert,
+				(const int16_t *) src + used * data->channels,
+				frames - used,
+				data->convert_buf + data->convert_len / 2,
+				(sizeof(data->convert_buf) - data->convert_len) /
+							sink_frame_size,
+				&consumed);
+		used += consumed;
+		data->convert_len += produced * sink_frame_size;
+
+		len = data->convert_len - data->convert_len % data->codesize;
+		n = a2dp_encode(data, (const uint8_t *) data->convert_buf, len);
+		if (n < 0)
+			return used > 0 ? used * frame_size : n;
+
+		data->convert_len -= n;
+		memmove(data->convert_buf, (uint8_t *) data->convert_buf + n,
+							data->convert_len);
+
+		if (consumed == 0 && n == 0)
+			break;
+	}
+
+	return used * frame_size;
+}
+
+int a2dp_write(a2dpData d, const void* buffer, int count)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+	int err, ret;
+#ifdef ENABLE_TIMING
+	uint64_t begin, end;
+	DBG("********** a2dp_write **********");
+	begin = get_microseconds();
+#endif
+
+	/* the leader feeds this stream */
+	if (data->leader)
+		return -EBUSY;
+
+	err = wait_for_start(data, WRITE_TIMEOUT);
+	if (err < 0)
+		return err;
+
+	if (data->rt_priority > 0)
+		set_realtime(data);
+
+	if (data->convert)
+		ret = a2dp_convert(data, buffer, count);
+	else
+		ret = a2dp_encode(data, buffer, count);
+
+	if (ret >= 0 && !data->convert && count - ret >= data->codesize)
+		ERR("%d bytes left at end of a2dp_write\n", count - ret);
 
-done:
 #ifdef ENABLE_TIMING
 	end = get_microseconds();
 	print_time("a2dp_write total", begin, end);
@@ -1353,12 +2080,161 @@ done:
 	return ret;
 }
 
+int a2dp_writev(a2dpData d, const struct iovec *iov, int iovcnt)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+	/* a block split between two segments, codesize is at most 512 */
+	uint8_t block[512];
+	int block_len = 0;
+	int codesize, err, i, ret = 0;
+#ifdef ENABLE_TIMING
+	uint64_t begin, end;
+	DBG("********** a2dp_writev **********");
+	begin = get_microseconds();
+#endif
+
+	/* the leader feeds this stream */
+	if (data->leader)
+		return -EBUSY;
+
+	err = wait_for_start(data, WRITE_TIMEOUT);
+	if (err < 0)
+		return err;
+
+	if (data->rt_priority > 0)
+		set_realtime(data);
+
+	codesize = data->codesize;
+
+	/* the converter keeps partial blocks itself */
+	for (i = 0; data->convert && i < iovcnt; i++) {
+		int n = a2dp_convert(data, iov[i].iov_base, iov[i].iov_len);
+
+		if (n < 0)
+			return ret > 0 ? ret : n;
+		ret += n;
+		if (n < (int) iov[i].iov_len)
+			goto done;
+	}
+	if (data->convert)
+		goto done;
+
+	for (i = 0; i < iovcnt; i++) {
+		const uint8_t *src = iov[i].iov_base;
+		int len = iov[i].iov_len;
+		int n;
+
+		/* complete the block started at the end of the last segment,
+		 * this is the only data that ever gets copied */
+		if (block_len > 0) {
+			n = MIN(codesize - block_len, len);
+			memcpy(block + block_len, src, n);
+			block_len += n;
+			src += n;
+			len -= n;
+
+			if (block_len < codesize)
+				continue;
+
+			n = a2dp_encode(data, block, codesize);
+			if (n < 0)
+				return ret > 0 ? ret : n;
+			if (n < codesize)
+				goto done;
+			ret += codesize;
+			block_len = 0;
+		}
+
+		n = a2dp_encode(data, src, len - len % codesize);
+		if (n < 0)
+			return ret > 0 ? ret : n;
+		ret += n;
+		if (n < len - len % codesize)
+			goto done;
+
+		if (i < iovcnt - 1) {
+			memcpy(block, src + n, len - n);
+			block_len = len - n;
+		}
+	}
+
+	/* a block still incomplete at the end is left to the caller */
+
+done:
+#ifdef ENABLE_TIMING
+	end = get_microseconds();
+	print_time("a2dp_writev total", begin, end);
+#endif
+	return ret;
+}
+
+uint32_t a2dp_get_latency(a2dpData d, uint32_t default_sink_us)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+	uint32_t latency;
+	int space;
+
+	if (!data)
+		return default_sink_us;
+
+	/* converted, encoded or queued for encoding, but not sent yet */
+	latency = (uint64_t) (data->samples + data->convert_len) /
+			(data->sink_channels * 2) * 1000000 / data->sink_rate;
+	if (data->convert)
+		latency += (uint64_t) pcm_convert_delay(data->convert) *
+							1000000 / data->rate;
+
+	/* sent, but still waiting in the L2CAP socket. For these sockets
+	 * SIOCOUTQ reports the free send buffer space */
+	if (data->state == A2DP_STATE_STARTED && data->sndbuf > 0 &&
+			data->packet_len > 0 &&
+			ioctl(data->stream.fd, SIOCOUTQ, &space) == 0 &&
+			space < data->sndbuf)
+		latency += (uint64_t) (data->sndbuf - space) *
+				data->packet_duration / data->packet_len;
+
+	/* sent, but queued because the socket had no room */
+	if (data->state == A2DP_STATE_STARTED)
+		latency += (uint64_t) data->backlog.count *
+						data->packet_duration;
+
+	/* received, but not played yet */
+	if (data->sink_delay_valid)
+		latency += data->sink_delay * 100;
+	else
+		latency += default_sink_us;
+
+	return latency;
+}
+
+void a2dp_get_stats(a2dpData d, struct a2dp_stats *stats)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+	unsigned int seq;
+
+	do {
+		while ((seq = data->stats_seq) & 1)
+			sched_yield();
+		__sync_synchronize();
+		memcpy(stats, &data->stats, sizeof(*stats));
+		__sync_synchronize();
+	} while (seq != data->stats_seq);
+}
+
 int a2dp_stop(a2dpData d)
 {
 	struct bluetooth_data* data = (struct bluetooth_data*)d;
+	int i;
 	DBG("a2dp_stop\n");
 	if (!data)
 		return 1;
+
+	/* followers suspend with their leader, and are restarted by it */
+	pthread_mutex_lock(&data->broadcast_lock);
+	for (i = 0; i < data->nfollowers; i++)
+		a2dp_stop(data->followers[i]);
+	pthread_mutex_unlock(&data->broadcast_lock);
+
 	if( data->state != A2DP_STATE_STARTED ){
 		DBG("*****liba2dp_state =%d", data->state);
 		return 1 ;
@@ -1370,9 +2246,57 @@ int a2dp_stop(a2dpData d)
 	}
 }
 
+int a2dp_broadcast_add(a2dpData l, a2dpData f, int policy)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)l;
+	struct bluetooth_data* follower = (struct bluetooth_data*)f;
+	int err = 0;
+
+	if (data == follower || data->leader || follower->leader ||
+						follower->nfollowers > 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&data->broadcast_lock);
+	if (data->nfollowers == A2DP_BROADCAST_MAX) {
+		err = -ENOSPC;
+	} else {
+		follower->leader = data;
+		follower->broadcast_policy = policy;
+		data->followers[data->nfollowers++] = follower;
+	}
+	pthread_mutex_unlock(&data->broadcast_lock);
+
+	return err;
+}
+
+void a2dp_broadcast_remove(a2dpData l, a2dpData f)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)l;
+	int i;
+
+	/* waits for a packet being sent to the follower */
+	pthread_mutex_lock(&data->broadcast_lock);
+	for (i = 0; i < data->nfollowers; i++) {
+		if (data->followers[i] != f)
+			continue;
+
+		data->followers[i]->leader = NULL;
+		data->followers[i] = data->followers[--data->nfollowers];
+		break;
+	}
+	pthread_mutex_unlock(&data->broadcast_lock);
+}
+
 void a2dp_cleanup(a2dpData d)
 {
 	struct bluetooth_data* data = (struct bluetooth_data*)d;
 	DBG("a2dp_cleanup\n");
+
+	if (data->leader)
+		a2dp_broadcast_remove(data->leader, data);
+
+	while (data->nfollowers > 0)
+		a2dp_broadcast_remove(data, data->followers[0]);
+
 	set_command(data, A2DP_CMD_QUIT);
 }
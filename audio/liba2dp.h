@@ -23,16 +23,63 @@
  *
  */
 
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef void* a2dpData;
 
+/* Most SBC frames a media packet can carry */
+#define A2DP_STATS_MAX_FRAMES	15
+
+/* Transmit counters of a stream, cumulative since a2dp_init */
+struct a2dp_stats {
+	uint64_t	packets;		/* Media packets sent */
+	uint64_t	bytes;			/* Bytes sent, headers included */
+	uint32_t	frames[A2DP_STATS_MAX_FRAMES + 1];	/* Packets sent
+						 * by number of SBC frames */
+	uint32_t	poll_timeouts;		/* Socket not writable in time */
+	uint32_t	eagain;			/* Sends failed with EAGAIN */
+	uint32_t	epipe;			/* Sends failed with EPIPE */
+	uint32_t	deadline_misses;	/* Packets a frame or more late */
+	uint32_t	bitpool_changes;
+	uint32_t	bitpool;		/* Current bitpool */
+	uint64_t	encode_ns;		/* Time spent in the encoder */
+	uint64_t	encode_frames;		/* SBC frames encoded */
+	uint32_t	dropped;		/* Broadcast packets not sent */
+};
+
+/* What a broadcast follower does when its link falls behind */
+#define A2DP_BROADCAST_DROP	0	/* Skip packets while its queue is full */
+#define A2DP_BROADCAST_WAIT	1	/* Hold up the group for up to a packet */
+
+/* Most followers of one leader, the rest of a piconet */
+#define A2DP_BROADCAST_MAX	6
+
 int a2dp_init(int rate, int channels, a2dpData* dataPtr);
 void a2dp_set_sink(a2dpData data, const char* address);
 void a2dp_set_cp_header(a2dpData data, uint8_t cpHeader);
+/* SCHED_FIFO priority for the thread calling a2dp_write, 0 to leave as is */
+void a2dp_set_realtime(a2dpData data, int priority);
 int a2dp_write(a2dpData data, const void* buffer, int count);
+/* Like a2dp_write, but encodes from several segments in place, for instance
+ * both parts of a wrapped ring. Returns the number of bytes consumed. */
+int a2dp_writev(a2dpData data, const struct iovec *iov, int iovcnt);
+/* Microseconds from a2dp_write to playback: pending encoder input, the L2CAP
+ * socket queue and the sink's AVDTP delay report, or default_sink_us for
+ * sinks which never sent one */
+uint32_t a2dp_get_latency(a2dpData data, uint32_t default_sink_us);
+/* Sends every packet encoded for leader to follower as well, so N sinks
+ * cost one encoder. The follower connects on its own, but only receives
+ * packets while its negotiated SBC configuration matches the leader's.
+ * a2dp_write must not be called on a follower. */
+int a2dp_broadcast_add(a2dpData leader, a2dpData follower, int policy);
+void a2dp_broadcast_remove(a2dpData leader, a2dpData follower);
+/* Copies a consistent snapshot of the counters, from any thread and without
+ * blocking the writer */
+void a2dp_get_stats(a2dpData data, struct a2dp_stats *stats);
 int a2dp_stop(a2dpData data);
 void a2dp_cleanup(a2dpData data);
 
@@ -0,0 +1,255 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012, The Linux Foundation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "rtp.h"
+#include "media_packetizer.h"
+
+static unsigned int header_len(struct media_packetizer *mp)
+{
+	return sizeof(struct rtp_header) + (mp->cp ? 1 : 0) +
+						sizeof(struct rtp_payload);
+}
+
+void media_packetizer_init(struct media_packetizer *mp, uint8_t *buffer,
+				size_t size, unsigned int mtu, int cp_header)
+{
+	struct rtp_header *header = (void *) mp->header;
+
+	memset(mp, 0, sizeof(*mp));
+	header->v = 2;
+	header->pt = 1;
+	header->ssrc = htonl(1);
+
+	if (cp_header >= 0) {
+		mp->cp = 1;
+		mp->header[sizeof(struct rtp_header)] = cp_header;
+	}
+
+	mp->buffer = buffer;
+	mp->size = size;
+	mp->mtu = mtu;
+
+	mp->iov[0].iov_base = mp->header;
+	mp->iov[0].iov_len = header_len(mp);
+	mp->iov[1].iov_base = buffer;
+	mp->iov[1].iov_len = 0;
+}
+
+void media_packetizer_set_cp_header(struct media_packetizer *mp,
+							uint8_t cp_header)
+{
+	if (mp->cp)
+		mp->header[sizeof(struct rtp_header)] = cp_header;
+}
+
+unsigned int media_packetizer_room(struct media_packetizer *mp,
+						unsigned int frame_length)
+{
+	size_t len = mp->iov[0].iov_len + mp->iov[1].iov_len;
+	size_t room = 0;
+
+	if (frame_length == 0)
+		return 0;
+
+	if (len < mp->mtu)
+		room = (mp->mtu - len) / frame_length;
+	if (room > (mp->size - mp->iov[1].iov_len) / frame_length)
+		room = (mp->size - mp->iov[1].iov_len) / frame_length;
+	if (room > MEDIA_PACKET_MAX_FRAMES - mp->frame_count)
+		room = MEDIA_PACKET_MAX_FRAMES - mp->frame_count;
+
+	/* frames can't be fragmented, an oversized one goes alone */
+	if (room == 0 && mp->frame_count == 0 && frame_length <= mp->size)
+		room = 1;
+
+	return room;
+}
+
+struct iovec *media_packetizer_payload(struct media_packetizer *mp)
+{
+	return &mp->iov[1];
+}
+
+void media_packetizer_commit(struct media_packetizer *mp,
+				unsigned int frames, uint32_t samples)
+{
+	mp->frame_count += frames;
+	mp->samples += samples;
+}
+
+int media_packetizer_add(struct media_packetizer *mp, const void *frames,
+				size_t len, unsigned int count,
+				uint32_t samples)
+{
+	if (count == 0 || media_packetizer_room(mp, len / count) < count ||
+				mp->iov[1].iov_len + len > mp->size)
+		return -ENOSPC;
+
+	memcpy(mp->buffer + mp->iov[1].iov_len, frames, len);
+	mp->iov[1].iov_len += len;
+	media_packetizer_commit(mp, count, samples);
+
+	return 0;
+}
+
+const struct iovec *media_packetizer_packet(struct media_packetizer *mp,
+								size_t *len)
+{
+	struct rtp_header *header = (void *) mp->header;
+
+	header->sequence_number = htons(mp->seq_num);
+	header->timestamp = htonl(mp->timestamp);
+	media_packetizer_payload_header(mp->header + mp->iov[0].iov_len - 1,
+							mp->frame_count);
+
+	if (len)
+		*len = mp->iov[0].iov_len + mp->iov[1].iov_len;
+
+	return mp->iov;
+}
+
+void media_packetizer_next(struct media_packetizer *mp)
+{
+	mp->seq_num++;
+	mp->timestamp += mp->samples;
+	mp->samples = 0;
+	mp->frame_count = 0;
+	mp->iov[1].iov_len = 0;
+}
+
+void media_backlog_init(struct media_backlog *b)
+{
+	b->head = 0;
+	b->count = 0;
+	b->dropped = 0;
+}
+
+static int backlog_push(struct media_backlog *b, const struct iovec *iov,
+								int iovcnt)
+{
+	unsigned int slot;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len > MEDIA_BACKLOG_PACKET_SIZE)
+		return -EMSGSIZE;
+
+	if (b->count == MEDIA_BACKLOG_PACKETS) {
+		b->head = (b->head + 1) % MEDIA_BACKLOG_PACKETS;
+		b->count--;
+		b->dropped++;
+	}
+
+	slot = (b->head + b->count) % MEDIA_BACKLOG_PACKETS;
+	b->len[slot] = 0;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(b->packets[slot] + b->len[slot], iov[i].iov_base,
+							iov[i].iov_len);
+		b->len[slot] += iov[i].iov_len;
+	}
+	b->count++;
+
+	return 0;
+}
+
+int media_backlog_flush(struct media_backlog *b, int fd)
+{
+	while (b->count > 0) {
+		if (send(fd, b->packets[b->head], b->len[b->head],
+					MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+
+		b->head = (b->head + 1) % MEDIA_BACKLOG_PACKETS;
+		b->count--;
+	}
+
+	return b->count;
+}
+
+int media_backlog_send(struct media_backlog *b, int fd,
+				const struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	int ret;
+
+	/* packets must not overtake the queue */
+	if (b->count > 0) {
+		ret = media_backlog_flush(b, fd);
+		if (ret < 0)
+			return ret;
+		if (ret > 0)
+			return backlog_push(b, iov, iovcnt);
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = iovcnt;
+
+	ret = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (ret >= 0)
+		return ret;
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		return -errno;
+
+	return backlog_push(b, iov, iovcnt);
+}
+
+unsigned int media_packetizer_max_frames(unsigned int payload_len,
+						unsigned int frame_length)
+{
+	unsigned int frames;
+
+	/* the SBC payload header takes one byte of the payload */
+	if (frame_length == 0 || payload_len <= sizeof(struct rtp_payload))
+		return 0;
+
+	frames = (payload_len - sizeof(struct rtp_payload)) / frame_length;
+
+	return frames < MEDIA_PACKET_MAX_FRAMES ?
+					frames : MEDIA_PACKET_MAX_FRAMES;
+}
+
+void media_packetizer_payload_header(uint8_t *dst, unsigned int frame_count)
+{
+	struct rtp_payload *payload = (void *) dst;
+
+	memset(payload, 0, sizeof(*payload));
+	payload->frame_count = frame_count;
+}
@@ -0,0 +1,121 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012, The Linux Foundation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Packs encoded SBC frames into A2DP media packets: an RTP header, an
+ * optional SCMS-T content protection header and the SBC payload header,
+ * followed by as many whole frames as the MTU and the 4 bit frame count
+ * allow. The RTP timestamp of a packet is the sample index of its first
+ * frame.
+ *
+ * Clients either encode straight into the payload iovec and commit the
+ * frames, or copy already encoded frames in with media_packetizer_add().
+ * Once media_packetizer_room() drops to zero the packet is sent with the
+ * iovecs returned by media_packetizer_packet(), followed by a call to
+ * media_packetizer_next().
+ */
+
+#define MEDIA_PACKET_MAX_FRAMES		15
+
+/* RTP, SCMS-T and SBC payload headers */
+#define MEDIA_PACKET_HEADER_MAX		(12 + 1 + 1)
+
+struct media_packetizer {
+	uint8_t header[MEDIA_PACKET_HEADER_MAX];
+	struct iovec iov[2];		/* Headers and frames of the packet */
+	uint8_t *buffer;		/* Frame buffer, owned by the client */
+	size_t size;
+	unsigned int mtu;
+	int cp;				/* Content protection header present */
+	unsigned int frame_count;	/* Frames in the pending packet */
+	uint16_t seq_num;
+	uint32_t timestamp;		/* Sample index of the pending packet */
+	uint32_t samples;		/* Samples per channel it holds */
+};
+
+/* cp_header is the SCMS-T header byte, or negative for none */
+void media_packetizer_init(struct media_packetizer *mp, uint8_t *buffer,
+				size_t size, unsigned int mtu, int cp_header);
+void media_packetizer_set_cp_header(struct media_packetizer *mp,
+							uint8_t cp_header);
+
+/* Frames of frame_length bytes which still fit into the pending packet,
+ * an empty packet always takes at least one */
+unsigned int media_packetizer_room(struct media_packetizer *mp,
+						unsigned int frame_length);
+
+/* For encoding in place, iov_base + iov_len is where the next frame goes
+ * and iov_len is to be advanced past it, followed by a commit */
+struct iovec *media_packetizer_payload(struct media_packetizer *mp);
+void media_packetizer_commit(struct media_packetizer *mp,
+				unsigned int frames, uint32_t samples);
+
+/* Copies count frames, returns -ENOSPC if they don't fit */
+int media_packetizer_add(struct media_packetizer *mp, const void *frames,
+				size_t len, unsigned int count,
+				uint32_t samples);
+
+/* Completes the headers of the pending packet and returns its two iovecs,
+ * len is set to the packet size */
+const struct iovec *media_packetizer_packet(struct media_packetizer *mp,
+								size_t *len);
+
+/* Starts the next packet, whether the last one was sent or dropped */
+void media_packetizer_next(struct media_packetizer *mp);
+
+/*
+ * Bounded queue of packets for a non-blocking media socket. Packets which
+ * find the socket full are copied in and sent once it drains, in order.
+ * When the queue is full the oldest packet is dropped, it would be the
+ * most late one to play.
+ */
+
+#define MEDIA_BACKLOG_PACKETS		8
+#define MEDIA_BACKLOG_PACKET_SIZE	(MEDIA_PACKET_HEADER_MAX + 2048)
+
+struct media_backlog {
+	uint8_t packets[MEDIA_BACKLOG_PACKETS][MEDIA_BACKLOG_PACKET_SIZE];
+	size_t len[MEDIA_BACKLOG_PACKETS];
+	unsigned int head;		/* Oldest queued packet */
+	unsigned int count;
+	uint32_t dropped;		/* Packets dropped since init */
+};
+
+void media_backlog_init(struct media_backlog *b);
+
+/* Sends queued packets until the socket fills up. Returns the number of
+ * packets left or a negative error. */
+int media_backlog_flush(struct media_backlog *b, int fd);
+
+/* Sends a packet, or queues it behind earlier ones or when the socket is
+ * full. Returns the bytes sent, 0 if queued, or a negative error. */
+int media_backlog_send(struct media_backlog *b, int fd,
+				const struct iovec *iov, int iovcnt);
+
+/* Helpers for clients which build the RTP header themselves */
+unsigned int media_packetizer_max_frames(unsigned int payload_len,
+						unsigned int frame_length);
+void media_packetizer_payload_header(uint8_t *dst, unsigned int frame_count);
@@ -28,6 +28,7 @@
 
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <time.h>
 #include <sys/time.h>
@@ -42,7 +43,8 @@
 
 #include "ipc.h"
 #include "sbc.h"
-#include "rtp.h"
+#include "media_packetizer.h"
+#include "sco_stream.h"
 
 /* #define ENABLE_DEBUG */
 
@@ -97,13 +99,10 @@ struct bluetooth_a2dp {
 	sbc_t sbc;				/* Codec data */
 	int sbc_initialized;			/* Keep track if the encoder is initialized */
 	unsigned int codesize;			/* SBC codesize */
-	int samples;				/* Number of encoded samples */
 	uint8_t buffer[BUFFER_SIZE];		/* Codec transfer buffer */
-	unsigned int count;			/* Codec transfer buffer counter */
-
-	int nsamples;				/* Cumulative number of codec samples */
-	uint16_t seq_num;			/* Cumulative packet sequence */
-	int frame_count;			/* Current frames in buffer*/
+	struct media_packetizer packetizer;	/* Packet being filled */
+	struct media_backlog backlog;		/* Packets the socket had no
+						 * room for yet */
 };
 
 struct bluetooth_alsa_config {
@@ -123,6 +122,8 @@ struct bluetooth_alsa_config {
 	int has_block_length;
 	uint8_t bitpool;		/* A2DP only */
 	int has_bitpool;
+	unsigned int packet_size;	/* SCO only */
+	int has_packet_size;
 	int autoconnect;
 };
 
@@ -137,6 +138,8 @@ struct bluetooth_data {
 	uint8_t buffer[BUFFER_SIZE];		/* Encoded transfer buffer */
 	unsigned int count;				/* Transfer buffer counter */
 	struct bluetooth_a2dp a2dp;			/* A2DP data */
+	struct sco_stream *sco;				/* SCO PCM ring */
+	uint8_t sco_codec;				/* CVSD or mSBC */
 
 	pthread_t hw_thread;				/* Makes virtual hw pointer move */
 	int pipefd[2];					/* Inter thread communication */
@@ -310,6 +313,8 @@ static void bluetooth_exit(struct bluetooth_data *data)
 	if (a2dp->sbc_initialized)
 		sbc_finish(&a2dp->sbc);
 
+	sco_stream_free(data->sco);
+
 	if (data->pipefd[0] > 0)
 		close(data->pipefd[0]);
 
@@ -338,7 +343,9 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 	struct bt_start_stream_req *req = (void *) buf;
 	struct bt_start_stream_rsp *rsp = (void *) buf;
 	struct bt_new_stream_ind *ind = (void *) buf;
+	struct bluetooth_alsa_config *cfg = &data->alsa_config;
 	uint32_t period_count = io->buffer_size / io->period_size;
+	unsigned int packet_size;
 	int opt_name, err;
 	struct timeval t = { 0, period_count };
 
@@ -402,6 +409,18 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 							sizeof(t)) < 0)
 			return -errno;
 	} else {
+		packet_size = data->link_mtu;
+		if (cfg->has_packet_size)
+			packet_size = MIN(cfg->packet_size, data->link_mtu);
+
+		/* Room for two ALSA buffers, so the ring never limits them */
+		sco_stream_free(data->sco);
+		data->sco = sco_stream_new(data->stream.fd, data->sco_codec,
+				packet_size,
+				snd_pcm_frames_to_bytes(io->pcm, io->buffer_size) * 2);
+		if (!data->sco)
+			return -errno;
+
 		opt_name = (io->stream == SND_PCM_STREAM_PLAYBACK) ?
 						SCO_TXBUFS : SCO_RXBUFS;
 
@@ -683,7 +702,6 @@ static void bluetooth_a2dp_setup(struct bluetooth_a2dp *a2dp)
 
 	a2dp->sbc.bitpool = active_capabilities.max_bitpool;
 	a2dp->codesize = sbc_get_codesize(&a2dp->sbc);
-	a2dp->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
 }
 
 static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
@@ -752,6 +770,9 @@ static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
 
 	/* Setup SBC encoder now we agree on parameters */
 	bluetooth_a2dp_setup(a2dp);
+	media_packetizer_init(&a2dp->packetizer, a2dp->buffer,
+				sizeof(a2dp->buffer), data->link_mtu, -1);
+	media_backlog_init(&a2dp->backlog);
 
 	DBG("\tallocation=%u\n\tsubbands=%u\n\tblocks=%u\n\tbitpool=%u\n",
 		a2dp->sbc.allocation, a2dp->sbc.subbands, a2dp->sbc.blocks,
@@ -848,55 +869,69 @@ static snd_pcm_sframes_t bluetooth_hsp_read(snd_pcm_ioplug_t *io,
 				snd_pcm_uframes_t size)
 {
 	struct bluetooth_data *data = io->private_data;
-	snd_pcm_uframes_t frames_to_write, ret;
+	snd_pcm_uframes_t frames_to_write;
+	snd_pcm_sframes_t ret;
 	unsigned char *buff;
 	unsigned int frame_size = 0;
-	int nrecv;
+	struct pollfd pfd;
+	ssize_t nrecv;
+	size_t len;
+	void *pcm;
 
 	DBG("areas->step=%u areas->first=%u offset=%lu size=%lu io->nonblock=%u",
 			areas->step, areas->first, offset, size, io->nonblock);
 
 	frame_size = areas->step / 8;
 
-	if (data->count > 0)
-		goto proceed;
+	while (sco_stream_avail(data->sco) < frame_size) {
+		nrecv = sco_stream_recv(data->sco);
+		if (nrecv < 0) {
+			ret = (nrecv == -EPIPE) ? -EIO : nrecv;
+			goto done;
+		}
 
-	nrecv = recv(data->stream.fd, data->buffer, data->link_mtu,
-					io->nonblock ? MSG_DONTWAIT : 0);
+		/* Increment hardware transmition pointer */
+		data->hw_ptr = (data->hw_ptr + nrecv / frame_size) %
+					io->buffer_size;
 
-	if (nrecv < 0) {
-		ret = (errno == EPIPE) ? -EIO : -errno;
-		goto done;
-	}
+		if (sco_stream_avail(data->sco) >= frame_size)
+			break;
 
-	if ((unsigned int) nrecv != data->link_mtu) {
-		ret = -EIO;
-		SNDERR(strerror(-ret));
-		goto done;
-	}
+		if (io->nonblock) {
+			ret = -EAGAIN;
+			goto done;
+		}
+
+		pfd.fd = data->stream.fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, -1) < 0) {
+			ret = -errno;
+			goto done;
+		}
 
-	/* Increment hardware transmition pointer */
-	data->hw_ptr = (data->hw_ptr + data->link_mtu / frame_size) %
-				io->buffer_size;
+		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			ret = -EIO;
+			SNDERR(strerror(-ret));
+			goto done;
+		}
+	}
 
-proceed:
 	buff = (unsigned char *) areas->addr +
 			(areas->first + areas->step * offset) / 8;
 
-	if ((data->count + size * frame_size) <= data->link_mtu)
-		frames_to_write = size;
-	else
-		frames_to_write = (data->link_mtu - data->count) / frame_size;
+	pcm = sco_stream_read_ptr(data->sco, &len);
+	frames_to_write = MIN(size, len / frame_size);
 
-	memcpy(buff, data->buffer + data->count, frame_size * frames_to_write);
-	data->count += (frame_size * frames_to_write);
-	data->count %= data->link_mtu;
+	memcpy(buff, pcm, frame_size * frames_to_write);
+	sco_stream_read_commit(data->sco, frame_size * frames_to_write);
 
 	/* Return written frames count */
 	ret = frames_to_write;
 
 done:
-	DBG("returning %lu", ret);
+	DBG("returning %ld", ret);
 	return ret;
 }
 
@@ -908,8 +943,11 @@ static snd_pcm_sframes_t bluetooth_hsp_write(snd_pcm_ioplug_t *io,
 	struct bluetooth_data *data = io->private_data;
 	snd_pcm_sframes_t ret = 0;
 	snd_pcm_uframes_t frames_to_read;
+	struct pollfd pfd;
 	uint8_t *buff;
-	int rsend, frame_size;
+	int frame_size;
+	size_t len;
+	void *pcm;
 
 	DBG("areas->step=%u areas->first=%u offset=%lu, size=%lu io->nonblock=%u",
 			areas->step, areas->first, offset, size, io->nonblock);
@@ -922,36 +960,54 @@ static snd_pcm_sframes_t bluetooth_hsp_write(snd_pcm_ioplug_t *io,
 	}
 
 	frame_size = areas->step / 8;
-	if ((data->count + size * frame_size) <= data->link_mtu)
-		frames_to_read = size;
-	else
-		frames_to_read = (data->link_mtu - data->count) / frame_size;
 
-	DBG("count=%d frames_to_read=%lu", data->count, frames_to_read);
+	/* Make room in the ring by sending what it holds */
+	pcm = sco_stream_write_ptr(data->sco, &len);
+	while (len < (size_t) frame_size) {
+		ret = sco_stream_send(data->sco);
+		if (ret < 0) {
+			ret = (ret == -EPIPE) ? -EIO : ret;
+			goto done;
+		}
+
+		pcm = sco_stream_write_ptr(data->sco, &len);
+		if (len >= (size_t) frame_size)
+			break;
 
-	/* Ready for more data */
-	buff = (uint8_t *) areas->addr +
-			(areas->first + areas->step * offset) / 8;
-	memcpy(data->buffer + data->count, buff, frame_size * frames_to_read);
+		if (io->nonblock) {
+			ret = -EAGAIN;
+			goto done;
+		}
 
-	/* Remember we have some frames in the pipe now */
-	data->count += frames_to_read * frame_size;
-	if (data->count != data->link_mtu) {
-		ret = frames_to_read;
-		goto done;
+		pfd.fd = data->stream.fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, -1) < 0) {
+			ret = -errno;
+			goto done;
+		}
+
+		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			ret = -EIO;
+			goto done;
+		}
 	}
 
-	rsend = send(data->stream.fd, data->buffer, data->link_mtu,
-			io->nonblock ? MSG_DONTWAIT : 0);
-	if (rsend > 0) {
-		/* Reset count pointer */
-		data->count = 0;
+	frames_to_read = MIN(size, len / frame_size);
 
-		ret = frames_to_read;
-	} else if (rsend < 0)
-		ret = (errno == EPIPE) ? -EIO : -errno;
+	DBG("frames_to_read=%lu", frames_to_read);
+
+	buff = (uint8_t *) areas->addr +
+			(areas->first + areas->step * offset) / 8;
+	memcpy(pcm, buff, frame_size * frames_to_read);
+	sco_stream_write_commit(data->sco, frame_size * frames_to_read);
+
+	ret = sco_stream_send(data->sco);
+	if (ret < 0)
+		ret = (ret == -EPIPE) ? -EIO : ret;
 	else
-		ret = -EIO;
+		ret = frames_to_read;
 
 done:
 	DBG("returning %ld", ret);
@@ -969,35 +1025,35 @@ static snd_pcm_sframes_t bluetooth_a2dp_read(snd_pcm_ioplug_t *io,
 static int avdtp_write(struct bluetooth_data *data)
 {
 	int ret = 0;
-	struct rtp_header *header;
-	struct rtp_payload *payload;
 	struct bluetooth_a2dp *a2dp = &data->a2dp;
 
-	header = (void *) a2dp->buffer;
-	payload = (void *) (a2dp->buffer + sizeof(*header));
+	/* Queue rather than drop packets which find the socket full */
+	ret = media_backlog_send(&a2dp->backlog, data->stream.fd,
+			media_packetizer_packet(&a2dp->packetizer, NULL), 2);
+	if (ret < 0)
+		DBG("send returned %d (%s).", ret, strerror(-ret));
 
-	memset(a2dp->buffer, 0, sizeof(*header) + sizeof(*payload));
+	/* Reset buffer of data to send */
+	media_packetizer_next(&a2dp->packetizer);
 
-	payload->frame_count = a2dp->frame_count;
-	header->v = 2;
-	header->pt = 1;
-	header->sequence_number = htons(a2dp->seq_num);
-	header->timestamp = htonl(a2dp->nsamples);
-	header->ssrc = htonl(1);
+	return ret;
+}
 
-	ret = send(data->stream.fd, a2dp->buffer, a2dp->count, MSG_DONTWAIT);
-	if (ret < 0) {
-		DBG("send returned %d errno %s.", ret, strerror(errno));
-		ret = -errno;
-	}
+/* Accounts for a frame just encoded into the packet and sends the packet
+ * once no further frame fits */
+static void bluetooth_a2dp_commit(struct bluetooth_data *data, int samples)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	struct media_packetizer *mp = &a2dp->packetizer;
 
-	/* Reset buffer of data to send */
-	a2dp->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
-	a2dp->frame_count = 0;
-	a2dp->samples = 0;
-	a2dp->seq_num++;
+	media_packetizer_commit(mp, 1, samples);
 
-	return ret;
+	/* No space left for another frame then send */
+	if (media_packetizer_room(mp, sbc_get_frame_length(&a2dp->sbc)) == 0) {
+		DBG("sending packet %d, frames %u, link_mtu %u", mp->seq_num,
+					mp->frame_count, data->link_mtu);
+		avdtp_write(data);
+	}
 }
 
 static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
@@ -1009,7 +1065,6 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 	snd_pcm_sframes_t ret = 0;
 	unsigned int bytes_left;
 	int frame_size, encoded;
-	ssize_t written;
 	uint8_t *buff;
 
 	DBG("areas->step=%u areas->first=%u offset=%lu size=%lu",
@@ -1062,28 +1117,15 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 						additional_bytes_needed);
 
 		/* Enough data to encode (sbc wants 1k blocks) */
-		encoded = sbc_encode(&a2dp->sbc, data->buffer, a2dp->codesize,
-					a2dp->buffer + a2dp->count,
-					sizeof(a2dp->buffer) - a2dp->count,
-								&written);
+		encoded = sbc_encode_iov(&a2dp->sbc, data->buffer, a2dp->codesize,
+				media_packetizer_payload(&a2dp->packetizer),
+				sizeof(a2dp->buffer));
 		if (encoded <= 0) {
 			DBG("Encoding error %d", encoded);
 			goto done;
 		}
 
-		/* Increment a2dp buffers */
-		a2dp->count += written;
-		a2dp->frame_count++;
-		a2dp->samples += encoded / frame_size;
-		a2dp->nsamples += encoded / frame_size;
-
-		/* No space left for another frame then send */
-		if (a2dp->count + written >= data->link_mtu) {
-			avdtp_write(data);
-			DBG("sending packet %d, count %d, link_mtu %u",
-					a2dp->seq_num, a2dp->count,
-							data->link_mtu);
-		}
+		bluetooth_a2dp_commit(data, encoded / frame_size);
 
 		/* Increment up buff pointer to take into account
 		 * the data processed */
@@ -1098,10 +1140,9 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 	/* Process this buffer in full chunks */
 	while (bytes_left >= a2dp->codesize) {
 		/* Enough data to encode (sbc wants 1k blocks) */
-		encoded = sbc_encode(&a2dp->sbc, buff, a2dp->codesize,
-					a2dp->buffer + a2dp->count,
-					sizeof(a2dp->buffer) - a2dp->count,
-								&written);
+		encoded = sbc_encode_iov(&a2dp->sbc, buff, a2dp->codesize,
+				media_packetizer_payload(&a2dp->packetizer),
+				sizeof(a2dp->buffer));
 		if (encoded <= 0) {
 			DBG("Encoding error %d", encoded);
 			goto done;
@@ -1112,19 +1153,7 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 		buff += a2dp->codesize;
 		bytes_left -= a2dp->codesize;
 
-		/* Increment a2dp buffers */
-		a2dp->count += written;
-		a2dp->frame_count++;
-		a2dp->samples += encoded / frame_size;
-		a2dp->nsamples += encoded / frame_size;
-
-		/* No space left for another frame then send */
-		if (a2dp->count + written >= data->link_mtu) {
-			avdtp_write(data);
-			DBG("sending packet %d, count %d, link_mtu %u",
-						a2dp->seq_num, a2dp->count,
-							data->link_mtu);
-		}
+		bluetooth_a2dp_commit(data, encoded / frame_size);
 	}
 
 out:
@@ -1228,6 +1257,7 @@ static int bluetooth_hsp_hw_constraint(snd_pcm_ioplug_t *io)
 	unsigned int format_list[] = {
 		SND_PCM_FORMAT_S16
 	};
+	unsigned int rate, period_bytes;
 	int err;
 
 	/* access type */
@@ -1249,14 +1279,17 @@ static int bluetooth_hsp_hw_constraint(snd_pcm_ioplug_t *io)
 		return err;
 
 	/* supported rate */
+	rate = sco_codec_rate(data->sco_codec);
 	err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_RATE,
-							8000, 8000);
+							rate, rate);
 	if (err < 0)
 		return err;
 
-	/* supported block size */
+	/* supported block size, a whole mSBC frame or SCO packet */
+	period_bytes = data->sco_codec == SCO_CODEC_MSBC ?
+					SCO_MSBC_PCM_SIZE : data->link_mtu;
 	err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
-						data->link_mtu, data->link_mtu);
+						period_bytes, period_bytes);
 	if (err < 0)
 		return err;
 
@@ -1525,6 +1558,17 @@ static int bluetooth_parse_config(snd_config_t *conf,
 			continue;
 		}
 
+		if (strcmp(id, "packet_size") == 0) {
+			if (snd_config_get_string(n, &value) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+
+			bt_config->packet_size = atoi(value);
+			bt_config->has_packet_size = 1;
+			continue;
+		}
+
 		SNDERR("Unknown field %s", id);
 		return -EINVAL;
 	}
@@ -1625,6 +1669,12 @@ static int bluetooth_parse_capabilities(struct bluetooth_data *data,
 
 	data->transport = codec->transport;
 
+	if (codec->transport == BT_CAPABILITIES_TRANSPORT_SCO) {
+		data->sco_codec = codec->type == BT_HFP_CODEC_MSBC ?
+					SCO_CODEC_MSBC : SCO_CODEC_CVSD;
+		return 0;
+	}
+
 	if (codec->transport != BT_CAPABILITIES_TRANSPORT_A2DP)
 		return 0;
 
@@ -1663,6 +1713,7 @@ static int bluetooth_init(struct bluetooth_data *data,
 
 	data->server.fd = -1;
 	data->stream.fd = -1;
+	data->sco_codec = SCO_CODEC_CVSD;
 
 	sk = bt_audio_service_open();
 	if (sk <= 0) {
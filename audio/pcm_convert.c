@@ -0,0 +1,453 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012, The Linux Foundation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "pcm_convert.h"
+
+/* filter taps per phase for each step of the decimation ratio, must be a
+ * multiple of 16 for the SIMD kernels */
+#define PCM_CONVERT_TAPS		32
+#define PCM_CONVERT_MAX_TAPS		256
+
+/* largest interpolation factor, 160 for 44.1 kHz to 48 kHz */
+#define PCM_CONVERT_MAX_PHASES		320
+
+/* input frames deinterleaved at a time */
+#define PCM_CONVERT_CHUNK		256
+
+/* fixed point scale of the filter taps */
+#define PCM_CONVERT_SCALE		14
+
+struct pcm_convert {
+	int in_channels;
+	int out_channels;
+	int planes;			/* channels kept after mixing */
+
+	/* resampling by up / down, both 1 when only mixing channels */
+	int up;
+	int down;
+	int ntaps;
+	int16_t *taps;			/* up phases of ntaps reversed taps */
+	void *taps_mem;
+
+	int phase;			/* phase of the next output frame */
+	int pos;			/* newest input sample it needs */
+	int len;			/* samples in each plane, < 0 to skip */
+	int size;			/* capacity of each plane */
+	int16_t *x[2];
+
+	int32_t (*dot)(const int16_t *x, const int16_t *h, int n);
+};
+
+static int32_t pcm_dot_c(const int16_t *x, const int16_t *h, int n)
+{
+	int32_t sum = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum += (int32_t) x[i] * h[i];
+
+	return sum;
+}
+
+/*
+ * x86 SSE2 optimizations
+ */
+
+#if defined(__GNUC__) && (defined(__amd64__) || \
+			(defined(__i386__) && defined(__SSE2__)))
+
+#define PCM_CONVERT_BUILD_WITH_SSE2_SUPPORT
+
+static int32_t pcm_dot_sse2(const int16_t *x, const int16_t *h, int n)
+{
+	int32_t sum;
+
+	asm volatile (
+		"pxor      %%xmm0, %%xmm0\n"
+		"pxor      %%xmm1, %%xmm1\n"
+		"1:\n"
+		"movdqu      (%1), %%xmm2\n"
+		"movdqu    16(%1), %%xmm3\n"
+		"pmaddwd     (%2), %%xmm2\n"
+		"pmaddwd   16(%2), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm0\n"
+		"paddd     %%xmm3, %%xmm1\n"
+		"add          $32, %1\n"
+		"add          $32, %2\n"
+		"sub          $16, %3\n"
+		"jnz            1b\n"
+		"\n"
+		"paddd     %%xmm1, %%xmm0\n"
+		"pshufd    $0x4e, %%xmm0, %%xmm1\n"
+		"paddd     %%xmm1, %%xmm0\n"
+		"pshufd    $0xb1, %%xmm0, %%xmm1\n"
+		"paddd     %%xmm1, %%xmm0\n"
+		"movd      %%xmm0, %0\n"
+		: "=r" (sum), "+r" (x), "+r" (h), "+r" (n)
+		:
+		: "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3");
+
+	return sum;
+}
+
+#endif
+
+/*
+ * ARM NEON optimizations
+ */
+
+#if defined(__GNUC__) && defined(__ARM_NEON__)
+
+#define PCM_CONVERT_BUILD_WITH_NEON_SUPPORT
+
+static int32_t pcm_dot_neon(const int16_t *x, const int16_t *h, int n)
+{
+	int32_t sum;
+
+	asm volatile (
+		"vmov.i32   q0, #0\n"
+		"vmov.i32   q1, #0\n"
+		"1:\n"
+		"vld1.16    {d4, d5, d6, d7}, [%1]!\n"
+		"vld1.16    {d8, d9, d10, d11}, [%2, :128]!\n"
+		"vmlal.s16  q0, d4, d8\n"
+		"vmlal.s16  q1, d5, d9\n"
+		"vmlal.s16  q0, d6, d10\n"
+		"vmlal.s16  q1, d7, d11\n"
+		"subs       %3, %3, #16\n"
+		"bne        1b\n"
+		"\n"
+		"vadd.s32   q0, q0, q1\n"
+		"vpadd.s32  d0, d0, d1\n"
+		"vpadd.s32  d0, d0, d0\n"
+		"vmov.32    %0, d0[0]\n"
+		: "=r" (sum), "+r" (x), "+r" (h), "+r" (n)
+		:
+		: "cc", "memory",
+		  "d0", "d1", "d2", "d3", "d4", "d5",
+		  "d6", "d7", "d8", "d9", "d10", "d11");
+
+	return sum;
+}
+
+#endif
+
+static int gcd(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/*
+ * Designs a Blackman windowed sinc low-pass at the interpolated rate and
+ * splits it into up phases of ntaps taps, each stored reversed so that a
+ * phase is applied as a plain dot product over the input history.
+ */
+static int pcm_convert_design(struct pcm_convert *cvt, int in_rate,
+								int out_rate)
+{
+	int n = cvt->up * cvt->ntaps;
+	double transition, cutoff, center, sum = 0;
+	double *proto;
+	int i, k, p;
+
+	proto = malloc(n * sizeof(double));
+	if (!proto)
+		return -1;
+
+	/* put the stop band edge at the lower Nyquist frequency */
+	transition = 5.5 * in_rate / cvt->ntaps;
+	cutoff = (0.5 * (in_rate < out_rate ? in_rate : out_rate) -
+				transition / 2) / ((double) in_rate * cvt->up);
+	center = (n - 1) / 2.0;
+
+	for (i = 0; i < n; i++) {
+		double t = i - center;
+		double s, w;
+
+		s = t == 0 ? 2 * cutoff :
+				sin(2 * M_PI * cutoff * t) / (M_PI * t);
+		w = 0.42 - 0.5 * cos(2 * M_PI * i / (n - 1)) +
+				0.08 * cos(4 * M_PI * i / (n - 1));
+		proto[i] = s * w;
+		sum += proto[i];
+	}
+
+	for (p = 0; p < cvt->up; p++) {
+		for (k = 0; k < cvt->ntaps; k++) {
+			double v = proto[k * cvt->up + p] * cvt->up / sum *
+						(1 << PCM_CONVERT_SCALE);
+
+			v = floor(v + 0.5);
+			if (v > INT16_MAX)
+				v = INT16_MAX;
+			else if (v < INT16_MIN)
+				v = INT16_MIN;
+			cvt->taps[p * cvt->ntaps + cvt->ntaps - 1 - k] = v;
+		}
+	}
+
+	free(proto);
+	return 0;
+}
+
+int pcm_convert_supported(int in_rate, int out_rate)
+{
+	int g, up, down;
+
+	if (in_rate <= 0 || out_rate <= 0)
+		return 0;
+
+	g = gcd(in_rate, out_rate);
+	up = out_rate / g;
+	down = in_rate / g;
+
+	if (up == 1 && down == 1)
+		return 1;
+
+	return up <= PCM_CONVERT_MAX_PHASES &&
+		PCM_CONVERT_TAPS * ((down + up - 1) / up) <=
+							PCM_CONVERT_MAX_TAPS;
+}
+
+struct pcm_convert *pcm_convert_new(int in_rate, int in_channels,
+					int out_rate, int out_channels)
+{
+	struct pcm_convert *cvt;
+	int g, i;
+
+	if (!pcm_convert_supported(in_rate, out_rate))
+		return NULL;
+
+	if (in_channels < 1 || in_channels > 2 ||
+			out_channels < 1 || out_channels > 2)
+		return NULL;
+
+	cvt = calloc(1, sizeof(*cvt));
+	if (!cvt)
+		return NULL;
+
+	g = gcd(in_rate, out_rate);
+	cvt->up = out_rate / g;
+	cvt->down = in_rate / g;
+	cvt->in_channels = in_channels;
+	cvt->out_channels = out_channels;
+	cvt->planes = in_channels < out_channels ? in_channels : out_channels;
+
+	if (cvt->up == 1 && cvt->down == 1)
+		return cvt;
+
+	cvt->ntaps = PCM_CONVERT_TAPS *
+			((cvt->down + cvt->up - 1) / cvt->up);
+
+	/* the SIMD kernels want aligned taps */
+	cvt->taps_mem = malloc(cvt->up * cvt->ntaps * sizeof(int16_t) + 15);
+	if (!cvt->taps_mem)
+		goto failed;
+	cvt->taps = (int16_t *) (((uintptr_t) cvt->taps_mem + 15) &
+							~(uintptr_t) 15);
+
+	if (pcm_convert_design(cvt, in_rate, out_rate) < 0)
+		goto failed;
+
+	/* start out with silence as history */
+	cvt->size = cvt->ntaps - 1 + PCM_CONVERT_CHUNK;
+	for (i = 0; i < cvt->planes; i++) {
+		cvt->x[i] = calloc(cvt->size, sizeof(int16_t));
+		if (!cvt->x[i])
+			goto failed;
+	}
+	cvt->pos = cvt->ntaps - 1;
+	cvt->len = cvt->ntaps - 1;
+
+	cvt->dot = pcm_dot_c;
+#ifdef PCM_CONVERT_BUILD_WITH_SSE2_SUPPORT
+	cvt->dot = pcm_dot_sse2;
+#endif
+#ifdef PCM_CONVERT_BUILD_WITH_NEON_SUPPORT
+	cvt->dot = pcm_dot_neon;
+#endif
+
+	return cvt;
+
+failed:
+	pcm_convert_free(cvt);
+	return NULL;
+}
+
+void pcm_convert_free(struct pcm_convert *cvt)
+{
+	if (!cvt)
+		return;
+
+	free(cvt->x[0]);
+	free(cvt->x[1]);
+	free(cvt->taps_mem);
+	free(cvt);
+}
+
+static inline int16_t pcm_clip(int32_t s)
+{
+	if (s > INT16_MAX)
+		return INT16_MAX;
+	if (s < INT16_MIN)
+		return INT16_MIN;
+	return s;
+}
+
+/* Mixing only, one output frame for each input frame */
+static int pcm_convert_channels(struct pcm_convert *cvt, const int16_t *in,
+				int in_frames, int16_t *out, int out_frames,
+				int *consumed)
+{
+	int n = in_frames < out_frames ? in_frames : out_frames;
+	int i;
+
+	if (cvt->in_channels == cvt->out_channels)
+		memcpy(out, in, n * cvt->in_channels * sizeof(int16_t));
+	else if (cvt->in_channels == 2)
+		for (i = 0; i < n; i++)
+			out[i] = (in[2 * i] + in[2 * i + 1]) >> 1;
+	else
+		for (i = 0; i < n; i++)
+			out[2 * i] = out[2 * i + 1] = in[i];
+
+	*consumed = n;
+	return n;
+}
+
+/* Appends up to n input frames to the planes, mixing channels on the way */
+static int pcm_convert_fill(struct pcm_convert *cvt, const int16_t *in, int n)
+{
+	int16_t *x0 = cvt->x[0], *x1 = cvt->x[1];
+	int space = cvt->size - (cvt->len > 0 ? cvt->len : 0);
+	int i, j;
+
+	if (n > space)
+		n = space;
+
+	for (i = 0, j = cvt->len; i < n; i++, j++) {
+		/* dropped by a decimation step larger than the history */
+		if (j < 0)
+			continue;
+
+		if (cvt->in_channels == 1)
+			x0[j] = in[i];
+		else if (cvt->planes == 1)
+			x0[j] = (in[2 * i] + in[2 * i + 1]) >> 1;
+		else {
+			x0[j] = in[2 * i];
+			x1[j] = in[2 * i + 1];
+		}
+	}
+
+	cvt->len += n;
+	return n;
+}
+
+int pcm_convert_process(struct pcm_convert *cvt, const int16_t *in,
+				int in_frames, int16_t *out, int out_frames,
+				int *consumed)
+{
+	const int round = 1 << (PCM_CONVERT_SCALE - 1);
+	int produced = 0;
+	int used = 0;
+
+	if (cvt->up == 1 && cvt->down == 1)
+		return pcm_convert_channels(cvt, in, in_frames, out,
+						out_frames, consumed);
+
+	while (produced < out_frames) {
+		int keep, p;
+
+		while (cvt->pos < cvt->len && produced < out_frames) {
+			const int16_t *h = cvt->taps + cvt->phase * cvt->ntaps;
+			int base = cvt->pos - (cvt->ntaps - 1);
+			int16_t *o = out + produced * cvt->out_channels;
+
+			for (p = 0; p < cvt->planes; p++)
+				o[p] = pcm_clip((cvt->dot(cvt->x[p] + base, h,
+							cvt->ntaps) + round) >>
+							PCM_CONVERT_SCALE);
+			if (cvt->planes < cvt->out_channels)
+				o[1] = o[0];
+
+			produced++;
+			cvt->phase += cvt->down;
+			cvt->pos += cvt->phase / cvt->up;
+			cvt->phase %= cvt->up;
+		}
+
+		if (produced == out_frames || used == in_frames)
+			break;
+
+		/* drop the history no longer needed and append new input */
+		keep = cvt->pos - (cvt->ntaps - 1);
+		if (keep > 0) {
+			if (keep < cvt->len)
+				for (p = 0; p < cvt->planes; p++)
+					memmove(cvt->x[p], cvt->x[p] + keep,
+						(cvt->len - keep) *
+						sizeof(int16_t));
+			cvt->len -= keep;
+			cvt->pos -= keep;
+		}
+
+		p = pcm_convert_fill(cvt, in + used * cvt->in_channels,
+							in_frames - used);
+		used += p;
+	}
+
+	*consumed = used;
+	return produced;
+}
+
+int pcm_convert_delay(struct pcm_convert *cvt)
+{
+	int pending;
+
+	if (cvt->up == 1 && cvt->down == 1)
+		return 0;
+
+	/* buffered input plus the group delay of the filter */
+	pending = cvt->len - cvt->pos;
+	if (pending < 0)
+		pending = 0;
+
+	return pending + cvt->ntaps / 2;
+}
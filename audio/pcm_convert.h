@@ -0,0 +1,53 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012, The Linux Foundation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+
+/*
+ * Converts interleaved native endian S16 PCM between sample rates and
+ * between mono and stereo. Rates are converted by a polyphase FIR filter
+ * working on planar data, channels are mixed while deinterleaving.
+ */
+
+struct pcm_convert;
+
+/* Whether the ratio of the two rates is supported */
+int pcm_convert_supported(int in_rate, int out_rate);
+
+/* Returns NULL if the rate ratio is not supported */
+struct pcm_convert *pcm_convert_new(int in_rate, int in_channels,
+					int out_rate, int out_channels);
+void pcm_convert_free(struct pcm_convert *cvt);
+
+/*
+ * Converts up to in_frames frames from in into at most out_frames frames
+ * in out. Returns the number of frames written to out and stores the number
+ * of input frames used in consumed. Input which is used but does not yet
+ * give a complete output frame is kept in the converter.
+ */
+int pcm_convert_process(struct pcm_convert *cvt, const int16_t *in,
+				int in_frames, int16_t *out, int out_frames,
+				int *consumed);
+
+/* Input frames held in the converter, for latency calculations */
+int pcm_convert_delay(struct pcm_convert *cvt);
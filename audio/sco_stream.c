@@ -0,0 +1,407 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012, The Linux Foundation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "sbc.h"
+#include "sco_stream.h"
+
+/* Encoded mSBC frame, without the H2 header and the padding */
+#define MSBC_FRAME_SIZE		57
+
+#define MSBC_SYNC		0x01
+#define MSBC_SYNCWORD		0xAD
+
+/* Second H2 header byte for the sequence numbers 0 to 3 */
+static const uint8_t msbc_h2[4] = { 0x08, 0x38, 0xc8, 0xf8 };
+
+struct sco_stream {
+	int fd;
+	uint8_t codec;
+	unsigned int packet_size;
+
+	uint8_t *ring;			/* PCM, shared anonymous mapping */
+	size_t ring_size;
+	unsigned long ring_read;	/* Bytes ever read from the ring */
+	unsigned long ring_write;	/* Bytes ever written to it */
+
+	/* mSBC only */
+	sbc_t sbc;
+	uint8_t *buf;			/* Encoded data in transit */
+	size_t buf_size;
+	size_t buf_len;
+	uint8_t seq;			/* Next H2 sequence number */
+	int synced;			/* Receiving, seq is valid */
+
+	uint32_t lost;
+	uint32_t overruns;
+};
+
+unsigned int sco_codec_rate(uint8_t codec)
+{
+	switch (codec) {
+	case SCO_CODEC_CVSD:
+		return 8000;
+	case SCO_CODEC_MSBC:
+		return 16000;
+	default:
+		return 0;
+	}
+}
+
+struct sco_stream *sco_stream_new(int fd, uint8_t codec,
+				unsigned int packet_size, size_t ring_size)
+{
+	struct sco_stream *s;
+	size_t unit;
+
+	if (packet_size == 0 || sco_codec_rate(codec) == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	unit = codec == SCO_CODEC_MSBC ? SCO_MSBC_PCM_SIZE : packet_size;
+	ring_size = (ring_size + unit - 1) / unit * unit;
+	if (ring_size < 2 * unit)
+		ring_size = 2 * unit;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->fd = fd;
+	s->codec = codec;
+	s->packet_size = packet_size;
+	s->ring_size = ring_size;
+
+	s->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (s->ring == MAP_FAILED)
+		goto failed;
+
+	if (codec == SCO_CODEC_MSBC) {
+		/* a packet in transit plus the frame completing the next */
+		s->buf_size = packet_size + SCO_MSBC_BLOCK_SIZE;
+		s->buf = malloc(s->buf_size);
+		if (!s->buf)
+			goto failed;
+
+		if (sbc_init_msbc(&s->sbc, 0) < 0) {
+			errno = ENOMEM;
+			goto failed;
+		}
+		s->sbc.endian = SBC_LE;
+	}
+
+	return s;
+
+failed:
+	if (s->ring != NULL && s->ring != MAP_FAILED)
+		munmap(s->ring, s->ring_size);
+	free(s->buf);
+	free(s);
+	return NULL;
+}
+
+void sco_stream_free(struct sco_stream *s)
+{
+	if (!s)
+		return;
+
+	if (s->codec == SCO_CODEC_MSBC)
+		sbc_finish(&s->sbc);
+
+	munmap(s->ring, s->ring_size);
+	free(s->buf);
+	free(s);
+}
+
+size_t sco_stream_avail(struct sco_stream *s)
+{
+	return s->ring_write - s->ring_read;
+}
+
+void *sco_stream_write_ptr(struct sco_stream *s, size_t *len)
+{
+	size_t offset = s->ring_write % s->ring_size;
+	size_t space = s->ring_size - sco_stream_avail(s);
+
+	*len = s->ring_size - offset < space ? s->ring_size - offset : space;
+
+	return s->ring + offset;
+}
+
+void sco_stream_write_commit(struct sco_stream *s, size_t len)
+{
+	s->ring_write += len;
+}
+
+void *sco_stream_read_ptr(struct sco_stream *s, size_t *len)
+{
+	size_t offset = s->ring_read % s->ring_size;
+	size_t avail = sco_stream_avail(s);
+
+	*len = s->ring_size - offset < avail ? s->ring_size - offset : avail;
+
+	return s->ring + offset;
+}
+
+void sco_stream_read_commit(struct sco_stream *s, size_t len)
+{
+	s->ring_read += len;
+}
+
+static int msbc_encode(struct sco_stream *s, const void *pcm)
+{
+	uint8_t *block = s->buf + s->buf_len;
+	ssize_t written;
+
+	block[0] = MSBC_SYNC;
+	block[1] = msbc_h2[s->seq++ & 3];
+
+	if (sbc_encode(&s->sbc, pcm, SCO_MSBC_PCM_SIZE, block + 2,
+				MSBC_FRAME_SIZE, &written) < 0 ||
+				written != MSBC_FRAME_SIZE)
+		return -EIO;
+
+	block[SCO_MSBC_BLOCK_SIZE - 1] = 0;
+	s->buf_len += SCO_MSBC_BLOCK_SIZE;
+
+	return 0;
+}
+
+ssize_t sco_stream_send(struct sco_stream *s)
+{
+	ssize_t consumed = 0;
+	const uint8_t *packet;
+	size_t len;
+	int err;
+
+	while (1) {
+		if (s->codec == SCO_CODEC_MSBC) {
+			/* encode until a whole packet is pending */
+			while (s->buf_len < s->packet_size) {
+				packet = sco_stream_read_ptr(s, &len);
+				if (len < SCO_MSBC_PCM_SIZE)
+					break;
+
+				err = msbc_encode(s, packet);
+				if (err < 0)
+					return err;
+
+				sco_stream_read_commit(s, SCO_MSBC_PCM_SIZE);
+				consumed += SCO_MSBC_PCM_SIZE;
+			}
+
+			if (s->buf_len < s->packet_size)
+				break;
+
+			packet = s->buf;
+		} else {
+			/* packets never wrap, the ring is made of them */
+			packet = sco_stream_read_ptr(s, &len);
+			if (len < s->packet_size)
+				break;
+		}
+
+		if (send(s->fd, packet, s->packet_size,
+					MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+
+		if (s->codec == SCO_CODEC_MSBC) {
+			s->buf_len -= s->packet_size;
+			memmove(s->buf, s->buf + s->packet_size, s->buf_len);
+		} else {
+			sco_stream_read_commit(s, s->packet_size);
+			consumed += s->packet_size;
+		}
+	}
+
+	return consumed;
+}
+
+/* Silence for a frame which did not arrive or did not decode */
+static ssize_t msbc_conceal(struct sco_stream *s)
+{
+	size_t len;
+	void *pcm = sco_stream_write_ptr(s, &len);
+
+	s->lost++;
+
+	if (len < SCO_MSBC_PCM_SIZE) {
+		s->overruns += SCO_MSBC_PCM_SIZE;
+		return 0;
+	}
+
+	memset(pcm, 0, SCO_MSBC_PCM_SIZE);
+	sco_stream_write_commit(s, SCO_MSBC_PCM_SIZE);
+
+	return SCO_MSBC_PCM_SIZE;
+}
+
+static int msbc_seq(uint8_t h2)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (msbc_h2[i] == h2)
+			return i;
+
+	return -1;
+}
+
+/* Decodes the complete frames in buf, skipping garbage until a sync */
+static ssize_t msbc_decode(struct sco_stream *s)
+{
+	ssize_t produced = 0;
+	size_t pos = 0, len, written;
+	int seq;
+	void *pcm;
+
+	while (s->buf_len - pos >= SCO_MSBC_BLOCK_SIZE) {
+		const uint8_t *block = s->buf + pos;
+
+		seq = msbc_seq(block[1]);
+		if (block[0] != MSBC_SYNC || seq < 0 ||
+					block[2] != MSBC_SYNCWORD) {
+			pos++;
+			continue;
+		}
+
+		/* missing sequence numbers are frames the link lost */
+		if (s->synced)
+			while (s->seq != seq) {
+				produced += msbc_conceal(s);
+				s->seq = (s->seq + 1) & 3;
+			}
+		s->seq = (seq + 1) & 3;
+		s->synced = 1;
+
+		pcm = sco_stream_write_ptr(s, &len);
+		if (len < SCO_MSBC_PCM_SIZE)
+			s->overruns += SCO_MSBC_PCM_SIZE;
+		else if (sbc_decode(&s->sbc, block + 2, MSBC_FRAME_SIZE, pcm,
+				SCO_MSBC_PCM_SIZE, &written) <= 0 ||
+				written != SCO_MSBC_PCM_SIZE) {
+			produced += msbc_conceal(s);
+		} else {
+			sco_stream_write_commit(s, SCO_MSBC_PCM_SIZE);
+			produced += SCO_MSBC_PCM_SIZE;
+		}
+
+		pos += SCO_MSBC_BLOCK_SIZE;
+	}
+
+	s->buf_len -= pos;
+	memmove(s->buf, s->buf + pos, s->buf_len);
+
+	return produced;
+}
+
+/* Receives one packet, returns the PCM bytes it added to the ring */
+static ssize_t cvsd_recv(struct sco_stream *s, ssize_t *ret)
+{
+	uint8_t packet[s->packet_size];
+	size_t len, first;
+	void *pcm;
+
+	pcm = sco_stream_write_ptr(s, &len);
+	if (len >= s->packet_size) {
+		*ret = recv(s->fd, pcm, s->packet_size, MSG_DONTWAIT);
+		if (*ret <= 0)
+			return 0;
+
+		sco_stream_write_commit(s, *ret);
+		return *ret;
+	}
+
+	/* short packets before may have left the ring unaligned */
+	*ret = recv(s->fd, packet, s->packet_size, MSG_DONTWAIT);
+	if (*ret <= 0)
+		return 0;
+
+	if (s->ring_size - sco_stream_avail(s) < (size_t) *ret) {
+		s->overruns += *ret;
+		return 0;
+	}
+
+	first = (size_t) *ret < len ? (size_t) *ret : len;
+	memcpy(pcm, packet, first);
+	sco_stream_write_commit(s, first);
+
+	pcm = sco_stream_write_ptr(s, &len);
+	memcpy(pcm, packet + first, *ret - first);
+	sco_stream_write_commit(s, *ret - first);
+
+	return *ret;
+}
+
+ssize_t sco_stream_recv(struct sco_stream *s)
+{
+	ssize_t produced = 0, ret;
+
+	while (1) {
+		if (s->codec == SCO_CODEC_MSBC) {
+			ret = recv(s->fd, s->buf + s->buf_len,
+					s->buf_size - s->buf_len, MSG_DONTWAIT);
+			if (ret > 0) {
+				s->buf_len += ret;
+				produced += msbc_decode(s);
+			}
+		} else
+			produced += cvsd_recv(s, &ret);
+
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+
+		/* orderly shutdown */
+		if (ret == 0)
+			break;
+	}
+
+	return produced;
+}
+
+void sco_stream_get_errors(struct sco_stream *s, uint32_t *lost,
+							uint32_t *overruns)
+{
+	if (lost)
+		*lost = s->lost;
+	if (overruns)
+		*overruns = s->overruns;
+}
@@ -0,0 +1,81 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012, The Linux Foundation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Moves voice data between a SCO socket and a ring of mono S16 PCM. The
+ * ring is a shared anonymous mapping sized in whole codec units, so a
+ * packet (CVSD) or an mSBC frame never wraps around it: CVSD packets are
+ * sent and received straight from and into the ring, mSBC frames are
+ * encoded from and decoded into it.
+ *
+ * A stream is used in one direction. The client fills or drains the ring
+ * through the pointer/commit pairs below and calls sco_stream_send() or
+ * sco_stream_recv(), which never block.
+ */
+
+/* HFP 1.6 codec IDs, as used by AT+BAC and +BCS */
+#define SCO_CODEC_CVSD		0x01
+#define SCO_CODEC_MSBC		0x02
+
+/* An mSBC frame with its H2 synchronization header and a padding byte */
+#define SCO_MSBC_BLOCK_SIZE	60
+/* PCM of one mSBC frame, 120 samples */
+#define SCO_MSBC_PCM_SIZE	240
+
+struct sco_stream;
+
+/* The ring is rounded up to whole packets or mSBC frames. Returns NULL
+ * with errno set on failure. */
+struct sco_stream *sco_stream_new(int fd, uint8_t codec,
+				unsigned int packet_size, size_t ring_size);
+void sco_stream_free(struct sco_stream *s);
+
+/* PCM sample rate of a codec, 0 if unknown */
+unsigned int sco_codec_rate(uint8_t codec);
+
+/* PCM bytes in the ring */
+size_t sco_stream_avail(struct sco_stream *s);
+
+/* Contiguous free space of the ring, for the client to write PCM into */
+void *sco_stream_write_ptr(struct sco_stream *s, size_t *len);
+void sco_stream_write_commit(struct sco_stream *s, size_t len);
+
+/* Contiguous PCM in the ring, for the client to read */
+void *sco_stream_read_ptr(struct sco_stream *s, size_t *len);
+void sco_stream_read_commit(struct sco_stream *s, size_t len);
+
+/* Sends whole packets while the ring holds enough PCM and the socket has
+ * room. Returns the PCM bytes consumed, or a negative error. */
+ssize_t sco_stream_send(struct sco_stream *s);
+
+/* Receives the pending packets. Returns the PCM bytes added to the ring,
+ * including silence standing in for lost mSBC frames, or a negative
+ * error. */
+ssize_t sco_stream_recv(struct sco_stream *s);
+
+/* mSBC frames lost or undecodable, and PCM bytes dropped on a full ring */
+void sco_stream_get_errors(struct sco_stream *s, uint32_t *lost,
+							uint32_t *overruns);
@@ -29,6 +29,7 @@
 
 #include <stdint.h>
 #include <errno.h>
+#include <string.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sdp.h>
@@ -39,6 +40,7 @@
 
 #include "log.h"
 
+#include "ipc.h"
 #include "device.h"
 #include "avdtp.h"
 #include "media.h"
@@ -71,6 +73,7 @@ struct sink {
 	struct pending_request *connect;
 	struct pending_request *disconnect;
 	DBusConnection *conn;
+	struct bt_stream_stats_ind *stats;	/* Last report of the client */
 };
 
 struct sink_state_callback {
@@ -672,6 +675,73 @@ static DBusMessage *sink_get_properties(DBusConnection *conn,
 	return reply;
 }
 
+static DBusMessage *sink_get_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	struct audio_device *device = data;
+	struct sink *sink = device->sink;
+	struct bt_stream_stats_ind *stats = sink->stats;
+	uint32_t frames[BT_STREAM_STATS_MAX_FRAMES + 1];
+	const uint32_t *array = frames;
+	DBusMessage *reply;
+	DBusMessageIter iter;
+	DBusMessageIter dict;
+	uint64_t value64;
+	uint32_t value;
+	uint8_t bitpool;
+
+	if (!stats)
+		return g_dbus_create_error(msg, ERROR_INTERFACE ".NotAvailable",
+				"No statistics reported for this stream");
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	/* the report is packed, copy fields out before taking addresses */
+	value64 = stats->packets;
+	dict_append_entry(&dict, "Packets", DBUS_TYPE_UINT64, &value64);
+
+	value64 = stats->bytes;
+	dict_append_entry(&dict, "Bytes", DBUS_TYPE_UINT64, &value64);
+
+	memcpy(frames, stats->frames, sizeof(frames));
+	dict_append_array(&dict, "FramesPerPacket", DBUS_TYPE_UINT32, &array,
+						BT_STREAM_STATS_MAX_FRAMES + 1);
+
+	value = stats->poll_timeouts;
+	dict_append_entry(&dict, "PollTimeouts", DBUS_TYPE_UINT32, &value);
+
+	value = stats->eagain;
+	dict_append_entry(&dict, "SendBlocked", DBUS_TYPE_UINT32, &value);
+
+	value = stats->epipe;
+	dict_append_entry(&dict, "SendBrokenPipe", DBUS_TYPE_UINT32, &value);
+
+	value = stats->deadline_misses;
+	dict_append_entry(&dict, "DeadlineMisses", DBUS_TYPE_UINT32, &value);
+
+	value = stats->bitpool_changes;
+	dict_append_entry(&dict, "BitpoolChanges", DBUS_TYPE_UINT32, &value);
+
+	bitpool = stats->bitpool;
+	dict_append_entry(&dict, "Bitpool", DBUS_TYPE_BYTE, &bitpool);
+
+	value = stats->encode_ns;
+	dict_append_entry(&dict, "EncodeTime", DBUS_TYPE_UINT32, &value);
+
+	dbus_message_iter_close_container(&iter, &dict);
+
+	return reply;
+}
+
 static DBusMessage *sink_require_protection(DBusConnection *conn,
 						DBusMessage *msg, void *data)
 {
@@ -703,6 +773,7 @@ static GDBusMethodTable sink_methods[] = {
 	{ "IsConnected",	"",	"b",	sink_is_connected,
 						G_DBUS_METHOD_FLAG_DEPRECATED },
 	{ "GetProperties",	"",	"a{sv}",sink_get_properties },
+	{ "GetStatistics",	"",	"a{sv}",sink_get_statistics },
 	{ "RequireProtection",	"b",	"",	sink_require_protection },
 	{ NULL, NULL, NULL, NULL }
 };
@@ -736,6 +807,7 @@ static void sink_free(struct audio_device *dev)
 	if (sink->retry_id)
 		g_source_remove(sink->retry_id);
 
+	g_free(sink->stats);
 	g_free(sink);
 	dev->sink = NULL;
 }
@@ -903,3 +975,17 @@ gboolean sink_remove_state_cb(unsigned int id)
 
 	return FALSE;
 }
+
+void sink_update_stats(struct audio_device *dev,
+				const struct bt_stream_stats_ind *stats)
+{
+	struct sink *sink = dev->sink;
+
+	if (!sink)
+		return;
+
+	if (!sink->stats)
+		sink->stats = g_new0(struct bt_stream_stats_ind, 1);
+
+	memcpy(sink->stats, stats, sizeof(*stats));
+}
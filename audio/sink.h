@@ -48,3 +48,7 @@ gboolean sink_new_stream(struct audio_device *dev, struct avdtp *session,
 				struct avdtp_stream *stream);
 gboolean sink_setup_stream(struct sink *sink, struct avdtp *session);
 gboolean sink_shutdown(struct sink *sink);
+
+struct bt_stream_stats_ind;
+void sink_update_stats(struct audio_device *dev,
+				const struct bt_stream_stats_ind *stats);
@@ -78,6 +78,7 @@ struct a2dp_data {
 
 struct headset_data {
 	gboolean locked;
+	uint8_t codec;		/* Announced in the capabilities */
 };
 
 struct unix_client {
@@ -278,6 +279,11 @@ static uint8_t headset_generate_capability(struct audio_device *dev,
 	pcm = (void *) codec;
 	pcm->sampling_rate = 8000;
 	if (dev->headset) {
+		/* The client encodes and decodes mSBC itself */
+		if (headset_get_codec(dev) == HFP_CODEC_MSBC) {
+			codec->type = BT_HFP_CODEC_MSBC;
+			pcm->sampling_rate = 16000;
+		}
 		if (headset_get_nrec(dev))
 			pcm->flags |= BT_PCM_FLAG_NREC;
 		if (!headset_get_sco_hci(dev))
@@ -309,6 +315,9 @@ static void headset_discovery_complete(struct audio_device *dev, void *user_data
 
 	length = headset_generate_capability(dev, (void *) rsp->data);
 
+	if (client->type == TYPE_HEADSET)
+		client->d.hs.codec = headset_get_codec(dev);
+
 	rsp->h.type = BT_RESPONSE;
 	rsp->h.name = BT_GET_CAPABILITIES;
 	rsp->h.length = sizeof(*rsp) + length;
@@ -325,6 +334,23 @@ failed:
 	unix_ipc_error(client, BT_SET_CONFIGURATION, EIO);
 }
 
+/* The codec is only known for sure once the HF confirmed it with AT+BCS,
+ * the client cannot use a link of another codec than it was told */
+static gboolean headset_codec_changed(struct audio_device *dev,
+						struct unix_client *client)
+{
+	uint8_t codec = headset_get_codec(dev);
+	/* Clients not asking for the capabilities expect CVSD */
+	uint8_t announced = client->d.hs.codec ? : HFP_CODEC_CVSD;
+
+	if (codec == announced)
+		return FALSE;
+
+	error("Codec changed from %u to %u", announced, codec);
+
+	return TRUE;
+}
+
 static void headset_setup_complete(struct audio_device *dev, void *user_data)
 {
 	struct unix_client *client = user_data;
@@ -333,7 +359,7 @@ static void headset_setup_complete(struct audio_device *dev, void *user_data)
 
 	client->req_id = 0;
 
-	if (!dev)
+	if (!dev || headset_codec_changed(dev, client))
 		goto failed;
 
 	memset(buf, 0, sizeof(buf));
@@ -390,7 +416,7 @@ static void headset_resume_complete(struct audio_device *dev, void *user_data)
 
 	client->req_id = 0;
 
-	if (!dev)
+	if (!dev || headset_codec_changed(dev, client))
 		goto failed;
 
 	client->data_fd = headset_get_sco_fd(dev);
@@ -716,6 +742,7 @@ static void a2dp_discovery_complete(struct avdtp *session, GSList *seps,
 	rsp->isEdrCapable = a2dp_read_edrcapability(&client->dev->src,
 							&client->dev->dst);
 	DBG("EdrCapable, %d", rsp->isEdrCapable);
+	rsp->sbcFastEncoder = a2dp_read_sbc_fast_encoder(&client->dev->src);
 
 	unix_ipc_sendmsg(client, &rsp->h);
 
@@ -1781,6 +1808,16 @@ failed:
 	unix_ipc_error(client, BT_DELAY_REPORT, -err);
 }
 
+static void handle_stream_stats_ind(struct unix_client *client,
+					struct bt_stream_stats_ind *ind)
+{
+	/* reports only come from clients streaming to a sink */
+	if (!client->dev || client->type != TYPE_SINK)
+		return;
+
+	sink_update_stats(client->dev, ind);
+}
+
 static gboolean client_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
 {
 	char buf[BT_SUGGESTED_BUFFER_SIZE];
@@ -1854,6 +1891,12 @@ static gboolean client_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
 		handle_delay_report_req(client,
 				(struct bt_delay_report_req *) msghdr);
 		break;
+	case BT_STREAM_STATS:
+		if (len < (int) sizeof(struct bt_stream_stats_ind))
+			break;
+		handle_stream_stats_ind(client,
+				(struct bt_stream_stats_ind *) msghdr);
+		break;
 	default:
 		error("Audio API: received unexpected message name %d",
 				msghdr->name);
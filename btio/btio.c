@@ -72,6 +72,7 @@ struct set_opts {
 	uint8_t force_active;
 	int flush_timeout;
 	struct bt_le_params le_params;
+	uint16_t voice;
 };
 
 struct connect {
@@ -743,11 +744,22 @@ static int sco_connect(int sock, const bdaddr_t *dst)
 	return 0;
 }
 
-static gboolean sco_set(int sock, uint16_t mtu, GError **err)
+static gboolean sco_set(int sock, uint16_t mtu, uint16_t voice, GError **err)
 {
 	struct sco_options sco_opt;
+	struct bt_voice voice_opt;
 	socklen_t len;
 
+	if (voice) {
+		memset(&voice_opt, 0, sizeof(voice_opt));
+		voice_opt.setting = voice;
+		if (setsockopt(sock, SOL_BLUETOOTH, BT_VOICE, &voice_opt,
+							sizeof(voice_opt)) < 0) {
+			ERROR_FAILED(err, "setsockopt(BT_VOICE)", errno);
+			return FALSE;
+		}
+	}
+
 	if (!mtu)
 		return TRUE;
 
@@ -851,6 +863,9 @@ static gboolean parse_set_opts(struct set_opts *opts, GError **err,
 		case BT_IO_OPT_LE_PARAMS:
 			opts->le_params = va_arg(args, struct bt_le_params);
 			break;
+		case BT_IO_OPT_VOICE:
+			opts->voice = va_arg(args, int);
+			break;
 		default:
 			g_set_error(err, BT_IO_ERROR, BT_IO_ERROR_INVALID_ARGS,
 					"Unknown option %d", opt);
@@ -1339,7 +1354,7 @@ gboolean bt_io_set(GIOChannel *io, BtIOType type, GError **err,
 		return rfcomm_set(sock, opts.sec_level, opts.master, opts.force_active,
 				err);
 	case BT_IO_SCO:
-		return sco_set(sock, opts.mtu, err);
+		return sco_set(sock, opts.mtu, opts.voice, err);
 	}
 
 	g_set_error(err, BT_IO_ERROR, BT_IO_ERROR_INVALID_ARGS,
@@ -1417,7 +1432,7 @@ static GIOChannel *create_io(BtIOType type, gboolean server,
 		}
 		if (sco_bind(sock, &opts->src, err) < 0)
 			goto failed;
-		if (!sco_set(sock, opts->mtu, err))
+		if (!sco_set(sock, opts->mtu, opts->voice, err))
 			goto failed;
 		break;
 	default:
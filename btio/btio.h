@@ -68,6 +68,7 @@ typedef enum {
 	BT_IO_OPT_POWER_ACTIVE,
 	BT_IO_OPT_FLUSH_TIMEOUT,
 	BT_IO_OPT_LE_PARAMS,
+	BT_IO_OPT_VOICE,
 } BtIOOption;
 
 typedef enum {
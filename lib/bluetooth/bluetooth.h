@@ -87,6 +87,14 @@ struct bt_power {
 #define BT_AMP_POLICY_PREFER_BR_EDR		1
 #define BT_AMP_POLICY_PREFER_AMP		2
 
+#define BT_VOICE	11
+struct bt_voice {
+	uint16_t setting;
+};
+
+#define BT_VOICE_TRANSPARENT	0x0003
+#define BT_VOICE_CVSD_16BIT	0x0060
+
 #define BT_LE_PARAMS	100
 struct bt_le_params {
 	uint8_t  prohibit_remote_chg;
@@ -0,0 +1,282 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) library
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+
+enum {
+	SLOT_FREE,
+	SLOT_FILLED,
+	SLOT_BUSY,
+	SLOT_DONE
+};
+
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct pipeline_slot *slots;
+	int nslots;
+
+	/* sequence numbers of the next slot to submit, process and write */
+	unsigned long next_submit;
+	unsigned long next_process;
+	unsigned long next_write;
+
+	int finished;
+	int error;
+
+	pthread_t *workers;
+	int nworkers;
+	pthread_t writer;
+	int writer_started;
+
+	const struct pipeline_ops *ops;
+	void *user_data;
+};
+
+static void *worker_thread(void *data)
+{
+	struct pipeline *p = data;
+	struct pipeline_slot *slot;
+	void *worker_data = NULL;
+
+	if (p->ops->worker_init)
+		worker_data = p->ops->worker_init(p->user_data);
+
+	pthread_mutex_lock(&p->lock);
+
+	while (!p->error) {
+		if (p->next_process == p->next_submit) {
+			if (p->finished)
+				break;
+			pthread_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+
+		slot = &p->slots[p->next_process % p->nslots];
+		p->next_process++;
+		slot->state = SLOT_BUSY;
+
+		pthread_mutex_unlock(&p->lock);
+
+		if (p->ops->process(worker_data, slot) < 0) {
+			pthread_mutex_lock(&p->lock);
+			p->error = 1;
+		} else {
+			pthread_mutex_lock(&p->lock);
+			slot->state = SLOT_DONE;
+		}
+
+		pthread_cond_broadcast(&p->cond);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+
+	if (p->ops->worker_free)
+		p->ops->worker_free(worker_data);
+
+	return NULL;
+}
+
+static void *writer_thread(void *data)
+{
+	struct pipeline *p = data;
+	struct pipeline_slot *slot;
+
+	pthread_mutex_lock(&p->lock);
+
+	while (!p->error) {
+		if (p->next_write == p->next_submit && p->finished)
+			break;
+
+		slot = &p->slots[p->next_write % p->nslots];
+		if (p->next_write == p->next_submit ||
+						slot->state != SLOT_DONE) {
+			pthread_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&p->lock);
+
+		if (p->ops->write(p->user_data, slot) < 0) {
+			pthread_mutex_lock(&p->lock);
+			p->error = 1;
+		} else {
+			pthread_mutex_lock(&p->lock);
+			slot->state = SLOT_FREE;
+			p->next_write++;
+		}
+
+		pthread_cond_broadcast(&p->cond);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+struct pipeline *pipeline_new(int threads, int slots, size_t input_size,
+				size_t output_size,
+				const struct pipeline_ops *ops, void *user_data)
+{
+	struct pipeline *p;
+	int i;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	p->ops = ops;
+	p->user_data = user_data;
+
+	p->slots = calloc(slots, sizeof(*p->slots));
+	p->workers = calloc(threads, sizeof(*p->workers));
+	if (!p->slots || !p->workers)
+		goto failed;
+
+	p->nslots = slots;
+
+	for (i = 0; i < slots; i++) {
+		struct pipeline_slot *slot = &p->slots[i];
+
+		if (input_size > 0) {
+			slot->input = malloc(input_size);
+			if (!slot->input)
+				goto failed;
+			slot->input_size = input_size;
+		}
+
+		if (output_size > 0) {
+			slot->output = malloc(output_size);
+			if (!slot->output)
+				goto failed;
+			slot->output_size = output_size;
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&p->workers[i], NULL, worker_thread, p))
+			goto failed;
+		p->nworkers++;
+	}
+
+	if (pthread_create(&p->writer, NULL, writer_thread, p))
+		goto failed;
+	p->writer_started = 1;
+
+	return p;
+
+failed:
+	pipeline_finish(p);
+	pipeline_free(p);
+	return NULL;
+}
+
+struct pipeline_slot *pipeline_get_slot(struct pipeline *p)
+{
+	struct pipeline_slot *slot = NULL;
+
+	pthread_mutex_lock(&p->lock);
+
+	while (!p->error) {
+		slot = &p->slots[p->next_submit % p->nslots];
+		if (slot->state == SLOT_FREE)
+			break;
+		slot = NULL;
+		pthread_cond_wait(&p->cond, &p->lock);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+
+	if (slot) {
+		slot->input_len = 0;
+		slot->prime_len = 0;
+		slot->output_len = 0;
+	}
+
+	return slot;
+}
+
+void pipeline_submit(struct pipeline *p, struct pipeline_slot *slot)
+{
+	pthread_mutex_lock(&p->lock);
+
+	slot->seq = p->next_submit++;
+	slot->state = SLOT_FILLED;
+
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+int pipeline_finish(struct pipeline *p)
+{
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->finished = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->nworkers; i++)
+		pthread_join(p->workers[i], NULL);
+	p->nworkers = 0;
+
+	if (p->writer_started)
+		pthread_join(p->writer, NULL);
+	p->writer_started = 0;
+
+	return p->error ? -1 : 0;
+}
+
+void pipeline_free(struct pipeline *p)
+{
+	int i;
+
+	if (p->slots) {
+		for (i = 0; i < p->nslots; i++) {
+			if (p->slots[i].input_size > 0)
+				free(p->slots[i].input);
+			if (p->slots[i].output_size > 0)
+				free(p->slots[i].output);
+		}
+	}
+
+	free(p->slots);
+	free(p->workers);
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+
+	free(p);
+}
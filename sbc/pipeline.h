@@ -0,0 +1,77 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) library
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <sys/types.h>
+
+/*
+ * Bounded reader/worker/writer pipeline used by the command line tools.
+ *
+ * The caller acts as the reader: it fills free slots in stream order and
+ * submits them. Submitted slots are processed by a pool of worker threads
+ * in any order and handed to a single writer thread strictly in the order
+ * in which they were submitted.
+ */
+
+struct pipeline_slot {
+	/* input data, the first prime_len bytes only prime the codec state */
+	unsigned char *input;
+	size_t input_len;
+	size_t input_size;
+	size_t prime_len;
+
+	/* output data as produced by the worker */
+	unsigned char *output;
+	size_t output_len;
+	size_t output_size;
+
+	unsigned long seq;
+	int state;
+};
+
+struct pipeline_ops {
+	/* returns per-worker data, called from the worker thread */
+	void *(*worker_init)(void *user_data);
+	void (*worker_free)(void *worker_data);
+
+	/* both return a negative value on error, which stops the pipeline */
+	int (*process)(void *worker_data, struct pipeline_slot *slot);
+	int (*write)(void *user_data, struct pipeline_slot *slot);
+};
+
+struct pipeline;
+
+/*
+ * Slot buffers are allocated only when the corresponding size is non-zero,
+ * otherwise the caller is expected to point them to its own memory.
+ */
+struct pipeline *pipeline_new(int threads, int slots, size_t input_size,
+				size_t output_size,
+				const struct pipeline_ops *ops, void *user_data);
+
+/* Returns the next slot to fill, or NULL if the pipeline failed */
+struct pipeline_slot *pipeline_get_slot(struct pipeline *p);
+void pipeline_submit(struct pipeline *p, struct pipeline_slot *slot);
+
+/* Waits until all submitted slots are written, returns negative on error */
+int pipeline_finish(struct pipeline *p);
+void pipeline_free(struct pipeline *p);
@@ -51,6 +51,10 @@
 
 #define SBC_SYNCWORD	0x9C
 
+#define MSBC_SYNCWORD	0xAD
+#define MSBC_BLOCKS	15
+#define MSBC_BITPOOL	26
+
 /* This structure contains an unpacked SBC frame.
    Yes, there is probably quite some unused space herein */
 struct sbc_frame {
@@ -74,6 +78,9 @@ struct sbc_frame {
 	uint16_t codesize;
 	uint8_t length;
 
+	/* mSBC frame, the header carries no parameters */
+	uint8_t msbc;
+
 	/* bit number x set means joint stereo has been used in subband x */
 	uint8_t joint;
 
@@ -90,10 +97,20 @@ struct sbc_frame {
 	int16_t SBC_ALIGNED pcm_sample[2][16*8];
 };
 
-struct sbc_decoder_state {
-	int subbands;
-	int32_t V[2][170];
-	int offset[2][16];
+#define SBC_BITS_CACHE_ORDER	5
+#define SBC_BITS_CACHE_SIZE	(1 << SBC_BITS_CACHE_ORDER)
+
+/* bit allocation cache, see sbc_calculate_bits_cached() */
+struct sbc_bits_cache_entry {
+	uint64_t scale_factors;
+	uint32_t params;
+	int bits[2][8];
+};
+
+struct sbc_bits_cache {
+	struct sbc_bits_cache_entry entries[SBC_BITS_CACHE_SIZE];
+	unsigned long hits;
+	unsigned long misses;
 };
 
 /*
@@ -362,6 +379,50 @@ static void sbc_calculate_bits(const struct sbc_frame *frame, int (*bits)[8])
 		sbc_calculate_bits_internal(frame, bits, 8);
 }
 
+/*
+ * The bit allocation only depends on the frame parameters and the scale
+ * factors, and consecutive frames of steady content very often share the
+ * same scale factors. Results are kept in a small direct mapped cache
+ * keyed on all of these, with the 4-bit scale factors packed into one
+ * 64-bit word.
+ */
+static void sbc_calculate_bits_cached(struct sbc_bits_cache *cache,
+				const struct sbc_frame *frame, int (*bits)[8])
+{
+	struct sbc_bits_cache_entry *entry;
+	uint64_t scale_factors = 0;
+	uint32_t params, hash;
+	int ch, sb;
+
+	for (ch = 0; ch < frame->channels; ch++)
+		for (sb = 0; sb < frame->subbands; sb++)
+			scale_factors = (scale_factors << 4) |
+				(frame->scale_factor[ch][sb] & 0x0F);
+
+	/* bit 31 marks the entry as valid */
+	params = 0x80000000 | (frame->frequency << 16) | (frame->mode << 12) |
+		(frame->allocation << 10) | (frame->subband_mode << 8) |
+		frame->bitpool;
+
+	hash = (uint32_t) scale_factors ^ (uint32_t) (scale_factors >> 32) ^
+								params;
+	hash = (hash * 0x9E3779B1) >> (32 - SBC_BITS_CACHE_ORDER);
+	entry = &cache->entries[hash];
+
+	if (entry->params == params && entry->scale_factors == scale_factors) {
+		memcpy(bits, entry->bits, sizeof(entry->bits));
+		cache->hits++;
+		return;
+	}
+
+	sbc_calculate_bits(frame, bits);
+
+	memcpy(entry->bits, bits, sizeof(entry->bits));
+	entry->scale_factors = scale_factors;
+	entry->params = params;
+	cache->misses++;
+}
+
 /*
  * Unpacks a SBC frame at the beginning of the stream in data,
  * which has at most len bytes into frame.
@@ -372,29 +433,49 @@ static void sbc_calculate_bits(const struct sbc_frame *frame, int (*bits)[8])
  *  -2   Sync byte incorrect
  *  -3   CRC8 incorrect
  *  -4   Bitpool value out of bounds
+ *
+ * The subband samples are left in the raw (quantized) form, the bits
+ * distribution needed to dequantize them is returned in bits.
  */
 static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
-								size_t len)
+				size_t len, int (*bits)[8],
+				struct sbc_bits_cache *cache)
 {
 	unsigned int consumed;
 	/* Will copy the parts of the header that are relevant to crc
 	 * calculation here */
 	uint8_t crc_header[11] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 	int crc_pos = 0;
-	int32_t temp;
 
-	int audio_sample;
-	int ch, sb, blk, bit;	/* channel, subband, block and bit standard
-				   counters */
-	int bits[2][8];		/* bits distribution */
-	uint32_t levels[2][8];	/* levels derived from that */
+	uint32_t audio_sample;
+	int ch, sb, blk;	/* channel, subband and block standard counters */
+	int n, avail, take;
 
 	if (len < 4)
 		return -1;
 
+	if (data[0] == MSBC_SYNCWORD) {
+		if (data[1] != 0 || data[2] != 0)
+			return -2;
+
+		frame->msbc = 1;
+		frame->frequency = SBC_FREQ_16000;
+		frame->block_mode = SBC_BLK_16;
+		frame->blocks = MSBC_BLOCKS;
+		frame->mode = MONO;
+		frame->channels = 1;
+		frame->allocation = LOUDNESS;
+		frame->subband_mode = SBC_SB_8;
+		frame->subbands = 8;
+		frame->bitpool = MSBC_BITPOOL;
+
+		goto header_done;
+	}
+
 	if (data[0] != SBC_SYNCWORD)
 		return -2;
 
+	frame->msbc = 0;
 	frame->frequency = (data[1] >> 6) & 0x03;
 
 	frame->block_mode = (data[1] >> 4) & 0x03;
@@ -440,6 +521,7 @@ static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
 			frame->bitpool > 32 * frame->subbands)
 		return -4;
 
+header_done:
 	/* data[3] is crc, we're checking it later */
 
 	consumed = 32;
@@ -483,48 +565,32 @@ static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
 	if (data[3] != sbc_crc8(crc_header, crc_pos))
 		return -3;
 
-	sbc_calculate_bits(frame, bits);
-
-	for (ch = 0; ch < frame->channels; ch++) {
-		for (sb = 0; sb < frame->subbands; sb++)
-			levels[ch][sb] = (1 << bits[ch][sb]) - 1;
-	}
+	sbc_calculate_bits_cached(cache, frame, bits);
 
 	for (blk = 0; blk < frame->blocks; blk++) {
 		for (ch = 0; ch < frame->channels; ch++) {
 			for (sb = 0; sb < frame->subbands; sb++) {
-				if (levels[ch][sb] > 0) {
-					audio_sample = 0;
-					for (bit = 0; bit < bits[ch][sb]; bit++) {
-						if (consumed > len * 8)
-							return -1;
-
-						if ((data[consumed >> 3] >> (7 - (consumed & 0x7))) & 0x01)
-							audio_sample |= 1 << (bits[ch][sb] - bit - 1);
-
-						consumed++;
-					}
-
-					frame->sb_sample[blk][ch][sb] =
-						(((audio_sample << 1) | 1) << frame->scale_factor[ch][sb]) /
-						levels[ch][sb] - (1 << frame->scale_factor[ch][sb]);
-				} else
-					frame->sb_sample[blk][ch][sb] = 0;
-			}
-		}
-	}
+				n = bits[ch][sb];
+				if (n == 0)
+					continue;
 
-	if (frame->mode == JOINT_STEREO) {
-		for (blk = 0; blk < frame->blocks; blk++) {
-			for (sb = 0; sb < frame->subbands; sb++) {
-				if (frame->joint & (0x01 << sb)) {
-					temp = frame->sb_sample[blk][0][sb] +
-						frame->sb_sample[blk][1][sb];
-					frame->sb_sample[blk][1][sb] =
-						frame->sb_sample[blk][0][sb] -
-						frame->sb_sample[blk][1][sb];
-					frame->sb_sample[blk][0][sb] = temp;
+				if (consumed + n > len * 8)
+					return -1;
+
+				/* read up to a whole byte at once */
+				audio_sample = 0;
+				while (n > 0) {
+					avail = 8 - (consumed & 0x7);
+					take = n < avail ? n : avail;
+					audio_sample = (audio_sample << take) |
+						((data[consumed >> 3] >>
+						(avail - take)) &
+						((1 << take) - 1));
+					consumed += take;
+					n -= take;
 				}
+
+				frame->sb_sample[blk][ch][sb] = audio_sample;
 			}
 		}
 	}
@@ -538,132 +604,54 @@ static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
 static void sbc_decoder_init(struct sbc_decoder_state *state,
 					const struct sbc_frame *frame)
 {
-	int i, ch;
-
 	memset(state->V, 0, sizeof(state->V));
 	state->subbands = frame->subbands;
+	state->position = SBC_V_BUFFER_SIZE - frame->subbands * 2 * 9;
 
-	for (ch = 0; ch < 2; ch++)
-		for (i = 0; i < frame->subbands * 2; i++)
-			state->offset[ch][i] = (10 * i + 10);
-}
-
-static SBC_ALWAYS_INLINE int16_t sbc_clip16(int32_t s)
-{
-	if (s > 0x7FFF)
-		return 0x7FFF;
-	else if (s < -0x8000)
-		return -0x8000;
-	else
-		return s;
+	sbc_init_primitives_dec(state);
 }
 
-static inline void sbc_synthesize_four(struct sbc_decoder_state *state,
-				struct sbc_frame *frame, int ch, int blk)
+static void sbc_dequantize_audio(struct sbc_decoder_state *state,
+				struct sbc_frame *frame, int (*bits)[8])
 {
-	int i, k, idx;
-	int32_t *v = state->V[ch];
-	int *offset = state->offset[ch];
-
-	for (i = 0; i < 8; i++) {
-		/* Shifting */
-		offset[i]--;
-		if (offset[i] < 0) {
-			offset[i] = 79;
-			memcpy(v + 80, v, 9 * sizeof(*v));
-		}
+	int32_t temp;
+	int blk, sb;
 
-		/* Distribute the new matrix value to the shifted position */
-		v[offset[i]] = SCALE4_STAGED1(
-			MULA(synmatrix4[i][0], frame->sb_sample[blk][ch][0],
-			MULA(synmatrix4[i][1], frame->sb_sample[blk][ch][1],
-			MULA(synmatrix4[i][2], frame->sb_sample[blk][ch][2],
-			MUL (synmatrix4[i][3], frame->sb_sample[blk][ch][3])))));
-	}
+	state->sbc_dequantize(frame->sb_sample,
+			(const uint32_t (*)[8]) frame->scale_factor,
+			(const int (*)[8]) bits, frame->blocks,
+			frame->channels, frame->subbands);
 
-	/* Compute the samples */
-	for (idx = 0, i = 0; i < 4; i++, idx += 5) {
-		k = (i + 4) & 0xf;
-
-		/* Store in output, Q0 */
-		frame->pcm_sample[ch][blk * 4 + i] = sbc_clip16(SCALE4_STAGED1(
-			MULA(v[offset[i] + 0], sbc_proto_4_40m0[idx + 0],
-			MULA(v[offset[k] + 1], sbc_proto_4_40m1[idx + 0],
-			MULA(v[offset[i] + 2], sbc_proto_4_40m0[idx + 1],
-			MULA(v[offset[k] + 3], sbc_proto_4_40m1[idx + 1],
-			MULA(v[offset[i] + 4], sbc_proto_4_40m0[idx + 2],
-			MULA(v[offset[k] + 5], sbc_proto_4_40m1[idx + 2],
-			MULA(v[offset[i] + 6], sbc_proto_4_40m0[idx + 3],
-			MULA(v[offset[k] + 7], sbc_proto_4_40m1[idx + 3],
-			MULA(v[offset[i] + 8], sbc_proto_4_40m0[idx + 4],
-			MUL( v[offset[k] + 9], sbc_proto_4_40m1[idx + 4]))))))))))));
-	}
-}
-
-static inline void sbc_synthesize_eight(struct sbc_decoder_state *state,
-				struct sbc_frame *frame, int ch, int blk)
-{
-	int i, j, k, idx;
-	int *offset = state->offset[ch];
-
-	for (i = 0; i < 16; i++) {
-		/* Shifting */
-		offset[i]--;
-		if (offset[i] < 0) {
-			offset[i] = 159;
-			for (j = 0; j < 9; j++)
-				state->V[ch][j + 160] = state->V[ch][j];
+	if (frame->mode == JOINT_STEREO) {
+		for (blk = 0; blk < frame->blocks; blk++) {
+			for (sb = 0; sb < frame->subbands; sb++) {
+				if (frame->joint & (0x01 << sb)) {
+					temp = frame->sb_sample[blk][0][sb] +
+						frame->sb_sample[blk][1][sb];
+					frame->sb_sample[blk][1][sb] =
+						frame->sb_sample[blk][0][sb] -
+						frame->sb_sample[blk][1][sb];
+					frame->sb_sample[blk][0][sb] = temp;
+				}
+			}
 		}
-
-		/* Distribute the new matrix value to the shifted position */
-		state->V[ch][offset[i]] = SCALE8_STAGED1(
-			MULA(synmatrix8[i][0], frame->sb_sample[blk][ch][0],
-			MULA(synmatrix8[i][1], frame->sb_sample[blk][ch][1],
-			MULA(synmatrix8[i][2], frame->sb_sample[blk][ch][2],
-			MULA(synmatrix8[i][3], frame->sb_sample[blk][ch][3],
-			MULA(synmatrix8[i][4], frame->sb_sample[blk][ch][4],
-			MULA(synmatrix8[i][5], frame->sb_sample[blk][ch][5],
-			MULA(synmatrix8[i][6], frame->sb_sample[blk][ch][6],
-			MUL( synmatrix8[i][7], frame->sb_sample[blk][ch][7])))))))));
-	}
-
-	/* Compute the samples */
-	for (idx = 0, i = 0; i < 8; i++, idx += 5) {
-		k = (i + 8) & 0xf;
-
-		/* Store in output, Q0 */
-		frame->pcm_sample[ch][blk * 8 + i] = sbc_clip16(SCALE8_STAGED1(
-			MULA(state->V[ch][offset[i] + 0], sbc_proto_8_80m0[idx + 0],
-			MULA(state->V[ch][offset[k] + 1], sbc_proto_8_80m1[idx + 0],
-			MULA(state->V[ch][offset[i] + 2], sbc_proto_8_80m0[idx + 1],
-			MULA(state->V[ch][offset[k] + 3], sbc_proto_8_80m1[idx + 1],
-			MULA(state->V[ch][offset[i] + 4], sbc_proto_8_80m0[idx + 2],
-			MULA(state->V[ch][offset[k] + 5], sbc_proto_8_80m1[idx + 2],
-			MULA(state->V[ch][offset[i] + 6], sbc_proto_8_80m0[idx + 3],
-			MULA(state->V[ch][offset[k] + 7], sbc_proto_8_80m1[idx + 3],
-			MULA(state->V[ch][offset[i] + 8], sbc_proto_8_80m0[idx + 4],
-			MUL( state->V[ch][offset[k] + 9], sbc_proto_8_80m1[idx + 4]))))))))))));
 	}
 }
 
 static int sbc_synthesize_audio(struct sbc_decoder_state *state,
 						struct sbc_frame *frame)
 {
-	int ch, blk;
-
 	switch (frame->subbands) {
 	case 4:
-		for (ch = 0; ch < frame->channels; ch++) {
-			for (blk = 0; blk < frame->blocks; blk++)
-				sbc_synthesize_four(state, frame, ch, blk);
-		}
+		state->position = state->sbc_synthesize_4s(state->position,
+				state->V, frame->sb_sample, frame->pcm_sample,
+				frame->blocks, frame->channels);
 		return frame->blocks * 4;
 
 	case 8:
-		for (ch = 0; ch < frame->channels; ch++) {
-			for (blk = 0; blk < frame->blocks; blk++)
-				sbc_synthesize_eight(state, frame, ch, blk);
-		}
+		state->position = state->sbc_synthesize_8s(state->position,
+				state->V, frame->sb_sample, frame->pcm_sample,
+				frame->blocks, frame->channels);
 		return frame->blocks * 8;
 
 	default:
@@ -694,6 +682,21 @@ static int sbc_analyze_audio(struct sbc_encoder_state *state,
 		return frame->blocks * 4;
 
 	case 8:
+		if (frame->msbc) {
+			/* 15 blocks, no multiple of the 4 blocks filter */
+			for (ch = 0; ch < frame->channels; ch++) {
+				x = &state->X[ch][state->position +
+						(frame->blocks - 1) * 8];
+				for (blk = 0; blk < frame->blocks; blk++) {
+					state->sbc_analyze_1b_8s(x,
+						frame->sb_sample_f[blk][ch],
+						(x - state->X[ch]) & 8);
+					x -= 8;
+				}
+			}
+			return frame->blocks * 8;
+		}
+
 		for (ch = 0; ch < frame->channels; ch++) {
 			x = &state->X[ch][state->position - 32 +
 							frame->blocks * 8];
@@ -759,7 +762,7 @@ static int sbc_analyze_audio(struct sbc_encoder_state *state,
 static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 					struct sbc_frame *frame, size_t len,
 					int frame_subbands, int frame_channels,
-					int joint)
+					int joint, struct sbc_bits_cache *cache)
 {
 	/* Bitstream writer starts from the fourth byte */
 	uint8_t *data_ptr = data + 4;
@@ -777,6 +780,14 @@ static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 	uint32_t levels[2][8];	/* levels are derived from that */
 	uint32_t sb_sample_delta[2][8];
 
+	if (frame->msbc) {
+		/* the parameters are implied, the two bytes are reserved */
+		data[0] = MSBC_SYNCWORD;
+		data[1] = 0;
+		data[2] = 0;
+		goto header_done;
+	}
+
 	data[0] = SBC_SYNCWORD;
 
 	data[1] = (frame->frequency & 0x03) << 6;
@@ -809,6 +820,7 @@ static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 			frame->bitpool > frame_subbands << 5)
 		return -5;
 
+header_done:
 	/* Can't fill in crc yet */
 
 	crc_header[0] = data[1];
@@ -838,7 +850,7 @@ static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 
 	data[3] = sbc_crc8(crc_header, crc_pos);
 
-	sbc_calculate_bits(frame, bits);
+	sbc_calculate_bits_cached(cache, frame, bits);
 
 	for (ch = 0; ch < frame_channels; ch++) {
 		for (sb = 0; sb < frame_subbands; sb++) {
@@ -874,41 +886,57 @@ static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 }
 
 static ssize_t sbc_pack_frame(uint8_t *data, struct sbc_frame *frame, size_t len,
-								int joint)
+				int joint, struct sbc_bits_cache *cache)
 {
 	if (frame->subbands == 4) {
 		if (frame->channels == 1)
 			return sbc_pack_frame_internal(
-				data, frame, len, 4, 1, joint);
+				data, frame, len, 4, 1, joint, cache);
 		else
 			return sbc_pack_frame_internal(
-				data, frame, len, 4, 2, joint);
+				data, frame, len, 4, 2, joint, cache);
 	} else {
 		if (frame->channels == 1)
 			return sbc_pack_frame_internal(
-				data, frame, len, 8, 1, joint);
+				data, frame, len, 8, 1, joint, cache);
 		else
 			return sbc_pack_frame_internal(
-				data, frame, len, 8, 2, joint);
+				data, frame, len, 8, 2, joint, cache);
 	}
 }
 
 static void sbc_encoder_init(struct sbc_encoder_state *state,
-					const struct sbc_frame *frame)
+					const struct sbc_frame *frame,
+					unsigned long flags)
 {
 	memset(&state->X, 0, sizeof(state->X));
 	state->position = (SBC_X_BUFFER_SIZE - frame->subbands * 9) & ~7;
 
 	sbc_init_primitives(state);
+	if (flags & SBC_FLAG_FAST)
+		sbc_init_primitives_fast(state);
+	if (flags & SBC_FLAG_MSBC)
+		sbc_init_primitives_msbc(state);
 }
 
 struct sbc_priv {
 	int init;
+	int fast;
+	struct sbc_bits_cache bits_cache;
 	struct SBC_ALIGNED sbc_frame frame;
 	struct SBC_ALIGNED sbc_decoder_state dec_state;
 	struct SBC_ALIGNED sbc_encoder_state enc_state;
 };
 
+/* Number of blocks per frame, mSBC is not covered by the blocks field */
+static uint8_t sbc_get_blocks(sbc_t *sbc)
+{
+	if (sbc->flags & SBC_FLAG_MSBC)
+		return MSBC_BLOCKS;
+
+	return 4 + (sbc->blocks * 4);
+}
+
 static void sbc_set_defaults(sbc_t *sbc, unsigned long flags)
 {
 	sbc->frequency = SBC_FREQ_44100;
@@ -916,6 +944,14 @@ static void sbc_set_defaults(sbc_t *sbc, unsigned long flags)
 	sbc->subbands = SBC_SB_8;
 	sbc->blocks = SBC_BLK_16;
 	sbc->bitpool = 32;
+	sbc->flags = flags;
+
+	if (flags & SBC_FLAG_MSBC) {
+		sbc->frequency = SBC_FREQ_16000;
+		sbc->mode = SBC_MODE_MONO;
+		sbc->allocation = SBC_AM_LOUDNESS;
+		sbc->bitpool = MSBC_BITPOOL;
+	}
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 	sbc->endian = SBC_LE;
 #elif __BYTE_ORDER == __BIG_ENDIAN
@@ -946,6 +982,11 @@ int sbc_init(sbc_t *sbc, unsigned long flags)
 	return 0;
 }
 
+int sbc_init_msbc(sbc_t *sbc, unsigned long flags)
+{
+	return sbc_init(sbc, flags | SBC_FLAG_MSBC);
+}
+
 ssize_t sbc_parse(sbc_t *sbc, const void *input, size_t input_len)
 {
 	return sbc_decode(sbc, input, input_len, NULL, 0, NULL);
@@ -957,15 +998,20 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 	struct sbc_priv *priv;
 	char *ptr;
 	int i, ch, framelen, samples;
+	int bits[2][8];
 
 	if (!sbc || !input)
 		return -EIO;
 
 	priv = sbc->priv;
 
-	framelen = sbc_unpack_frame(input, &priv->frame, input_len);
+	framelen = sbc_unpack_frame(input, &priv->frame, input_len, bits,
+							&priv->bits_cache);
 
-	if (!priv->init) {
+	/* Set up again when the stream switches subbands, the synthesis
+	 * state is sized for them */
+	if (framelen > 0 && (!priv->init ||
+			priv->frame.subbands != priv->dec_state.subbands)) {
 		sbc_decoder_init(&priv->dec_state, &priv->frame);
 		priv->init = 1;
 
@@ -975,6 +1021,8 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 		sbc->blocks = priv->frame.block_mode;
 		sbc->allocation = priv->frame.allocation;
 		sbc->bitpool = priv->frame.bitpool;
+		if (priv->frame.msbc)
+			sbc->flags |= SBC_FLAG_MSBC;
 
 		priv->frame.codesize = sbc_get_codesize(sbc);
 		priv->frame.length = framelen;
@@ -992,6 +1040,8 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 	if (framelen <= 0)
 		return framelen;
 
+	sbc_dequantize_audio(&priv->dec_state, &priv->frame, bits);
+
 	samples = sbc_synthesize_audio(&priv->dec_state, &priv->frame);
 
 	ptr = output;
@@ -1020,24 +1070,26 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 	return framelen;
 }
 
-ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
-			void *output, size_t output_len, ssize_t *written)
+/* Select the needed input data processing function */
+static int (*sbc_get_process_input(sbc_t *sbc, struct sbc_priv *priv))(
+		int position, const uint8_t *pcm,
+		int16_t X[2][SBC_X_BUFFER_SIZE], int nsamples, int nchannels)
 {
-	struct sbc_priv *priv;
-	int samples;
-	ssize_t framelen;
-	int (*sbc_enc_process_input)(int position,
-			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
-			int nsamples, int nchannels);
-
-	if (!sbc || !input)
-		return -EIO;
-
-	priv = sbc->priv;
-
-	if (written)
-		*written = 0;
+	if (priv->frame.subbands == 8) {
+		if (sbc->endian == SBC_BE)
+			return priv->enc_state.sbc_enc_process_input_8s_be;
+		else
+			return priv->enc_state.sbc_enc_process_input_8s_le;
+	} else {
+		if (sbc->endian == SBC_BE)
+			return priv->enc_state.sbc_enc_process_input_4s_be;
+		else
+			return priv->enc_state.sbc_enc_process_input_4s_le;
+	}
+}
 
+static void sbc_encoder_setup(sbc_t *sbc, struct sbc_priv *priv)
+{
 	if (!priv->init) {
 		priv->frame.frequency = sbc->frequency;
 		priv->frame.mode = sbc->mode;
@@ -1046,67 +1098,134 @@ ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
 		priv->frame.subband_mode = sbc->subbands;
 		priv->frame.subbands = sbc->subbands ? 8 : 4;
 		priv->frame.block_mode = sbc->blocks;
-		priv->frame.blocks = 4 + (sbc->blocks * 4);
+		priv->frame.blocks = sbc_get_blocks(sbc);
 		priv->frame.bitpool = sbc->bitpool;
+		priv->frame.msbc = sbc->flags & SBC_FLAG_MSBC ? 1 : 0;
 		priv->frame.codesize = sbc_get_codesize(sbc);
 		priv->frame.length = sbc_get_frame_length(sbc);
 
-		sbc_encoder_init(&priv->enc_state, &priv->frame);
+		sbc_encoder_init(&priv->enc_state, &priv->frame, sbc->flags);
+		priv->fast = sbc->flags & SBC_FLAG_FAST ? 1 : 0;
 		priv->init = 1;
 	} else if (priv->frame.bitpool != sbc->bitpool) {
 		priv->frame.length = sbc_get_frame_length(sbc);
 		priv->frame.bitpool = sbc->bitpool;
 	}
+}
 
-	/* input must be large enough to encode a complete frame */
-	if (input_len < priv->frame.codesize)
-		return 0;
-
-	/* output must be large enough to receive the encoded frame */
-	if (!output || output_len < priv->frame.length)
-		return -ENOSPC;
-
-	/* Select the needed input data processing function and call it */
-	if (priv->frame.subbands == 8) {
-		if (sbc->endian == SBC_BE)
-			sbc_enc_process_input =
-				priv->enc_state.sbc_enc_process_input_8s_be;
-		else
-			sbc_enc_process_input =
-				priv->enc_state.sbc_enc_process_input_8s_le;
-	} else {
-		if (sbc->endian == SBC_BE)
-			sbc_enc_process_input =
-				priv->enc_state.sbc_enc_process_input_4s_be;
-		else
-			sbc_enc_process_input =
-				priv->enc_state.sbc_enc_process_input_4s_le;
-	}
-
+static ssize_t sbc_encode_frame(struct sbc_priv *priv, const uint8_t *input,
+				uint8_t *output, size_t output_len,
+				int (*sbc_enc_process_input)(int position,
+					const uint8_t *pcm,
+					int16_t X[2][SBC_X_BUFFER_SIZE],
+					int nsamples, int nchannels))
+{
 	priv->enc_state.position = sbc_enc_process_input(
-		priv->enc_state.position, (const uint8_t *) input,
+		priv->enc_state.position, input,
 		priv->enc_state.X, priv->frame.subbands * priv->frame.blocks,
 		priv->frame.channels);
 
-	samples = sbc_analyze_audio(&priv->enc_state, &priv->frame);
+	sbc_analyze_audio(&priv->enc_state, &priv->frame);
 
-	if (priv->frame.mode == JOINT_STEREO) {
+	/* The fast mode never searches for joint stereo subbands, coding all
+	 * of them as plain left/right still makes a valid joint stereo frame */
+	if (priv->frame.mode == JOINT_STEREO && !priv->fast) {
 		int j = priv->enc_state.sbc_calc_scalefactors_j(
 			priv->frame.sb_sample_f, priv->frame.scale_factor,
 			priv->frame.blocks, priv->frame.subbands);
-		framelen = sbc_pack_frame(output, &priv->frame, output_len, j);
+		return sbc_pack_frame(output, &priv->frame, output_len, j,
+							&priv->bits_cache);
 	} else {
 		priv->enc_state.sbc_calc_scalefactors(
 			priv->frame.sb_sample_f, priv->frame.scale_factor,
 			priv->frame.blocks, priv->frame.channels,
 			priv->frame.subbands);
-		framelen = sbc_pack_frame(output, &priv->frame, output_len, 0);
+		return sbc_pack_frame(output, &priv->frame, output_len, 0,
+							&priv->bits_cache);
 	}
+}
+
+ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, ssize_t *written)
+{
+	struct sbc_priv *priv;
+	ssize_t framelen;
+
+	if (!sbc || !input)
+		return -EIO;
+
+	priv = sbc->priv;
+
+	if (written)
+		*written = 0;
+
+	sbc_encoder_setup(sbc, priv);
+
+	/* input must be large enough to encode a complete frame */
+	if (input_len < priv->frame.codesize)
+		return 0;
+
+	/* output must be large enough to receive the encoded frame */
+	if (!output || output_len < priv->frame.length)
+		return -ENOSPC;
+
+	framelen = sbc_encode_frame(priv, input, output, output_len,
+					sbc_get_process_input(sbc, priv));
 
 	if (written)
 		*written = framelen;
 
-	return samples * priv->frame.channels * 2;
+	return priv->frame.codesize;
+}
+
+ssize_t sbc_encode_batch(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, ssize_t *written)
+{
+	struct sbc_priv *priv;
+	const uint8_t *in = input;
+	uint8_t *out = output;
+	ssize_t framelen;
+	int (*sbc_enc_process_input)(int position,
+			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+			int nsamples, int nchannels);
+
+	if (!sbc || !input)
+		return -EIO;
+
+	priv = sbc->priv;
+
+	if (written)
+		*written = 0;
+
+	sbc_encoder_setup(sbc, priv);
+
+	/* input must be large enough to encode a complete frame */
+	if (input_len < priv->frame.codesize)
+		return 0;
+
+	/* output must be large enough to receive at least one frame */
+	if (!output || output_len < priv->frame.length)
+		return -ENOSPC;
+
+	sbc_enc_process_input = sbc_get_process_input(sbc, priv);
+
+	while (input_len >= priv->frame.codesize &&
+				output_len >= priv->frame.length) {
+		framelen = sbc_encode_frame(priv, in, out, output_len,
+							sbc_enc_process_input);
+		if (framelen < 0)
+			break;
+
+		in += priv->frame.codesize;
+		input_len -= priv->frame.codesize;
+		out += framelen;
+		output_len -= framelen;
+	}
+
+	if (written)
+		*written = out - (uint8_t *) output;
+
+	return in - (const uint8_t *) input;
 }
 
 void sbc_finish(sbc_t *sbc)
@@ -1119,6 +1238,24 @@ void sbc_finish(sbc_t *sbc)
 	memset(sbc, 0, sizeof(sbc_t));
 }
 
+ssize_t sbc_encode_iov(sbc_t *sbc, const void *input, size_t input_len,
+			struct iovec *iov, size_t size)
+{
+	ssize_t consumed, written;
+
+	if (!iov || iov->iov_len > size)
+		return -EINVAL;
+
+	/* Encoded frames land right behind the data already in the buffer */
+	consumed = sbc_encode_batch(sbc, input, input_len,
+				(uint8_t *) iov->iov_base + iov->iov_len,
+				size - iov->iov_len, &written);
+	if (consumed > 0)
+		iov->iov_len += written;
+
+	return consumed;
+}
+
 size_t sbc_get_frame_length(sbc_t *sbc)
 {
 	int ret;
@@ -1130,14 +1267,14 @@ size_t sbc_get_frame_length(sbc_t *sbc)
 		return priv->frame.length;
 
 	subbands = sbc->subbands ? 8 : 4;
-	blocks = 4 + (sbc->blocks * 4);
+	blocks = sbc_get_blocks(sbc);
 	channels = sbc->mode == SBC_MODE_MONO ? 1 : 2;
 	joint = sbc->mode == SBC_MODE_JOINT_STEREO ? 1 : 0;
 	bitpool = sbc->bitpool;
 
 	ret = 4 + (4 * subbands * channels) / 8;
 	/* This term is not always evenly divide so we round it up */
-	if (channels == 1)
+	if (sbc->mode == SBC_MODE_MONO || sbc->mode == SBC_MODE_DUAL_CHANNEL)
 		ret += ((blocks * channels * bitpool) + 7) / 8;
 	else
 		ret += (((joint ? subbands : 0) + blocks * bitpool) + 7) / 8;
@@ -1154,7 +1291,7 @@ unsigned sbc_get_frame_duration(sbc_t *sbc)
 	priv = sbc->priv;
 	if (!priv->init) {
 		subbands = sbc->subbands ? 8 : 4;
-		blocks = 4 + (sbc->blocks * 4);
+		blocks = sbc_get_blocks(sbc);
 	} else {
 		subbands = priv->frame.subbands;
 		blocks = priv->frame.blocks;
@@ -1191,7 +1328,7 @@ size_t sbc_get_codesize(sbc_t *sbc)
 	priv = sbc->priv;
 	if (!priv->init) {
 		subbands = sbc->subbands ? 8 : 4;
-		blocks = 4 + (sbc->blocks * 4);
+		blocks = sbc_get_blocks(sbc);
 		channels = sbc->mode == SBC_MODE_MONO ? 1 : 2;
 	} else {
 		subbands = priv->frame.subbands;
@@ -1216,6 +1353,24 @@ const char *sbc_get_implementation_info(sbc_t *sbc)
 	return priv->enc_state.implementation_info;
 }
 
+int sbc_get_bits_cache_stats(sbc_t *sbc, unsigned long *hits,
+							unsigned long *misses)
+{
+	struct sbc_priv *priv;
+
+	if (!sbc || !sbc->priv)
+		return -EIO;
+
+	priv = sbc->priv;
+
+	if (hits)
+		*hits = priv->bits_cache.hits;
+	if (misses)
+		*misses = priv->bits_cache.misses;
+
+	return 0;
+}
+
 int sbc_reinit(sbc_t *sbc, unsigned long flags)
 {
 	struct sbc_priv *priv;
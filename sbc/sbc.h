@@ -33,6 +33,7 @@ extern "C" {
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* sampling frequency */
 #define SBC_FREQ_16000		0x00
@@ -64,6 +65,10 @@ extern "C" {
 #define SBC_LE			0x00
 #define SBC_BE			0x01
 
+/* Flags for sbc_init() and sbc_reinit() */
+#define SBC_FLAG_FAST		0x01	/* Reduced precision encoder */
+#define SBC_FLAG_MSBC		0x02	/* Wideband speech frames, HFP 1.6 */
+
 struct sbc_struct {
 	unsigned long flags;
 
@@ -84,6 +89,10 @@ typedef struct sbc_struct sbc_t;
 int sbc_init(sbc_t *sbc, unsigned long flags);
 int sbc_reinit(sbc_t *sbc, unsigned long flags);
 
+/* Same as sbc_init(), for the fixed mSBC configuration: 16 kHz mono,
+ * 15 blocks, 8 subbands, loudness allocation and bitpool 26 */
+int sbc_init_msbc(sbc_t *sbc, unsigned long flags);
+
 ssize_t sbc_parse(sbc_t *sbc, const void *input, size_t input_len);
 
 /* Decodes ONE input block into ONE output block */
@@ -94,6 +103,14 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
 			void *output, size_t output_len, ssize_t *written);
 
+/* Encodes as many input blocks as fit into consecutive output blocks */
+ssize_t sbc_encode_batch(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, ssize_t *written);
+
+/* Same as above, but appends the output to the iovec buffer of size bytes */
+ssize_t sbc_encode_iov(sbc_t *sbc, const void *input, size_t input_len,
+			struct iovec *iov, size_t size);
+
 /* Returns the output block size in bytes */
 size_t sbc_get_frame_length(sbc_t *sbc);
 
@@ -103,6 +120,10 @@ unsigned sbc_get_frame_duration(sbc_t *sbc);
 /* Returns the input block size in bytes */
 size_t sbc_get_codesize(sbc_t *sbc);
 
+/* Returns the bit allocation cache hit and miss counters */
+int sbc_get_bits_cache_stats(sbc_t *sbc, unsigned long *hits,
+							unsigned long *misses);
+
 const char *sbc_get_implementation_info(sbc_t *sbc);
 void sbc_finish(sbc_t *sbc);
 
@@ -33,6 +33,8 @@
 
 #include "sbc_primitives.h"
 #include "sbc_primitives_mmx.h"
+#include "sbc_primitives_sse2.h"
+#include "sbc_primitives_avx2.h"
 #include "sbc_primitives_iwmmxt.h"
 #include "sbc_primitives_neon.h"
 #include "sbc_primitives_armv6.h"
@@ -114,8 +116,8 @@ static inline void sbc_analyze_four_simd(const int16_t *in, int32_t *out,
 		(SBC_COS_TABLE_FIXED4_SCALE - SCALE_OUT_BITS);
 }
 
-static inline void sbc_analyze_eight_simd(const int16_t *in, int32_t *out,
-							const FIXED_T *consts)
+static SBC_ALWAYS_INLINE void sbc_analyze_eight_internal(const int16_t *in,
+				int32_t *out, const FIXED_T *consts, int taps)
 {
 	FIXED_A t1[8];
 	FIXED_T t2[8];
@@ -126,7 +128,7 @@ static inline void sbc_analyze_eight_simd(const int16_t *in, int32_t *out,
 		(FIXED_A) 1 << (SBC_PROTO_FIXED8_SCALE-1);
 
 	/* low pass polyphase filter */
-	for (hop = 0; hop < 80; hop += 16) {
+	for (hop = 0; hop < taps; hop += 16) {
 		t1[0] += (FIXED_A) in[hop] * consts[hop];
 		t1[0] += (FIXED_A) in[hop + 1] * consts[hop + 1];
 		t1[1] += (FIXED_A) in[hop + 2] * consts[hop + 2];
@@ -183,6 +185,27 @@ static inline void sbc_analyze_eight_simd(const int16_t *in, int32_t *out,
 			(SBC_COS_TABLE_FIXED8_SCALE - SCALE_OUT_BITS);
 }
 
+static inline void sbc_analyze_eight_simd(const int16_t *in, int32_t *out,
+							const FIXED_T *consts)
+{
+	sbc_analyze_eight_internal(in, out, consts, 80);
+}
+
+/*
+ * Reduced precision variant of the analysis filter for SBC_FLAG_FAST.
+ *
+ * The last of the five polyphase segments only carries a tail of the
+ * prototype window which stays more than 25 dB below its peak. Skipping it
+ * saves a fifth of the windowing multiplications at the cost of somewhat
+ * more aliasing between neighbouring subbands. The 4 subbands filter is
+ * short already and loses much more from such truncation, so it is kept.
+ */
+static inline void sbc_analyze_eight_fast(const int16_t *in, int32_t *out,
+							const FIXED_T *consts)
+{
+	sbc_analyze_eight_internal(in, out, consts, 64);
+}
+
 static inline void sbc_analyze_4b_4s_simd(int16_t *x,
 						int32_t *out, int out_stride)
 {
@@ -209,6 +232,31 @@ static inline void sbc_analyze_4b_8s_simd(int16_t *x,
 	sbc_analyze_eight_simd(x + 0, out, analysis_consts_fixed8_simd_even);
 }
 
+static inline void sbc_analyze_4b_8s_fast(int16_t *x,
+					  int32_t *out, int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_eight_fast(x + 24, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_fast(x + 16, out, analysis_consts_fixed8_simd_even);
+	out += out_stride;
+	sbc_analyze_eight_fast(x + 8, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_fast(x + 0, out, analysis_consts_fixed8_simd_even);
+}
+
+static inline void sbc_analyze_1b_8s_simd(int16_t *x, int32_t *out, int odd)
+{
+	sbc_analyze_eight_simd(x, out, odd ? analysis_consts_fixed8_simd_odd :
+					analysis_consts_fixed8_simd_even);
+}
+
+static inline void sbc_analyze_1b_8s_fast(int16_t *x, int32_t *out, int odd)
+{
+	sbc_analyze_eight_fast(x, out, odd ? analysis_consts_fixed8_simd_odd :
+					analysis_consts_fixed8_simd_even);
+}
+
 static inline int16_t unaligned16_be(const uint8_t *ptr)
 {
 	return (int16_t) ((ptr[0] << 8) | ptr[1]);
@@ -282,20 +330,60 @@ static SBC_ALWAYS_INLINE int sbc_encoder_process_input_s8_internal(
 	const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
 	int nsamples, int nchannels, int big_endian)
 {
+	/*
+	 * Samples are reordered in groups of 16, the older half of a group
+	 * going to x[1] and x[9..15] and the newer half to x[0] and x[2..8].
+	 * mSBC frames carry 120 samples, so every other frame starts and ends
+	 * halfway through a group. The wraparound copy keeps the group
+	 * alignment in that case.
+	 */
+	int skew = position & 8;
+
 	/* handle X buffer wraparound */
-	if (position < nsamples) {
+	if (position < nsamples + (nsamples & 8)) {
+		int start = SBC_X_BUFFER_SIZE - 72 - 2 * skew;
+
 		if (nchannels > 0)
-			memcpy(&X[0][SBC_X_BUFFER_SIZE - 72], &X[0][position],
-							72 * sizeof(int16_t));
+			memcpy(&X[0][start], &X[0][position - skew],
+						(72 + skew) * sizeof(int16_t));
 		if (nchannels > 1)
-			memcpy(&X[1][SBC_X_BUFFER_SIZE - 72], &X[1][position],
-							72 * sizeof(int16_t));
-		position = SBC_X_BUFFER_SIZE - 72;
+			memcpy(&X[1][start], &X[1][position - skew],
+						(72 + skew) * sizeof(int16_t));
+		position = start + skew;
 	}
 
 	#define PCM(i) (big_endian ? \
 		unaligned16_be(pcm + (i) * 2) : unaligned16_le(pcm + (i) * 2))
 
+	/* complete the group the previous frame ended in */
+	if (skew && nsamples >= 8) {
+		position -= 8;
+		nsamples -= 8;
+		if (nchannels > 0) {
+			int16_t *x = &X[0][position];
+			x[0]  = PCM(0 + 7 * nchannels);
+			x[2]  = PCM(0 + 6 * nchannels);
+			x[3]  = PCM(0 + 0 * nchannels);
+			x[4]  = PCM(0 + 5 * nchannels);
+			x[5]  = PCM(0 + 1 * nchannels);
+			x[6]  = PCM(0 + 4 * nchannels);
+			x[7]  = PCM(0 + 2 * nchannels);
+			x[8]  = PCM(0 + 3 * nchannels);
+		}
+		if (nchannels > 1) {
+			int16_t *x = &X[1][position];
+			x[0]  = PCM(1 + 7 * nchannels);
+			x[2]  = PCM(1 + 6 * nchannels);
+			x[3]  = PCM(1 + 0 * nchannels);
+			x[4]  = PCM(1 + 5 * nchannels);
+			x[5]  = PCM(1 + 1 * nchannels);
+			x[6]  = PCM(1 + 4 * nchannels);
+			x[7]  = PCM(1 + 2 * nchannels);
+			x[8]  = PCM(1 + 3 * nchannels);
+		}
+		pcm += 16 * nchannels;
+	}
+
 	/* copy/permutate audio samples */
 	while ((nsamples -= 16) >= 0) {
 		position -= 16;
@@ -339,6 +427,33 @@ static SBC_ALWAYS_INLINE int sbc_encoder_process_input_s8_internal(
 		}
 		pcm += 32 * nchannels;
 	}
+
+	/* start a new group with the remaining older half */
+	if (nsamples + 16 == 8) {
+		position -= 8;
+		if (nchannels > 0) {
+			int16_t *x = &X[0][position];
+			x[-7] = PCM(0 + 7 * nchannels);
+			x[1]  = PCM(0 + 3 * nchannels);
+			x[2]  = PCM(0 + 6 * nchannels);
+			x[3]  = PCM(0 + 0 * nchannels);
+			x[4]  = PCM(0 + 5 * nchannels);
+			x[5]  = PCM(0 + 1 * nchannels);
+			x[6]  = PCM(0 + 4 * nchannels);
+			x[7]  = PCM(0 + 2 * nchannels);
+		}
+		if (nchannels > 1) {
+			int16_t *x = &X[1][position];
+			x[-7] = PCM(1 + 7 * nchannels);
+			x[1]  = PCM(1 + 3 * nchannels);
+			x[2]  = PCM(1 + 6 * nchannels);
+			x[3]  = PCM(1 + 0 * nchannels);
+			x[4]  = PCM(1 + 5 * nchannels);
+			x[5]  = PCM(1 + 1 * nchannels);
+			x[6]  = PCM(1 + 4 * nchannels);
+			x[7]  = PCM(1 + 2 * nchannels);
+		}
+	}
 	#undef PCM
 
 	return position;
@@ -516,14 +631,148 @@ static int sbc_calc_scalefactors_j(
 	return joint;
 }
 
+/*
+ * Dequantization of the subband samples. The formula from the spec is
+ * evaluated using unsigned arithmetics, as the intermediate value may
+ * need all the 32 bits.
+ */
+
+static void sbc_dequantize(int32_t sb_sample[16][2][8],
+		const uint32_t scale_factor[2][8], const int bits[2][8],
+		int blocks, int channels, int subbands)
+{
+	int ch, sb, blk;
+
+	for (ch = 0; ch < channels; ch++) {
+		for (sb = 0; sb < subbands; sb++) {
+			uint32_t levels = (1 << bits[ch][sb]) - 1;
+			uint32_t sf = scale_factor[ch][sb];
+
+			if (levels == 0) {
+				for (blk = 0; blk < blocks; blk++)
+					sb_sample[blk][ch][sb] = 0;
+				continue;
+			}
+
+			for (blk = 0; blk < blocks; blk++) {
+				uint32_t audio_sample = sb_sample[blk][ch][sb];
+				sb_sample[blk][ch][sb] =
+					(((audio_sample << 1) | 1) << sf) /
+					levels - (1 << sf);
+			}
+		}
+	}
+}
+
+static SBC_ALWAYS_INLINE int16_t sbc_clip16(int32_t s)
+{
+	if (s > 0x7FFF)
+		return 0x7FFF;
+	else if (s < -0x8000)
+		return -0x8000;
+	else
+		return s;
+}
+
+/*
+ * A reference C code of synthesis filter with SIMD-friendly tables
+ * reordering and data layout. The V vectors calculated for each block are
+ * stored one after another in the "V" array (newer vectors go to lower
+ * addresses), so the windowing only needs contiguous reads. Old data is
+ * copied to the top of the buffer on wraparound, similar to the "X"
+ * array used by the encoder.
+ */
+
+static SBC_ALWAYS_INLINE int sbc_synthesize_internal(int position,
+		int32_t V[2][SBC_V_BUFFER_SIZE], int32_t sb_sample[16][2][8],
+		int16_t pcm_sample[2][16 * 8], int blocks, int channels,
+		int subbands)
+{
+	int ch, blk, i, m, sb;
+	int n = subbands * 2;
+
+	for (blk = 0; blk < blocks; blk++) {
+		/* handle V buffer wraparound */
+		if (position < n) {
+			for (ch = 0; ch < channels; ch++)
+				memcpy(&V[ch][SBC_V_BUFFER_SIZE - 9 * n],
+					&V[ch][position],
+					9 * n * sizeof(int32_t));
+			position = SBC_V_BUFFER_SIZE - 9 * n;
+		}
+		position -= n;
+
+		for (ch = 0; ch < channels; ch++) {
+			int32_t *v = &V[ch][position];
+			int16_t *pcm = &pcm_sample[ch][blk * subbands];
+			const int32_t *s = sb_sample[blk][ch];
+
+			/* matrixing */
+			for (i = 0; i < n; i++) {
+				int32_t t = 0;
+				for (sb = 0; sb < subbands; sb++) {
+					if (subbands == 4)
+						t = MULA(synmatrix4_simd[sb][i],
+								s[sb], t);
+					else
+						t = MULA(synmatrix8_simd[sb][i],
+								s[sb], t);
+				}
+				if (subbands == 4)
+					v[i] = SCALE4_STAGED1(t);
+				else
+					v[i] = SCALE8_STAGED1(t);
+			}
+
+			/* windowing */
+			for (i = 0; i < subbands; i++) {
+				int32_t t = 0;
+				for (m = 0; m < 10; m++) {
+					const int32_t *vm = v + m * n +
+						(m & 1) * subbands;
+					if (subbands == 4)
+						t = MULA(vm[i],
+						synthesis_window4_simd[m][i], t);
+					else
+						t = MULA(vm[i],
+						synthesis_window8_simd[m][i], t);
+				}
+				if (subbands == 4)
+					pcm[i] = sbc_clip16(SCALE4_STAGED1(t));
+				else
+					pcm[i] = sbc_clip16(SCALE8_STAGED1(t));
+			}
+		}
+	}
+
+	return position;
+}
+
+static int sbc_synthesize_4s(int position, int32_t V[2][SBC_V_BUFFER_SIZE],
+		int32_t sb_sample[16][2][8], int16_t pcm_sample[2][16 * 8],
+		int blocks, int channels)
+{
+	return sbc_synthesize_internal(position, V, sb_sample, pcm_sample,
+						blocks, channels, 4);
+}
+
+static int sbc_synthesize_8s(int position, int32_t V[2][SBC_V_BUFFER_SIZE],
+		int32_t sb_sample[16][2][8], int16_t pcm_sample[2][16 * 8],
+		int blocks, int channels)
+{
+	return sbc_synthesize_internal(position, V, sb_sample, pcm_sample,
+						blocks, channels, 8);
+}
+
 /*
  * Detect CPU features and setup function pointers
  */
-void sbc_init_primitives(struct sbc_encoder_state *state)
+void sbc_init_primitives_generic(struct sbc_encoder_state *state)
 {
 	/* Default implementation for analyze functions */
 	state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_simd;
 	state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_simd;
+	state->sbc_analyze_1b_8s = sbc_analyze_1b_8s_simd;
 
 	/* Default implementation for input reordering / deinterleaving */
 	state->sbc_enc_process_input_4s_le = sbc_enc_process_input_4s_le;
@@ -535,11 +784,22 @@ void sbc_init_primitives(struct sbc_encoder_state *state)
 	state->sbc_calc_scalefactors = sbc_calc_scalefactors;
 	state->sbc_calc_scalefactors_j = sbc_calc_scalefactors_j;
 	state->implementation_info = "Generic C";
+}
+
+void sbc_init_primitives(struct sbc_encoder_state *state)
+{
+	sbc_init_primitives_generic(state);
 
 	/* X86/AMD64 optimizations */
 #ifdef SBC_BUILD_WITH_MMX_SUPPORT
 	sbc_init_primitives_mmx(state);
 #endif
+#ifdef SBC_BUILD_WITH_SSE2_SUPPORT
+	sbc_init_primitives_sse2(state);
+#endif
+#ifdef SBC_BUILD_WITH_AVX2_SUPPORT
+	sbc_init_primitives_avx2(state);
+#endif
 
 	/* ARM optimizations */
 #ifdef SBC_BUILD_WITH_ARMV6_SUPPORT
@@ -552,3 +812,56 @@ void sbc_init_primitives(struct sbc_encoder_state *state)
 	sbc_init_primitives_neon(state);
 #endif
 }
+
+void sbc_init_primitives_fast(struct sbc_encoder_state *state)
+{
+	/* Reduced precision analysis, the rest is kept as selected above */
+	state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_fast;
+	state->sbc_analyze_1b_8s = sbc_analyze_1b_8s_fast;
+
+	/* X86/AMD64 optimizations */
+#ifdef SBC_BUILD_WITH_SSE2_SUPPORT
+	sbc_init_primitives_fast_sse2(state);
+#endif
+#ifdef SBC_BUILD_WITH_AVX2_SUPPORT
+	sbc_init_primitives_fast_avx2(state);
+#endif
+
+	/* ARM optimizations */
+#ifdef SBC_BUILD_WITH_NEON_SUPPORT
+	sbc_init_primitives_fast_neon(state);
+#endif
+}
+
+void sbc_init_primitives_msbc(struct sbc_encoder_state *state)
+{
+	/* The SIMD versions only take whole groups of 16 samples */
+	state->sbc_enc_process_input_8s_le = sbc_enc_process_input_8s_le;
+	state->sbc_enc_process_input_8s_be = sbc_enc_process_input_8s_be;
+}
+
+void sbc_init_primitives_dec_generic(struct sbc_decoder_state *state)
+{
+	/* Default implementation for dequantization */
+	state->sbc_dequantize = sbc_dequantize;
+
+	/* Default implementation for synthesis functions */
+	state->sbc_synthesize_4s = sbc_synthesize_4s;
+	state->sbc_synthesize_8s = sbc_synthesize_8s;
+	state->implementation_info = "Generic C";
+}
+
+void sbc_init_primitives_dec(struct sbc_decoder_state *state)
+{
+	sbc_init_primitives_dec_generic(state);
+
+	/* X86/AMD64 optimizations */
+#ifdef SBC_BUILD_WITH_SSE2_SUPPORT
+	sbc_init_primitives_dec_sse2(state);
+#endif
+
+	/* ARM optimizations */
+#ifdef SBC_BUILD_WITH_NEON_SUPPORT
+	sbc_init_primitives_dec_neon(state);
+#endif
+}
@@ -29,6 +29,7 @@
 
 #define SCALE_OUT_BITS 15
 #define SBC_X_BUFFER_SIZE 328
+#define SBC_V_BUFFER_SIZE 320
 
 #ifdef __GNUC__
 #define SBC_ALWAYS_INLINE __attribute__((always_inline))
@@ -45,6 +46,10 @@ struct sbc_encoder_state {
 	/* Polyphase analysis filter for 8 subbands configuration,
 	 * it handles 4 blocks at once */
 	void (*sbc_analyze_4b_8s)(int16_t *x, int32_t *out, int out_stride);
+	/* Polyphase analysis filter for 8 subbands configuration, it handles
+	 * a single block for the 15 blocks frames of mSBC. Blocks at odd
+	 * multiples of 8 samples in X use the odd coefficients */
+	void (*sbc_analyze_1b_8s)(int16_t *x, int32_t *out, int odd);
 	/* Process input data (deinterleave, endian conversion, reordering),
 	 * depending on the number of subbands and input data byte order */
 	int (*sbc_enc_process_input_4s_le)(int position,
@@ -70,11 +75,54 @@ struct sbc_encoder_state {
 	const char *implementation_info;
 };
 
+struct sbc_decoder_state {
+	int subbands;
+	int position;
+	int32_t SBC_ALIGNED V[2][SBC_V_BUFFER_SIZE];
+	/* Dequantization of the unpacked subband samples, the raw values
+	 * read from the bitstream are replaced in place */
+	void (*sbc_dequantize)(int32_t sb_sample[16][2][8],
+			const uint32_t scale_factor[2][8], const int bits[2][8],
+			int blocks, int channels, int subbands);
+	/* Polyphase synthesis filter for 4 subbands configuration,
+	 * it handles all the blocks of the frame */
+	int (*sbc_synthesize_4s)(int position,
+			int32_t V[2][SBC_V_BUFFER_SIZE],
+			int32_t sb_sample[16][2][8],
+			int16_t pcm_sample[2][16 * 8],
+			int blocks, int channels);
+	/* Polyphase synthesis filter for 8 subbands configuration,
+	 * it handles all the blocks of the frame */
+	int (*sbc_synthesize_8s)(int position,
+			int32_t V[2][SBC_V_BUFFER_SIZE],
+			int32_t sb_sample[16][2][8],
+			int16_t pcm_sample[2][16 * 8],
+			int blocks, int channels);
+	const char *implementation_info;
+};
+
 /*
  * Initialize pointers to the functions which are the basic "building bricks"
  * of SBC codec. Best implementation is selected based on target CPU
  * capabilities.
  */
 void sbc_init_primitives(struct sbc_encoder_state *encoder_state);
+void sbc_init_primitives_dec(struct sbc_decoder_state *decoder_state);
+
+/*
+ * Switch the analysis filter to the reduced precision variant used by
+ * SBC_FLAG_FAST, must be called after sbc_init_primitives().
+ */
+void sbc_init_primitives_fast(struct sbc_encoder_state *encoder_state);
+
+/*
+ * Switch to the input processing which handles the 8 samples granularity
+ * of mSBC frames, must be called after sbc_init_primitives().
+ */
+void sbc_init_primitives_msbc(struct sbc_encoder_state *encoder_state);
+
+/* Generic C implementation only, used as the base for the above */
+void sbc_init_primitives_generic(struct sbc_encoder_state *encoder_state);
+void sbc_init_primitives_dec_generic(struct sbc_decoder_state *decoder_state);
 
 #endif
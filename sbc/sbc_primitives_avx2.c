@@ -0,0 +1,425 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) library
+ *
+ *  Copyright (C) 2008-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *  Copyright (C) 2004-2005  Henryk Ploetz <henryk@ploetzli.ch>
+ *  Copyright (C) 2005-2006  Brad Midgley <bmidgley@xmission.com>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include "sbc.h"
+#include "sbc_math.h"
+#include "sbc_tables.h"
+
+#include "sbc_primitives_avx2.h"
+
+/*
+ * AVX2 optimizations
+ *
+ * Only the 8 subbands configuration benefits from 256-bit vectors (one
+ * block of 8 subbands fits a single register), so the 4 subbands and input
+ * processing functions are left to the SSE2 implementation.
+ */
+
+#ifdef SBC_BUILD_WITH_AVX2_SUPPORT
+
+static inline void sbc_analyze_eight_avx2(const int16_t *in, int32_t *out,
+							const FIXED_T *consts)
+{
+	static const SBC_ALIGNED int32_t round_c[8] = {
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+	};
+	asm volatile (
+		"vmovdqu       (%0), %%ymm0\n"
+		"vmovdqu     32(%0), %%ymm1\n"
+		"vpmaddwd      (%1), %%ymm0, %%ymm0\n"
+		"vpmaddwd    32(%1), %%ymm1, %%ymm1\n"
+		"vpaddd        (%2), %%ymm0, %%ymm0\n"
+		"vpaddd      %%ymm1, %%ymm0, %%ymm0\n"
+		"\n"
+		"vmovdqu     64(%0), %%ymm2\n"
+		"vmovdqu     96(%0), %%ymm3\n"
+		"vpmaddwd    64(%1), %%ymm2, %%ymm2\n"
+		"vpmaddwd    96(%1), %%ymm3, %%ymm3\n"
+		"vpaddd      %%ymm2, %%ymm0, %%ymm0\n"
+		"vpaddd      %%ymm3, %%ymm0, %%ymm0\n"
+		"\n"
+		"vmovdqu    128(%0), %%ymm1\n"
+		"vpmaddwd   128(%1), %%ymm1, %%ymm1\n"
+		"vpaddd      %%ymm1, %%ymm0, %%ymm0\n"
+		"\n"
+		"vpsrad          %4, %%ymm0, %%ymm0\n"
+		"vextracti128    $1, %%ymm0, %%xmm1\n"
+		"vpackssdw   %%xmm1, %%xmm0, %%xmm0\n"
+		"vinserti128     $1, %%xmm0, %%ymm0, %%ymm0\n"
+		"\n"
+		"vpshufd     $0x00, %%ymm0, %%ymm1\n"
+		"vpshufd     $0x55, %%ymm0, %%ymm2\n"
+		"vpmaddwd   160(%1), %%ymm1, %%ymm1\n"
+		"vpmaddwd   192(%1), %%ymm2, %%ymm2\n"
+		"vpaddd      %%ymm2, %%ymm1, %%ymm1\n"
+		"\n"
+		"vpshufd     $0xaa, %%ymm0, %%ymm2\n"
+		"vpshufd     $0xff, %%ymm0, %%ymm3\n"
+		"vpmaddwd   224(%1), %%ymm2, %%ymm2\n"
+		"vpmaddwd   256(%1), %%ymm3, %%ymm3\n"
+		"vpaddd      %%ymm2, %%ymm1, %%ymm1\n"
+		"vpaddd      %%ymm3, %%ymm1, %%ymm1\n"
+		"\n"
+		"vmovdqu     %%ymm1, (%3)\n"
+		:
+		: "r" (in), "r" (consts), "r" (&round_c), "r" (out),
+			"i" (SBC_PROTO_FIXED8_SCALE)
+		: "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3");
+}
+
+static inline void sbc_analyze_4b_8s_avx2(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_eight_avx2(x + 24, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_avx2(x + 16, out, analysis_consts_fixed8_simd_even);
+	out += out_stride;
+	sbc_analyze_eight_avx2(x + 8, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_avx2(x + 0, out, analysis_consts_fixed8_simd_even);
+
+	asm volatile ("vzeroupper\n");
+}
+
+/*
+ * Variant for SBC_FLAG_FAST which skips the last segment of the polyphase
+ * window, see the generic C implementation for details.
+ */
+static inline void sbc_analyze_eight_fast_avx2(const int16_t *in,
+					int32_t *out, const FIXED_T *consts)
+{
+	static const SBC_ALIGNED int32_t round_c[8] = {
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+	};
+	asm volatile (
+		"vmovdqu       (%0), %%ymm0\n"
+		"vmovdqu     32(%0), %%ymm1\n"
+		"vpmaddwd      (%1), %%ymm0, %%ymm0\n"
+		"vpmaddwd    32(%1), %%ymm1, %%ymm1\n"
+		"vpaddd        (%2), %%ymm0, %%ymm0\n"
+		"vpaddd      %%ymm1, %%ymm0, %%ymm0\n"
+		"\n"
+		"vmovdqu     64(%0), %%ymm2\n"
+		"vmovdqu     96(%0), %%ymm3\n"
+		"vpmaddwd    64(%1), %%ymm2, %%ymm2\n"
+		"vpmaddwd    96(%1), %%ymm3, %%ymm3\n"
+		"vpaddd      %%ymm2, %%ymm0, %%ymm0\n"
+		"vpaddd      %%ymm3, %%ymm0, %%ymm0\n"
+		"\n"
+		"vpsrad          %4, %%ymm0, %%ymm0\n"
+		"vextracti128    $1, %%ymm0, %%xmm1\n"
+		"vpackssdw   %%xmm1, %%xmm0, %%xmm0\n"
+		"vinserti128     $1, %%xmm0, %%ymm0, %%ymm0\n"
+		"\n"
+		"vpshufd     $0x00, %%ymm0, %%ymm1\n"
+		"vpshufd     $0x55, %%ymm0, %%ymm2\n"
+		"vpmaddwd   160(%1), %%ymm1, %%ymm1\n"
+		"vpmaddwd   192(%1), %%ymm2, %%ymm2\n"
+		"vpaddd      %%ymm2, %%ymm1, %%ymm1\n"
+		"\n"
+		"vpshufd     $0xaa, %%ymm0, %%ymm2\n"
+		"vpshufd     $0xff, %%ymm0, %%ymm3\n"
+		"vpmaddwd   224(%1), %%ymm2, %%ymm2\n"
+		"vpmaddwd   256(%1), %%ymm3, %%ymm3\n"
+		"vpaddd      %%ymm2, %%ymm1, %%ymm1\n"
+		"vpaddd      %%ymm3, %%ymm1, %%ymm1\n"
+		"\n"
+		"vmovdqu     %%ymm1, (%3)\n"
+		:
+		: "r" (in), "r" (consts), "r" (&round_c), "r" (out),
+			"i" (SBC_PROTO_FIXED8_SCALE)
+		: "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3");
+}
+
+static inline void sbc_analyze_4b_8s_fast_avx2(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_eight_fast_avx2(x + 24, out,
+				analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_fast_avx2(x + 16, out,
+				analysis_consts_fixed8_simd_even);
+	out += out_stride;
+	sbc_analyze_eight_fast_avx2(x + 8, out,
+				analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_fast_avx2(x + 0, out,
+				analysis_consts_fixed8_simd_even);
+
+	asm volatile ("vzeroupper\n");
+}
+
+/*
+ * Accumulate (abs(x) - 1) for a vector of subband samples into 'acc' with
+ * bitwise OR, zero samples do not contribute anything.
+ */
+#define SBC_AVX2_ACCUMULATE(x, t, z, acc)				\
+		"vpxor     %%" z ", %%" z ", %%" z "\n"			\
+		"vpcmpgtd  %%" z ", %%" x ", %%" t "\n"			\
+		"vpaddd    %%" x ", %%" t ", %%" t "\n"			\
+		"vpcmpgtd  %%" t ", %%" z ", %%" z "\n"			\
+		"vpxor     %%" z ", %%" t ", %%" t "\n"			\
+		"vpor      %%" t ", %%" acc ", %%" acc "\n"
+
+/*
+ * A whole block of subband samples for one channel is processed at once,
+ * the scale factors for the unused upper half of the vector are computed
+ * for 4 subbands configuration too, but are not stored.
+ */
+static void sbc_calc_scalefactors_avx2(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int channels, int subbands)
+{
+	static const SBC_ALIGNED int32_t consts[8] = {
+		1 << SCALE_OUT_BITS, 1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS, 1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS, 1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS, 1 << SCALE_OUT_BITS,
+	};
+	uint32_t SBC_ALIGNED acc[8];
+	int ch, sb;
+	intptr_t offs;
+
+	for (ch = 0; ch < channels; ch++) {
+		offs = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+			(char *) &sb_sample_f[0][0][0]));
+		asm volatile (
+			"vmovdqu    (%[consts]), %%ymm0\n"
+		"1:\n"
+			"vmovdqu    (%[in], %[offs]), %%ymm1\n"
+			SBC_AVX2_ACCUMULATE("ymm1", "ymm2", "ymm3", "ymm0")
+			"sub         %[inc], %[offs]\n"
+			"jns                 1b\n"
+			"vmovdqu        %%ymm0, (%[acc])\n"
+			"vzeroupper\n"
+			: [offs] "+r" (offs)
+			: [in] "r" (&sb_sample_f[0][ch][0]),
+			  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+					(char *) &sb_sample_f[0][0][0]),
+			  [acc] "r" (acc),
+			  [consts] "r" (&consts)
+			: "cc", "memory",
+			  "xmm0", "xmm1", "xmm2", "xmm3");
+
+		for (sb = 0; sb < subbands; sb++)
+			scale_factor[ch][sb] = (31 - SCALE_OUT_BITS) -
+						__builtin_clz(acc[sb]);
+	}
+}
+
+static int sbc_calc_scalefactors_j_avx2(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int subbands)
+{
+	static const SBC_ALIGNED int32_t consts[8] = {
+		1 << SCALE_OUT_BITS, 1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS, 1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS, 1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS, 1 << SCALE_OUT_BITS,
+	};
+	/* OR-accumulated (abs(x) - 1) values for left, right, mid, side */
+	uint32_t SBC_ALIGNED acc[4][8];
+	int blk, sb, joint = 0;
+	intptr_t offs;
+
+	offs = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+		(char *) &sb_sample_f[0][0][0]));
+	asm volatile (
+		"vmovdqu    (%[consts]), %%ymm0\n"
+		"vmovdqa         %%ymm0, %%ymm1\n"
+		"vmovdqa         %%ymm0, %%ymm2\n"
+		"vmovdqa         %%ymm0, %%ymm3\n"
+	"1:\n"
+		"vmovdqu    (%[in0], %[offs]), %%ymm4\n"
+		"vmovdqu    (%[in1], %[offs]), %%ymm5\n"
+		SBC_AVX2_ACCUMULATE("ymm4", "ymm6", "ymm7", "ymm0")
+		SBC_AVX2_ACCUMULATE("ymm5", "ymm6", "ymm7", "ymm1")
+		"vpsrad            $1, %%ymm4, %%ymm4\n"
+		"vpsrad            $1, %%ymm5, %%ymm5\n"
+		"vpsubd        %%ymm5, %%ymm4, %%ymm6\n"
+		"vpaddd        %%ymm5, %%ymm4, %%ymm4\n"
+		SBC_AVX2_ACCUMULATE("ymm4", "ymm5", "ymm7", "ymm2")
+		SBC_AVX2_ACCUMULATE("ymm6", "ymm5", "ymm7", "ymm3")
+		"sub         %[inc], %[offs]\n"
+		"jns                 1b\n"
+		"vmovdqu        %%ymm0,  (%[acc])\n"
+		"vmovdqu        %%ymm1,  32(%[acc])\n"
+		"vmovdqu        %%ymm2,  64(%[acc])\n"
+		"vmovdqu        %%ymm3,  96(%[acc])\n"
+		"vzeroupper\n"
+		: [offs] "+r" (offs)
+		: [in0] "r" (&sb_sample_f[0][0][0]),
+		  [in1] "r" (&sb_sample_f[0][1][0]),
+		  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+				(char *) &sb_sample_f[0][0][0]),
+		  [acc] "r" (acc),
+		  [consts] "r" (&consts)
+		: "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3",
+		  "xmm4", "xmm5", "xmm6", "xmm7");
+
+	#define SF(x) ((31 - SCALE_OUT_BITS) - __builtin_clz(x))
+
+	/* last subband does not use joint stereo */
+	sb = subbands - 1;
+	scale_factor[0][sb] = SF(acc[0][sb]);
+	scale_factor[1][sb] = SF(acc[1][sb]);
+
+	/* the rest of subbands can use joint stereo */
+	while (--sb >= 0) {
+		uint32_t x = SF(acc[2][sb]);
+		uint32_t y = SF(acc[3][sb]);
+
+		scale_factor[0][sb] = SF(acc[0][sb]);
+		scale_factor[1][sb] = SF(acc[1][sb]);
+
+		/* decide whether to use joint stereo for this subband */
+		if ((scale_factor[0][sb] + scale_factor[1][sb]) > x + y) {
+			joint |= 1 << (subbands - 1 - sb);
+			scale_factor[0][sb] = x;
+			scale_factor[1][sb] = y;
+			for (blk = 0; blk < blocks; blk++) {
+				int32_t tmp0 = sb_sample_f[blk][0][sb];
+				int32_t tmp1 = sb_sample_f[blk][1][sb];
+				sb_sample_f[blk][0][sb] =
+					ASR(tmp0, 1) + ASR(tmp1, 1);
+				sb_sample_f[blk][1][sb] =
+					ASR(tmp0, 1) - ASR(tmp1, 1);
+			}
+		}
+	}
+
+	#undef SF
+
+	/* bitmask with the information about subbands using joint stereo */
+	return joint;
+}
+
+static void sbc_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#ifdef __amd64__
+	asm volatile (
+		"cpuid\n"
+		: "=a" (regs[0]), "=b" (regs[1]), "=c" (regs[2]),
+			"=d" (regs[3])
+		: "a" (leaf), "c" (subleaf));
+#else
+	/* %ebx may be reserved as PIC register */
+	asm volatile (
+		"xchgl    %%ebx, %1\n"
+		"cpuid\n"
+		"xchgl    %%ebx, %1\n"
+		: "=a" (regs[0]), "=&r" (regs[1]), "=c" (regs[2]),
+			"=d" (regs[3])
+		: "a" (leaf), "c" (subleaf));
+#endif
+}
+
+static int check_avx2_support(void)
+{
+	uint32_t regs[4];
+	uint32_t xcr0;
+
+#ifndef __amd64__
+	int cpuid_supported;
+	asm volatile (
+		/* According to Intel manual, CPUID instruction is supported
+		 * if the value of ID bit (bit 21) in EFLAGS can be modified */
+		"pushf\n"
+		"movl     (%%esp),   %0\n"
+		"xorl     $0x200000, (%%esp)\n" /* try to modify ID bit */
+		"popf\n"
+		"pushf\n"
+		"xorl     (%%esp),   %0\n"      /* check if ID bit changed */
+		"popf\n"
+		: "=r" (cpuid_supported)
+		:
+		: "cc");
+	if (!cpuid_supported)
+		return 0;
+#endif
+
+	sbc_cpuid(0, 0, regs);
+	if (regs[0] < 7)
+		return 0;
+
+	/* AVX and OSXSAVE (the OS saves YMM registers on context switch) */
+	sbc_cpuid(1, 0, regs);
+	if ((regs[2] & ((1 << 27) | (1 << 28))) != ((1 << 27) | (1 << 28)))
+		return 0;
+
+	/* xgetbv, both XMM and YMM state must be enabled in XCR0 */
+	asm volatile (
+		".byte 0x0f, 0x01, 0xd0\n"
+		: "=a" (xcr0)
+		: "c" (0)
+		: "edx");
+	if ((xcr0 & 6) != 6)
+		return 0;
+
+	sbc_cpuid(7, 0, regs);
+	return regs[1] & (1 << 5);
+}
+
+void sbc_init_primitives_fast_avx2(struct sbc_encoder_state *state)
+{
+	if (check_avx2_support())
+		state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_fast_avx2;
+}
+
+void sbc_init_primitives_avx2(struct sbc_encoder_state *state)
+{
+	if (check_avx2_support()) {
+		state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_avx2;
+		state->sbc_calc_scalefactors = sbc_calc_scalefactors_avx2;
+		state->sbc_calc_scalefactors_j = sbc_calc_scalefactors_j_avx2;
+		state->implementation_info = "AVX2";
+	}
+}
+
+#endif
@@ -24,6 +24,7 @@
  *
  */
 
+#include <string.h>
 #include <stdint.h>
 #include <limits.h>
 #include "sbc.h"
@@ -237,6 +238,131 @@ static inline void sbc_analyze_4b_8s_neon(int16_t *x,
 	_sbc_analyze_eight_neon(x + 0, out, analysis_consts_fixed8_simd_even);
 }
 
+/*
+ * Variant for SBC_FLAG_FAST which skips the last segment of the polyphase
+ * window, see the generic C implementation for details.
+ */
+static inline void _sbc_analyze_eight_fast_neon(const int16_t *in,
+					int32_t *out, const FIXED_T *consts)
+{
+	asm volatile (
+		"vld1.16    {d4, d5}, [%0, :64]!\n"
+		"vld1.16    {d8, d9}, [%1, :128]!\n"
+
+		"vmull.s16  q6, d4, d8\n"
+		"vld1.16    {d6,  d7}, [%0, :64]!\n"
+		"vmull.s16  q7, d5, d9\n"
+		"vld1.16    {d10, d11}, [%1, :128]!\n"
+		"vmull.s16  q8, d6, d10\n"
+		"vld1.16    {d4, d5}, [%0, :64]!\n"
+		"vmull.s16  q9, d7, d11\n"
+		"vld1.16    {d8, d9}, [%1, :128]!\n"
+
+		"vmlal.s16  q6, d4, d8\n"
+		"vld1.16    {d6,  d7}, [%0, :64]!\n"
+		"vmlal.s16  q7, d5, d9\n"
+		"vld1.16    {d10, d11}, [%1, :128]!\n"
+		"vmlal.s16  q8, d6, d10\n"
+		"vld1.16    {d4, d5}, [%0, :64]!\n"
+		"vmlal.s16  q9, d7, d11\n"
+		"vld1.16    {d8, d9}, [%1, :128]!\n"
+
+		"vmlal.s16  q6, d4, d8\n"
+		"vld1.16    {d6,  d7}, [%0, :64]!\n"
+		"vmlal.s16  q7, d5, d9\n"
+		"vld1.16    {d10, d11}, [%1, :128]!\n"
+		"vmlal.s16  q8, d6, d10\n"
+		"vld1.16    {d4, d5}, [%0, :64]!\n"
+		"vmlal.s16  q9, d7, d11\n"
+		"vld1.16    {d8, d9}, [%1, :128]!\n"
+
+		"vmlal.s16  q6, d4, d8\n"
+		"vld1.16    {d6,  d7}, [%0, :64]!\n"
+		"vmlal.s16  q7, d5, d9\n"
+		"vld1.16    {d10, d11}, [%1, :128]!\n"
+
+		"vmlal.s16  q8, d6, d10\n"
+		"vmlal.s16  q9, d7, d11\n"
+
+		/* skip the constants of the last window segment */
+		"add        %1, %1, #32\n"
+
+		"vpadd.s32  d0, d12, d13\n"
+		"vpadd.s32  d1, d14, d15\n"
+		"vpadd.s32  d2, d16, d17\n"
+		"vpadd.s32  d3, d18, d19\n"
+
+		"vrshr.s32 q0, q0, %3\n"
+		"vrshr.s32 q1, q1, %3\n"
+		"vmovn.s32 d0, q0\n"
+		"vmovn.s32 d1, q1\n"
+
+		"vdup.i32   d3, d1[1]\n"  /* TODO: can be eliminated */
+		"vdup.i32   d2, d1[0]\n"  /* TODO: can be eliminated */
+		"vdup.i32   d1, d0[1]\n"  /* TODO: can be eliminated */
+		"vdup.i32   d0, d0[0]\n"  /* TODO: can be eliminated */
+
+		"vld1.16    {d4, d5}, [%1, :128]!\n"
+		"vmull.s16  q6, d4, d0\n"
+		"vld1.16    {d6, d7}, [%1, :128]!\n"
+		"vmull.s16  q7, d5, d0\n"
+		"vmull.s16  q8, d6, d0\n"
+		"vmull.s16  q9, d7, d0\n"
+
+		"vld1.16    {d4, d5}, [%1, :128]!\n"
+		"vmlal.s16  q6, d4, d1\n"
+		"vld1.16    {d6, d7}, [%1, :128]!\n"
+		"vmlal.s16  q7, d5, d1\n"
+		"vmlal.s16  q8, d6, d1\n"
+		"vmlal.s16  q9, d7, d1\n"
+
+		"vld1.16    {d4, d5}, [%1, :128]!\n"
+		"vmlal.s16  q6, d4, d2\n"
+		"vld1.16    {d6, d7}, [%1, :128]!\n"
+		"vmlal.s16  q7, d5, d2\n"
+		"vmlal.s16  q8, d6, d2\n"
+		"vmlal.s16  q9, d7, d2\n"
+
+		"vld1.16    {d4, d5}, [%1, :128]!\n"
+		"vmlal.s16  q6, d4, d3\n"
+		"vld1.16    {d6, d7}, [%1, :128]!\n"
+		"vmlal.s16  q7, d5, d3\n"
+		"vmlal.s16  q8, d6, d3\n"
+		"vmlal.s16  q9, d7, d3\n"
+
+		"vpadd.s32  d0, d12, d13\n" /* TODO: can be eliminated */
+		"vpadd.s32  d1, d14, d15\n" /* TODO: can be eliminated */
+		"vpadd.s32  d2, d16, d17\n" /* TODO: can be eliminated */
+		"vpadd.s32  d3, d18, d19\n" /* TODO: can be eliminated */
+
+		"vst1.32    {d0, d1, d2, d3}, [%2, :128]\n"
+		: "+r" (in), "+r" (consts)
+		: "r" (out),
+			"i" (SBC_PROTO_FIXED8_SCALE)
+		: "memory",
+			"d0", "d1", "d2", "d3", "d4", "d5",
+			"d6", "d7", "d8", "d9", "d10", "d11",
+			"d12", "d13", "d14", "d15", "d16", "d17",
+			"d18", "d19");
+}
+
+static inline void sbc_analyze_4b_8s_fast_neon(int16_t *x,
+						int32_t *out, int out_stride)
+{
+	/* Analyze blocks */
+	_sbc_analyze_eight_fast_neon(x + 24, out,
+				analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	_sbc_analyze_eight_fast_neon(x + 16, out,
+				analysis_consts_fixed8_simd_even);
+	out += out_stride;
+	_sbc_analyze_eight_fast_neon(x + 8, out,
+				analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	_sbc_analyze_eight_fast_neon(x + 0, out,
+				analysis_consts_fixed8_simd_even);
+}
+
 static void sbc_calc_scalefactors_neon(
 	int32_t sb_sample_f[16][2][8],
 	uint32_t scale_factor[2][8],
@@ -877,6 +1003,258 @@ static int sbc_enc_process_input_8s_le_neon(int position, const uint8_t *pcm,
 		position, pcm, X, nsamples, nchannels, 0);
 }
 
+/*
+ * Synthesis filter, see the reference C implementation in "sbc_primitives.c"
+ * for the details about the data layout. Unlike SSE2, NEON has 32-bit
+ * multiply-accumulate instructions, so the code is straightforward.
+ */
+static inline void sbc_synthesize_four_neon(int32_t *v, const int32_t *s,
+								int16_t *pcm)
+{
+	const int32_t *t = &synmatrix4_simd[0][0];
+	const int32_t *w = &synthesis_window4_simd[0][0];
+	int32_t *vv = v;
+
+	asm volatile (
+		"vld1.32    {d0, d1}, [%[s], :128]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vmul.s32   q8, q12, d0[0]\n"
+		"vmul.s32   q9, q13, d0[0]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vmla.s32   q8, q12, d0[1]\n"
+		"vmla.s32   q9, q13, d0[1]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vmla.s32   q8, q12, d1[0]\n"
+		"vmla.s32   q9, q13, d1[0]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vmla.s32   q8, q12, d1[1]\n"
+		"vmla.s32   q9, q13, d1[1]\n"
+		"vshr.s32   q8, q8, #15\n"
+		"vshr.s32   q9, q9, #15\n"
+		"vst1.32    {d16, d17, d18, d19}, [%[v], :128]\n"
+		: [t] "+r" (t)
+		: [s] "r" (s), [v] "r" (v)
+		: "memory", "d0", "d1", "d16", "d17", "d18", "d19",
+		  "d24", "d25", "d26", "d27");
+
+	asm volatile (
+		"vld1.32    {d16, d17}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21}, [%[w], :128]!\n"
+		"vmul.s32   q0, q8, q10\n"
+		"add        %[v], %[v], #32\n"
+		"vld1.32    {d16, d17}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vld1.32    {d16, d17}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"add        %[v], %[v], #32\n"
+		"vld1.32    {d16, d17}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vld1.32    {d16, d17}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"add        %[v], %[v], #32\n"
+		"vld1.32    {d16, d17}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vld1.32    {d16, d17}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"add        %[v], %[v], #32\n"
+		"vld1.32    {d16, d17}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vld1.32    {d16, d17}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"add        %[v], %[v], #32\n"
+		"vld1.32    {d16, d17}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vqshrn.s32 d0, q0, #15\n"
+		"vst1.16    {d0}, [%[pcm], :64]\n"
+		: [v] "+r" (vv), [w] "+r" (w)
+		: [pcm] "r" (pcm)
+		: "memory", "d0", "d1", "d16", "d17", "d20", "d21");
+}
+
+static inline void sbc_synthesize_eight_neon(int32_t *v, const int32_t *s,
+								int16_t *pcm)
+{
+	const int32_t *t = &synmatrix8_simd[0][0];
+	const int32_t *w = &synthesis_window8_simd[0][0];
+	int32_t *vv = v;
+
+	asm volatile (
+		"vld1.32    {d0, d1, d2, d3}, [%[s], :128]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vld1.32    {d28, d29, d30, d31}, [%[t], :128]!\n"
+		"vmul.s32   q8, q12, d0[0]\n"
+		"vmul.s32   q9, q13, d0[0]\n"
+		"vmul.s32   q10, q14, d0[0]\n"
+		"vmul.s32   q11, q15, d0[0]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vld1.32    {d28, d29, d30, d31}, [%[t], :128]!\n"
+		"vmla.s32   q8, q12, d0[1]\n"
+		"vmla.s32   q9, q13, d0[1]\n"
+		"vmla.s32   q10, q14, d0[1]\n"
+		"vmla.s32   q11, q15, d0[1]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vld1.32    {d28, d29, d30, d31}, [%[t], :128]!\n"
+		"vmla.s32   q8, q12, d1[0]\n"
+		"vmla.s32   q9, q13, d1[0]\n"
+		"vmla.s32   q10, q14, d1[0]\n"
+		"vmla.s32   q11, q15, d1[0]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vld1.32    {d28, d29, d30, d31}, [%[t], :128]!\n"
+		"vmla.s32   q8, q12, d1[1]\n"
+		"vmla.s32   q9, q13, d1[1]\n"
+		"vmla.s32   q10, q14, d1[1]\n"
+		"vmla.s32   q11, q15, d1[1]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vld1.32    {d28, d29, d30, d31}, [%[t], :128]!\n"
+		"vmla.s32   q8, q12, d2[0]\n"
+		"vmla.s32   q9, q13, d2[0]\n"
+		"vmla.s32   q10, q14, d2[0]\n"
+		"vmla.s32   q11, q15, d2[0]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vld1.32    {d28, d29, d30, d31}, [%[t], :128]!\n"
+		"vmla.s32   q8, q12, d2[1]\n"
+		"vmla.s32   q9, q13, d2[1]\n"
+		"vmla.s32   q10, q14, d2[1]\n"
+		"vmla.s32   q11, q15, d2[1]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vld1.32    {d28, d29, d30, d31}, [%[t], :128]!\n"
+		"vmla.s32   q8, q12, d3[0]\n"
+		"vmla.s32   q9, q13, d3[0]\n"
+		"vmla.s32   q10, q14, d3[0]\n"
+		"vmla.s32   q11, q15, d3[0]\n"
+		"vld1.32    {d24, d25, d26, d27}, [%[t], :128]!\n"
+		"vld1.32    {d28, d29, d30, d31}, [%[t], :128]!\n"
+		"vmla.s32   q8, q12, d3[1]\n"
+		"vmla.s32   q9, q13, d3[1]\n"
+		"vmla.s32   q10, q14, d3[1]\n"
+		"vmla.s32   q11, q15, d3[1]\n"
+		"vshr.s32   q8, q8, #15\n"
+		"vshr.s32   q9, q9, #15\n"
+		"vshr.s32   q10, q10, #15\n"
+		"vshr.s32   q11, q11, #15\n"
+		"vst1.32    {d16, d17, d18, d19}, [%[v], :128]!\n"
+		"vst1.32    {d20, d21, d22, d23}, [%[v], :128]\n"
+		: [t] "+r" (t), [v] "+r" (vv)
+		: [s] "r" (s)
+		: "memory", "d0", "d1", "d2", "d3",
+		  "d16", "d17", "d18", "d19", "d20", "d21", "d22", "d23",
+		  "d24", "d25", "d26", "d27", "d28", "d29", "d30", "d31");
+
+	vv = v;
+	asm volatile (
+		"vld1.32    {d16, d17, d18, d19}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21, d22, d23}, [%[w], :128]!\n"
+		"vmul.s32   q0, q8, q10\n"
+		"vmul.s32   q1, q9, q11\n"
+		"add        %[v], %[v], #64\n"
+		"vld1.32    {d16, d17, d18, d19}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21, d22, d23}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vmla.s32   q1, q9, q11\n"
+		"vld1.32    {d16, d17, d18, d19}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21, d22, d23}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vmla.s32   q1, q9, q11\n"
+		"add        %[v], %[v], #64\n"
+		"vld1.32    {d16, d17, d18, d19}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21, d22, d23}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vmla.s32   q1, q9, q11\n"
+		"vld1.32    {d16, d17, d18, d19}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21, d22, d23}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vmla.s32   q1, q9, q11\n"
+		"add        %[v], %[v], #64\n"
+		"vld1.32    {d16, d17, d18, d19}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21, d22, d23}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vmla.s32   q1, q9, q11\n"
+		"vld1.32    {d16, d17, d18, d19}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21, d22, d23}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vmla.s32   q1, q9, q11\n"
+		"add        %[v], %[v], #64\n"
+		"vld1.32    {d16, d17, d18, d19}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21, d22, d23}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vmla.s32   q1, q9, q11\n"
+		"vld1.32    {d16, d17, d18, d19}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21, d22, d23}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vmla.s32   q1, q9, q11\n"
+		"add        %[v], %[v], #64\n"
+		"vld1.32    {d16, d17, d18, d19}, [%[v], :128]!\n"
+		"vld1.32    {d20, d21, d22, d23}, [%[w], :128]!\n"
+		"vmla.s32   q0, q8, q10\n"
+		"vmla.s32   q1, q9, q11\n"
+		"vqshrn.s32 d0, q0, #15\n"
+		"vqshrn.s32 d1, q1, #15\n"
+		"vst1.16    {d0, d1}, [%[pcm], :128]\n"
+		: [v] "+r" (vv), [w] "+r" (w)
+		: [pcm] "r" (pcm)
+		: "memory", "d0", "d1", "d2", "d3",
+		  "d16", "d17", "d18", "d19", "d20", "d21", "d22", "d23");
+}
+
+static SBC_ALWAYS_INLINE int sbc_synthesize_neon_internal(int position,
+		int32_t V[2][SBC_V_BUFFER_SIZE], int32_t sb_sample[16][2][8],
+		int16_t pcm_sample[2][16 * 8], int blocks, int channels,
+		int subbands)
+{
+	int ch, blk;
+	int n = subbands * 2;
+
+	for (blk = 0; blk < blocks; blk++) {
+		/* handle V buffer wraparound */
+		if (position < n) {
+			for (ch = 0; ch < channels; ch++)
+				memcpy(&V[ch][SBC_V_BUFFER_SIZE - 9 * n],
+					&V[ch][position],
+					9 * n * sizeof(int32_t));
+			position = SBC_V_BUFFER_SIZE - 9 * n;
+		}
+		position -= n;
+
+		for (ch = 0; ch < channels; ch++) {
+			if (subbands == 4)
+				sbc_synthesize_four_neon(&V[ch][position],
+					sb_sample[blk][ch],
+					&pcm_sample[ch][blk * 4]);
+			else
+				sbc_synthesize_eight_neon(&V[ch][position],
+					sb_sample[blk][ch],
+					&pcm_sample[ch][blk * 8]);
+		}
+	}
+
+	return position;
+}
+
+static int sbc_synthesize_4s_neon(int position,
+		int32_t V[2][SBC_V_BUFFER_SIZE], int32_t sb_sample[16][2][8],
+		int16_t pcm_sample[2][16 * 8], int blocks, int channels)
+{
+	return sbc_synthesize_neon_internal(position, V, sb_sample,
+					pcm_sample, blocks, channels, 4);
+}
+
+static int sbc_synthesize_8s_neon(int position,
+		int32_t V[2][SBC_V_BUFFER_SIZE], int32_t sb_sample[16][2][8],
+		int16_t pcm_sample[2][16 * 8], int blocks, int channels)
+{
+	return sbc_synthesize_neon_internal(position, V, sb_sample,
+					pcm_sample, blocks, channels, 8);
+}
+
 void sbc_init_primitives_neon(struct sbc_encoder_state *state)
 {
 	state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_neon;
@@ -890,4 +1268,21 @@ void sbc_init_primitives_neon(struct sbc_encoder_state *state)
 	state->implementation_info = "NEON";
 }
 
+/*
+ * Dequantization needs integer division, which NEON does not have (and
+ * single precision floating point is not accurate enough), so the generic
+ * C implementation is kept for it.
+ */
+void sbc_init_primitives_fast_neon(struct sbc_encoder_state *state)
+{
+	state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_fast_neon;
+}
+
+void sbc_init_primitives_dec_neon(struct sbc_decoder_state *state)
+{
+	state->sbc_synthesize_4s = sbc_synthesize_4s_neon;
+	state->sbc_synthesize_8s = sbc_synthesize_8s_neon;
+	state->implementation_info = "NEON";
+}
+
 #endif
@@ -0,0 +1,925 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) library
+ *
+ *  Copyright (C) 2008-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *  Copyright (C) 2004-2005  Henryk Ploetz <henryk@ploetzli.ch>
+ *  Copyright (C) 2005-2006  Brad Midgley <bmidgley@xmission.com>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include "sbc.h"
+#include "sbc_math.h"
+#include "sbc_tables.h"
+
+#include "sbc_primitives_sse2.h"
+
+/*
+ * SSE2 optimizations
+ */
+
+#ifdef SBC_BUILD_WITH_SSE2_SUPPORT
+
+static inline void sbc_analyze_four_sse2(const int16_t *in, int32_t *out,
+					const FIXED_T *consts)
+{
+	static const SBC_ALIGNED int32_t round_c[4] = {
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+	};
+	asm volatile (
+		"movdqu      (%0), %%xmm0\n"
+		"movdqu    16(%0), %%xmm1\n"
+		"pmaddwd     (%1), %%xmm0\n"
+		"pmaddwd   16(%1), %%xmm1\n"
+		"paddd       (%2), %%xmm0\n"
+		"paddd     %%xmm1, %%xmm0\n"
+		"\n"
+		"movdqu    32(%0), %%xmm2\n"
+		"movdqu    48(%0), %%xmm3\n"
+		"pmaddwd   32(%1), %%xmm2\n"
+		"pmaddwd   48(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm0\n"
+		"paddd     %%xmm3, %%xmm0\n"
+		"\n"
+		"movdqu    64(%0), %%xmm1\n"
+		"pmaddwd   64(%1), %%xmm1\n"
+		"paddd     %%xmm1, %%xmm0\n"
+		"\n"
+		"psrad         %4, %%xmm0\n"
+		"packssdw  %%xmm0, %%xmm0\n"
+		"\n"
+		"pshufd    $0x00, %%xmm0, %%xmm1\n"
+		"pshufd    $0x55, %%xmm0, %%xmm2\n"
+		"pmaddwd   80(%1), %%xmm1\n"
+		"pmaddwd   96(%1), %%xmm2\n"
+		"paddd     %%xmm2, %%xmm1\n"
+		"\n"
+		"movdqu    %%xmm1, (%3)\n"
+		:
+		: "r" (in), "r" (consts), "r" (&round_c), "r" (out),
+			"i" (SBC_PROTO_FIXED4_SCALE)
+		: "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3");
+}
+
+static inline void sbc_analyze_eight_sse2(const int16_t *in, int32_t *out,
+							const FIXED_T *consts)
+{
+	static const SBC_ALIGNED int32_t round_c[4] = {
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+	};
+	asm volatile (
+		"movdqu      (%0), %%xmm0\n"
+		"movdqu    16(%0), %%xmm1\n"
+		"pmaddwd     (%1), %%xmm0\n"
+		"pmaddwd   16(%1), %%xmm1\n"
+		"paddd       (%2), %%xmm0\n"
+		"paddd       (%2), %%xmm1\n"
+		"\n"
+		"movdqu    32(%0), %%xmm2\n"
+		"movdqu    48(%0), %%xmm3\n"
+		"pmaddwd   32(%1), %%xmm2\n"
+		"pmaddwd   48(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm0\n"
+		"paddd     %%xmm3, %%xmm1\n"
+		"\n"
+		"movdqu    64(%0), %%xmm2\n"
+		"movdqu    80(%0), %%xmm3\n"
+		"pmaddwd   64(%1), %%xmm2\n"
+		"pmaddwd   80(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm0\n"
+		"paddd     %%xmm3, %%xmm1\n"
+		"\n"
+		"movdqu    96(%0), %%xmm2\n"
+		"movdqu   112(%0), %%xmm3\n"
+		"pmaddwd   96(%1), %%xmm2\n"
+		"pmaddwd  112(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm0\n"
+		"paddd     %%xmm3, %%xmm1\n"
+		"\n"
+		"movdqu   128(%0), %%xmm2\n"
+		"movdqu   144(%0), %%xmm3\n"
+		"pmaddwd  128(%1), %%xmm2\n"
+		"pmaddwd  144(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm0\n"
+		"paddd     %%xmm3, %%xmm1\n"
+		"\n"
+		"psrad         %4, %%xmm0\n"
+		"psrad         %4, %%xmm1\n"
+		"packssdw  %%xmm1, %%xmm0\n"
+		"\n"
+		"pshufd    $0x00, %%xmm0, %%xmm4\n"
+		"movdqa    %%xmm4, %%xmm5\n"
+		"pmaddwd  160(%1), %%xmm4\n"
+		"pmaddwd  176(%1), %%xmm5\n"
+		"\n"
+		"pshufd    $0x55, %%xmm0, %%xmm2\n"
+		"movdqa    %%xmm2, %%xmm3\n"
+		"pmaddwd  192(%1), %%xmm2\n"
+		"pmaddwd  208(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm4\n"
+		"paddd     %%xmm3, %%xmm5\n"
+		"\n"
+		"pshufd    $0xaa, %%xmm0, %%xmm2\n"
+		"movdqa    %%xmm2, %%xmm3\n"
+		"pmaddwd  224(%1), %%xmm2\n"
+		"pmaddwd  240(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm4\n"
+		"paddd     %%xmm3, %%xmm5\n"
+		"\n"
+		"pshufd    $0xff, %%xmm0, %%xmm2\n"
+		"movdqa    %%xmm2, %%xmm3\n"
+		"pmaddwd  256(%1), %%xmm2\n"
+		"pmaddwd  272(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm4\n"
+		"paddd     %%xmm3, %%xmm5\n"
+		"\n"
+		"movdqu    %%xmm4, (%3)\n"
+		"movdqu    %%xmm5, 16(%3)\n"
+		:
+		: "r" (in), "r" (consts), "r" (&round_c), "r" (out),
+			"i" (SBC_PROTO_FIXED8_SCALE)
+		: "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3",
+		  "xmm4", "xmm5");
+}
+
+static inline void sbc_analyze_4b_4s_sse2(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_four_sse2(x + 12, out, analysis_consts_fixed4_simd_odd);
+	out += out_stride;
+	sbc_analyze_four_sse2(x + 8, out, analysis_consts_fixed4_simd_even);
+	out += out_stride;
+	sbc_analyze_four_sse2(x + 4, out, analysis_consts_fixed4_simd_odd);
+	out += out_stride;
+	sbc_analyze_four_sse2(x + 0, out, analysis_consts_fixed4_simd_even);
+}
+
+static inline void sbc_analyze_4b_8s_sse2(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_eight_sse2(x + 24, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_sse2(x + 16, out, analysis_consts_fixed8_simd_even);
+	out += out_stride;
+	sbc_analyze_eight_sse2(x + 8, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_sse2(x + 0, out, analysis_consts_fixed8_simd_even);
+}
+
+/*
+ * Variant for SBC_FLAG_FAST which skips the last segment of the polyphase
+ * window, see the generic C implementation for details.
+ */
+static inline void sbc_analyze_eight_fast_sse2(const int16_t *in,
+					int32_t *out, const FIXED_T *consts)
+{
+	static const SBC_ALIGNED int32_t round_c[4] = {
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+	};
+	asm volatile (
+		"movdqu      (%0), %%xmm0\n"
+		"movdqu    16(%0), %%xmm1\n"
+		"pmaddwd     (%1), %%xmm0\n"
+		"pmaddwd   16(%1), %%xmm1\n"
+		"paddd       (%2), %%xmm0\n"
+		"paddd       (%2), %%xmm1\n"
+		"\n"
+		"movdqu    32(%0), %%xmm2\n"
+		"movdqu    48(%0), %%xmm3\n"
+		"pmaddwd   32(%1), %%xmm2\n"
+		"pmaddwd   48(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm0\n"
+		"paddd     %%xmm3, %%xmm1\n"
+		"\n"
+		"movdqu    64(%0), %%xmm2\n"
+		"movdqu    80(%0), %%xmm3\n"
+		"pmaddwd   64(%1), %%xmm2\n"
+		"pmaddwd   80(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm0\n"
+		"paddd     %%xmm3, %%xmm1\n"
+		"\n"
+		"movdqu    96(%0), %%xmm2\n"
+		"movdqu   112(%0), %%xmm3\n"
+		"pmaddwd   96(%1), %%xmm2\n"
+		"pmaddwd  112(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm0\n"
+		"paddd     %%xmm3, %%xmm1\n"
+		"\n"
+		"psrad         %4, %%xmm0\n"
+		"psrad         %4, %%xmm1\n"
+		"packssdw  %%xmm1, %%xmm0\n"
+		"\n"
+		"pshufd    $0x00, %%xmm0, %%xmm4\n"
+		"movdqa    %%xmm4, %%xmm5\n"
+		"pmaddwd  160(%1), %%xmm4\n"
+		"pmaddwd  176(%1), %%xmm5\n"
+		"\n"
+		"pshufd    $0x55, %%xmm0, %%xmm2\n"
+		"movdqa    %%xmm2, %%xmm3\n"
+		"pmaddwd  192(%1), %%xmm2\n"
+		"pmaddwd  208(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm4\n"
+		"paddd     %%xmm3, %%xmm5\n"
+		"\n"
+		"pshufd    $0xaa, %%xmm0, %%xmm2\n"
+		"movdqa    %%xmm2, %%xmm3\n"
+		"pmaddwd  224(%1), %%xmm2\n"
+		"pmaddwd  240(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm4\n"
+		"paddd     %%xmm3, %%xmm5\n"
+		"\n"
+		"pshufd    $0xff, %%xmm0, %%xmm2\n"
+		"movdqa    %%xmm2, %%xmm3\n"
+		"pmaddwd  256(%1), %%xmm2\n"
+		"pmaddwd  272(%1), %%xmm3\n"
+		"paddd     %%xmm2, %%xmm4\n"
+		"paddd     %%xmm3, %%xmm5\n"
+		"\n"
+		"movdqu    %%xmm4, (%3)\n"
+		"movdqu    %%xmm5, 16(%3)\n"
+		:
+		: "r" (in), "r" (consts), "r" (&round_c), "r" (out),
+			"i" (SBC_PROTO_FIXED8_SCALE)
+		: "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3",
+		  "xmm4", "xmm5");
+}
+
+static inline void sbc_analyze_4b_8s_fast_sse2(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_eight_fast_sse2(x + 24, out,
+				analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_fast_sse2(x + 16, out,
+				analysis_consts_fixed8_simd_even);
+	out += out_stride;
+	sbc_analyze_eight_fast_sse2(x + 8, out,
+				analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_fast_sse2(x + 0, out,
+				analysis_consts_fixed8_simd_even);
+}
+
+/*
+ * Reorder 16 samples of one channel, which are stored as two vectors of
+ * eight words (lo = samples 0..7, hi = samples 8..15), into the order
+ * expected by the analysis filter:
+ *
+ *   15, 7, 14, 8, 13, 9, 12, 10, 11, 3, 6, 0, 5, 1, 4, 2
+ *
+ * This is done by building two intermediate vectors
+ *
+ *   P = 15, 14, 13, 12, 11, 6, 5, 4
+ *   Q =  7,  8,  9, 10,  3, 0, 1, 2
+ *
+ * and interleaving them. The 'lo' and 'hi' registers are clobbered.
+ */
+#define SBC_SSE2_PERMUTE_8S(lo, hi, t1, t2, dst)			\
+		"pshuflw   $0x1b, %%" hi ", %%" t1 "\n"		\
+		"pshufhw   $0x1b, %%" t1 ", %%" t1 "\n"		\
+		"pshuflw   $0x1b, %%" lo ", %%" t2 "\n"		\
+		"pshufhw   $0x1b, %%" t2 ", %%" t2 "\n"		\
+		"punpckhqdq %%" t2 ", %%" t1 "\n"			\
+		"pextrw       $3, %%" hi ", %k[tmp]\n"			\
+		"pinsrw       $4, %k[tmp], %%" t1 "\n"			\
+		"psllq       $16, %%" hi "\n"				\
+		"movdqa    %%" lo ", %%" t2 "\n"			\
+		"psllq       $16, %%" t2 "\n"				\
+		"punpcklqdq %%" t2 ", %%" hi "\n"			\
+		"pextrw       $7, %%" lo ", %k[tmp]\n"			\
+		"pinsrw       $0, %k[tmp], %%" hi "\n"			\
+		"pextrw       $3, %%" lo ", %k[tmp]\n"			\
+		"pinsrw       $4, %k[tmp], %%" hi "\n"			\
+		"movdqa    %%" t1 ", %%" t2 "\n"			\
+		"punpcklwd %%" hi ", %%" t2 "\n"			\
+		"punpckhwd %%" hi ", %%" t1 "\n"			\
+		"movdqu    %%" t2 ", (%[" dst "])\n"			\
+		"movdqu    %%" t1 ", 16(%[" dst "])\n"
+
+static int sbc_enc_process_input_8s_le_sse2(int position,
+		const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+		int nsamples, int nchannels)
+{
+	intptr_t tmp;
+
+	/* handle X buffer wraparound */
+	if (position < nsamples) {
+		memcpy(&X[0][SBC_X_BUFFER_SIZE - 72], &X[0][position],
+						72 * sizeof(int16_t));
+		if (nchannels > 1)
+			memcpy(&X[1][SBC_X_BUFFER_SIZE - 72], &X[1][position],
+						72 * sizeof(int16_t));
+		position = SBC_X_BUFFER_SIZE - 72;
+	}
+
+	if (nchannels > 1) {
+		while ((nsamples -= 16) >= 0) {
+			position -= 16;
+			asm volatile (
+				/* deinterleave left and right channels */
+				"movdqu      (%[pcm]), %%xmm0\n"
+				"movdqu    16(%[pcm]), %%xmm1\n"
+				"movdqu    32(%[pcm]), %%xmm2\n"
+				"movdqu    48(%[pcm]), %%xmm3\n"
+				"movdqa    %%xmm0, %%xmm4\n"
+				"movdqa    %%xmm1, %%xmm5\n"
+				"pslld        $16, %%xmm4\n"
+				"pslld        $16, %%xmm5\n"
+				"psrad        $16, %%xmm4\n"
+				"psrad        $16, %%xmm5\n"
+				"packssdw  %%xmm5, %%xmm4\n"
+				"psrad        $16, %%xmm0\n"
+				"psrad        $16, %%xmm1\n"
+				"packssdw  %%xmm1, %%xmm0\n"
+				"movdqa    %%xmm2, %%xmm5\n"
+				"movdqa    %%xmm3, %%xmm6\n"
+				"pslld        $16, %%xmm5\n"
+				"pslld        $16, %%xmm6\n"
+				"psrad        $16, %%xmm5\n"
+				"psrad        $16, %%xmm6\n"
+				"packssdw  %%xmm6, %%xmm5\n"
+				"psrad        $16, %%xmm2\n"
+				"psrad        $16, %%xmm3\n"
+				"packssdw  %%xmm3, %%xmm2\n"
+				/* xmm4/xmm5 - left, xmm0/xmm2 - right */
+				SBC_SSE2_PERMUTE_8S("xmm4", "xmm5",
+						"xmm6", "xmm7", "x0")
+				SBC_SSE2_PERMUTE_8S("xmm0", "xmm2",
+						"xmm6", "xmm7", "x1")
+				: [tmp] "=&r" (tmp)
+				: [pcm] "r" (pcm),
+				  [x0] "r" (&X[0][position]),
+				  [x1] "r" (&X[1][position])
+				: "cc", "memory",
+				  "xmm0", "xmm1", "xmm2", "xmm3",
+				  "xmm4", "xmm5", "xmm6", "xmm7");
+			pcm += 64;
+		}
+	} else {
+		while ((nsamples -= 16) >= 0) {
+			position -= 16;
+			asm volatile (
+				"movdqu      (%[pcm]), %%xmm0\n"
+				"movdqu    16(%[pcm]), %%xmm1\n"
+				SBC_SSE2_PERMUTE_8S("xmm0", "xmm1",
+						"xmm2", "xmm3", "x0")
+				: [tmp] "=&r" (tmp)
+				: [pcm] "r" (pcm),
+				  [x0] "r" (&X[0][position])
+				: "cc", "memory",
+				  "xmm0", "xmm1", "xmm2", "xmm3");
+			pcm += 32;
+		}
+	}
+
+	return position;
+}
+
+/*
+ * Accumulate (abs(x) - 1) for a vector of subband samples into 'acc' with
+ * bitwise OR, zero samples do not contribute anything. The same trick is
+ * used by the scale factors calculation functions below.
+ */
+#define SBC_SSE2_ACCUMULATE(x, t, z, acc)				\
+		"pxor      %%" z ", %%" z "\n"				\
+		"movdqa    %%" x ", %%" t "\n"				\
+		"pcmpgtd   %%" z ", %%" t "\n"				\
+		"paddd     %%" x ", %%" t "\n"				\
+		"pcmpgtd   %%" t ", %%" z "\n"				\
+		"pxor      %%" z ", %%" t "\n"				\
+		"por       %%" t ", %%" acc "\n"
+
+static void sbc_calc_scalefactors_sse2(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int channels, int subbands)
+{
+	static const SBC_ALIGNED int32_t consts[4] = {
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+	};
+	int ch, sb;
+	intptr_t blk;
+	for (ch = 0; ch < channels; ch++) {
+		for (sb = 0; sb < subbands; sb += 4) {
+			blk = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+				(char *) &sb_sample_f[0][0][0]));
+			asm volatile (
+				"movdqa        (%4), %%xmm0\n"
+			"1:\n"
+				"movdqa    (%1, %0), %%xmm1\n"
+				"pxor       %%xmm2, %%xmm2\n"
+				"pcmpgtd    %%xmm2, %%xmm1\n"
+				"paddd     (%1, %0), %%xmm1\n"
+				"pcmpgtd    %%xmm1, %%xmm2\n"
+				"pxor       %%xmm2, %%xmm1\n"
+
+				"por        %%xmm1, %%xmm0\n"
+
+				"sub            %2, %0\n"
+				"jns            1b\n"
+
+				"movd       %%xmm0, %k0\n"
+				"bsrl          %k0, %k0\n"
+				"subl           %5, %k0\n"
+				"movl          %k0, (%3)\n"
+
+				"psrldq         $4, %%xmm0\n"
+				"movd       %%xmm0, %k0\n"
+				"bsrl          %k0, %k0\n"
+				"subl           %5, %k0\n"
+				"movl          %k0, 4(%3)\n"
+
+				"psrldq         $4, %%xmm0\n"
+				"movd       %%xmm0, %k0\n"
+				"bsrl          %k0, %k0\n"
+				"subl           %5, %k0\n"
+				"movl          %k0, 8(%3)\n"
+
+				"psrldq         $4, %%xmm0\n"
+				"movd       %%xmm0, %k0\n"
+				"bsrl          %k0, %k0\n"
+				"subl           %5, %k0\n"
+				"movl          %k0, 12(%3)\n"
+			: "+r" (blk)
+			: "r" (&sb_sample_f[0][ch][sb]),
+				"i" ((char *) &sb_sample_f[1][0][0] -
+					(char *) &sb_sample_f[0][0][0]),
+				"r" (&scale_factor[ch][sb]),
+				"r" (&consts),
+				"i" (SCALE_OUT_BITS)
+			: "cc", "memory",
+			  "xmm0", "xmm1", "xmm2");
+		}
+	}
+}
+
+static int sbc_calc_scalefactors_j_sse2(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int subbands)
+{
+	static const SBC_ALIGNED int32_t consts[4] = {
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+	};
+	/* OR-accumulated (abs(x) - 1) values for left, right, mid, side */
+	uint32_t SBC_ALIGNED acc[4][8];
+	int blk, sb, joint = 0;
+	intptr_t offs;
+
+	for (sb = 0; sb < subbands; sb += 4) {
+		offs = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+			(char *) &sb_sample_f[0][0][0]));
+		asm volatile (
+			"movdqa        (%[consts]), %%xmm0\n"
+			"movdqa         %%xmm0, %%xmm1\n"
+			"movdqa         %%xmm0, %%xmm2\n"
+			"movdqa         %%xmm0, %%xmm3\n"
+		"1:\n"
+			"movdqa    (%[in0], %[offs]), %%xmm4\n"
+			"movdqa    (%[in1], %[offs]), %%xmm5\n"
+			SBC_SSE2_ACCUMULATE("xmm4", "xmm6", "xmm7", "xmm0")
+			SBC_SSE2_ACCUMULATE("xmm5", "xmm6", "xmm7", "xmm1")
+			"psrad             $1, %%xmm4\n"
+			"psrad             $1, %%xmm5\n"
+			"movdqa         %%xmm4, %%xmm6\n"
+			"paddd          %%xmm5, %%xmm4\n"
+			"psubd          %%xmm5, %%xmm6\n"
+			SBC_SSE2_ACCUMULATE("xmm4", "xmm5", "xmm7", "xmm2")
+			SBC_SSE2_ACCUMULATE("xmm6", "xmm5", "xmm7", "xmm3")
+			"sub         %[inc], %[offs]\n"
+			"jns                 1b\n"
+			"movdqa         %%xmm0,   (%[acc])\n"
+			"movdqa         %%xmm1, 32(%[acc])\n"
+			"movdqa         %%xmm2, 64(%[acc])\n"
+			"movdqa         %%xmm3, 96(%[acc])\n"
+			: [offs] "+r" (offs)
+			: [in0] "r" (&sb_sample_f[0][0][sb]),
+			  [in1] "r" (&sb_sample_f[0][1][sb]),
+			  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+					(char *) &sb_sample_f[0][0][0]),
+			  [acc] "r" (&acc[0][sb]),
+			  [consts] "r" (&consts)
+			: "cc", "memory",
+			  "xmm0", "xmm1", "xmm2", "xmm3",
+			  "xmm4", "xmm5", "xmm6", "xmm7");
+	}
+
+	#define SF(x) ((31 - SCALE_OUT_BITS) - __builtin_clz(x))
+
+	/* last subband does not use joint stereo */
+	sb = subbands - 1;
+	scale_factor[0][sb] = SF(acc[0][sb]);
+	scale_factor[1][sb] = SF(acc[1][sb]);
+
+	/* the rest of subbands can use joint stereo */
+	while (--sb >= 0) {
+		uint32_t x = SF(acc[2][sb]);
+		uint32_t y = SF(acc[3][sb]);
+
+		scale_factor[0][sb] = SF(acc[0][sb]);
+		scale_factor[1][sb] = SF(acc[1][sb]);
+
+		/* decide whether to use joint stereo for this subband */
+		if ((scale_factor[0][sb] + scale_factor[1][sb]) > x + y) {
+			joint |= 1 << (subbands - 1 - sb);
+			scale_factor[0][sb] = x;
+			scale_factor[1][sb] = y;
+			for (blk = 0; blk < blocks; blk++) {
+				int32_t tmp0 = sb_sample_f[blk][0][sb];
+				int32_t tmp1 = sb_sample_f[blk][1][sb];
+				sb_sample_f[blk][0][sb] =
+					ASR(tmp0, 1) + ASR(tmp1, 1);
+				sb_sample_f[blk][1][sb] =
+					ASR(tmp0, 1) - ASR(tmp1, 1);
+			}
+		}
+	}
+
+	#undef SF
+
+	/* bitmask with the information about subbands using joint stereo */
+	return joint;
+}
+
+/*
+ * SSE2 has no instruction for 32-bit multiplication, so pmuludq is used
+ * instead: it multiplies even 32-bit lanes and the lower half of the 64-bit
+ * product is the same for signed and unsigned operands. The products for
+ * even and odd lanes are accumulated separately (the upper halves of the
+ * 64-bit lanes are garbage) and merged at the end.
+ */
+#define SBC_SSE2_MERGE_EVEN_ODD(even, odd)				\
+		"pshufd    $0x08, %%" even ", %%" even "\n"		\
+		"pshufd    $0x08, %%" odd ", %%" odd "\n"		\
+		"punpckldq %%" odd ", %%" even "\n"
+
+#define SBC_SSE2_MATRIX_MAC(s, imm, offs)				\
+		"pshufd    $" imm ", %%" s ", %%xmm2\n"		\
+		"movdqa    " offs "(%[t]), %%xmm3\n"			\
+		"movdqa    %%xmm3, %%xmm4\n"				\
+		"psrlq        $32, %%xmm4\n"				\
+		"pmuludq   %%xmm2, %%xmm3\n"				\
+		"pmuludq   %%xmm2, %%xmm4\n"				\
+		"paddd     %%xmm3, %%xmm0\n"				\
+		"paddd     %%xmm4, %%xmm1\n"
+
+#define SBC_SSE2_WINDOW_MAC(voffs, woffs)				\
+		"movdqu    " voffs "(%[v]), %%xmm2\n"			\
+		"movdqa    " woffs "(%[w]), %%xmm3\n"			\
+		"movdqa    %%xmm2, %%xmm4\n"				\
+		"movdqa    %%xmm3, %%xmm5\n"				\
+		"psrlq        $32, %%xmm4\n"				\
+		"psrlq        $32, %%xmm5\n"				\
+		"pmuludq   %%xmm3, %%xmm2\n"				\
+		"pmuludq   %%xmm5, %%xmm4\n"				\
+		"paddd     %%xmm2, %%xmm0\n"				\
+		"paddd     %%xmm4, %%xmm1\n"
+
+static inline void sbc_synthesize_four_sse2(int32_t *v, const int32_t *s,
+								int16_t *pcm)
+{
+	int g;
+
+	/* matrixing, 4 values of the V vector at a time */
+	for (g = 0; g < 8; g += 4) {
+		asm volatile (
+		"pxor      %%xmm0, %%xmm0\n"
+		"pxor      %%xmm1, %%xmm1\n"
+		"movdqu    (%[s]), %%xmm6\n"
+		SBC_SSE2_MATRIX_MAC("xmm6", "0x00", "0")
+		SBC_SSE2_MATRIX_MAC("xmm6", "0x55", "32")
+		SBC_SSE2_MATRIX_MAC("xmm6", "0xaa", "64")
+		SBC_SSE2_MATRIX_MAC("xmm6", "0xff", "96")
+		SBC_SSE2_MERGE_EVEN_ODD("xmm0", "xmm1")
+		"psrad        $15, %%xmm0\n"
+		"movdqu    %%xmm0, (%[v])\n"
+		:
+		: [s] "r" (s), [t] "r" (&synmatrix4_simd[0][g]),
+		  [v] "r" (v + g)
+		: "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm6");
+	}
+
+	/* windowing */
+	asm volatile (
+		"pxor      %%xmm0, %%xmm0\n"
+		"pxor      %%xmm1, %%xmm1\n"
+		SBC_SSE2_WINDOW_MAC("0", "0")
+		SBC_SSE2_WINDOW_MAC("48", "16")
+		SBC_SSE2_WINDOW_MAC("64", "32")
+		SBC_SSE2_WINDOW_MAC("112", "48")
+		SBC_SSE2_WINDOW_MAC("128", "64")
+		SBC_SSE2_WINDOW_MAC("176", "80")
+		SBC_SSE2_WINDOW_MAC("192", "96")
+		SBC_SSE2_WINDOW_MAC("240", "112")
+		SBC_SSE2_WINDOW_MAC("256", "128")
+		SBC_SSE2_WINDOW_MAC("304", "144")
+		SBC_SSE2_MERGE_EVEN_ODD("xmm0", "xmm1")
+		"psrad        $15, %%xmm0\n"
+		"packssdw  %%xmm0, %%xmm0\n"
+		"movq      %%xmm0, (%[pcm])\n"
+		:
+		: [v] "r" (v), [w] "r" (synthesis_window4_simd),
+		  [pcm] "r" (pcm)
+		: "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5");
+}
+
+static inline void sbc_synthesize_eight_sse2(int32_t *v, const int32_t *s,
+								int16_t *pcm)
+{
+	int g;
+
+	/* matrixing, 4 values of the V vector at a time */
+	for (g = 0; g < 16; g += 4) {
+		asm volatile (
+		"pxor      %%xmm0, %%xmm0\n"
+		"pxor      %%xmm1, %%xmm1\n"
+		"movdqu      (%[s]), %%xmm6\n"
+		"movdqu    16(%[s]), %%xmm7\n"
+		SBC_SSE2_MATRIX_MAC("xmm6", "0x00", "0")
+		SBC_SSE2_MATRIX_MAC("xmm6", "0x55", "64")
+		SBC_SSE2_MATRIX_MAC("xmm6", "0xaa", "128")
+		SBC_SSE2_MATRIX_MAC("xmm6", "0xff", "192")
+		SBC_SSE2_MATRIX_MAC("xmm7", "0x00", "256")
+		SBC_SSE2_MATRIX_MAC("xmm7", "0x55", "320")
+		SBC_SSE2_MATRIX_MAC("xmm7", "0xaa", "384")
+		SBC_SSE2_MATRIX_MAC("xmm7", "0xff", "448")
+		SBC_SSE2_MERGE_EVEN_ODD("xmm0", "xmm1")
+		"psrad        $15, %%xmm0\n"
+		"movdqu    %%xmm0, (%[v])\n"
+		:
+		: [s] "r" (s), [t] "r" (&synmatrix8_simd[0][g]),
+		  [v] "r" (v + g)
+		: "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3",
+		  "xmm4", "xmm6", "xmm7");
+	}
+
+	/* windowing, output samples 0-3 go to xmm6, 4-7 to xmm0 */
+	asm volatile (
+		"pxor      %%xmm0, %%xmm0\n"
+		"pxor      %%xmm1, %%xmm1\n"
+		SBC_SSE2_WINDOW_MAC("0", "0")
+		SBC_SSE2_WINDOW_MAC("96", "32")
+		SBC_SSE2_WINDOW_MAC("128", "64")
+		SBC_SSE2_WINDOW_MAC("224", "96")
+		SBC_SSE2_WINDOW_MAC("256", "128")
+		SBC_SSE2_WINDOW_MAC("352", "160")
+		SBC_SSE2_WINDOW_MAC("384", "192")
+		SBC_SSE2_WINDOW_MAC("480", "224")
+		SBC_SSE2_WINDOW_MAC("512", "256")
+		SBC_SSE2_WINDOW_MAC("608", "288")
+		SBC_SSE2_MERGE_EVEN_ODD("xmm0", "xmm1")
+		"psrad        $15, %%xmm0\n"
+		"movdqa    %%xmm0, %%xmm6\n"
+		"pxor      %%xmm0, %%xmm0\n"
+		"pxor      %%xmm1, %%xmm1\n"
+		SBC_SSE2_WINDOW_MAC("16", "16")
+		SBC_SSE2_WINDOW_MAC("112", "48")
+		SBC_SSE2_WINDOW_MAC("144", "80")
+		SBC_SSE2_WINDOW_MAC("240", "112")
+		SBC_SSE2_WINDOW_MAC("272", "144")
+		SBC_SSE2_WINDOW_MAC("368", "176")
+		SBC_SSE2_WINDOW_MAC("400", "208")
+		SBC_SSE2_WINDOW_MAC("496", "240")
+		SBC_SSE2_WINDOW_MAC("528", "272")
+		SBC_SSE2_WINDOW_MAC("624", "304")
+		SBC_SSE2_MERGE_EVEN_ODD("xmm0", "xmm1")
+		"psrad        $15, %%xmm0\n"
+		"packssdw  %%xmm0, %%xmm6\n"
+		"movdqu    %%xmm6, (%[pcm])\n"
+		:
+		: [v] "r" (v), [w] "r" (synthesis_window8_simd),
+		  [pcm] "r" (pcm)
+		: "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3",
+		  "xmm4", "xmm5", "xmm6");
+}
+
+static SBC_ALWAYS_INLINE int sbc_synthesize_sse2_internal(int position,
+		int32_t V[2][SBC_V_BUFFER_SIZE], int32_t sb_sample[16][2][8],
+		int16_t pcm_sample[2][16 * 8], int blocks, int channels,
+		int subbands)
+{
+	int ch, blk;
+	int n = subbands * 2;
+
+	for (blk = 0; blk < blocks; blk++) {
+		/* handle V buffer wraparound */
+		if (position < n) {
+			for (ch = 0; ch < channels; ch++)
+				memcpy(&V[ch][SBC_V_BUFFER_SIZE - 9 * n],
+					&V[ch][position],
+					9 * n * sizeof(int32_t));
+			position = SBC_V_BUFFER_SIZE - 9 * n;
+		}
+		position -= n;
+
+		for (ch = 0; ch < channels; ch++) {
+			if (subbands == 4)
+				sbc_synthesize_four_sse2(&V[ch][position],
+					sb_sample[blk][ch],
+					&pcm_sample[ch][blk * 4]);
+			else
+				sbc_synthesize_eight_sse2(&V[ch][position],
+					sb_sample[blk][ch],
+					&pcm_sample[ch][blk * 8]);
+		}
+	}
+
+	return position;
+}
+
+static int sbc_synthesize_4s_sse2(int position,
+		int32_t V[2][SBC_V_BUFFER_SIZE], int32_t sb_sample[16][2][8],
+		int16_t pcm_sample[2][16 * 8], int blocks, int channels)
+{
+	return sbc_synthesize_sse2_internal(position, V, sb_sample,
+					pcm_sample, blocks, channels, 4);
+}
+
+static int sbc_synthesize_8s_sse2(int position,
+		int32_t V[2][SBC_V_BUFFER_SIZE], int32_t sb_sample[16][2][8],
+		int16_t pcm_sample[2][16 * 8], int blocks, int channels)
+{
+	return sbc_synthesize_sse2_internal(position, V, sb_sample,
+					pcm_sample, blocks, channels, 8);
+}
+
+/*
+ * Dequantization is done with double precision floating point math,
+ * because there is no SIMD integer division. The dividend is an exact
+ * integer below 2^32 and the divisor is below 2^16, so the quotient
+ * can't get rounded up to the next integer and truncation gives exactly
+ * the same result as integer division.
+ */
+static void sbc_dequantize_sse2(int32_t sb_sample[16][2][8],
+		const uint32_t scale_factor[2][8], const int bits[2][8],
+		int blocks, int channels, int subbands)
+{
+	static const SBC_ALIGNED int32_t ones[4] = { 1, 1, 1, 1 };
+	double SBC_ALIGNED scale[8], levels[8];
+	int32_t SBC_ALIGNED delta[8], mask[8];
+	int ch, sb;
+	intptr_t offs;
+
+	for (ch = 0; ch < channels; ch++) {
+		for (sb = 0; sb < subbands; sb++) {
+			scale[sb] = (double) (1 << scale_factor[ch][sb]);
+			delta[sb] = 1 << scale_factor[ch][sb];
+			if (bits[ch][sb] > 0) {
+				levels[sb] = (double) ((1 << bits[ch][sb]) - 1);
+				mask[sb] = -1;
+			} else {
+				levels[sb] = 1.0;
+				mask[sb] = 0;
+			}
+		}
+
+		for (sb = 0; sb < subbands; sb += 4) {
+			offs = (blocks - 1) * (((char *) &sb_sample[1][0][0] -
+				(char *) &sb_sample[0][0][0]));
+			asm volatile (
+				"movapd      (%[scale]), %%xmm4\n"
+				"movapd    16(%[scale]), %%xmm5\n"
+				"movapd     (%[levels]), %%xmm6\n"
+				"movapd   16(%[levels]), %%xmm7\n"
+			"1:\n"
+				"movdqa   (%[in], %[offs]), %%xmm0\n"
+				"pslld             $1, %%xmm0\n"
+				"por        (%[ones]), %%xmm0\n"
+				"cvtdq2pd       %%xmm0, %%xmm1\n"
+				"pshufd   $0xee, %%xmm0, %%xmm0\n"
+				"cvtdq2pd       %%xmm0, %%xmm2\n"
+				"mulpd          %%xmm4, %%xmm1\n"
+				"mulpd          %%xmm5, %%xmm2\n"
+				"divpd          %%xmm6, %%xmm1\n"
+				"divpd          %%xmm7, %%xmm2\n"
+				"cvttpd2dq      %%xmm1, %%xmm1\n"
+				"cvttpd2dq      %%xmm2, %%xmm2\n"
+				"punpcklqdq     %%xmm2, %%xmm1\n"
+				"psubd     (%[delta]), %%xmm1\n"
+				"pand       (%[mask]), %%xmm1\n"
+				"movdqa   %%xmm1, (%[in], %[offs])\n"
+				"sub         %[inc], %[offs]\n"
+				"jns                 1b\n"
+				: [offs] "+r" (offs)
+				: [in] "r" (&sb_sample[0][ch][sb]),
+				  [inc] "i" ((char *) &sb_sample[1][0][0] -
+						(char *) &sb_sample[0][0][0]),
+				  [scale] "r" (&scale[sb]),
+				  [levels] "r" (&levels[sb]),
+				  [delta] "r" (&delta[sb]),
+				  [mask] "r" (&mask[sb]),
+				  [ones] "r" (ones)
+				: "cc", "memory",
+				  "xmm0", "xmm1", "xmm2",
+				  "xmm4", "xmm5", "xmm6", "xmm7");
+		}
+	}
+}
+
+static int check_sse2_support(void)
+{
+#ifdef __amd64__
+	return 1; /* SSE2 is a part of the base AMD64 instruction set */
+#else
+	int cpuid_feature_information;
+	asm volatile (
+		/* According to Intel manual, CPUID instruction is supported
+		 * if the value of ID bit (bit 21) in EFLAGS can be modified */
+		"pushf\n"
+		"movl     (%%esp),   %0\n"
+		"xorl     $0x200000, (%%esp)\n" /* try to modify ID bit */
+		"popf\n"
+		"pushf\n"
+		"xorl     (%%esp),   %0\n"      /* check if ID bit changed */
+		"jz       1f\n"
+		"push     %%eax\n"
+		"push     %%ebx\n"
+		"push     %%ecx\n"
+		"mov      $1,        %%eax\n"
+		"cpuid\n"
+		"pop      %%ecx\n"
+		"pop      %%ebx\n"
+		"pop      %%eax\n"
+		"1:\n"
+		"popf\n"
+		: "=d" (cpuid_feature_information)
+		:
+		: "cc");
+	return cpuid_feature_information & (1 << 26);
+#endif
+}
+
+void sbc_init_primitives_sse2(struct sbc_encoder_state *state)
+{
+	if (check_sse2_support()) {
+		state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_sse2;
+		state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_sse2;
+		state->sbc_enc_process_input_8s_le =
+					sbc_enc_process_input_8s_le_sse2;
+		state->sbc_calc_scalefactors = sbc_calc_scalefactors_sse2;
+		state->sbc_calc_scalefactors_j = sbc_calc_scalefactors_j_sse2;
+		state->implementation_info = "SSE2";
+	}
+}
+
+void sbc_init_primitives_fast_sse2(struct sbc_encoder_state *state)
+{
+	if (check_sse2_support())
+		state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_fast_sse2;
+}
+
+void sbc_init_primitives_dec_sse2(struct sbc_decoder_state *state)
+{
+	if (check_sse2_support()) {
+		state->sbc_dequantize = sbc_dequantize_sse2;
+		state->sbc_synthesize_4s = sbc_synthesize_4s_sse2;
+		state->sbc_synthesize_8s = sbc_synthesize_8s_sse2;
+		state->implementation_info = "SSE2";
+	}
+}
+
+#endif
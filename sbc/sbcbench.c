@@ -0,0 +1,511 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) benchmark
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "sbc.h"
+#include "sbc_math.h"
+#include "sbc_tables.h"
+#include "sbc_primitives.h"
+#include "sbc_primitives_mmx.h"
+#include "sbc_primitives_sse2.h"
+#include "sbc_primitives_avx2.h"
+#include "sbc_primitives_iwmmxt.h"
+#include "sbc_primitives_neon.h"
+#include "sbc_primitives_armv6.h"
+
+/* number of distinct input frames, the benchmark cycles over them */
+#define PCM_FRAMES 64
+
+struct backend {
+	const char *name;
+	void (*init)(struct sbc_encoder_state *state);
+	void (*init_dec)(struct sbc_decoder_state *state);
+};
+
+/*
+ * Every backend is applied on top of the generic C implementation, so
+ * the primitives it does not provide are measured in C, just like the
+ * library would run them.
+ */
+static const struct backend backends[] = {
+	{ "C", NULL, NULL },
+#ifdef SBC_BUILD_WITH_MMX_SUPPORT
+	{ "MMX", sbc_init_primitives_mmx, NULL },
+#endif
+#ifdef SBC_BUILD_WITH_SSE2_SUPPORT
+	{ "SSE2", sbc_init_primitives_sse2, sbc_init_primitives_dec_sse2 },
+#endif
+#ifdef SBC_BUILD_WITH_AVX2_SUPPORT
+	{ "AVX2", sbc_init_primitives_avx2, NULL },
+#endif
+#ifdef SBC_BUILD_WITH_ARMV6_SUPPORT
+	{ "ARMV6", sbc_init_primitives_armv6, NULL },
+#endif
+#ifdef SBC_BUILD_WITH_IWMMXT_SUPPORT
+	{ "IWMMXT", sbc_init_primitives_iwmmxt, NULL },
+#endif
+#ifdef SBC_BUILD_WITH_NEON_SUPPORT
+	{ "NEON", sbc_init_primitives_neon, sbc_init_primitives_dec_neon },
+#endif
+	{ "auto", sbc_init_primitives, sbc_init_primitives_dec },
+};
+
+#define NUM_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+/* all times are in nanoseconds per frame */
+struct primitive_times {
+	const char *info;
+	double input;
+	double analysis;
+	double scalefactors;
+	double dequantize;
+	double synthesis;
+};
+
+struct codec_times {
+	double encode;
+	double decode;
+};
+
+static const char *mode_names[] = {
+	"mono", "dual_channel", "stereo", "joint_stereo"
+};
+
+static int json = 0;
+
+static uint64_t get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Deterministic test signal: a couple of tones mixed with some noise */
+static void generate_pcm(int16_t *pcm, int nsamples, int channels)
+{
+	uint32_t seed = 1;
+	int i, ch;
+
+	for (i = 0; i < nsamples; i++) {
+		for (ch = 0; ch < channels; ch++) {
+			int32_t v = ((i * (ch + 3) * 37) & 0x1fff) - 0x1000;
+
+			seed = seed * 1103515245 + 12345;
+			v += ((i * 11) & 0x3fff) - 0x2000;
+			v += (int32_t) ((seed >> 16) & 0x7ff) - 0x400;
+			pcm[i * channels + ch] = v;
+		}
+	}
+}
+
+static int bench_primitives(const struct backend *b, int subbands, int blocks,
+				int mode, int frames, const uint8_t *pcm,
+				struct primitive_times *t)
+{
+	static struct sbc_encoder_state enc;
+	static struct sbc_decoder_state dec;
+	static int32_t SBC_ALIGNED sb_sample_f[16][2][8];
+	static int32_t SBC_ALIGNED sb_sample[16][2][8];
+	static int32_t SBC_ALIGNED codes[16][2][8];
+	static uint32_t SBC_ALIGNED scale_factor[2][8];
+	static int16_t SBC_ALIGNED pcm_sample[2][16 * 8];
+	int bits[2][8];
+	int (*process_input)(int position, const uint8_t *pcm,
+			int16_t X[2][SBC_X_BUFFER_SIZE],
+			int nsamples, int nchannels);
+	int (*synthesize)(int position, int32_t V[2][SBC_V_BUFFER_SIZE],
+			int32_t sb_sample[16][2][8],
+			int16_t pcm_sample[2][16 * 8],
+			int blocks, int channels);
+	int channels = mode == SBC_MODE_MONO ? 1 : 2;
+	int codesize = subbands * blocks * channels * 2;
+	int i, ch, sb, blk, position;
+	uint64_t start;
+	int16_t *x;
+
+	sbc_init_primitives_generic(&enc);
+	sbc_init_primitives_dec_generic(&dec);
+
+	if (b->init) {
+		b->init(&enc);
+		/* backend is not supported by this CPU */
+		if (b->init != sbc_init_primitives &&
+				!strcmp(enc.implementation_info, "Generic C"))
+			return -1;
+	}
+
+	if (b->init_dec)
+		b->init_dec(&dec);
+
+	t->info = enc.implementation_info;
+
+	memset(enc.X, 0, sizeof(enc.X));
+	enc.position = (SBC_X_BUFFER_SIZE - subbands * 9) & ~7;
+
+	if (subbands == 8) {
+		process_input = enc.sbc_enc_process_input_8s_le;
+		synthesize = dec.sbc_synthesize_8s;
+	} else {
+		process_input = enc.sbc_enc_process_input_4s_le;
+		synthesize = dec.sbc_synthesize_4s;
+	}
+
+	start = get_ns();
+	for (i = 0; i < frames; i++)
+		enc.position = process_input(enc.position,
+				pcm + (i % PCM_FRAMES) * codesize, enc.X,
+				subbands * blocks, channels);
+	t->input = (double) (get_ns() - start) / frames;
+
+	start = get_ns();
+	for (i = 0; i < frames; i++) {
+		for (ch = 0; ch < channels; ch++) {
+			x = &enc.X[ch][enc.position - subbands * 4 +
+							blocks * subbands];
+			for (blk = 0; blk < blocks; blk += 4) {
+				if (subbands == 8)
+					enc.sbc_analyze_4b_8s(x,
+						sb_sample_f[blk][ch],
+						sb_sample_f[blk + 1][ch] -
+						sb_sample_f[blk][ch]);
+				else
+					enc.sbc_analyze_4b_4s(x,
+						sb_sample_f[blk][ch],
+						sb_sample_f[blk + 1][ch] -
+						sb_sample_f[blk][ch]);
+				x -= subbands * 4;
+			}
+		}
+	}
+	t->analysis = (double) (get_ns() - start) / frames;
+
+	start = get_ns();
+	for (i = 0; i < frames; i++) {
+		if (mode == SBC_MODE_JOINT_STEREO)
+			enc.sbc_calc_scalefactors_j(sb_sample_f, scale_factor,
+							blocks, subbands);
+		else
+			enc.sbc_calc_scalefactors(sb_sample_f, scale_factor,
+						blocks, channels, subbands);
+	}
+	t->scalefactors = (double) (get_ns() - start) / frames;
+
+	/* Fake a typical bit distribution with codes in range for it */
+	for (ch = 0; ch < 2; ch++)
+		for (sb = 0; sb < 8; sb++) {
+			bits[ch][sb] = sb < subbands ? 8 - sb / 2 : 0;
+			scale_factor[ch][sb] = 6 + sb;
+		}
+	for (blk = 0; blk < 16; blk++)
+		for (ch = 0; ch < 2; ch++)
+			for (sb = 0; sb < 8; sb++)
+				codes[blk][ch][sb] = (blk * 37 + sb * 11 + ch) &
+						((1 << bits[ch][sb]) - 1);
+
+	/* The in place dequantization needs fresh codes on every run */
+	start = get_ns();
+	for (i = 0; i < frames; i++) {
+		memcpy(sb_sample, codes, sizeof(sb_sample));
+		dec.sbc_dequantize(sb_sample, scale_factor, bits, blocks,
+							channels, subbands);
+	}
+	t->dequantize = (double) (get_ns() - start) / frames;
+
+	memset(dec.V, 0, sizeof(dec.V));
+	position = SBC_V_BUFFER_SIZE - subbands * 2 * 9;
+
+	start = get_ns();
+	for (i = 0; i < frames; i++)
+		position = synthesize(position, dec.V, sb_sample, pcm_sample,
+							blocks, channels);
+	t->synthesis = (double) (get_ns() - start) / frames;
+
+	return 0;
+}
+
+static int bench_codec(int subbands, int blocks, int mode, int bitpool,
+				int frames, const uint8_t *pcm,
+				struct codec_times *t)
+{
+	sbc_t enc, dec;
+	uint8_t *stream, out[512];
+	size_t codesize, framelen, pos, len;
+	ssize_t encoded, written;
+	uint64_t start;
+	int i, ret = -1;
+
+	sbc_init(&enc, 0L);
+	enc.subbands = subbands == 8 ? SBC_SB_8 : SBC_SB_4;
+	enc.blocks = (blocks / 4) - 1;
+	enc.mode = mode;
+	enc.bitpool = bitpool;
+	enc.endian = SBC_LE;
+
+	codesize = sbc_get_codesize(&enc);
+	framelen = sbc_get_frame_length(&enc);
+
+	stream = malloc(framelen * PCM_FRAMES);
+	if (!stream)
+		goto done;
+
+	/* Encode the whole input over and over again */
+	start = get_ns();
+	for (i = 0; i < frames; i += PCM_FRAMES) {
+		encoded = sbc_encode_batch(&enc, pcm, codesize * PCM_FRAMES,
+				stream, framelen * PCM_FRAMES, &written);
+		if (encoded != (ssize_t) (codesize * PCM_FRAMES))
+			goto free;
+	}
+	t->encode = (double) (get_ns() - start) / i;
+
+	sbc_init(&dec, 0L);
+
+	start = get_ns();
+	for (i = 0; i < frames; i += PCM_FRAMES) {
+		for (pos = 0; pos < (size_t) written; pos += framelen) {
+			if (sbc_decode(&dec, stream + pos, written - pos,
+					out, sizeof(out), &len) <= 0) {
+				sbc_finish(&dec);
+				goto free;
+			}
+		}
+	}
+	t->decode = (double) (get_ns() - start) / i;
+
+	sbc_finish(&dec);
+
+	ret = 0;
+
+free:
+	free(stream);
+done:
+	sbc_finish(&enc);
+	return ret;
+}
+
+static double mbps(size_t bytes, double ns)
+{
+	return ns > 0 ? bytes * 1000.0 / ns : 0;
+}
+
+static void print_result(const struct backend *b,
+				const struct primitive_times *p,
+				const struct primitive_times *ref,
+				const struct codec_times *c,
+				int subbands, int blocks, int mode, int bitpool,
+				int first)
+{
+	int channels = mode == SBC_MODE_MONO ? 1 : 2;
+	size_t codesize = subbands * blocks * channels * 2;
+	double pack, unpack, encode, decode;
+
+	/*
+	 * Packing, bit allocation and unpacking do not depend on the
+	 * backend. They are derived from the full codec run of the library,
+	 * minus the primitives of the implementation it selected.
+	 */
+	pack = c->encode - ref->input - ref->analysis - ref->scalefactors;
+	unpack = c->decode - ref->dequantize - ref->synthesis;
+	encode = p->input + p->analysis + p->scalefactors + pack;
+	decode = p->dequantize + p->synthesis + unpack;
+
+	if (json) {
+		printf("%s  {\"backend\": \"%s\", \"implementation\": \"%s\", "
+			"\"subbands\": %d, \"blocks\": %d, \"mode\": \"%s\", "
+			"\"bitpool\": %d,\n", first ? "" : ",\n",
+			b->name, p->info, subbands, blocks,
+			mode_names[mode], bitpool);
+		printf("   \"input_ns\": %.1f, \"analysis_ns\": %.1f, "
+			"\"scalefactors_ns\": %.1f, \"pack_ns\": %.1f, "
+			"\"encode_ns\": %.1f, \"encode_mbps\": %.2f,\n",
+			p->input, p->analysis, p->scalefactors, pack,
+			encode, mbps(codesize, encode));
+		printf("   \"dequantize_ns\": %.1f, \"synthesis_ns\": %.1f, "
+			"\"unpack_ns\": %.1f, \"decode_ns\": %.1f, "
+			"\"decode_mbps\": %.2f}",
+			p->dequantize, p->synthesis, unpack,
+			decode, mbps(codesize, decode));
+		return;
+	}
+
+	printf("%-6s %2d %2d %-12s %3d %7.0f %7.0f %7.0f %7.0f %8.0f %7.1f "
+		"%7.0f %7.0f %7.0f %8.0f %7.1f\n",
+		b->name, subbands, blocks, mode_names[mode], bitpool,
+		p->input, p->analysis, p->scalefactors, pack,
+		encode, mbps(codesize, encode),
+		p->dequantize, p->synthesis, unpack,
+		decode, mbps(codesize, decode));
+}
+
+static void usage(void)
+{
+	printf("SBC benchmark utility ver %s\n", VERSION);
+	printf("Copyright (c) 2004-2010  Marcel Holtmann\n\n");
+
+	printf("Usage:\n"
+		"\tsbcbench [options]\n"
+		"\n");
+
+	printf("Options:\n"
+		"\t-h, --help           Display help\n"
+		"\t-n, --frames <n>     Number of frames per measurement\n"
+		"\t-B, --blocks <n>     Number of blocks (4, 8, 12 or 16)\n"
+		"\t-j, --json           Output results in JSON format\n"
+		"\n");
+
+	printf("All times are in nanoseconds per frame, throughput is in\n"
+		"megabytes of PCM data per second.\n");
+}
+
+static struct option main_options[] = {
+	{ "help",	0, 0, 'h' },
+	{ "frames",	1, 0, 'n' },
+	{ "blocks",	1, 0, 'B' },
+	{ "json",	0, 0, 'j' },
+	{ 0, 0, 0, 0 }
+};
+
+static const int bitpools[] = { 2, 19, 35, 53, 128, 250 };
+
+int main(int argc, char *argv[])
+{
+	struct primitive_times prim[NUM_BACKENDS], *ref;
+	int supported[NUM_BACKENDS];
+	struct codec_times codec;
+	int opt, frames = 20000, blocks = 16, first = 1;
+	int subbands, mode, max_bitpool;
+	unsigned int i, b;
+	uint8_t *pcm;
+
+	while ((opt = getopt_long(argc, argv, "+hn:B:j",
+						main_options, NULL)) != -1) {
+		switch(opt) {
+		case 'h':
+			usage();
+			exit(0);
+
+		case 'n':
+			frames = atoi(optarg);
+			if (frames < PCM_FRAMES) {
+				fprintf(stderr, "Invalid number of frames\n");
+				exit(1);
+			}
+			break;
+
+		case 'B':
+			blocks = atoi(optarg);
+			if (blocks != 16 && blocks != 12 &&
+						blocks != 8 && blocks != 4) {
+				fprintf(stderr, "Invalid blocks\n");
+				exit(1);
+			}
+			break;
+
+		case 'j':
+			json = 1;
+			break;
+
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	pcm = malloc(PCM_FRAMES * 16 * 8 * 2 * 2);
+	if (!pcm) {
+		perror("Can't allocate memory");
+		exit(1);
+	}
+
+	generate_pcm((int16_t *) pcm, PCM_FRAMES * 16 * 8, 2);
+
+	if (json)
+		printf("[\n");
+	else
+		printf("%-6s %2s %2s %-12s %3s %7s %7s %7s %7s %8s %7s "
+			"%7s %7s %7s %8s %7s\n", "impl", "sb", "bl", "mode",
+			"bp", "input", "analyz", "scalef", "pack", "encode",
+			"MB/s", "dequant", "synth", "unpack", "decode", "MB/s");
+
+	for (subbands = 4; subbands <= 8; subbands += 4) {
+		for (mode = SBC_MODE_MONO; mode <= SBC_MODE_JOINT_STEREO;
+								mode++) {
+			/* The primitives do not depend on the bitpool */
+			for (b = 0; b < NUM_BACKENDS; b++)
+				supported[b] = bench_primitives(&backends[b],
+						subbands, blocks, mode,
+						frames, pcm, &prim[b]) == 0;
+
+			/* the last entry is what the library selects */
+			ref = &prim[NUM_BACKENDS - 1];
+
+			if (mode == SBC_MODE_MONO ||
+					mode == SBC_MODE_DUAL_CHANNEL)
+				max_bitpool = 16 * subbands;
+			else
+				max_bitpool = 32 * subbands;
+
+			for (i = 0; i < sizeof(bitpools) / sizeof(bitpools[0]);
+									i++) {
+				if (bitpools[i] > max_bitpool)
+					break;
+
+				if (bench_codec(subbands, blocks, mode,
+						bitpools[i], frames, pcm,
+						&codec) < 0) {
+					fprintf(stderr, "Codec run failed\n");
+					continue;
+				}
+
+				for (b = 0; b < NUM_BACKENDS; b++) {
+					if (!supported[b])
+						continue;
+					print_result(&backends[b], &prim[b],
+						ref, &codec, subbands, blocks,
+						mode, bitpools[i], first);
+					first = 0;
+				}
+			}
+		}
+	}
+
+	if (json)
+		printf("\n]\n");
+
+	free(pcm);
+
+	return 0;
+}
@@ -39,12 +39,188 @@
 
 #include "sbc.h"
 #include "formats.h"
+#include "pipeline.h"
 
 #define BUF_SIZE 8192
 
+/* frames per chunk handed to a decoder thread */
+#define CHUNK_FRAMES 256
+/* largest possible decoded frame: 16 blocks, 8 subbands, 2 channels */
+#define MAX_FRAME_SIZE (16 * 8 * 2 * 2)
+
 static int verbose = 0;
 
-static void decode(char *filename, char *output, int tofile)
+static void *decode_worker_init(void *user_data)
+{
+	sbc_t *sbc;
+
+	sbc = malloc(sizeof(*sbc));
+	if (!sbc)
+		return NULL;
+
+	sbc_init(sbc, 0L);
+
+	return sbc;
+}
+
+static void decode_worker_free(void *worker_data)
+{
+	sbc_t *sbc = worker_data;
+
+	if (!sbc)
+		return;
+
+	sbc_finish(sbc);
+	free(sbc);
+}
+
+/*
+ * Every chunk is decoded with a fresh decoder state. The synthesis filter
+ * only depends on the last 9 blocks of subband samples, so decoding the
+ * frames that precede the chunk (and throwing away the result) brings the
+ * state to exactly what a sequential decoder would have at this point.
+ */
+static int decode_chunk(void *worker_data, struct pipeline_slot *slot)
+{
+	sbc_t *sbc = worker_data;
+	size_t pos = 0, len;
+	int framelen;
+
+	if (!sbc)
+		return -1;
+
+	sbc_reinit(sbc, 0L);
+	sbc->endian = SBC_BE;
+
+	while (pos < slot->prime_len) {
+		framelen = sbc_decode(sbc, slot->input + pos,
+					slot->input_len - pos, slot->output,
+					slot->output_size, &len);
+		if (framelen <= 0)
+			return -1;
+		pos += framelen;
+	}
+
+	while (pos < slot->input_len) {
+		framelen = sbc_decode(sbc, slot->input + pos,
+				slot->input_len - pos,
+				slot->output + slot->output_len,
+				slot->output_size - slot->output_len, &len);
+		if (framelen <= 0) {
+			fprintf(stderr, "Can't decode frame (error %d)\n",
+								framelen);
+			return -1;
+		}
+		pos += framelen;
+		slot->output_len += len;
+	}
+
+	return 0;
+}
+
+static int decode_write(void *user_data, struct pipeline_slot *slot)
+{
+	int ad = *(int *) user_data;
+	size_t pos = 0;
+	ssize_t written;
+
+	while (pos < slot->output_len) {
+		written = write(ad, slot->output + pos,
+						slot->output_len - pos);
+		if (written <= 0) {
+			perror("Can't write decoded audio");
+			return -1;
+		}
+		pos += written;
+	}
+
+	return 0;
+}
+
+static const struct pipeline_ops decode_ops = {
+	.worker_init	= decode_worker_init,
+	.worker_free	= decode_worker_free,
+	.process	= decode_chunk,
+	.write		= decode_write,
+};
+
+/* Returns the length of the frame at data, or 0 if there is none */
+static size_t frame_length(sbc_t *hdr, const unsigned char *data,
+								size_t len)
+{
+	size_t framelen;
+
+	if (len < 4 || data[0] != 0x9c)
+		return 0;
+
+	hdr->frequency = (data[1] >> 6) & 0x03;
+	hdr->blocks = (data[1] >> 4) & 0x03;
+	hdr->mode = (data[1] >> 2) & 0x03;
+	hdr->allocation = (data[1] >> 1) & 0x01;
+	hdr->subbands = data[1] & 0x01;
+	hdr->bitpool = data[2];
+
+	framelen = sbc_get_frame_length(hdr);
+
+	return framelen <= len ? framelen : 0;
+}
+
+static void decode_parallel(unsigned char *stream, size_t streamlen, int ad,
+								int threads)
+{
+	struct pipeline *p;
+	struct pipeline_slot *slot;
+	/* offsets of the most recent frames, blocks are at least 4 */
+	size_t history[3], pos = 0, framelen;
+	int prime_frames = 0, nframes, n;
+	sbc_t hdr;
+
+	sbc_init(&hdr, 0L);
+
+	p = pipeline_new(threads, threads * 2, 0,
+				(CHUNK_FRAMES + 3) * MAX_FRAME_SIZE,
+				&decode_ops, &ad);
+	if (!p) {
+		fprintf(stderr, "Can't start decoder threads\n");
+		sbc_finish(&hdr);
+		return;
+	}
+
+	while ((slot = pipeline_get_slot(p))) {
+		framelen = frame_length(&hdr, stream + pos, streamlen - pos);
+		if (framelen == 0)
+			break;
+
+		if (prime_frames == 0)
+			prime_frames = (9 + 4 + hdr.blocks * 4 - 1) /
+							(4 + hdr.blocks * 4);
+
+		n = pos == 0 ? 0 : prime_frames;
+		slot->input = stream + (n ? history[n - 1] : pos);
+		slot->prime_len = stream + pos - slot->input;
+
+		for (nframes = 0; nframes < CHUNK_FRAMES && framelen > 0;
+								nframes++) {
+			memmove(history + 1, history,
+					sizeof(history) - sizeof(history[0]));
+			history[0] = pos;
+
+			pos += framelen;
+			framelen = frame_length(&hdr, stream + pos,
+							streamlen - pos);
+		}
+
+		slot->input_len = stream + pos - slot->input;
+
+		pipeline_submit(p, slot);
+	}
+
+	pipeline_finish(p);
+	pipeline_free(p);
+	sbc_finish(&hdr);
+}
+
+static void decode(char *filename, char *output, int tofile, int threads)
 {
 	unsigned char buf[BUF_SIZE], *stream;
 	struct stat st;
@@ -168,6 +344,11 @@ static void decode(char *filename, char *output, int tofile)
 		}
 	}
 
+	if (threads > 1) {
+		decode_parallel(stream, streamlen, ad, threads);
+		goto close;
+	}
+
 	count = len;
 
 	while (framelen > 0) {
@@ -231,6 +412,7 @@ static void usage(void)
 		"\t-v, --verbose        Verbose mode\n"
 		"\t-d, --device <dsp>   Sound device\n"
 		"\t-f, --file <file>    Decode to a file\n"
+		"\t-t, --threads <n>    Number of decoder threads\n"
 		"\n");
 }
 
@@ -239,15 +421,16 @@ static struct option main_options[] = {
 	{ "device",	1, 0, 'd' },
 	{ "verbose",	0, 0, 'v' },
 	{ "file",	1, 0, 'f' },
+	{ "threads",	1, 0, 't' },
 	{ 0, 0, 0, 0 }
 };
 
 int main(int argc, char *argv[])
 {
 	char *output = NULL;
-	int i, opt, tofile = 0;
+	int i, opt, tofile = 0, threads = 1;
 
-	while ((opt = getopt_long(argc, argv, "+hvd:f:",
+	while ((opt = getopt_long(argc, argv, "+hvd:f:t:",
 						main_options, NULL)) != -1) {
 		switch(opt) {
 		case 'h':
@@ -270,6 +453,14 @@ int main(int argc, char *argv[])
 			tofile = 1;
 			break;
 
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 1) {
+				fprintf(stderr, "Invalid number of threads\n");
+				exit(1);
+			}
+			break;
+
 		default:
 			exit(1);
 		}
@@ -285,7 +476,8 @@ int main(int argc, char *argv[])
 	}
 
 	for (i = 0; i < argc; i++)
-		decode(argv[i], output ? output : "/dev/dsp", tofile);
+		decode(argv[i], output ? output : "/dev/dsp", tofile,
+								threads);
 
 	free(output);
 
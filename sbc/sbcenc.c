@@ -38,14 +38,194 @@
 
 #include "sbc.h"
 #include "formats.h"
+#include "pipeline.h"
 
 static int verbose = 0;
 
 #define BUF_SIZE 32768
 static unsigned char input[BUF_SIZE], output[BUF_SIZE + BUF_SIZE / 4];
 
+struct encode_worker {
+	sbc_t sbc;
+	const sbc_t *params;
+};
+
+static void *encode_worker_init(void *user_data)
+{
+	struct encode_worker *worker;
+
+	worker = malloc(sizeof(*worker));
+	if (!worker)
+		return NULL;
+
+	sbc_init(&worker->sbc, 0L);
+	worker->params = user_data;
+
+	return worker;
+}
+
+static void encode_worker_free(void *worker_data)
+{
+	struct encode_worker *worker = worker_data;
+
+	if (!worker)
+		return;
+
+	sbc_finish(&worker->sbc);
+	free(worker);
+}
+
+/*
+ * Every chunk is encoded with a fresh encoder state. The analysis filter
+ * only depends on the last 9 * subbands input samples, so encoding the
+ * frames that precede the chunk (and throwing away the result) brings the
+ * state to exactly what a sequential encoder would have at this point.
+ */
+static int encode_chunk(void *worker_data, struct pipeline_slot *slot)
+{
+	struct encode_worker *worker = worker_data;
+	sbc_t *sbc;
+	ssize_t len, encoded;
+
+	if (!worker)
+		return -1;
+
+	sbc = &worker->sbc;
+	sbc_reinit(sbc, worker->params->flags);
+	sbc->frequency = worker->params->frequency;
+	sbc->blocks = worker->params->blocks;
+	sbc->subbands = worker->params->subbands;
+	sbc->mode = worker->params->mode;
+	sbc->allocation = worker->params->allocation;
+	sbc->bitpool = worker->params->bitpool;
+	sbc->endian = worker->params->endian;
+
+	if (slot->prime_len > 0) {
+		len = sbc_encode_batch(sbc, slot->input, slot->prime_len,
+				slot->output, slot->output_size, &encoded);
+		if (len != (ssize_t) slot->prime_len)
+			return -1;
+	}
+
+	len = sbc_encode_batch(sbc, slot->input + slot->prime_len,
+				slot->input_len - slot->prime_len,
+				slot->output, slot->output_size, &encoded);
+	if (len != (ssize_t) (slot->input_len - slot->prime_len)) {
+		fprintf(stderr, "sbc_encode_batch fail, len=%zd\n", len);
+		return -1;
+	}
+
+	slot->output_len = encoded;
+
+	return 0;
+}
+
+static int encode_write(void *user_data, struct pipeline_slot *slot)
+{
+	ssize_t len;
+
+	len = write(fileno(stdout), slot->output, slot->output_len);
+	if (len != (ssize_t) slot->output_len) {
+		perror("Can't write SBC output");
+		return -1;
+	}
+
+	return 0;
+}
+
+static const struct pipeline_ops encode_ops = {
+	.worker_init	= encode_worker_init,
+	.worker_free	= encode_worker_free,
+	.process	= encode_chunk,
+	.write		= encode_write,
+};
+
+static ssize_t read_full(int fd, unsigned char *buf, size_t count)
+{
+	ssize_t len, pos = 0;
+
+	while (count > 0) {
+		len = read(fd, buf + pos, count);
+		if (len < 0)
+			return len;
+		if (len == 0)
+			break;
+		pos += len;
+		count -= len;
+	}
+
+	return pos;
+}
+
+static void encode_parallel(int fd, sbc_t *sbc, int threads)
+{
+	struct pipeline *p;
+	struct pipeline_slot *slot;
+	unsigned char *prime;
+	size_t prime_len = 0, prime_size, chunk_size;
+	int codesize, samples, prime_frames, nframes;
+	ssize_t size;
+
+	codesize = sbc_get_codesize(sbc);
+	nframes = sizeof(input) / codesize;
+	chunk_size = nframes * codesize;
+
+	samples = (sbc->subbands ? 8 : 4) * (4 + sbc->blocks * 4);
+	prime_frames = ((sbc->subbands ? 8 : 4) * 9 + samples - 1) / samples;
+	prime_size = prime_frames * codesize;
+
+	prime = malloc(prime_size);
+	if (!prime) {
+		perror("Can't allocate memory");
+		return;
+	}
+
+	p = pipeline_new(threads, threads * 2, prime_size + chunk_size,
+			(prime_frames + nframes) * sbc_get_frame_length(sbc),
+			&encode_ops, sbc);
+	if (!p) {
+		fprintf(stderr, "Can't start encoder threads\n");
+		free(prime);
+		return;
+	}
+
+	while ((slot = pipeline_get_slot(p))) {
+		memcpy(slot->input, prime, prime_len);
+		slot->prime_len = prime_len;
+
+		size = read_full(fd, slot->input + prime_len, chunk_size);
+		if (size < 0) {
+			perror("Can't read audio data");
+			break;
+		}
+
+		/* trailing partial data is insufficient to encode a frame */
+		size -= size % codesize;
+		if (size == 0)
+			break;
+
+		slot->input_len = prime_len + size;
+
+		/* the tail of this chunk primes the encoder for the next one */
+		prime_len = slot->input_len < prime_size ?
+					slot->input_len : prime_size;
+		memcpy(prime, slot->input + slot->input_len - prime_len,
+								prime_len);
+
+		pipeline_submit(p, slot);
+
+		if ((size_t) size < chunk_size)
+			break;
+	}
+
+	pipeline_finish(p);
+	pipeline_free(p);
+	free(prime);
+}
+
 static void encode(char *filename, int subbands, int bitpool, int joint,
-					int dualchannel, int snr, int blocks)
+				int dualchannel, int snr, int blocks, int threads,
+				int fast)
 {
 	struct au_header au_hdr;
 	sbc_t sbc;
@@ -87,7 +267,7 @@ static void encode(char *filename, int subbands, int bitpool, int joint,
 		goto done;
 	}
 
-	sbc_init(&sbc, 0L);
+	sbc_init(&sbc, fast ? SBC_FLAG_FAST : 0L);
 
 	switch (BE_INT(au_hdr.sample_rate)) {
 	case 16000:
@@ -149,6 +329,11 @@ static void encode(char *filename, int subbands, int bitpool, int joint,
 						"STEREO" : "JOINTSTEREO");
 	}
 
+	if (threads > 1) {
+		encode_parallel(fd, &sbc, threads);
+		goto finish;
+	}
+
 	codesize = sbc_get_codesize(&sbc);
 	nframes = sizeof(input) / codesize;
 	while (1) {
@@ -196,6 +381,7 @@ static void encode(char *filename, int subbands, int bitpool, int joint,
 		}
 	}
 
+finish:
 	sbc_finish(&sbc);
 
 done:
@@ -221,6 +407,8 @@ static void usage(void)
 		"\t-d, --dualchannel    Dual channel\n"
 		"\t-S, --snr            Use SNR mode (default is loudness)\n"
 		"\t-B, --blocks         Number of blocks (4, 8, 12 or 16)\n"
+		"\t-t, --threads        Number of encoder threads\n"
+		"\t-f, --fast           Faster encoding at reduced quality\n"
 		"\n");
 }
 
@@ -233,15 +421,17 @@ static struct option main_options[] = {
 	{ "dualchannel",0, 0, 'd' },
 	{ "snr",	0, 0, 'S' },
 	{ "blocks",	1, 0, 'B' },
+	{ "threads",	1, 0, 't' },
+	{ "fast",	0, 0, 'f' },
 	{ 0, 0, 0, 0 }
 };
 
 int main(int argc, char *argv[])
 {
 	int i, opt, subbands = 8, bitpool = 32, joint = 0, dualchannel = 0;
-	int snr = 0, blocks = 16;
+	int snr = 0, blocks = 16, threads = 1, fast = 0;
 
-	while ((opt = getopt_long(argc, argv, "+hvs:b:jdSB:",
+	while ((opt = getopt_long(argc, argv, "+hvs:b:jdSB:t:f",
 						main_options, NULL)) != -1) {
 		switch(opt) {
 		case 'h':
@@ -285,6 +475,18 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 1) {
+				fprintf(stderr, "Invalid number of threads\n");
+				exit(1);
+			}
+			break;
+
+		case 'f':
+			fast = 1;
+			break;
+
 		default:
 			usage();
 			exit(1);
@@ -302,7 +504,7 @@ int main(int argc, char *argv[])
 
 	for (i = 0; i < argc; i++)
 		encode(argv[i], subbands, bitpool, joint, dualchannel,
-								snr, blocks);
+						snr, blocks, threads, fast);
 
 	return 0;
 }
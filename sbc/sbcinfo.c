@@ -35,6 +35,8 @@
 #include <string.h>
 #include <libgen.h>
 
+#include "sbc.h"
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 struct sbc_frame_hdr {
 	uint8_t syncword:8;		/* Sync word */
@@ -171,11 +173,14 @@ static ssize_t __read(int fd, void *buf, size_t count)
 static int analyze_file(char *filename)
 {
 	struct sbc_frame_hdr hdr;
-	unsigned char buf[64];
+	/* large enough for a whole frame with the maximum bitpool */
+	unsigned char buf[1024];
+	unsigned long hits, misses;
+	sbc_t sbc;
 	double rate;
 	int bitpool[SIZE], frame_len[SIZE];
 	int subbands, blocks, freq, method;
-	int n, p1, p2, fd, size, num;
+	int n, p1, p2, fd, size, num, pos, err = -1;
 	ssize_t len;
 	unsigned int count;
 
@@ -193,7 +198,7 @@ static int analyze_file(char *filename)
 	len = __read(fd, &hdr, sizeof(hdr));
 	if (len != sizeof(hdr) || hdr.syncword != 0x9c) {
 		fprintf(stderr, "Not a SBC audio file\n");
-		return -1;
+		goto close;
 	}
 
 	subbands = (hdr.subbands + 1) * 4;
@@ -211,16 +216,26 @@ static int analyze_file(char *filename)
 		frame_len[n] = 0;
 	}
 
+	if (sbc_init(&sbc, 0) < 0) {
+		fprintf(stderr, "Can't initialize SBC decoder\n");
+		goto close;
+	}
+
 	if (lseek(fd, 0, SEEK_SET) < 0) {
 		num = 1;
 		rate = calc_bit_rate(&hdr);
+		memcpy(buf, &hdr, sizeof(hdr));
+		pos = sizeof(hdr);
 		while (count) {
-			size = count > sizeof(buf) ? sizeof(buf) : count;
-			len = __read(fd, buf, size);
-			if (len < 0)
+			size = count > sizeof(buf) - pos ?
+						sizeof(buf) - pos : count;
+			len = __read(fd, buf + pos, size);
+			if (len <= 0)
 				break;
 			count -= len;
+			pos += len;
 		}
+		sbc_parse(&sbc, buf, pos);
 	} else {
 		num = 0;
 		rate = 0;
@@ -260,10 +275,13 @@ static int analyze_file(char *filename)
 		if (p2 >= 0)
 			frame_len[p2] = len;
 
+		memcpy(buf, &hdr, sizeof(hdr));
+		pos = sizeof(hdr);
 		while (count) {
-			size = count > sizeof(buf) ? sizeof(buf) : count;
+			size = count > sizeof(buf) - pos ?
+						sizeof(buf) - pos : count;
 
-			len = __read(fd, buf, size);
+			len = __read(fd, buf + pos, size);
 			if (len != size) {
 				fprintf(stderr, "Unable to read frame data "
 						"(error %d)\n", errno);
@@ -271,8 +289,12 @@ static int analyze_file(char *filename)
 			}
 
 			count -= len;
+			pos += len;
 		}
 
+		/* Unpacking the frame runs it through the bit allocation */
+		sbc_parse(&sbc, buf, pos);
+
 		rate += calc_bit_rate(&hdr);
 		num++;
 	}
@@ -296,12 +318,22 @@ static int analyze_file(char *filename)
 	if (num > 0)
 		printf("Bit rate\t\t%.3f kbps\n", rate / num);
 
-	if (fd > fileno(stderr))
-		close(fd);
+	if (sbc_get_bits_cache_stats(&sbc, &hits, &misses) == 0 &&
+							hits + misses > 0)
+		printf("Bit allocation cache\t%lu hits, %lu misses (%.1f%%)\n",
+				hits, misses, 100.0 * hits / (hits + misses));
 
 	printf("\n");
 
-	return 0;
+	err = 0;
+
+	sbc_finish(&sbc);
+
+close:
+	if (fd > fileno(stderr))
+		close(fd);
+
+	return err;
 }
 
 int main(int argc, char *argv[])
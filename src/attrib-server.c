@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <glib.h>
 #include <sys/stat.h>
 
@@ -58,6 +59,15 @@
 
 #define GATT_SERVER_INTERFACE	"org.bluez.GattServer"
 #define REQUEST_TIMEOUT (5 * 1000)		/* 5 seconds */
+#define SERVER_VALUE_TTL 1000			/* 1 second */
+#define SERVER_REPLIES_MAX 512
+#define NOTIFY_RING_SIZE 8			/* Outgoing PDUs per channel */
+#define NOTIFY_WINDOW 2				/* Of them handed to GAttrib */
+
+#define CLI_CFG_PREFIX		"ccc_"
+#define CLI_CFG_VERSION		1
+#define CLI_CFG_ENTRY_SIZE	6
+#define CLI_CFG_FLUSH_DELAY	1		/* 1 second */
 
 #define CARRIER_NO_RESTRICTION	0
 #define CARRIER_LE_ONLY		1
@@ -67,7 +77,44 @@ const char *gatt_sdp_prefix = "gatt_sdp_";
 const char *gatt_adv_prefix = "gatt_adv_";
 const char *serial_num_str = "SerialNum";
 
-static GSList *database = NULL;
+/*
+ * Attribute database. Attributes are indexed by handle; db_types maps each
+ * attribute type, as a 128-bit UUID, to the sorted handles of that type and
+ * db_services holds the handles of the Primary and Secondary Service
+ * declarations, which bound the service groups.
+ */
+static struct attribute **db_attrs = NULL;
+static guint db_size = 0;
+static uint16_t db_last = 0;
+static GHashTable *db_types = NULL;
+static GArray *db_services = NULL;
+
+/* Bumped whenever the layout of the database changes, which invalidates
+ * the cached discovery responses */
+static uint32_t db_generation = 0;
+
+#define RESP_CACHE_MAX	256
+
+struct resp_key {
+	uint8_t opcode;
+	uint8_t vlen;
+	uint16_t start;
+	uint16_t end;
+	uint16_t mtu;
+	bt_uuid_t uuid;
+	uint8_t value[16];
+};
+
+struct resp_entry {
+	struct resp_key key;
+	uint32_t generation;
+	uint16_t len;
+	uint8_t pdu[0];
+};
+
+/* Pre-encoded responses to the discovery requests served from the
+ * builtin database, by request */
+static GHashTable *resp_cache = NULL;
 
 struct gatt_sdp_handles {
 	struct gatt_sdp_handles	*next;
@@ -87,10 +134,27 @@ struct gatt_server {
 	uint16_t		count;
 	uint16_t		base;
 	uint8_t			carrier;
+	GHashTable		*replies;	/* Kept replies, by call */
+	uint32_t		values_serial;	/* Bumped when values change */
 	char			*path;
 	char			name[0];
 } *gatt_server_list = NULL, *gatt_server_last = NULL;
 
+/* A reply of a GATT server, kept to answer the same call again */
+struct server_reply {
+	DBusMessage		*reply;
+	guint64			expires;	/* 0 if kept while registered */
+};
+
+/* What is needed to keep the reply of a call once it arrives */
+struct server_call {
+	char			*path;
+	char			*key;
+	gboolean		layout;
+	uint32_t		generation;
+	uint32_t		values_serial;
+};
+
 struct operation {
 	uint8_t	opcode;
 	struct gatt_server	*server;
@@ -137,11 +201,41 @@ struct operation {
 	} u;
 };
 
+/* Client configuration descriptors a peer has written */
+struct cli_cfg_entry {
+	uint16_t handle;
+	uint32_t value;		/* Or the serial, for the Service Changed one */
+};
+
+struct cli_cfg_peer {
+	bdaddr_t src;
+	bdaddr_t dst;
+	GArray *entries;
+	unsigned int refs;	/* Channels connected to the peer */
+	gboolean dirty;
+};
+
+/* A notification or indication owned by its channel until sent */
+struct notify_slot {
+	guint id;
+	uint16_t len;
+	GAttribResultFunc func;
+	uint8_t pdu[ATT_MAX_MTU];
+};
+
 struct gatt_channel {
 	bdaddr_t src;
 	bdaddr_t dst;
-	GSList *notify;
+	GSList *notify;				/* Value handles */
 	GSList *indicate;
+	struct notify_slot *ring;
+	unsigned int ring_head;			/* Oldest slot in use */
+	unsigned int ring_sent;			/* Slots handed to GAttrib */
+	unsigned int ring_count;		/* Slots in use */
+	gboolean ind_wait;			/* Unconfirmed indication */
+	GQueue ind_overflow;			/* Indications for a full ring */
+	guint flush_id;
+	struct cli_cfg_peer *cli_cfg;
 	GAttrib *attrib;
 	void *device;
 	guint mtu;
@@ -165,9 +259,13 @@ struct group_elem {
 };
 
 static DBusConnection *connection = NULL;
+static dbus_int32_t server_call_slot = -1;
+static DBusMessage *kept_reply = NULL;
 static GIOChannel *l2cap_io = NULL;
 static GIOChannel *le_io = NULL;
 static GSList *clients = NULL;
+static GSList *cli_cfg_peers = NULL;
+static guint cli_cfg_flush_id = 0;
 static uint32_t gatt_sdp_handle = 0;
 static uint32_t gap_sdp_handle = 0;
 static uint32_t serial_num = 0;
@@ -275,20 +373,272 @@ static sdp_record_t *server_record_new(uuid_t *uuid, uint16_t start, uint16_t en
 	return record;
 }
 
-static int handle_cmp(gconstpointer a, gconstpointer b)
+static guint uuid_hash(gconstpointer key)
+{
+	const bt_uuid_t *uuid = key;
+	guint i, h = 0;
+
+	for (i = 0; i < sizeof(uuid->value.u128.data); i++)
+		h = h * 31 + uuid->value.u128.data[i];
+
+	return h;
+}
+
+static gboolean uuid_equal(gconstpointer a, gconstpointer b)
+{
+	return bt_uuid_cmp(a, b) == 0;
+}
+
+static void handles_free(gpointer data)
+{
+	g_array_free(data, TRUE);
+}
+
+static gboolean is_service_decl(const bt_uuid_t *uuid)
+{
+	return bt_uuid_cmp(uuid, &prim_uuid) == 0 ||
+					bt_uuid_cmp(uuid, &snd_uuid) == 0;
+}
+
+/* Declarations, whose values only change along with the database layout */
+static gboolean is_decl(const bt_uuid_t *uuid)
+{
+	return is_service_decl(uuid) || bt_uuid_cmp(uuid, &inc_uuid) == 0 ||
+					bt_uuid_cmp(uuid, &char_uuid) == 0;
+}
+
+/* Index of the first handle not below handle in a sorted handle array */
+static guint handles_bsearch(GArray *handles, guint handle)
+{
+	guint lo = 0, hi = handles->len;
+
+	while (lo < hi) {
+		guint mid = (lo + hi) / 2;
+
+		if (g_array_index(handles, uint16_t, mid) < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void handles_insert(GArray *handles, uint16_t handle)
+{
+	g_array_insert_val(handles, handles_bsearch(handles, handle), handle);
+}
+
+static void handles_remove(GArray *handles, uint16_t handle)
+{
+	guint i = handles_bsearch(handles, handle);
+
+	if (i < handles->len && g_array_index(handles, uint16_t, i) == handle)
+		g_array_remove_index(handles, i);
+}
+
+static struct attribute *db_lookup(uint16_t handle)
+{
+	if (handle >= db_size)
+		return NULL;
+
+	return db_attrs[handle];
+}
+
+/* Sorted handles of the attributes of a type, NULL if there are none */
+static GArray *db_type_handles(const bt_uuid_t *uuid)
+{
+	bt_uuid_t u128;
+
+	if (db_types == NULL)
+		return NULL;
+
+	bt_uuid_to_uuid128(uuid, &u128);
+
+	return g_hash_table_lookup(db_types, &u128);
+}
+
+/* Highest handle in use not above handle, 0x0000 if there is none */
+static uint16_t db_prev_handle(uint16_t handle)
+{
+	for (; handle > 0x0000; handle--)
+		if (db_lookup(handle))
+			return handle;
+
+	return 0x0000;
+}
+
+/* Last handle of the group an attribute belongs to, that is the one before
+ * the next service declaration or the last handle of the database */
+static uint16_t db_group_end(uint16_t handle)
+{
+	guint i = handles_bsearch(db_services, handle + 1);
+
+	if (i == db_services->len)
+		return db_last;
+
+	return db_prev_handle(g_array_index(db_services, uint16_t, i) - 1);
+}
+
+static void db_index_add(struct attribute *a)
+{
+	GArray *handles;
+	bt_uuid_t *key;
+
+	if (db_types == NULL) {
+		db_types = g_hash_table_new_full(uuid_hash, uuid_equal,
+							g_free, handles_free);
+		db_services = g_array_new(FALSE, FALSE, sizeof(uint16_t));
+	}
+
+	handles = db_type_handles(&a->uuid);
+	if (handles == NULL) {
+		key = g_new(bt_uuid_t, 1);
+		bt_uuid_to_uuid128(&a->uuid, key);
+		handles = g_array_new(FALSE, FALSE, sizeof(uint16_t));
+		g_hash_table_insert(db_types, key, handles);
+	}
+
+	handles_insert(handles, a->handle);
+
+	if (is_service_decl(&a->uuid))
+		handles_insert(db_services, a->handle);
+}
+
+static void db_index_remove(struct attribute *a)
+{
+	GArray *handles;
+	bt_uuid_t u128;
+
+	handles = db_type_handles(&a->uuid);
+	if (handles == NULL)
+		return;
+
+	handles_remove(handles, a->handle);
+	if (handles->len == 0) {
+		bt_uuid_to_uuid128(&a->uuid, &u128);
+		g_hash_table_remove(db_types, &u128);
+	}
+
+	if (is_service_decl(&a->uuid))
+		handles_remove(db_services, a->handle);
+}
+
+static void db_store(uint16_t handle, struct attribute *a)
 {
-	const struct attribute *attrib = a;
-	uint16_t handle = GPOINTER_TO_UINT(b);
+	if (handle >= db_size) {
+		guint size = MAX(db_size, 64);
+
+		while (size <= handle)
+			size *= 2;
+
+		size = MIN(size, 0x10000);
+		db_attrs = g_renew(struct attribute *, db_attrs, size);
+		memset(&db_attrs[db_size], 0,
+				(size - db_size) * sizeof(struct attribute *));
+		db_size = size;
+	}
+
+	db_attrs[handle] = a;
 
-	return attrib->handle - handle;
+	if (a != NULL && handle > db_last)
+		db_last = handle;
+	else if (a == NULL && handle == db_last)
+		db_last = db_prev_handle(handle);
 }
 
-static int attribute_cmp(gconstpointer a1, gconstpointer a2)
+static void db_changed(void)
 {
-	const struct attribute *attrib1 = a1;
-	const struct attribute *attrib2 = a2;
+	db_generation++;
+}
+
+static guint resp_key_hash(gconstpointer key)
+{
+	const uint8_t *data = key;
+	guint i, h = 0;
+
+	for (i = 0; i < sizeof(struct resp_key); i++)
+		h = h * 31 + data[i];
+
+	return h;
+}
+
+static gboolean resp_key_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, sizeof(struct resp_key)) == 0;
+}
+
+static void resp_key_init(struct resp_key *key, uint8_t opcode,
+				uint16_t start, uint16_t end, bt_uuid_t *uuid,
+				const uint8_t *value, int vlen, int mtu)
+{
+	/* keys are hashed and compared as a whole, padding included */
+	memset(key, 0, sizeof(*key));
+
+	key->opcode = opcode;
+	key->start = start;
+	key->end = end;
+	key->mtu = mtu;
+
+	if (uuid)
+		bt_uuid_to_uuid128(uuid, &key->uuid);
+
+	if (value && vlen > 0 && vlen <= (int) sizeof(key->value)) {
+		memcpy(key->value, value, vlen);
+		key->vlen = vlen;
+	}
+}
+
+/* Copies the cached response into pdu, returns its length or 0 */
+static int resp_cache_get(const struct resp_key *key, uint8_t *pdu, int len)
+{
+	struct resp_entry *entry;
+
+	if (resp_cache == NULL)
+		return 0;
+
+	entry = g_hash_table_lookup(resp_cache, key);
+	if (entry == NULL || entry->generation != db_generation ||
+							entry->len > len)
+		return 0;
+
+	memcpy(pdu, entry->pdu, entry->len);
+
+	return entry->len;
+}
+
+/* Caches an encoded response, returns its length */
+static int resp_cache_put(const struct resp_key *key, const uint8_t *pdu,
+								int len)
+{
+	struct resp_entry *entry;
+
+	if (len <= 0)
+		return len;
+
+	if (resp_cache == NULL)
+		resp_cache = g_hash_table_new_full(resp_key_hash,
+						resp_key_equal, NULL, g_free);
+
+	/* Whatever the generation, start over rather than grow unbounded */
+	if (g_hash_table_size(resp_cache) >= RESP_CACHE_MAX)
+		g_hash_table_remove_all(resp_cache);
+
+	entry = g_malloc(sizeof(struct resp_entry) + len);
+	entry->key = *key;
+	entry->generation = db_generation;
+	entry->len = len;
+	memcpy(entry->pdu, pdu, len);
+
+	g_hash_table_replace(resp_cache, &entry->key, entry);
+
+	return len;
+}
 
-	return attrib1->handle - attrib2->handle;
+/* Whether reading an attribute gives the same result on every channel */
+static gboolean attr_is_static(struct attribute *a)
+{
+	return a->read_reqs == ATT_NONE && a->read_cb == NULL;
 }
 
 static uint8_t att_check_reqs(struct gatt_channel *channel, uint8_t opcode,
@@ -321,77 +671,276 @@ static uint8_t att_check_reqs(struct gatt_channel *channel, uint8_t opcode,
 	return 0;
 }
 
-static void make_cli_cfg_name(char *dst, struct gatt_channel *channel)
+static void make_cli_cfg_name(char *dst, struct cli_cfg_peer *peer,
+							const char *prefix)
 {
 	char srcstr[18];
 	char dststr[18 + 7];
+	size_t len = strlen(prefix);
 
-	ba2str(&channel->src, srcstr);
-	memcpy(dststr, "clicfg_", 7);
-	ba2str(&channel->dst, &dststr[7]);
+	ba2str(&peer->src, srcstr);
+	memcpy(dststr, prefix, len);
+	ba2str(&peer->dst, &dststr[len]);
 	create_name(dst, PATH_MAX, STORAGEDIR, srcstr, dststr);
 }
 
-static void cache_cli_cfg(struct gatt_channel *channel, uint16_t handle,
-								uint8_t *val)
+static struct cli_cfg_entry *cli_cfg_find(struct cli_cfg_peer *peer,
+							uint16_t handle)
 {
-	char filename[PATH_MAX + 1];
-	char key[5];
-	char value[9];
-	int i, j;
-	uint16_t cfg_val = att_get_u16(val);
+	struct cli_cfg_entry *e;
+	guint i;
+
+	for (i = 0; i < peer->entries->len; i++) {
+		e = &g_array_index(peer->entries, struct cli_cfg_entry, i);
+		if (e->handle == handle)
+			return e;
+	}
 
-	make_cli_cfg_name(filename, channel);
+	return NULL;
+}
 
-	snprintf(key, sizeof(key), "%4.4X", handle);
+/* Snapshot: the version byte, then a little endian handle and value for
+ * each entry */
+static void cli_cfg_save(struct cli_cfg_peer *peer)
+{
+	char filename[PATH_MAX + 1];
+	GError *gerr = NULL;
+	uint8_t *buf, *ptr;
+	gsize len;
+	guint i;
 
-	if (!cfg_val) {
-		textfile_del(filename, key);
+	make_cli_cfg_name(filename, peer, CLI_CFG_PREFIX);
+	peer->dirty = FALSE;
+
+	if (peer->entries->len == 0) {
+		delete_file(filename);
 		return;
 	}
 
+	len = 1 + peer->entries->len * CLI_CFG_ENTRY_SIZE;
+	buf = g_malloc(len);
+	buf[0] = CLI_CFG_VERSION;
+
+	for (i = 0, ptr = &buf[1]; i < peer->entries->len; i++) {
+		struct cli_cfg_entry *e = &g_array_index(peer->entries,
+						struct cli_cfg_entry, i);
+
+		att_put_u16(e->handle, ptr);
+		att_put_u32(e->value, ptr + 2);
+		ptr += CLI_CFG_ENTRY_SIZE;
+	}
+
 	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
-	if (cfg_val && handle == svc_chg_handle + 1)
-		snprintf(value, sizeof(value), "%8.8X", serial_num);
-	else
-		for (j = i = 0; i < 2; i++, j += 2)
-			snprintf(&value[j], 3, "%2.2X", val[i]);
+	if (!g_file_set_contents(filename, (gchar *) buf, len, &gerr)) {
+		error("Unable to store %s: %s", filename, gerr->message);
+		g_error_free(gerr);
+		peer->dirty = TRUE;
+	}
 
-	textfile_put(filename, key, value);
+	g_free(buf);
 }
 
-static uint16_t read_cli_cfg(struct gatt_channel *channel, uint16_t handle,
-								uint8_t *dst)
+static void cli_cfg_peer_free(struct cli_cfg_peer *peer)
 {
-	char filename[PATH_MAX + 1];
-	char key[5];
+	g_array_free(peer->entries, TRUE);
+	g_free(peer);
+}
+
+/* Saves the pending changes and drops the tables of the peers no longer
+ * connected, unless they still could not be written */
+static void cli_cfg_flush(void)
+{
+	GSList *l, *next;
+
+	if (cli_cfg_flush_id) {
+		g_source_remove(cli_cfg_flush_id);
+		cli_cfg_flush_id = 0;
+	}
+
+	for (l = cli_cfg_peers; l; l = next) {
+		struct cli_cfg_peer *peer = l->data;
+
+		next = l->next;
+
+		if (peer->dirty)
+			cli_cfg_save(peer);
+
+		if (peer->refs || peer->dirty)
+			continue;
+
+		cli_cfg_peers = g_slist_delete_link(cli_cfg_peers, l);
+		cli_cfg_peer_free(peer);
+	}
+}
+
+static gboolean cli_cfg_flush_cb(gpointer user_data)
+{
+	cli_cfg_flush_id = 0;
+	cli_cfg_flush();
+
+	return FALSE;
+}
+
+/* Changes are written back together, CLI_CFG_FLUSH_DELAY after the first
+ * one or when a client disconnects */
+static void cli_cfg_changed(struct cli_cfg_peer *peer)
+{
+	peer->dirty = TRUE;
+
+	if (!cli_cfg_flush_id)
+		cli_cfg_flush_id = g_timeout_add_seconds(CLI_CFG_FLUSH_DELAY,
+						cli_cfg_flush_cb, NULL);
+}
+
+static void cli_cfg_set(struct cli_cfg_peer *peer, uint16_t handle,
+							uint32_t value)
+{
+	struct cli_cfg_entry *e = cli_cfg_find(peer, handle);
+	struct cli_cfg_entry entry;
+
+	if (e && e->value == value)
+		return;
+
+	if (e)
+		e->value = value;
+	else {
+		entry.handle = handle;
+		entry.value = value;
+		g_array_append_val(peer->entries, entry);
+	}
+
+	cli_cfg_changed(peer);
+}
+
+static void cli_cfg_del(struct cli_cfg_peer *peer, uint16_t handle)
+{
+	struct cli_cfg_entry *e = cli_cfg_find(peer, handle);
+
+	if (e == NULL)
+		return;
+
+	g_array_remove_index_fast(peer->entries, e -
+			&g_array_index(peer->entries, struct cli_cfg_entry, 0));
+
+	cli_cfg_changed(peer);
+}
+
+/* Entry of the text files the configurations were stored in before */
+static void cli_cfg_import(char *key, char *value, void *user_data)
+{
+	struct cli_cfg_peer *peer = user_data;
+	uint16_t handle = (uint16_t) strtol(key, NULL, 16);
+	uint8_t buf[2] = { 0, 0 };
 	char tmp[3];
-	char *val;
+	int i;
 
-	make_cli_cfg_name(filename, channel);
+	if (handle == svc_chg_handle + 1) {
+		cli_cfg_set(peer, handle, (uint32_t) strtoul(value, NULL, 16));
+		return;
+	}
 
-	snprintf(key, sizeof(key), "%4.4X", handle);
-	val = textfile_get(filename, key);
+	tmp[2] = 0;
+	for (i = 0; i < 2 && value[i * 2] && value[i * 2 + 1]; i++) {
+		tmp[0] = value[i * 2];
+		tmp[1] = value[i * 2 + 1];
+		buf[i] = (uint8_t) strtol(tmp, NULL, 16);
+	}
 
-	/* Default to all off */
-	att_put_u16(0x0000, dst);
+	cli_cfg_set(peer, handle, att_get_u16(buf));
+}
 
-	/* Special handling of SCI config, where any non-NULL returns 0x0002 */
-	if (val && handle == svc_chg_handle + 1)
-		att_put_u16(0x0002, dst);
-	else if (val) {
-		int i, vlen = MIN(2, strlen(val) / 2);
-
-		tmp[2] = 0;
-		for (i = 0; i < vlen; i++) {
-			tmp[0] = val[i * 2];
-			tmp[1] = val[i * 2 + 1];
-			dst[i] = (uint8_t) strtol(tmp, NULL, 16);
+static void cli_cfg_load(struct cli_cfg_peer *peer)
+{
+	char filename[PATH_MAX + 1];
+	struct cli_cfg_entry entry;
+	gchar *buf;
+	gsize len, i;
+
+	make_cli_cfg_name(filename, peer, CLI_CFG_PREFIX);
+
+	if (!g_file_get_contents(filename, &buf, &len, NULL)) {
+		make_cli_cfg_name(filename, peer, "clicfg_");
+		if (textfile_foreach(filename, cli_cfg_import, peer) == 0) {
+			cli_cfg_save(peer);
+			delete_file(filename);
+		}
+		return;
+	}
+
+	if (len < 1 || buf[0] != CLI_CFG_VERSION ||
+				(len - 1) % CLI_CFG_ENTRY_SIZE) {
+		error("Invalid client configuration file %s", filename);
+		g_free(buf);
+		return;
+	}
+
+	for (i = 1; i < len; i += CLI_CFG_ENTRY_SIZE) {
+		entry.handle = att_get_u16(&buf[i]);
+		entry.value = att_get_u32(&buf[i + 2]);
+		g_array_append_val(peer->entries, entry);
+	}
+
+	g_free(buf);
+}
+
+/* The table of the peer, loaded on its first connection and kept until
+ * the last one is gone and the table is saved */
+static struct cli_cfg_peer *cli_cfg_peer_get(bdaddr_t *src, bdaddr_t *dst)
+{
+	struct cli_cfg_peer *peer;
+	GSList *l;
+
+	for (l = cli_cfg_peers; l; l = l->next) {
+		peer = l->data;
+
+		if (!bacmp(&peer->src, src) && !bacmp(&peer->dst, dst)) {
+			peer->refs++;
+			return peer;
 		}
 	}
 
-	g_free(val);
+	peer = g_new0(struct cli_cfg_peer, 1);
+	bacpy(&peer->src, src);
+	bacpy(&peer->dst, dst);
+	peer->entries = g_array_new(FALSE, FALSE,
+					sizeof(struct cli_cfg_entry));
+
+	peer->refs = 1;
+
+	cli_cfg_load(peer);
+
+	cli_cfg_peers = g_slist_prepend(cli_cfg_peers, peer);
+
+	return peer;
+}
+
+static void cache_cli_cfg(struct gatt_channel *channel, uint16_t handle,
+								uint8_t *val)
+{
+	uint16_t cfg_val = att_get_u16(val);
+
+	if (!cfg_val)
+		cli_cfg_del(channel->cli_cfg, handle);
+	else if (handle == svc_chg_handle + 1)
+		cli_cfg_set(channel->cli_cfg, handle, serial_num);
+	else
+		cli_cfg_set(channel->cli_cfg, handle, cfg_val);
+}
+
+static uint16_t read_cli_cfg(struct gatt_channel *channel, uint16_t handle,
+								uint8_t *dst)
+{
+	struct cli_cfg_entry *e = cli_cfg_find(channel->cli_cfg, handle);
+
+	/* Default to all off */
+	att_put_u16(0x0000, dst);
+
+	/* Special handling of SCI config, where any entry returns 0x0002 */
+	if (e && handle == svc_chg_handle + 1)
+		att_put_u16(0x0002, dst);
+	else if (e)
+		att_put_u16(e->value, dst);
 
 	return att_get_u16(dst);
 }
@@ -421,31 +970,30 @@ static uint8_t client_set_configurations(struct attribute *attr,
 							gpointer user_data)
 {
 	struct gatt_channel *channel = user_data;
-	struct attribute *last_chr_val = NULL;
-	uint16_t handle = 0;
+	struct attribute *chr, *last_chr_val;
+	uint16_t handle;
 	uint16_t cfg_val;
 	uint8_t props;
-	GSList *l;
+	GArray *chrs;
+	guint i;
 
 	cfg_val = att_get_u16(attr->data);
 
-	/* Search correct for builtin Characteristic Value Handle */
-	for (l = database, props = 0; l != NULL; l = l->next) {
-		struct attribute *a = l->data;
-
-		if (a->handle >= attr->handle)
-			break;
+	/* The builtin Characteristic Value is declared by the last
+	 * Characteristic before the descriptor */
+	chrs = db_type_handles(&char_uuid);
+	i = chrs ? handles_bsearch(chrs, attr->handle) : 0;
+	if (i == 0)
+		return 0;
 
-		if (bt_uuid_cmp(&a->uuid, &char_uuid) == 0) {
-			props = att_get_u8(&a->data[0]);
-			handle = att_get_u16(&a->data[1]);
-			continue;
-		}
+	chr = db_lookup(g_array_index(chrs, uint16_t, i - 1));
+	props = att_get_u8(&chr->data[0]);
+	handle = att_get_u16(&chr->data[1]);
 
-		if (handle && a->handle == handle)
-			last_chr_val = a;
-	}
+	if (handle >= attr->handle)
+		return 0;
 
+	last_chr_val = db_lookup(handle);
 	if (last_chr_val == NULL)
 		return 0;
 
@@ -466,17 +1014,18 @@ static uint8_t client_set_configurations(struct attribute *attr,
 	if (last_chr_val->handle == svc_chg_handle)
 		return 0;
 
+	/* Handles, the attributes move when the database is updated */
+	channel->notify = g_slist_remove(channel->notify,
+						GUINT_TO_POINTER(handle));
 	if (cfg_val & 0x0001)
-		channel->notify = g_slist_append(channel->notify, last_chr_val);
-	else
-		channel->notify = g_slist_remove(channel->notify, last_chr_val);
+		channel->notify = g_slist_append(channel->notify,
+						GUINT_TO_POINTER(handle));
 
+	channel->indicate = g_slist_remove(channel->indicate,
+						GUINT_TO_POINTER(handle));
 	if (cfg_val & 0x0002)
 		channel->indicate = g_slist_append(channel->indicate,
-								last_chr_val);
-	else
-		channel->indicate = g_slist_remove(channel->indicate,
-								last_chr_val);
+						GUINT_TO_POINTER(handle));
 
 	return 0;
 }
@@ -727,7 +1276,250 @@ static gboolean is_channel_valid(gpointer data)
 		}
 	}
 
-	return FALSE;
+	return FALSE;
+}
+
+/* Methods whose replies describe the layout of a server, which does not
+ * change while it is registered, rather than attribute values */
+static const char *layout_methods[] = {
+	"ReadByGroup",
+	"ReadByChar",
+	"ReadByInc",
+	"FindInfo",
+	"FindByPrim",
+	NULL
+};
+
+static struct gatt_server *find_gatt_server(const char *path);
+
+static guint64 monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (guint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static gboolean is_layout_method(const char *member)
+{
+	int i;
+
+	for (i = 0; layout_methods[i]; i++)
+		if (g_str_equal(layout_methods[i], member))
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Identifies a call by its method and arguments, NULL if it cannot be */
+static char *server_call_key(DBusMessage *msg)
+{
+	DBusMessageIter iter, array;
+	const unsigned char *bytes;
+	const char *str;
+	dbus_uint16_t u16;
+	dbus_uint32_t u32;
+	GString *key;
+	int i, n;
+
+	key = g_string_new(dbus_message_get_member(msg));
+
+	if (!dbus_message_iter_init(msg, &iter))
+		return g_string_free(key, FALSE);
+
+	do {
+		switch (dbus_message_iter_get_arg_type(&iter)) {
+		case DBUS_TYPE_UINT16:
+			dbus_message_iter_get_basic(&iter, &u16);
+			g_string_append_printf(key, " %u", u16);
+			break;
+		case DBUS_TYPE_UINT32:
+			dbus_message_iter_get_basic(&iter, &u32);
+			g_string_append_printf(key, " %u", u32);
+			break;
+		case DBUS_TYPE_STRING:
+		case DBUS_TYPE_OBJECT_PATH:
+			dbus_message_iter_get_basic(&iter, &str);
+			g_string_append_printf(key, " %s", str);
+			break;
+		case DBUS_TYPE_ARRAY:
+			if (dbus_message_iter_get_element_type(&iter) !=
+							DBUS_TYPE_BYTE)
+				goto failed;
+
+			dbus_message_iter_recurse(&iter, &array);
+			dbus_message_iter_get_fixed_array(&array, &bytes, &n);
+
+			g_string_append_c(key, ' ');
+			for (i = 0; i < n; i++)
+				g_string_append_printf(key, "%2.2x", bytes[i]);
+			break;
+		default:
+			goto failed;
+		}
+	} while (dbus_message_iter_next(&iter));
+
+	return g_string_free(key, FALSE);
+
+failed:
+	g_string_free(key, TRUE);
+	return NULL;
+}
+
+static void server_reply_free(gpointer data)
+{
+	struct server_reply *kept = data;
+
+	dbus_message_unref(kept->reply);
+	g_free(kept);
+}
+
+static void server_call_free(void *data)
+{
+	struct server_call *pending = data;
+
+	g_free(pending->path);
+	g_free(pending->key);
+	g_free(pending);
+}
+
+static gboolean is_value_reply(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct server_reply *kept = value;
+
+	return kept->expires != 0;
+}
+
+/* Drops the kept replies carrying values of a server, which notified,
+ * indicated or was written to */
+static void server_values_changed(struct gatt_server *server)
+{
+	server->values_serial++;
+
+	if (server->replies)
+		g_hash_table_foreach_remove(server->replies, is_value_reply,
+									NULL);
+}
+
+static void server_keep_reply(struct gatt_server *server,
+				struct server_call *pending, DBusMessage *reply)
+{
+	struct server_reply *kept;
+
+	if (server->replies == NULL)
+		server->replies = g_hash_table_new_full(g_str_hash,
+					g_str_equal, g_free, server_reply_free);
+
+	if (g_hash_table_size(server->replies) >= SERVER_REPLIES_MAX)
+		g_hash_table_remove_all(server->replies);
+
+	kept = g_new0(struct server_reply, 1);
+	kept->reply = dbus_message_ref(reply);
+
+	if (!pending->layout)
+		kept->expires = monotonic_ms() + SERVER_VALUE_TTL;
+
+	g_hash_table_replace(server->replies, g_strdup(pending->key), kept);
+}
+
+/*
+ * Sends channel->msg to a server, reply is called once it answers. When a
+ * reply to the same call is kept, reply is called right away with a NULL
+ * pending call instead. The reply handlers get the reply from
+ * server_reply_take().
+ */
+static gboolean server_call(struct gatt_channel *channel,
+				struct gatt_server *server,
+				DBusPendingCallNotifyFunction reply)
+{
+	struct server_reply *kept = NULL;
+	struct server_call *pending;
+	char *key;
+
+	key = server_call_key(channel->msg);
+
+	if (key && server->replies)
+		kept = g_hash_table_lookup(server->replies, key);
+
+	if (kept && kept->expires && kept->expires <= monotonic_ms()) {
+		g_hash_table_remove(server->replies, key);
+		kept = NULL;
+	}
+
+	if (kept) {
+		DBG("Kept reply to %s", key);
+		g_free(key);
+
+		dbus_message_unref(channel->msg);
+		channel->msg = NULL;
+
+		kept_reply = dbus_message_ref(kept->reply);
+		reply(NULL, channel);
+		return TRUE;
+	}
+
+	if (!dbus_connection_send_with_reply(connection, channel->msg,
+					&channel->call, REQUEST_TIMEOUT)) {
+		g_free(key);
+		return FALSE;
+	}
+
+	if (key && (server_call_slot >= 0 ||
+			dbus_pending_call_allocate_data_slot(&server_call_slot))) {
+		pending = g_new0(struct server_call, 1);
+		pending->path = g_strdup(server->path);
+		pending->key = key;
+		pending->layout = is_layout_method(
+					dbus_message_get_member(channel->msg));
+		pending->generation = db_generation;
+		pending->values_serial = server->values_serial;
+
+		dbus_pending_call_set_data(channel->call, server_call_slot,
+						pending, server_call_free);
+	} else
+		g_free(key);
+
+	dbus_pending_call_set_notify(channel->call, reply, channel, NULL);
+
+	return TRUE;
+}
+
+/* Returns the reply a handler passed to server_call() was called for,
+ * keeping it for the calls to come when the server answered the call */
+static DBusMessage *server_reply_take(DBusPendingCall *call)
+{
+	struct server_call *pending = NULL;
+	struct gatt_server *server;
+	DBusMessage *message;
+
+	if (call == NULL) {
+		message = kept_reply;
+		kept_reply = NULL;
+		return message;
+	}
+
+	/* steal_reply will always return non-NULL since the callback
+	 * is only called after a reply has been received */
+	message = dbus_pending_call_steal_reply(call);
+
+	if (server_call_slot >= 0)
+		pending = dbus_pending_call_get_data(call, server_call_slot);
+
+	if (pending == NULL || dbus_message_get_type(message) !=
+					DBUS_MESSAGE_TYPE_METHOD_RETURN)
+		return message;
+
+	/* The server may have gone or changed while the call was pending */
+	server = find_gatt_server(pending->path);
+	if (server == NULL || pending->generation != db_generation ||
+			pending->values_serial != server->values_serial)
+		return message;
+
+	server_keep_reply(server, pending, message);
+
+	return message;
 }
 
 static void dbus_read_by_group(struct gatt_channel *channel, uint16_t start,
@@ -751,9 +1543,7 @@ static void read_by_group_reply(DBusPendingCall *call, void *user_data)
 	/* Init handle to end of this server in case of error */
 	handle = server->base + server->count;
 
-	/* steal_reply will always return non-NULL since the callback
-	 * is only called after a reply has been received */
-	message = dbus_pending_call_steal_reply(call);
+	message = server_reply_take(call);
 
 	if (!is_channel_valid(channel)) {
 		dbus_message_unref(message);
@@ -924,15 +1714,12 @@ static void dbus_read_by_group(struct gatt_channel *channel, uint16_t start,
 
 	DBG(" Calling Server %s, %s", server->name, server->path);
 
-	if (!dbus_connection_send_with_reply(connection, channel->msg,
-					&channel->call, REQUEST_TIMEOUT)) {
+	channel->op.server = server;
+	if (!server_call(channel, server, read_by_group_reply)) {
 		DBG(" Failed try to: %s + %s -- Cleanup and recurse", server->name, server->path);
 		goto failed_dbus;
 	}
 
-	channel->op.server = server;
-	dbus_pending_call_set_notify(channel->call, read_by_group_reply,
-								channel, NULL);
 	DBG(" Server Pending %s, %s", server->name, server->path);
 
 	return;
@@ -983,12 +1770,15 @@ static int read_by_group(struct gatt_channel *channel, uint16_t start,
 						uint8_t *pdu, int len)
 {
 	struct att_data_list *adl = NULL;
+	struct resp_key key;
 	struct attribute *a;
-	struct group_elem *cur, *old = NULL;
+	struct group_elem *cur;
 	GSList *l, *groups;
-	uint16_t length = 0, last_handle, last_size = 0;
+	GArray *handles;
+	uint16_t length = 0, last_size = 0;
 	uint8_t status;
-	gboolean terminated = FALSE;
+	gboolean terminated = FALSE, cacheable = TRUE;
+	guint idx;
 	int i;
 
 	{
@@ -1019,39 +1809,25 @@ static int read_by_group(struct gatt_channel *channel, uint16_t start,
 	if (gatt_server_list && gatt_server_list->base <= start)
 		goto empty_list;
 
-	last_handle = end;
-	for (l = database, groups = NULL, cur = NULL; l; l = l->next) {
-		a = l->data;
-
-		DBG("a->handle:0x%04x", a->handle);
+	resp_key_init(&key, ATT_OP_READ_BY_GROUP_REQ, start, end, uuid, NULL,
+								0, len);
+	length = resp_cache_get(&key, pdu, len);
+	if (length > 0)
+		return length;
 
-		if (a->handle < start)
-			continue;
+	/* Only the declarations of the grouping type are visited, their
+	 * groups end before the next service declaration */
+	handles = db_type_handles(uuid);
+	idx = handles ? handles_bsearch(handles, start) : 0;
+	for (groups = NULL; handles && idx < handles->len; idx++) {
+		a = db_lookup(g_array_index(handles, uint16_t, idx));
 
 		if (a->handle >= end) {
 			terminated = TRUE;
 			break;
 		}
 
-		/* The old group ends when a new one starts */
-		if (old && (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0)) {
-			old->end = last_handle;
-			old = NULL;
-		}
-
-		if (bt_uuid_cmp(&a->uuid, uuid) != 0) {
-			char uuid_buf[MAX_LEN_UUID_STR];
-			uuid_buf[0] = 0;
-			bt_uuid_to_string(&a->uuid, uuid_buf, MAX_LEN_UUID_STR);
-			/* Still inside a service, update its last handle */
-			DBG("not found h:0x%04x %s", a->handle, uuid_buf);
-			if (old)
-				last_handle = a->handle;
-			continue;
-		} else {
-			DBG("found h:0x%04x", a->handle);
-		}
+		DBG("found h:0x%04x", a->handle);
 
 		if (last_size && (last_size != a->len)) {
 			terminated = TRUE;
@@ -1074,6 +1850,9 @@ static int read_by_group(struct gatt_channel *channel, uint16_t start,
 
 		cur = g_new0(struct group_elem, 1);
 		cur->handle = a->handle;
+		cur->end = db_group_end(a->handle);
+		if (cur->end >= end)
+			cur->end = db_prev_handle(end - 1);
 		cur->data = a->data;
 		cur->len = a->len;
 
@@ -1081,25 +1860,26 @@ static int read_by_group(struct gatt_channel *channel, uint16_t start,
 		groups = g_slist_append(groups, cur);
 
 		last_size = a->len;
-		old = cur;
-		last_handle = cur->handle;
+
+		if (!attr_is_static(a))
+			cacheable = FALSE;
 	}
 
+	/* Builtin attributes follow the range */
+	if (db_last >= end)
+		terminated = TRUE;
+
 	if (groups == NULL) {
 		DBG(" Built-in: ATT_ECODE_ATTR_NOT_FOUND");
 		if (terminated || gatt_server_list == NULL ||
 						gatt_server_list->base > end)
-			return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, start,
-					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
+			return resp_cache_put(&key, pdu,
+				enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, start,
+					ATT_ECODE_ATTR_NOT_FOUND, pdu, len));
 		else
 			goto empty_list;
 	}
 
-	if (l == NULL)
-		last_handle = a->handle;
-
-	cur->end = last_handle;
-
 	last_size += 4;
 	length = (len - 2) / last_size;
 
@@ -1129,6 +1909,10 @@ static int read_by_group(struct gatt_channel *channel, uint16_t start,
 
 		length = enc_read_by_grp_resp(adl, pdu, len);
 		att_data_list_free(adl);
+
+		if (cacheable)
+			resp_cache_put(&key, pdu, length);
+
 		return length;
 	}
 
@@ -1164,9 +1948,7 @@ static void read_by_chr_reply(DBusPendingCall *call, void *user_data)
 	/* Init handle to end of this server in case of error */
 	handle = server->base + server->count;
 
-	/* steal_reply will always return non-NULL since the callback
-	 * is only called after a reply has been received */
-	message = dbus_pending_call_steal_reply(call);
+	message = server_reply_take(call);
 
 	if (!is_channel_valid(channel)) {
 		dbus_message_unref(message);
@@ -1320,9 +2102,7 @@ static void read_by_inc_reply(DBusPendingCall *call, void *user_data)
 	/* Init handle to end of this server in case of error */
 	handle = server->base + server->count;
 
-	/* steal_reply will always return non-NULL since the callback
-	 * is only called after a reply has been received */
-	message = dbus_pending_call_steal_reply(call);
+	message = server_reply_take(call);
 
 	if (!is_channel_valid(channel)) {
 		dbus_message_unref(message);
@@ -1467,9 +2247,7 @@ static void read_by_type_reply(DBusPendingCall *call, void *user_data)
 	/* Init handle to end of this server in case of error */
 	handle = server->base + server->count;
 
-	/* steal_reply will always return non-NULL since the callback
-	 * is only called after a reply has been received */
-	message = dbus_pending_call_steal_reply(call);
+	message = server_reply_take(call);
 
 	if (!is_channel_valid(channel)) {
 		dbus_message_unref(message);
@@ -1620,6 +2398,7 @@ static void dbus_read_by_type(struct gatt_channel *channel, uint16_t start,
 {
 	struct gatt_server *server = gatt_server_list;
 	struct att_data_list *adl = channel->op.u.read_by_type.adl;
+	DBusPendingCallNotifyFunction reply;
 	uint16_t norm_start = 0, norm_end, length;
 	uint8_t status = ATT_ECODE_ATTR_NOT_FOUND;
 	uint16_t type = 0;
@@ -1699,25 +2478,22 @@ restart_read_by_type:
 				DBUS_TYPE_INVALID);
 	}
 
-	if (!dbus_connection_send_with_reply(connection, channel->msg,
-					&channel->call, REQUEST_TIMEOUT))
-		goto failed_dbus;
-
 	channel->op.server = server;
 
 	switch (type) {
 	case GATT_CHARAC_UUID:
-		dbus_pending_call_set_notify(channel->call, read_by_chr_reply,
-								channel, NULL);
+		reply = read_by_chr_reply;
 		break;
 	case GATT_INCLUDE_UUID:
-		dbus_pending_call_set_notify(channel->call, read_by_inc_reply,
-								channel, NULL);
+		reply = read_by_inc_reply;
 		break;
 	default:
-		dbus_pending_call_set_notify(channel->call, read_by_type_reply,
-								channel, NULL);
+		reply = read_by_type_reply;
 	}
+
+	if (!server_call(channel, server, reply))
+		goto failed_dbus;
+
 	return;
 
 failed_dbus:
@@ -1759,11 +2535,14 @@ static int read_by_type(struct gatt_channel *channel, uint16_t start,
 						uint8_t *pdu, int len)
 {
 	struct att_data_list *adl = NULL;
+	struct resp_key key;
 	GSList *l, *types;
+	GArray *handles;
 	struct attribute *a;
 	uint16_t num, length, res_len;
 	uint8_t status;
-	gboolean terminated = FALSE;
+	gboolean terminated = FALSE, cacheable;
+	guint idx;
 	int i;
 
 	DBG("start:0x%04x end:0x%04x", start, end);
@@ -1775,22 +2554,27 @@ static int read_by_type(struct gatt_channel *channel, uint16_t start,
 	if (gatt_server_list && gatt_server_list->base <= start)
 		goto empty_list;
 
-	for (l = database, length = 0, types = NULL; l; l = l->next) {
-		struct attribute *client_attr;
+	resp_key_init(&key, ATT_OP_READ_BY_TYPE_REQ, start, end, uuid, NULL,
+								0, len);
+	length = resp_cache_get(&key, pdu, len);
+	if (length > 0)
+		return length;
 
-		a = l->data;
+	/* Only the declarations are cached, other values change at will */
+	cacheable = is_decl(uuid);
 
-		if (a->handle < start)
-			continue;
+	handles = db_type_handles(uuid);
+	idx = handles ? handles_bsearch(handles, start) : 0;
+	for (length = 0, types = NULL; handles && idx < handles->len; idx++) {
+		struct attribute *client_attr;
+
+		a = db_lookup(g_array_index(handles, uint16_t, idx));
 
 		if (a->handle > end) {
 			terminated = TRUE;
 			break;
 		}
 
-		if (bt_uuid_cmp(&a->uuid, uuid) != 0)
-			continue;
-
 		client_attr = client_cfg_attribute(channel, a);
 		if (client_attr)
 			a = client_attr;
@@ -1822,13 +2606,21 @@ static int read_by_type(struct gatt_channel *channel, uint16_t start,
 			break;
 
 		types = g_slist_append(types, a);
+
+		if (!attr_is_static(a))
+			cacheable = FALSE;
 	}
 
+	/* Builtin attributes follow the range */
+	if ((handles == NULL || idx == handles->len) && db_last > end)
+		terminated = TRUE;
+
 	if (types == NULL) {
 		if (terminated || gatt_server_list == NULL ||
 						gatt_server_list->base > end)
-			return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
-					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
+			return resp_cache_put(&key, pdu,
+				enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
+					ATT_ECODE_ATTR_NOT_FOUND, pdu, len));
 		else
 			goto empty_list;
 	}
@@ -1863,6 +2655,10 @@ static int read_by_type(struct gatt_channel *channel, uint16_t start,
 
 		length = enc_read_by_type_resp(adl, pdu, len);
 		att_data_list_free(adl);
+
+		if (cacheable)
+			resp_cache_put(&key, pdu, length);
+
 		return length;
 	}
 
@@ -1898,9 +2694,7 @@ static void find_info_reply(DBusPendingCall *call, void *user_data)
 	/* Init handle to end of this server in case of error */
 	handle = server->base + server->count;
 
-	/* steal_reply will always return non-NULL since the callback
-	 * is only called after a reply has been received */
-	message = dbus_pending_call_steal_reply(call);
+	message = server_reply_take(call);
 
 	if (!is_channel_valid(channel)) {
 		dbus_message_unref(message);
@@ -2055,13 +2849,10 @@ static void dbus_find_info(struct gatt_channel *channel, uint16_t start,
 						DBUS_TYPE_UINT16, &norm_end,
 						DBUS_TYPE_INVALID);
 
-	if (!dbus_connection_send_with_reply(connection, channel->msg,
-					&channel->call, REQUEST_TIMEOUT))
+	channel->op.server = server;
+	if (!server_call(channel, server, find_info_reply))
 		goto failed_dbus;
 
-	channel->op.server = server;
-	dbus_pending_call_set_notify(channel->call, find_info_reply,
-								channel, NULL);
 	return;
 
 failed_dbus:
@@ -2108,10 +2899,12 @@ static int find_info(struct gatt_channel *channel, uint16_t start,
 {
 	struct attribute *a;
 	struct att_data_list *adl = NULL;
+	struct resp_key key;
 	GSList *l, *info;
 	uint8_t format, last_type = BT_UUID_UNSPEC;
 	uint16_t num, length, res_len;
 	gboolean terminated = FALSE;
+	guint h;
 	int i;
 
 	DBG("start:0x%04x end:0x%04x", start, end);
@@ -2123,17 +2916,17 @@ static int find_info(struct gatt_channel *channel, uint16_t start,
 	if (gatt_server_list && gatt_server_list->base <= start)
 		goto empty_list;
 
-	for (l = database, info = NULL, num = 0; l; l = l->next) {
-		a = l->data;
+	resp_key_init(&key, ATT_OP_FIND_INFO_REQ, start, end, NULL, NULL, 0,
+									len);
+	length = resp_cache_get(&key, pdu, len);
+	if (length > 0)
+		return length;
 
-		if (a->handle < start)
+	for (h = start, info = NULL, num = 0; h <= MIN(end, db_last); h++) {
+		a = db_lookup(h);
+		if (a == NULL)
 			continue;
 
-		if (a->handle > end) {
-			terminated = TRUE;
-			break;
-		}
-
 		if (last_type == BT_UUID_UNSPEC)
 			last_type = a->uuid.type;
 
@@ -2148,11 +2941,16 @@ static int find_info(struct gatt_channel *channel, uint16_t start,
 		last_type = a->uuid.type;
 	}
 
+	/* Builtin attributes follow the range */
+	if (db_last > end)
+		terminated = TRUE;
+
 	if (info == NULL) {
 		if (terminated || gatt_server_list == NULL ||
 						gatt_server_list->base > end)
-			return enc_error_resp(ATT_OP_FIND_INFO_REQ, start,
-					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
+			return resp_cache_put(&key, pdu,
+				enc_error_resp(ATT_OP_FIND_INFO_REQ, start,
+					ATT_ECODE_ATTR_NOT_FOUND, pdu, len));
 		else
 			goto empty_list;
 	}
@@ -2197,7 +2995,9 @@ static int find_info(struct gatt_channel *channel, uint16_t start,
 
 		length = enc_find_info_resp(format, adl, pdu, len);
 		att_data_list_free(adl);
-		return length;
+
+		/* Handles and types only, the same for every channel */
+		return resp_cache_put(&key, pdu, length);
 	}
 
 
@@ -2232,9 +3032,7 @@ static void find_by_type_reply(DBusPendingCall *call, void *user_data)
 	/* Init handle to end of this server in case of error */
 	start = server->base + server->count;
 
-	/* steal_reply will always return non-NULL since the callback
-	 * is only called after a reply has been received */
-	message = dbus_pending_call_steal_reply(call);
+	message = server_reply_take(call);
 
 	if (!is_channel_valid(channel)) {
 		dbus_message_unref(message);
@@ -2422,13 +3220,10 @@ static void dbus_find_by_type(struct gatt_channel *channel, uint16_t start,
 				DBUS_TYPE_INVALID);
 
 send_dbus:
-	if (!dbus_connection_send_with_reply(connection, channel->msg,
-					&channel->call, REQUEST_TIMEOUT))
+	channel->op.server = server;
+	if (!server_call(channel, server, find_by_type_reply))
 		goto failed_dbus;
 
-	channel->op.server = server;
-	dbus_pending_call_set_notify(channel->call, find_by_type_reply,
-								channel, NULL);
 	return;
 
 failed_dbus:
@@ -2475,12 +3270,15 @@ static int find_by_type(struct gatt_channel *channel, uint16_t start,
 {
 	struct attribute *a;
 	struct att_data_list *adl = NULL;
+	struct resp_key key;
 	struct att_range *range;
 	GSList *l, *matches;
+	GArray *handles;
 	bt_uuid_t srch_uuid, tmp_uuid;
 	uint16_t length;
+	guint idx;
 	int i;
-	gboolean compare, terminated = FALSE;
+	gboolean terminated = FALSE;
 
 	DBG("start:0x%04x end:0x%04x", start, end);
 
@@ -2500,66 +3298,68 @@ static int find_by_type(struct gatt_channel *channel, uint16_t start,
 	if (gatt_server_list && gatt_server_list->base <= start)
 		goto empty_list;
 
+	resp_key_init(&key, ATT_OP_FIND_BY_TYPE_REQ, start, end, uuid, value,
+								vlen, len);
+	length = resp_cache_get(&key, opdu, len);
+	if (length > 0)
+		return length;
+
 	if (vlen == sizeof(struct server_def_val128))
 		bt_uuid128_create(&srch_uuid, att_get_u128(value));
 	else
 		bt_uuid16_create(&srch_uuid, att_get_u16(value));
 
-	/* Searching first requested handle number */
-	for (l = database, matches = NULL, range = NULL; l; l = l->next) {
-		a = l->data;
-
-		if (a->handle < start)
-			continue;
+	/* Only the attributes of the type are visited, a match covers its
+	 * group up to the next match */
+	handles = db_type_handles(uuid);
+	idx = handles ? handles_bsearch(handles, start) : 0;
+	for (matches = NULL, range = NULL; handles && idx < handles->len;
+									idx++) {
+		a = db_lookup(g_array_index(handles, uint16_t, idx));
 
-		if (a->handle > end) {
-			terminated = TRUE;
+		if (a->handle > end)
 			break;
-		}
 
 		/* Convert attribute value to UUID for generic UUID compares */
-		if (a->len == sizeof(struct server_def_val16) ||
-				a->len == sizeof(struct server_def_val128)) {
-			compare = TRUE;
-			if (a->len == sizeof(struct server_def_val128))
-				bt_uuid128_create(&tmp_uuid,
-						att_get_u128(a->data));
-			else
-				bt_uuid16_create(&tmp_uuid,
-						att_get_u16(a->data));
-		} else {
-			compare = FALSE;
-		}
+		if (a->len == sizeof(struct server_def_val128))
+			bt_uuid128_create(&tmp_uuid, att_get_u128(a->data));
+		else if (a->len == sizeof(struct server_def_val16))
+			bt_uuid16_create(&tmp_uuid, att_get_u16(a->data));
+		else
+			continue;
 
 		/* Attribute value UUID matches? */
-		if (compare && bt_uuid_cmp(&a->uuid, uuid) == 0 &&
-				bt_uuid_cmp(&tmp_uuid, &srch_uuid) == 0) {
-
-			range = g_new0(struct att_range, 1);
-			range->start = a->handle;
-			/* It is allowed to have end group handle the same as
-			 * start handle, for groups with only one attribute. */
-			range->end = a->handle;
-
-			matches = g_slist_append(matches, range);
-		} else if (range) {
-			/* Update the last found handle or reset the pointer
-			 * to track that a new group started: Primary or
-			 * Secondary service. */
-			if (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-					bt_uuid_cmp(&a->uuid, &snd_uuid) == 0)
-				range = NULL;
-			else
-				range->end = a->handle;
-		}
+		if (bt_uuid_cmp(&tmp_uuid, &srch_uuid) != 0)
+			continue;
+
+		if (range && range->end >= a->handle)
+			range->end = db_prev_handle(a->handle - 1);
+
+		range = g_new0(struct att_range, 1);
+		range->start = a->handle;
+		/* It is allowed to have end group handle the same as
+		 * start handle, for groups with only one attribute. */
+		range->end = MIN(db_group_end(a->handle), end);
+		range->end = db_prev_handle(range->end);
+
+		matches = g_slist_append(matches, range);
 	}
 
+	/* Builtin attributes follow the range */
+	if (db_last > end)
+		terminated = TRUE;
+
 	if (matches == NULL) {
 		if (terminated || gatt_server_list == NULL ||
-						gatt_server_list->base > end)
-			return enc_error_resp(ATT_OP_FIND_BY_TYPE_REQ, start,
-				ATT_ECODE_ATTR_NOT_FOUND, opdu, len);
-		else
+					gatt_server_list->base > end) {
+			length = enc_error_resp(ATT_OP_FIND_BY_TYPE_REQ, start,
+					ATT_ECODE_ATTR_NOT_FOUND, opdu, len);
+
+			if (is_service_decl(uuid))
+				resp_cache_put(&key, opdu, length);
+
+			return length;
+		} else
 			goto empty_list;
 	}
 
@@ -2588,6 +3388,11 @@ static int find_by_type(struct gatt_channel *channel, uint16_t start,
 
 		length = enc_find_by_type_resp(adl, opdu, len);
 		att_data_list_free(adl);
+
+		/* Only the values of declarations are cached */
+		if (is_service_decl(uuid))
+			resp_cache_put(&key, opdu, length);
+
 		return length;
 	}
 
@@ -2607,32 +3412,18 @@ empty_list:
 static struct attribute *find_primary_range(uint16_t start, uint16_t *end)
 {
 	struct attribute *attrib;
-	guint h = start;
-	GSList *l;
 
 	if (end == NULL)
 		return NULL;
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	attrib = db_lookup(start);
+	if (attrib == NULL)
 		return NULL;
 
-	attrib = l->data;
-
 	if (bt_uuid_cmp(&attrib->uuid, &prim_uuid) != 0)
 		return NULL;
 
-	*end = start;
-
-	for (l = l->next; l; l = l->next) {
-		struct attribute *a = l->data;
-
-		if (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0)
-			break;
-
-		*end = a->handle;
-	}
+	*end = db_group_end(start);
 
 	return attrib;
 }
@@ -2656,9 +3447,7 @@ static void read_reply(DBusPendingCall *call, void *user_data)
 
 	DBG("");
 
-	/* steal_reply will always return non-NULL since the callback
-	 * is only called after a reply has been received */
-	message = dbus_pending_call_steal_reply(call);
+	message = server_reply_take(call);
 
 	if (!is_channel_valid(channel)) {
 		dbus_message_unref(message);
@@ -2787,14 +3576,12 @@ static void dbus_read(struct gatt_channel *channel, uint16_t handle)
 						DBUS_TYPE_STRING, &auth,
 						DBUS_TYPE_INVALID);
 
-	if (!dbus_connection_send_with_reply(connection, channel->msg,
-					&channel->call, REQUEST_TIMEOUT)) {
+	channel->op.server = server;
+	if (!server_call(channel, server, read_reply)) {
 		att_err = ATT_ECODE_UNLIKELY;
 		goto failed_dbus;
 	}
 
-	channel->op.server = server;
-	dbus_pending_call_set_notify(channel->call, read_reply, channel, NULL);
 	return;
 
 failed_dbus:
@@ -2823,8 +3610,6 @@ static int read_value(struct gatt_channel *channel, uint16_t handle,
 {
 	struct attribute *a, *client_attr;
 	uint8_t status;
-	GSList *l;
-	guint h = handle;
 
 	DBG("handle:0x%04x", handle);
 
@@ -2836,13 +3621,11 @@ static int read_value(struct gatt_channel *channel, uint16_t handle,
 		return -1;
 	}
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	a = db_lookup(handle);
+	if (a == NULL)
 		return enc_error_resp(ATT_OP_READ_REQ, handle,
 					ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	a = l->data;
-
 	client_attr = client_cfg_attribute(channel, a);
 	if (client_attr)
 		a = client_attr;
@@ -2864,8 +3647,6 @@ static int read_blob(struct gatt_channel *channel, uint16_t handle,
 {
 	struct attribute *a, *client_attr;
 	uint8_t status;
-	GSList *l;
-	guint h = handle;
 
 	DBG("handle:0x%04x offset:0x%04x", handle, offset);
 
@@ -2877,13 +3658,11 @@ static int read_blob(struct gatt_channel *channel, uint16_t handle,
 		return -1;
 	}
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	a = db_lookup(handle);
+	if (a == NULL)
 		return enc_error_resp(ATT_OP_READ_BLOB_REQ, handle,
 					ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	a = l->data;
-
 	client_attr = client_cfg_attribute(channel, a);
 	if (client_attr)
 		a = client_attr;
@@ -2997,6 +3776,8 @@ static void dbus_write(struct gatt_channel *channel, uint16_t handle,
 	if (handle >= server->base)
 		handle -= server->base;
 
+	server_values_changed(server);
+
 	channel->msg = dbus_message_new_method_call(server->name,
 				server->path, GATT_SERVER_INTERFACE, "Write");
 
@@ -3062,6 +3843,8 @@ static void dbus_writecmd(struct gatt_channel *channel, uint16_t handle,
 	if (handle >= server->base)
 		handle -= server->base;
 
+	server_values_changed(server);
+
 	channel->msg = dbus_message_new_method_call(server->name,
 			server->path, GATT_SERVER_INTERFACE, "WriteCmd");
 
@@ -3084,8 +3867,6 @@ static int write_value(struct gatt_channel *channel, gboolean resp,
 {
 	struct attribute *a, *client_attr;
 	uint8_t status;
-	GSList *l;
-	guint h = handle;
 
 	DBG("handle:0x%04x", handle);
 
@@ -3109,13 +3890,11 @@ static int write_value(struct gatt_channel *channel, gboolean resp,
 		return -1;
 	}
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	a = db_lookup(handle);
+	if (a == NULL)
 		return enc_error_resp(ATT_OP_WRITE_REQ, handle,
 				ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	a = l->data;
-
 	status = att_check_reqs(channel, ATT_OP_WRITE_REQ, a->write_reqs);
 	if (status)
 		return enc_error_resp(ATT_OP_WRITE_REQ, handle, status, pdu,
@@ -3161,12 +3940,10 @@ static int mtu_exchange(struct gatt_channel *channel, uint16_t mtu,
 	return enc_mtu_resp(old_mtu, pdu, len);
 }
 
-static void zero_cli_cfg(char *key, char *value, void *user_data)
+static void zero_cli_cfg(struct gatt_channel *channel, uint16_t handle)
 {
-	struct gatt_channel *channel = user_data;
 	struct gatt_server *server = gatt_server_list;
 	DBusMessage *msg;
-	uint16_t handle = (uint16_t) strtol(key, NULL, 16);
 	uint8_t tmp_buf[] = {0,0};
 	uint8_t *buf = tmp_buf;
 
@@ -3194,18 +3971,165 @@ static void zero_cli_cfg(char *key, char *value, void *user_data)
 	dbus_message_unref(msg);
 }
 
+static struct notify_slot *ring_slot(struct gatt_channel *channel,
+							unsigned int i)
+{
+	return &channel->ring[(channel->ring_head + i) % NOTIFY_RING_SIZE];
+}
+
+static void notify_sent(gpointer user_data);
+
+/* Hands the queued PDUs to GAttrib, NOTIFY_WINDOW at a time and none
+ * while an indication waits for its confirmation, so that values which
+ * keep changing meanwhile are coalesced in the ring instead */
+static void notify_flush(struct gatt_channel *channel)
+{
+	struct notify_slot *slot;
+
+	while (channel->ring_sent < channel->ring_count &&
+					channel->ring_sent < NOTIFY_WINDOW &&
+					!channel->ind_wait) {
+		slot = ring_slot(channel, channel->ring_sent);
+
+		slot->id = g_attrib_send_buffer(channel->attrib, slot->pdu[0],
+					slot->pdu, slot->len, slot->func,
+					channel, notify_sent);
+		if (slot->id == 0)
+			break;
+
+		channel->ring_sent++;
+
+		if (slot->pdu[0] == ATT_OP_HANDLE_IND)
+			channel->ind_wait = TRUE;
+	}
+}
+
+static gboolean notify_flush_cb(gpointer user_data)
+{
+	struct gatt_channel *channel = user_data;
+
+	channel->flush_id = 0;
+	notify_flush(channel);
+
+	return FALSE;
+}
+
+static void notify_sent(gpointer user_data)
+{
+	struct gatt_channel *channel = user_data;
+	struct notify_slot *slot;
+
+	/* Cancelled by notify_ring_free() */
+	if (channel->ring == NULL)
+		return;
+
+	slot = ring_slot(channel, 0);
+	if (slot->pdu[0] == ATT_OP_HANDLE_IND)
+		channel->ind_wait = FALSE;
+
+	channel->ring_head = (channel->ring_head + 1) % NOTIFY_RING_SIZE;
+	channel->ring_sent--;
+	channel->ring_count--;
+
+	/* The slot goes to the oldest indication waiting for room */
+	slot = g_queue_pop_head(&channel->ind_overflow);
+	if (slot) {
+		*ring_slot(channel, channel->ring_count++) = *slot;
+		g_free(slot);
+	}
+
+	/* Not from here, GAttrib may be destroying its queue */
+	if (channel->ring_sent < channel->ring_count && !channel->flush_id)
+		channel->flush_id = g_idle_add(notify_flush_cb, channel);
+}
+
+/* Queues an encoded notification or indication, truncated to the MTU. A
+ * notification still queued for the same handle is overwritten, one which
+ * finds the ring full is dropped. Indications are never dropped, they wait
+ * outside the ring for room, in order. */
+static gboolean notify_queue(struct gatt_channel *channel,
+				const uint8_t *pdu, uint16_t len,
+				GAttribResultFunc func)
+{
+	struct notify_slot *slot;
+	unsigned int i;
+
+	len = MIN(len, channel->mtu);
+
+	if (pdu[0] == ATT_OP_HANDLE_IND) {
+		if (channel->ring_count < NOTIFY_RING_SIZE &&
+				g_queue_is_empty(&channel->ind_overflow))
+			goto append;
+
+		slot = g_new(struct notify_slot, 1);
+		g_queue_push_tail(&channel->ind_overflow, slot);
+		goto store;
+	}
+
+	for (i = channel->ring_sent; i < channel->ring_count; i++) {
+		slot = ring_slot(channel, i);
+
+		if (slot->pdu[0] == ATT_OP_HANDLE_NOTIFY &&
+				memcmp(&slot->pdu[1], &pdu[1], 2) == 0)
+			goto store;
+	}
+
+	if (channel->ring_count == NOTIFY_RING_SIZE) {
+		DBG("channel %p: ring full, dropping notification for 0x%04x",
+					channel, att_get_u16(&pdu[1]));
+		return FALSE;
+	}
+
+append:
+	slot = ring_slot(channel, channel->ring_count++);
+
+store:
+	memcpy(slot->pdu, pdu, len);
+	slot->len = len;
+	slot->func = func;
+
+	notify_flush(channel);
+
+	return TRUE;
+}
+
+static void notify_ring_free(struct gatt_channel *channel)
+{
+	struct notify_slot *ring = channel->ring;
+	unsigned int i;
+
+	if (channel->flush_id)
+		g_source_remove(channel->flush_id);
+
+	/* GAttrib points into the ring, take the PDUs back first: cancelling
+	 * releases them all, even an indication waiting for confirmation */
+	channel->ring = NULL;
+	for (i = 0; i < channel->ring_sent; i++)
+		g_attrib_cancel(channel->attrib,
+			ring[(channel->ring_head + i) % NOTIFY_RING_SIZE].id);
+
+	g_free(ring);
+
+	while (!g_queue_is_empty(&channel->ind_overflow))
+		g_free(g_queue_pop_head(&channel->ind_overflow));
+}
+
 static void ind_return(guint8 status, const guint8 *pdu, guint16 len,
 								gpointer data);
 static void channel_destroy(void *user_data)
 {
 	struct gatt_channel *channel = user_data;
-	char filename[PATH_MAX + 1];
+	GArray *entries = channel->cli_cfg->entries;
+	guint i;
 
 	DBG("channel: %p", user_data);
 
+	for (i = 0; i < entries->len; i++)
+		zero_cli_cfg(channel, g_array_index(entries,
+					struct cli_cfg_entry, i).handle);
 
-	make_cli_cfg_name(filename, channel);
-	textfile_foreach(filename, zero_cli_cfg, channel);
+	channel->cli_cfg->refs--;
+	cli_cfg_flush();
 
 	if (channel->ind_msg) {
 		DBG(" return_failure channel->ind_msg");
@@ -3214,6 +4138,8 @@ static void channel_destroy(void *user_data)
 
 	clients = g_slist_remove(clients, channel);
 
+	notify_ring_free(channel);
+
 	if (channel->msg) {
 		DBG("channel_disconnect channel->msg");
 		dbus_message_unref(channel->msg);
@@ -3416,19 +4342,20 @@ static void sci_return(guint8 status, const guint8 *pdu, guint16 len,
 		update_client_serial(channel);
 }
 
-static void update_cli_cfg(char *key, char *value, void *user_data)
+static void update_cli_cfg(struct gatt_channel *channel,
+						struct cli_cfg_entry *entry)
 {
-	struct gatt_channel *channel = user_data;
 	struct gatt_server *server = gatt_server_list;
 	DBusMessage *msg;
-	uint16_t handle = (uint16_t) strtol(key, NULL, 16);
-	uint8_t *buf;
-	int i, len;
+	uint16_t handle = entry->handle;
+	uint8_t tmp_buf[2];
+	uint8_t *buf = tmp_buf;
+	int i;
 
 	if (handle == svc_chg_handle + 1) {
 		uint8_t tmp[7];
 
-		channel->serial = (uint32_t) strtol(value, NULL, 16);
+		channel->serial = entry->value;
 
 		/* Remote client is up-to-date */
 		if (channel->serial >= serial_num)
@@ -3449,26 +4376,13 @@ static void update_cli_cfg(char *key, char *value, void *user_data)
 		return;
 	}
 
-	len = strlen(value) / 2;
-	buf = g_malloc0(len);
-
-	if (!buf)
-		return;
-
-	for (i = 0; i < len; i++) {
-		char tmp[3];
-
-		tmp[0] = value[i * 2];
-		tmp[1] = value[i * 2 + 1];
-		tmp[2] = 0;
-		buf[i] = (uint8_t) strtol(tmp, NULL, 16);
-	}
+	att_put_u16(entry->value, tmp_buf);
 
 	while (server && (server->base + server->count) <= handle)
 		server = server->next;
 
 	if (!server)
-		goto failed;
+		return;
 
 	handle -= server->base;
 
@@ -3476,27 +4390,24 @@ static void update_cli_cfg(char *key, char *value, void *user_data)
 			server->path, GATT_SERVER_INTERFACE, "UpdateClientConfig");
 
 	if (msg == NULL)
-		goto failed;
+		return;
 
 	dbus_message_append_args(msg,
 				DBUS_TYPE_UINT32, &channel->session,
 				DBUS_TYPE_UINT16, &handle,
-				DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &buf, len,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &buf, 2,
 				DBUS_TYPE_INVALID);
 
 	dbus_connection_send(connection, msg, NULL);
 	dbus_message_unref(msg);
-
-failed:
-	g_free(buf);
 }
 
 void attrib_server_attach(struct _GAttrib *attrib, bdaddr_t *src,
 						bdaddr_t *dst, guint mtu)
 {
 	static uint32_t session = 0;
-	char filename[PATH_MAX + 1];
 	struct gatt_channel *channel;
+	GArray *entries;
 	uint16_t cid, cli_cfg = 0;
 	GError *gerr = NULL;
 	char addrstr[18];
@@ -3504,6 +4415,7 @@ void attrib_server_attach(struct _GAttrib *attrib, bdaddr_t *src,
 	char *serial_val, *cfg_val;
 	void *adapter, *device;
 	int ret;
+	guint i;
 
 	DBG("");
 
@@ -3525,6 +4437,8 @@ void attrib_server_attach(struct _GAttrib *attrib, bdaddr_t *src,
 
 	channel->mtu = mtu;
 	channel->attrib = attrib;
+	channel->ring = g_new0(struct notify_slot, NOTIFY_RING_SIZE);
+	channel->cli_cfg = cli_cfg_peer_get(src, dst);
 	channel->src = *src;
 	channel->dst = *dst;
 	channel->device = device;
@@ -3554,8 +4468,10 @@ void attrib_server_attach(struct _GAttrib *attrib, bdaddr_t *src,
 				NULL, NULL, 0, NULL, NULL, 0))
 		return;
 
-	make_cli_cfg_name(filename, channel);
-	textfile_foreach(filename, update_cli_cfg, channel);
+	entries = channel->cli_cfg->entries;
+	for (i = 0; i < entries->len; i++)
+		update_cli_cfg(channel, &g_array_index(entries,
+						struct cli_cfg_entry, i));
 }
 
 static void connect_event(GIOChannel *io, GError *err, void *user_data)
@@ -3598,38 +4514,32 @@ static void confirm_event(GIOChannel *io, void *user_data)
 
 static void attrib_notify_clients(struct attribute *attr)
 {
-	guint handle = attr->handle;
+	gpointer handle = GUINT_TO_POINTER(attr->handle);
+	uint8_t npdu[ATT_MAX_MTU], ipdu[ATT_MAX_MTU];
+	int nlen = -1, ilen = -1;
 	GSList *l;
 
+	/* Each PDU is encoded once, clients with a smaller MTU get it
+	 * truncated */
 	for (l = clients; l; l = l->next) {
 		struct gatt_channel *channel = l->data;
 
 		/* Notification */
-		if (g_slist_find_custom(channel->notify,
-					GUINT_TO_POINTER(handle), handle_cmp)) {
-			uint8_t pdu[ATT_MAX_MTU];
-			uint16_t len;
-
-			len = enc_notification(attr, pdu, channel->mtu);
-			if (len == 0)
-				continue;
-
-			server_resp(channel->attrib, 0, pdu[0], pdu, len,
-							NULL, NULL, NULL);
+		if (g_slist_find(channel->notify, handle)) {
+			if (nlen < 0)
+				nlen = enc_notification(attr, npdu,
+								sizeof(npdu));
+			if (nlen > 0)
+				notify_queue(channel, npdu, nlen, NULL);
 		}
 
 		/* Indication */
-		if (g_slist_find_custom(channel->indicate,
-					GUINT_TO_POINTER(handle), handle_cmp)) {
-			uint8_t pdu[ATT_MAX_MTU];
-			uint16_t len;
-
-			len = enc_indication(attr, pdu, channel->mtu);
-			if (len == 0)
-				return;
-
-			server_resp(channel->attrib, 0, pdu[0], pdu, len,
-							NULL, NULL, NULL);
+		if (g_slist_find(channel->indicate, handle)) {
+			if (ilen < 0)
+				ilen = enc_indication(attr, ipdu,
+								sizeof(ipdu));
+			if (ilen > 0)
+				notify_queue(channel, ipdu, ilen, NULL);
 		}
 	}
 }
@@ -3965,12 +4875,18 @@ static void rebuild_server_list(char *filename)
 			free(tmp);
 		}
 
+		if (gatt_server_list->replies)
+			g_hash_table_destroy(gatt_server_list->replies);
+
 		tmp = gatt_server_list;
 		gatt_server_list = gatt_server_list->next;
 		free(tmp);
 	}
 	gatt_server_last = NULL;
 	textfile_foreach(filename, create_server_entry, NULL);
+
+	/* Builtin responses depend on where the servers start */
+	db_changed();
 }
 
 static DBusMessage *register_server(DBusConnection *conn, DBusMessage *msg,
@@ -4242,7 +5158,7 @@ static DBusMessage *server_notify(DBusConnection *conn, DBusMessage *msg,
 {
 	struct gatt_channel *channel;
 	struct gatt_server *server;
-	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	uint8_t pdu[ATT_MAX_MTU];
 	GSList *l;
 	uint32_t session;
 	const char *path;
@@ -4272,12 +5188,14 @@ static DBusMessage *server_notify(DBusConnection *conn, DBusMessage *msg,
 	if (!server)
 		return btd_error_invalid_args(msg);
 
+	server_values_changed(server);
+
 	handle += server->base;
 
 	ret = enc_notify(handle, payload, len, pdu, sizeof(pdu));
 
-	g_attrib_send(channel->attrib, 0, ATT_OP_HANDLE_NOTIFY, pdu,
-			(guint16) ret, NULL, NULL, NULL);
+	if (!notify_queue(channel, pdu, ret, NULL))
+		return btd_error_failed(msg, "Insufficient Resources");
 
 	return dbus_message_new_method_return(msg);
 }
@@ -4320,7 +5238,7 @@ static DBusMessage *server_indicate(DBusConnection *conn, DBusMessage *msg,
 {
 	struct gatt_channel *channel = NULL;
 	struct gatt_server *server;
-	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	uint8_t pdu[ATT_MAX_MTU];
 	GSList *l;
 	uint32_t session;
 	const char *path;
@@ -4355,14 +5273,13 @@ static DBusMessage *server_indicate(DBusConnection *conn, DBusMessage *msg,
 	if (!server)
 		return btd_error_invalid_args(msg);
 
+	server_values_changed(server);
+
 	handle += server->base;
 
 	ret = enc_indicate(handle, payload, len, pdu, sizeof(pdu));
 
-	ret = g_attrib_send(channel->attrib, 0, ATT_OP_HANDLE_IND, pdu,
-			(guint16) ret, ind_return, channel, NULL);
-
-	if (!ret)
+	if (!notify_queue(channel, pdu, ret, ind_return))
 		return btd_error_failed(msg, "Insufficient Resources");
 
 	g_attrib_ref(channel->attrib);
@@ -4528,9 +5445,30 @@ void attrib_server_dbus_enable(void)
 void attrib_server_exit(void)
 {
 	GSList *l;
+	guint h;
+
+	for (h = 0; h <= db_last && h < db_size; h++)
+		g_free(db_attrs[h]);
+
+	g_free(db_attrs);
+	db_attrs = NULL;
+	db_size = 0;
+	db_last = 0;
+
+	if (db_types) {
+		g_hash_table_destroy(db_types);
+		g_array_free(db_services, TRUE);
+		db_types = NULL;
+		db_services = NULL;
+	}
+
+	if (resp_cache) {
+		g_hash_table_destroy(resp_cache);
+		resp_cache = NULL;
+	}
 
-	g_slist_foreach(database, (GFunc) g_free, NULL);
-	g_slist_free(database);
+	if (server_call_slot >= 0)
+		dbus_pending_call_free_data_slot(&server_call_slot);
 
 	if (l2cap_io) {
 		g_io_channel_unref(l2cap_io);
@@ -4545,6 +5483,7 @@ void attrib_server_exit(void)
 	for (l = clients; l; l = l->next) {
 		struct gatt_channel *channel = l->data;
 
+		notify_ring_free(channel);
 		g_slist_free(channel->notify);
 		g_slist_free(channel->indicate);
 
@@ -4554,6 +5493,11 @@ void attrib_server_exit(void)
 
 	g_slist_free(clients);
 
+	cli_cfg_flush();
+	g_slist_foreach(cli_cfg_peers, (GFunc) cli_cfg_peer_free, NULL);
+	g_slist_free(cli_cfg_peers);
+	cli_cfg_peers = NULL;
+
 	if (gatt_sdp_handle)
 		remove_record_from_server(gatt_sdp_handle);
 
@@ -4589,43 +5533,37 @@ void attrib_free_sdp(uint32_t sdp_handle)
 
 uint16_t attrib_db_find_end(void)
 {
-	uint16_t handle;
-	GSList *l;
-
-	for (l = database, handle = 1; l; l = l->next) {
-		struct attribute *a = l->data;
-
-		if (a->handle == 0xffff)
-			return 0xffff;
+	if (db_last == 0xffff)
+		return 0xffff;
 
-		handle = a->handle + 1;
-	}
-
-	return handle;
+	return db_last + 1;
 }
 
 uint16_t attrib_db_find_avail(uint16_t nitems)
 {
-	uint16_t handle;
-	GSList *l;
+	uint16_t handle, prev;
+	guint i;
 
 	g_assert(nitems > 0);
 
-	for (l = database, handle = 0; l; l = l->next) {
-		struct attribute *a = l->data;
+	/* Look for a gap before a service declaration first */
+	for (i = 0; db_services && i < db_services->len; i++) {
+		uint16_t svc = g_array_index(db_services, uint16_t, i);
 
-		if (handle && (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0) &&
-				a->handle - handle >= nitems)
-			/* Note: the range above excludes the current handle */
-			return handle;
-
-		if (a->handle == 0xffff)
-			return 0;
+		prev = db_prev_handle(svc - 1);
+		if (prev == 0x0000)
+			continue;
 
-		handle = a->handle + 1;
+		/* Note: the range excludes the service declaration */
+		if (svc - prev - 1 >= nitems)
+			return prev + 1;
 	}
 
+	if (db_last == 0xffff)
+		return 0;
+
+	handle = db_last ? db_last + 1 : 0;
+
 	if (0xffff - handle + 1 >= nitems)
 		return handle;
 
@@ -4636,11 +5574,11 @@ struct attribute *attrib_db_add(uint16_t handle, bt_uuid_t *uuid, int read_reqs,
 				int write_reqs, const uint8_t *value, int len)
 {
 	struct attribute *a;
-	guint h = handle;
 
 	DBG("handle=0x%04x", handle);
 
-	if (g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp))
+	/* 0x0000 is reserved */
+	if (handle == 0x0000 || db_lookup(handle))
 		return NULL;
 
 	a = g_malloc0(sizeof(struct attribute) + len);
@@ -4651,7 +5589,9 @@ struct attribute *attrib_db_add(uint16_t handle, bt_uuid_t *uuid, int read_reqs,
 	a->len = len;
 	memcpy(a->data, value, len);
 
-	database = g_slist_insert_sorted(database, a, attribute_cmp);
+	db_store(handle, a);
+	db_index_add(a);
+	db_changed();
 
 	return a;
 }
@@ -4660,25 +5600,29 @@ int attrib_db_update(uint16_t handle, bt_uuid_t *uuid, const uint8_t *value,
 					int len, struct attribute **attr)
 {
 	struct attribute *a;
-	GSList *l;
-	guint h = handle;
 
 	DBG("handle=0x%04x", handle);
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	a = db_lookup(handle);
+	if (a == NULL)
 		return -ENOENT;
 
-	a = g_try_realloc(l->data, sizeof(struct attribute) + len);
+	a = g_try_realloc(a, sizeof(struct attribute) + len);
 	if (a == NULL)
 		return -ENOMEM;
 
-	l->data = a;
-	if (uuid != NULL)
+	db_store(handle, a);
+	if (uuid != NULL) {
+		db_index_remove(a);
 		memcpy(&a->uuid, uuid, sizeof(bt_uuid_t));
+		db_index_add(a);
+	}
 	a->len = len;
 	memcpy(a->data, value, len);
 
+	if (uuid != NULL || is_decl(&a->uuid))
+		db_changed();
+
 	attrib_notify_clients(a);
 
 	if (attr)
@@ -4690,19 +5634,19 @@ int attrib_db_update(uint16_t handle, bt_uuid_t *uuid, const uint8_t *value,
 int attrib_db_del(uint16_t handle)
 {
 	struct attribute *a;
-	GSList *l;
-	guint h = handle;
 
 	DBG("handle=0x%04x", handle);
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	a = db_lookup(handle);
+	if (a == NULL)
 		return -ENOENT;
 
-	a = l->data;
-	database = g_slist_remove(database, a);
+	db_index_remove(a);
+	db_store(handle, NULL);
 	g_free(a);
 
+	db_changed();
+
 	return 0;
 }
 